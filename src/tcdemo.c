@@ -18,11 +18,17 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
 
 #include <libsoup/soup.h>
 #include <clutter-gst/clutter-gst.h>
 #include <gst/gst.h>
+#include <gio/gunixfdlist.h>
 
+#include "tcmmd-client.h"
 #include "tcmmd-generated.h"
 
 #define GETTEXT_PACKAGE "tcdemo"
@@ -30,6 +36,15 @@
 typedef struct
 {
   TcmmdManagedConnections *proxy;
+  /* instead of the proxy, with --control-socket */
+  gchar *control_path;
+  TcmmdClient *client;
+  /* instead of both, with --shared-page: the page of the flow of
+   * shared_socket, once tcmmd returned it */
+  gboolean use_shared_page;
+  TcmmdManagedConnections2 *proxy2;
+  TcmmdSharedPolicy *shared;
+  SoupSocket *shared_socket;
   GstElement *source;
 
   gboolean disable_traffic_control;
@@ -51,14 +66,108 @@ typedef struct
   gboolean setup_queue_done;
 } DemoData;
 
+static void
+clear_shared_page (DemoData *self)
+{
+  if (self->shared != NULL)
+    {
+      tcmmd_client_unmap_shared_policy (self->shared);
+      self->shared = NULL;
+    }
+  self->shared_socket = NULL;
+}
+
+static void
+got_shared_page_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  DemoData *self = user_data;
+  GUnixFDList *fd_list = NULL;
+  GVariant *handle = NULL;
+  GError *error = NULL;
+  TcmmdSharedPolicy *page;
+  int fd;
+
+  if (!tcmmd_managed_connections2_call_set_shared_policy_finish (self->proxy2,
+          &handle, &fd_list, result, &error))
+    {
+      g_printerr ("SetSharedPolicy failed: %s\n", error->message);
+      g_clear_error (&error);
+      self->shared_socket = NULL;
+      return;
+    }
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (handle), &error);
+  g_variant_unref (handle);
+  g_object_unref (fd_list);
+  if (fd < 0)
+    {
+      g_printerr ("SetSharedPolicy failed: %s\n", error->message);
+      g_clear_error (&error);
+      self->shared_socket = NULL;
+      return;
+    }
+
+  page = tcmmd_client_map_shared_policy (fd);
+  close (fd);
+  if (page == NULL)
+    {
+      g_printerr ("Cannot map the shared page: %s\n", strerror (errno));
+      self->shared_socket = NULL;
+      return;
+    }
+
+  if (self->shared != NULL)
+    tcmmd_client_unmap_shared_policy (self->shared);
+  self->shared = page;
+
+  /* what changed during the call */
+  tcmmd_shared_policy_write (self->shared,
+      self->audio_bitrate + self->video_bitrate, self->buffer_fill);
+}
+
+/* (ayqayqy) address */
+static GVariant *
+address_to_variant (SoupAddress *address)
+{
+  GInetAddress *inet_address;
+  GVariant *bytes;
+
+  inet_address = g_inet_address_new_from_string (
+      soup_address_get_physical (address));
+  bytes = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+      g_inet_address_to_bytes (inet_address),
+      g_inet_address_get_native_size (inet_address), 1);
+  g_object_unref (inet_address);
+
+  return bytes;
+}
+
+/* (ayqayqy) flow of a connection */
+static GVariant *
+socket_to_flow (SoupSocket *socket)
+{
+  SoupAddress *local_address = soup_socket_get_local_address (socket);
+  SoupAddress *remote_address = soup_socket_get_remote_address (socket);
+
+  return g_variant_new ("(@ayq@ayqy)",
+      address_to_variant (local_address),
+      soup_address_get_port (local_address),
+      address_to_variant (remote_address),
+      soup_address_get_port (remote_address),
+      IPPROTO_TCP);
+}
+
 static void
 update_daemon (DemoData *self)
 {
   SoupAddress *local_address;
   SoupAddress *remote_address;
   guint bitrate;
+  int ret = 0;
 
-  if (self->proxy == NULL)
+  if (self->proxy == NULL && self->client == NULL && self->proxy2 == NULL)
     return;
 
   bitrate = self->audio_bitrate + self->video_bitrate;
@@ -68,8 +177,29 @@ update_daemon (DemoData *self)
   if (self->socket == NULL)
     {
       g_print ("No socket. Unset policy.\n");
-      tcmmd_managed_connections_call_unset_policy (self->proxy,
-          NULL, NULL, NULL);
+      if (self->client)
+        ret = tcmmd_client_unset_policy (self->client);
+      else if (self->proxy2)
+        {
+          clear_shared_page (self);
+          tcmmd_managed_connections2_call_unset_policies (self->proxy2,
+              g_variant_new_array (G_VARIANT_TYPE ("(ayqayqy)"), NULL, 0),
+              g_variant_new ("a{sv}", NULL),
+              NULL, NULL, NULL);
+        }
+      else
+        tcmmd_managed_connections_call_unset_policy (self->proxy,
+            NULL, NULL, NULL);
+      if (ret < 0)
+        g_printerr ("UnsetPolicy failed: %s\n", strerror (-ret));
+      return;
+    }
+
+  /* the flow already has its page, or is about to */
+  if (self->shared_socket == self->socket)
+    {
+      if (self->shared != NULL)
+        tcmmd_shared_policy_write (self->shared, bitrate, self->buffer_fill);
       return;
     }
 
@@ -89,14 +219,36 @@ update_daemon (DemoData *self)
   if (self->disable_traffic_control)
     return;
 
-  tcmmd_managed_connections_call_set_policy (self->proxy,
-      soup_address_get_physical (local_address),
-      soup_address_get_port (local_address),
-      soup_address_get_physical (remote_address),
-      soup_address_get_port (remote_address),
-      bitrate,
-      self->buffer_fill,
-      NULL, NULL, NULL);
+  if (self->proxy2)
+    {
+      self->shared_socket = self->socket;
+      tcmmd_managed_connections2_call_set_shared_policy (self->proxy2,
+          socket_to_flow (self->socket),
+          bitrate,
+          self->buffer_fill,
+          NULL, NULL, got_shared_page_cb, self);
+    }
+  /* the control socket saves the trip through dbus-daemon, when the
+   * buffer drains */
+  else if (self->client)
+    ret = tcmmd_client_set_policy (self->client,
+        soup_address_get_physical (local_address),
+        soup_address_get_port (local_address),
+        soup_address_get_physical (remote_address),
+        soup_address_get_port (remote_address),
+        bitrate,
+        self->buffer_fill);
+  else
+    tcmmd_managed_connections_call_set_policy (self->proxy,
+        soup_address_get_physical (local_address),
+        soup_address_get_port (local_address),
+        soup_address_get_physical (remote_address),
+        soup_address_get_port (remote_address),
+        bitrate,
+        self->buffer_fill,
+        NULL, NULL, NULL);
+  if (ret < 0)
+    g_printerr ("SetPolicy failed: %s\n", strerror (-ret));
 }
 
 static void
@@ -111,6 +263,28 @@ update_soup_socket (DemoData *self)
       return;
     }
 
+  /* The daemon keeps a policy per connection: drop the one of the previous
+   * connection before setting the new one. */
+  if (self->socket != NULL && !self->disable_traffic_control)
+    {
+      if (self->proxy2 != NULL)
+        {
+          GVariant *flow = socket_to_flow (self->socket);
+
+          if (self->shared_socket == self->socket)
+            clear_shared_page (self);
+          tcmmd_managed_connections2_call_unset_policies (self->proxy2,
+              g_variant_new_array (G_VARIANT_TYPE ("(ayqayqy)"), &flow, 1),
+              g_variant_new ("a{sv}", NULL),
+              NULL, NULL, NULL);
+        }
+      else if (self->client != NULL)
+        tcmmd_client_unset_policy (self->client);
+      else if (self->proxy != NULL)
+        tcmmd_managed_connections_call_unset_policy (self->proxy,
+            NULL, NULL, NULL);
+    }
+
   g_clear_object (&self->socket);
   self->socket = socket;
   update_daemon (self);
@@ -266,8 +440,14 @@ buffer_fill_notify_cb (ClutterGstPlayer *player,
       self->buffer_critically_low_count++;
     }
 
+  /* Writing to the shared page costs no message: give tcmmd every change */
+  if (self->shared != NULL)
+    {
+      self->buffer_fill = buffer_fill;
+      update_daemon (self);
+    }
   /* Don't bother with a change less than 5% */
-  if (ABS (self->buffer_fill - buffer_fill) > 0.05 ||
+  else if (ABS (self->buffer_fill - buffer_fill) > 0.05 ||
       (self->buffer_fill == 1.0) != (buffer_fill == 1.0))
     {
       self->buffer_fill = buffer_fill;
@@ -310,6 +490,26 @@ got_proxy_cb (GObject *source,
   update_daemon (self);
 }
 
+static void
+got_proxy2_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  DemoData *self = user_data;
+  GError *error = NULL;
+
+  self->proxy2 = tcmmd_managed_connections2_proxy_new_for_bus_finish (result,
+      &error);
+  if (self->proxy2 == NULL)
+    {
+      g_critical ("Failed to get proxy: %s\n", error->message);
+      g_clear_error (&error);
+      return;
+    }
+
+  update_daemon (self);
+}
+
 gint
 main (gint argc,
     gchar *argv[])
@@ -327,6 +527,8 @@ main (gint argc,
   {
     { "disable-tc", 'd', 0, G_OPTION_ARG_NONE, &self.disable_traffic_control, "Disable traffic control", NULL },
     { "looping",       'l', 0, G_OPTION_ARG_NONE, &self.looping, "Start again at the end of the stream", NULL },
+    { "control-socket", 'c', 0, G_OPTION_ARG_STRING, &self.control_path, "Talk to tcmmd on its control socket instead of D-Bus", "PATH" },
+    { "shared-page", 's', 0, G_OPTION_ARG_NONE, &self.use_shared_page, "Write the buffer fill to a page shared with tcmmd instead of calling SetPolicy", NULL },
     { NULL }
   };
 
@@ -392,11 +594,32 @@ main (gint argc,
   clutter_gst_player_set_playing (CLUTTER_GST_PLAYER (player), TRUE);
   clutter_actor_show (stage);
 
-  tcmmd_managed_connections_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
-      G_DBUS_PROXY_FLAGS_NONE,
-      "org.tcmmd",
-      "/org/tcmmd/ManagedConnections",
-      NULL, got_proxy_cb, &self);
+  if (self.control_path)
+    {
+      self.client = tcmmd_client_new (self.control_path);
+      if (self.client == NULL)
+        {
+          g_print ("Cannot connect to '%s': %s\n", self.control_path,
+                   strerror (errno));
+          return 1;
+        }
+    }
+  else if (self.use_shared_page)
+    {
+      tcmmd_managed_connections2_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+          G_DBUS_PROXY_FLAGS_NONE,
+          "org.tcmmd",
+          "/org/tcmmd/ManagedConnections",
+          NULL, got_proxy2_cb, &self);
+    }
+  else
+    {
+      tcmmd_managed_connections_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+          G_DBUS_PROXY_FLAGS_NONE,
+          "org.tcmmd",
+          "/org/tcmmd/ManagedConnections",
+          NULL, got_proxy_cb, &self);
+    }
 
   clutter_main ();
 
@@ -405,6 +628,10 @@ main (gint argc,
   g_clear_object (&self.source);
   g_clear_object (&self.socket);
   g_clear_object (&self.proxy);
+  clear_shared_page (&self);
+  g_clear_object (&self.proxy2);
+  if (self.client)
+    tcmmd_client_free (self.client);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,704 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "tcmmd-backend-memory.h"
+#include "tcmmd-trace.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/pkt_sched.h>
+
+/* the layout of tcmmd_rtnl.c */
+#define HANDLE(maj, min) TC_H_MAKE ((guint32) (maj) << 16, (min))
+#define STREAM_MINOR(id) (0x10 + (id))
+#define SSH_MINOR 1
+#define SSH_QDISC 3
+#define BACKGROUND_MINOR 3
+#define BACKGROUND_QDISC 5
+#define SSH_RATE 50000
+#define FILTER_HANDLE_SSH 1
+
+#define IFB_NAME "ifb0"
+
+static gchar *link_name;
+static TcmmdClassifier classifier = TCMMD_CLASSIFIER_U32;
+static TcmmdDirection direction = TCMMD_DIRECTION_INGRESS;
+static gboolean tree_installed = FALSE;
+static gboolean stream_used[TCMMD_MAX_STREAMS];
+static GArray *objects = NULL;
+static GArray *changes = NULL;
+static TcmmdStats stats;
+
+/* ifb0, or the main link when shaping egress */
+static const gchar *
+tree_dev (void)
+{
+  return direction == TCMMD_DIRECTION_EGRESS ? link_name : IFB_NAME;
+}
+
+static struct {
+  gulong latency;
+  guint skip;
+  guint fail;
+  guint count;
+} calls[TCMMD_MEMORY_N_CALLS];
+
+/* Count the call, wait for its latency and tell whether it succeeds */
+static gboolean
+begin_call (TcmmdMemoryCall call)
+{
+  calls[call].count++;
+  if (calls[call].latency > 0)
+    g_usleep (calls[call].latency);
+
+  if (calls[call].fail == 0)
+    return TRUE;
+  if (calls[call].skip > 0)
+    {
+      calls[call].skip--;
+      return TRUE;
+    }
+  if (calls[call].fail != G_MAXUINT)
+    calls[call].fail--;
+
+  return FALSE;
+}
+
+static void
+ensure_arrays (void)
+{
+  if (objects)
+    return;
+
+  objects = g_array_new (FALSE, TRUE, sizeof (TcmmdMemoryObject));
+  changes = g_array_new (FALSE, TRUE, sizeof (TcmmdMemoryChange));
+}
+
+static void
+log_change (TcmmdMemoryChangeType type, const TcmmdMemoryObject *object)
+{
+  TcmmdMemoryChange change;
+
+  change.change = type;
+  change.time = g_get_monotonic_time ();
+  change.object = *object;
+  g_array_append_val (changes, change);
+}
+
+static guint
+find_object (TcmmdMemoryObjectType type, const gchar *dev, guint32 handle)
+{
+  guint i;
+
+  for (i = 0; i < objects->len; i++)
+    {
+      TcmmdMemoryObject *object = &g_array_index (objects, TcmmdMemoryObject, i);
+
+      if (object->type == type && object->handle == handle &&
+          g_strcmp0 (object->dev, dev) == 0)
+        return i;
+    }
+
+  return G_MAXUINT;
+}
+
+static TcmmdMemoryObject *
+add_object (TcmmdMemoryObjectType type,
+            const gchar *dev,
+            const gchar *kind,
+            guint32 handle,
+            guint32 parent)
+{
+  TcmmdMemoryObject object;
+
+  memset (&object, 0, sizeof (object));
+  object.type = type;
+  object.dev = dev;
+  object.kind = kind;
+  object.handle = handle;
+  object.parent = parent;
+  g_array_append_val (objects, object);
+
+  return &g_array_index (objects, TcmmdMemoryObject, objects->len - 1);
+}
+
+/* The fields are only final once the object is logged */
+static void
+commit_object (const TcmmdMemoryObject *object)
+{
+  log_change (TCMMD_MEMORY_ADD, object);
+}
+
+static void
+del_object (TcmmdMemoryObjectType type, const gchar *dev, guint32 handle)
+{
+  guint i = find_object (type, dev, handle);
+
+  if (i == G_MAXUINT)
+    return;
+
+  log_change (TCMMD_MEMORY_DELETE, &g_array_index (objects, TcmmdMemoryObject, i));
+  g_array_remove_index (objects, i);
+}
+
+static void
+add_class (guint32 handle, guint64 rate, guint64 ceil)
+{
+  TcmmdMemoryObject *class;
+
+  class = add_object (TCMMD_MEMORY_CLASS, tree_dev (), "htb", handle,
+                      HANDLE (1, 0));
+  class->rate = rate;
+  /* htb takes the rate as ceil by default */
+  class->ceil = ceil ? ceil : rate;
+  commit_object (class);
+}
+
+static void
+add_leaf (int minor, int qdisc, guint64 rate, guint64 ceil)
+{
+  add_class (HANDLE (1, minor), rate, ceil);
+  commit_object (add_object (TCMMD_MEMORY_QDISC, tree_dev (), "sfq",
+                             HANDLE (qdisc, 0), HANDLE (1, minor)));
+}
+
+static void
+add_filter (guint32 handle,
+            int family,
+            const void *ip_src,
+            const void *ip_dst,
+            uint16_t sport,
+            uint16_t dport,
+            guint32 classid)
+{
+  TcmmdMemoryObject *filter;
+  gsize len = family == AF_INET6 ? 16 : 4;
+
+  filter = add_object (TCMMD_MEMORY_FILTER, tree_dev (),
+                       classifier == TCMMD_CLASSIFIER_FLOWER ? "flower" : "u32",
+                       handle, HANDLE (1, 0));
+  filter->family = family;
+  if (ip_src)
+    memcpy (filter->ip_src, ip_src, len);
+  if (ip_dst)
+    memcpy (filter->ip_dst, ip_dst, len);
+  filter->sport = sport;
+  filter->dport = dport;
+  filter->classid = classid;
+  commit_object (filter);
+}
+
+static void
+del_tree_objects (void)
+{
+  guint i;
+
+  /* children first, as the kernel would report them */
+  for (i = objects->len; i > 0; i--)
+    {
+      TcmmdMemoryObject *object = &g_array_index (objects, TcmmdMemoryObject, i - 1);
+
+      if (g_strcmp0 (object->dev, tree_dev ()) == 0)
+        {
+          log_change (TCMMD_MEMORY_DELETE, object);
+          g_array_remove_index (objects, i - 1);
+        }
+    }
+}
+
+/* The shared part of the tree, on an empty ifb0 or main link */
+static void
+add_base_objects (guint64 background_rate)
+{
+  del_tree_objects ();
+  commit_object (add_object (TCMMD_MEMORY_QDISC, tree_dev (), "htb",
+                             HANDLE (1, 0), TC_H_ROOT));
+  add_leaf (SSH_MINOR, SSH_QDISC, SSH_RATE, SSH_RATE);
+  add_leaf (BACKGROUND_MINOR, BACKGROUND_QDISC, background_rate,
+            background_rate);
+  add_filter (FILTER_HANDLE_SSH, AF_INET, NULL, NULL, 22, 0,
+              HANDLE (1, SSH_MINOR));
+  tree_installed = TRUE;
+}
+
+static void
+add_stream_objects (int stream_id, const TcmmdStreamSpec *stream)
+{
+  int minor = STREAM_MINOR (stream_id);
+
+  add_leaf (minor, minor, stream->stream_rate, 0);
+  add_filter (minor, stream->family, stream->ip_src, stream->ip_dst,
+              stream->tcp_sport, stream->tcp_dport, HANDLE (1, minor));
+  stream_used[stream_id] = TRUE;
+}
+
+/* Only the first interface is modelled: its stream ids are those of
+ * uplink 0 */
+static void
+memory_init (const char * const *names)
+{
+  ensure_arrays ();
+
+  g_free (link_name);
+  link_name = g_strdup (names && names[0] ? names[0] : "eth0");
+
+  tcmmd_log (TCMMD_LOG_INFO, "Using iface %s (memory backend)\n", link_name);
+}
+
+static void
+memory_del_rules (void)
+{
+  ensure_arrays ();
+  del_tree_objects ();
+
+  tree_installed = FALSE;
+  memset (stream_used, 0, sizeof (stream_used));
+}
+
+static void
+memory_init_ifb (void)
+{
+  TcmmdMemoryObject *filter;
+
+  memory_del_rules ();
+  if (direction == TCMMD_DIRECTION_EGRESS)
+    return;
+
+  del_object (TCMMD_MEMORY_FILTER, link_name, 1);
+  del_object (TCMMD_MEMORY_FILTER, link_name, 2);
+  del_object (TCMMD_MEMORY_QDISC, link_name, HANDLE (0xffff, 0));
+
+  commit_object (add_object (TCMMD_MEMORY_QDISC, link_name, "ingress",
+                             HANDLE (0xffff, 0), TC_H_INGRESS));
+
+  /* redirections to ifb0, one per protocol */
+  filter = add_object (TCMMD_MEMORY_FILTER, link_name, "u32", 1,
+                       HANDLE (0xffff, 0));
+  filter->family = AF_INET;
+  commit_object (filter);
+  filter = add_object (TCMMD_MEMORY_FILTER, link_name, "u32", 2,
+                       HANDLE (0xffff, 0));
+  filter->family = AF_INET6;
+  commit_object (filter);
+}
+
+/* The model does not outlive the process: the tree the previous tcmmd
+ * left is rebuilt from the streams, as if it had been found installed */
+static gboolean
+memory_adopt (const TcmmdStreamSpec *streams,
+              const int *stream_ids,
+              guint n_streams,
+              const guint64 *background_rates)
+{
+  guint i;
+
+  for (i = 0; i < n_streams; i++)
+    g_return_val_if_fail (stream_ids[i] >= 0 &&
+                          stream_ids[i] < TCMMD_MAX_STREAMS, FALSE);
+
+  memory_init_ifb ();
+  add_base_objects (background_rates[0]);
+  for (i = 0; i < n_streams; i++)
+    add_stream_objects (stream_ids[i], &streams[i]);
+
+  return TRUE;
+}
+
+static void
+memory_uninit (void)
+{
+  if (!objects)
+    return;
+
+  memory_del_rules ();
+  if (direction == TCMMD_DIRECTION_EGRESS)
+    return;
+
+  del_object (TCMMD_MEMORY_FILTER, link_name, 1);
+  del_object (TCMMD_MEMORY_FILTER, link_name, 2);
+  del_object (TCMMD_MEMORY_QDISC, link_name, HANDLE (0xffff, 0));
+}
+
+static void
+memory_set_classifier (TcmmdClassifier new_classifier)
+{
+  g_return_if_fail (!tree_installed);
+
+  classifier = new_classifier;
+}
+
+static void
+memory_set_direction (TcmmdDirection new_direction)
+{
+  g_return_if_fail (!tree_installed);
+
+  direction = new_direction;
+}
+
+static gint64
+update_class (guint32 handle, guint64 rate, guint64 ceil)
+{
+  TcmmdMemoryObject *class;
+  guint i;
+
+  i = find_object (TCMMD_MEMORY_CLASS, tree_dev (), handle);
+  if (i == G_MAXUINT)
+    return -1;
+
+  class = &g_array_index (objects, TcmmdMemoryObject, i);
+  class->rate = rate;
+  class->ceil = ceil ? ceil : rate;
+  log_change (TCMMD_MEMORY_CHANGE, class);
+
+  return 0;
+}
+
+static gint64
+memory_update_rate (TcmmdClass class_id,
+                    int stream_id,
+                    guint64 rate,
+                    guint64 ceil)
+{
+  gint64 start = g_get_monotonic_time ();
+  guint32 handle;
+
+  if (!begin_call (TCMMD_MEMORY_CALL_UPDATE_RATE))
+    return -1;
+
+  if (class_id == TCMMD_CLASS_STREAM)
+    {
+      g_return_val_if_fail (stream_id >= 0 && stream_id < TCMMD_MAX_STREAMS, -1);
+      handle = HANDLE (1, STREAM_MINOR (stream_id));
+    }
+  else
+    {
+      g_return_val_if_fail (stream_id >= 0 && stream_id < TCMMD_MAX_STREAMS, -1);
+      handle = HANDLE (1, BACKGROUND_MINOR);
+    }
+
+  if (update_class (handle, rate, ceil) < 0)
+    return -1;
+
+  return g_get_monotonic_time () - start;
+}
+
+/* The filter of a stream taken over is changed in place, its class and
+ * sfq are kept */
+static void
+move_stream_objects (int stream_id, const TcmmdStreamSpec *stream)
+{
+  int minor = STREAM_MINOR (stream_id);
+  TcmmdMemoryObject *filter;
+  gsize len = stream->family == AF_INET6 ? 16 : 4;
+  guint i;
+
+  i = find_object (TCMMD_MEMORY_FILTER, tree_dev (), minor);
+  filter = &g_array_index (objects, TcmmdMemoryObject, i);
+  filter->family = stream->family;
+  memset (filter->ip_src, 0, sizeof (filter->ip_src));
+  memset (filter->ip_dst, 0, sizeof (filter->ip_dst));
+  if (stream->ip_src)
+    memcpy (filter->ip_src, stream->ip_src, len);
+  if (stream->ip_dst)
+    memcpy (filter->ip_dst, stream->ip_dst, len);
+  filter->sport = stream->tcp_sport;
+  filter->dport = stream->tcp_dport;
+  log_change (TCMMD_MEMORY_CHANGE, filter);
+
+  i = find_object (TCMMD_MEMORY_CLASS, tree_dev (), HANDLE (1, minor));
+  if (g_array_index (objects, TcmmdMemoryObject, i).rate != stream->stream_rate)
+    update_class (HANDLE (1, minor), stream->stream_rate, 0);
+}
+
+static gboolean
+memory_replace_streams (const int *old_ids,
+                        guint n_old,
+                        const TcmmdStreamSpec *streams,
+                        guint n_streams,
+                        const guint64 *background_rates,
+                        int *stream_ids)
+{
+  guint64 background_rate = background_rates[0];
+  gboolean freed[TCMMD_MAX_STREAMS] = { FALSE, };
+  gboolean used[TCMMD_MAX_STREAMS];
+  int id;
+  guint i;
+
+  for (i = 0; i < n_old; i++)
+    {
+      g_return_val_if_fail (old_ids[i] >= 0 &&
+                            old_ids[i] < TCMMD_MAX_STREAMS, FALSE);
+      g_return_val_if_fail (stream_used[old_ids[i]], FALSE);
+      freed[old_ids[i]] = TRUE;
+    }
+
+  /* a new stream takes the class of a removed one first */
+  memcpy (used, stream_used, sizeof (used));
+  for (i = 0; i < n_old; i++)
+    used[old_ids[i]] = FALSE;
+  for (i = 0; i < n_streams; i++)
+    {
+      for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+        if (freed[id] && !used[id])
+          break;
+      if (id == TCMMD_MAX_STREAMS)
+        for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+          if (!used[id])
+            break;
+      if (id == TCMMD_MAX_STREAMS)
+        {
+          g_printerr ("Error: too many streams, tcp_dport=%d not managed\n",
+                      streams[i].tcp_dport);
+          return FALSE;
+        }
+      used[id] = TRUE;
+      stream_ids[i] = id;
+    }
+
+  if (n_old == 0 && n_streams == 0)
+    return TRUE;
+
+  /* one transaction is one call */
+  if (!begin_call (n_streams > 0 ? TCMMD_MEMORY_CALL_ADD_STREAM
+                                 : TCMMD_MEMORY_CALL_DEL_STREAM))
+    return FALSE;
+
+  for (i = 0; i < n_old; i++)
+    TCMMD_TRACE1 (rules_remove_start, old_ids[i]);
+  for (i = 0; i < n_streams; i++)
+    TCMMD_TRACE2 (rules_install_start, stream_ids[i], streams[i].family);
+  ensure_arrays ();
+
+  for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+    if (used[id])
+      break;
+
+  /* no stream left: go back to an unshaped link */
+  if (id == TCMMD_MAX_STREAMS)
+    memory_del_rules ();
+  else
+    {
+      for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+        {
+          int minor = STREAM_MINOR (id);
+
+          if (!freed[id] || used[id])
+            continue;
+
+          del_object (TCMMD_MEMORY_FILTER, tree_dev (), minor);
+          del_object (TCMMD_MEMORY_QDISC, tree_dev (), HANDLE (minor, 0));
+          del_object (TCMMD_MEMORY_CLASS, tree_dev (), HANDLE (1, minor));
+          stream_used[id] = FALSE;
+        }
+
+      if (!tree_installed)
+        add_base_objects (background_rate);
+      else if (n_streams > 0)
+        {
+          guint j = find_object (TCMMD_MEMORY_CLASS, tree_dev (),
+                                 HANDLE (1, BACKGROUND_MINOR));
+
+          if (g_array_index (objects, TcmmdMemoryObject, j).rate != background_rate)
+            update_class (HANDLE (1, BACKGROUND_MINOR), background_rate,
+                          background_rate);
+        }
+
+      for (i = 0; i < n_streams; i++)
+        if (freed[stream_ids[i]])
+          move_stream_objects (stream_ids[i], &streams[i]);
+        else
+          add_stream_objects (stream_ids[i], &streams[i]);
+    }
+
+  for (i = 0; i < n_old; i++)
+    TCMMD_TRACE1 (rules_remove_end, old_ids[i]);
+  for (i = 0; i < n_streams; i++)
+    TCMMD_TRACE1 (rules_install_end, stream_ids[i]);
+
+  return TRUE;
+}
+
+static void
+memory_del_stream (int stream_id)
+{
+  int minor = STREAM_MINOR (stream_id);
+  int id;
+
+  g_return_if_fail (stream_id >= 0 && stream_id < TCMMD_MAX_STREAMS);
+
+  if (!stream_used[stream_id])
+    return;
+
+  if (!begin_call (TCMMD_MEMORY_CALL_DEL_STREAM))
+    {
+      g_printerr ("Error: cannot remove stream %d\n", stream_id);
+      return;
+    }
+
+  TCMMD_TRACE1 (rules_remove_start, stream_id);
+
+  for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+    if (id != stream_id && stream_used[id])
+      break;
+
+  /* last stream: go back to an unshaped link */
+  if (id == TCMMD_MAX_STREAMS)
+    memory_del_rules ();
+  else
+    {
+      del_object (TCMMD_MEMORY_FILTER, tree_dev (), minor);
+      del_object (TCMMD_MEMORY_QDISC, tree_dev (), HANDLE (minor, 0));
+      del_object (TCMMD_MEMORY_CLASS, tree_dev (), HANDLE (1, minor));
+      stream_used[stream_id] = FALSE;
+    }
+
+  TCMMD_TRACE1 (rules_remove_end, stream_id);
+}
+
+/* the model has a single uplink */
+static void
+memory_get_stats (TcmmdStats *link_stats)
+{
+  memset (link_stats, 0, TCMMD_MAX_LINKS * sizeof (TcmmdStats));
+  if (!begin_call (TCMMD_MEMORY_CALL_GET_STATS))
+    return;
+
+  link_stats[0] = stats;
+}
+
+const TcmmdBackend tcmmd_backend_memory = {
+  "memory",
+  memory_init,
+  memory_init_ifb,
+  memory_adopt,
+  memory_uninit,
+  memory_del_rules,
+  memory_set_classifier,
+  memory_set_direction,
+  memory_replace_streams,
+  memory_del_stream,
+  memory_update_rate,
+  memory_get_stats,
+};
+
+void
+tcmmd_backend_memory_set_latency (TcmmdMemoryCall call, gulong latency)
+{
+  g_return_if_fail (call < TCMMD_MEMORY_N_CALLS);
+
+  calls[call].latency = latency;
+}
+
+void
+tcmmd_backend_memory_fail (TcmmdMemoryCall call, guint skip, guint count)
+{
+  g_return_if_fail (call < TCMMD_MEMORY_N_CALLS);
+
+  calls[call].skip = skip;
+  calls[call].fail = count;
+}
+
+void
+tcmmd_backend_memory_set_stats (const TcmmdStats *new_stats)
+{
+  stats.qdisc_ingress_bytes = new_stats->qdisc_ingress_bytes;
+  stats.qdisc_root_bytes = new_stats->qdisc_root_bytes;
+  stats.qdisc_stream_bytes = new_stats->qdisc_stream_bytes;
+  stats.qdisc_background_bytes = new_stats->qdisc_background_bytes;
+  stats.qdisc_stream_drops = new_stats->qdisc_stream_drops;
+  stats.qdisc_background_drops = new_stats->qdisc_background_drops;
+}
+
+GArray *
+tcmmd_backend_memory_get_objects (void)
+{
+  ensure_arrays ();
+  return objects;
+}
+
+const TcmmdMemoryObject *
+tcmmd_backend_memory_lookup (TcmmdMemoryObjectType type,
+                             const gchar *dev,
+                             guint32 handle)
+{
+  guint i;
+
+  ensure_arrays ();
+  i = find_object (type, dev, handle);
+  if (i == G_MAXUINT)
+    return NULL;
+
+  return &g_array_index (objects, TcmmdMemoryObject, i);
+}
+
+GArray *
+tcmmd_backend_memory_get_log (void)
+{
+  ensure_arrays ();
+  return changes;
+}
+
+void
+tcmmd_backend_memory_clear_log (void)
+{
+  ensure_arrays ();
+  g_array_set_size (changes, 0);
+}
+
+guint
+tcmmd_backend_memory_get_calls (TcmmdMemoryCall call)
+{
+  g_return_val_if_fail (call < TCMMD_MEMORY_N_CALLS, 0);
+
+  return calls[call].count;
+}
+
+void
+tcmmd_backend_memory_dump (FILE *file)
+{
+  static const gchar *types[] = { "qdisc", "class", "filter" };
+  guint i;
+
+  ensure_arrays ();
+
+  for (i = 0; i < objects->len; i++)
+    {
+      TcmmdMemoryObject *object = &g_array_index (objects, TcmmdMemoryObject, i);
+
+      fprintf (file, "%s %s dev %s", types[object->type], object->kind,
+               object->dev);
+      /* filter handles are not major:minor */
+      if (object->type == TCMMD_MEMORY_FILTER)
+        fprintf (file, " handle %x", object->handle);
+      else
+        fprintf (file, " handle %x:%x", TC_H_MAJ (object->handle) >> 16,
+                 TC_H_MIN (object->handle));
+      fprintf (file, " parent %x:%x", TC_H_MAJ (object->parent) >> 16,
+               TC_H_MIN (object->parent));
+      if (object->type == TCMMD_MEMORY_CLASS)
+        fprintf (file, " rate %"G_GUINT64_FORMAT" ceil %"G_GUINT64_FORMAT,
+                 object->rate, object->ceil);
+      if (object->type == TCMMD_MEMORY_FILTER && object->classid != 0)
+        fprintf (file, " sport %u dport %u classid %x:%x",
+                 object->sport, object->dport,
+                 TC_H_MAJ (object->classid) >> 16, TC_H_MIN (object->classid));
+      fputc ('\n', file);
+    }
+}
@@ -0,0 +1,115 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_BACKEND_MEMORY_H
+#define __TCMMD_BACKEND_MEMORY_H
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "tcmmd-backend.h"
+
+/* The "memory" backend keeps a model of the tree tcmmd_rtnl.c would
+ * install, with the same handles (see the layout in tcmmd_rtnl.c), and a
+ * log of every change. It needs neither root nor a network interface, and
+ * lets tests and benchmarks slow down or fail the calls. */
+
+typedef enum {
+  TCMMD_MEMORY_QDISC,
+  TCMMD_MEMORY_CLASS,
+  TCMMD_MEMORY_FILTER,
+} TcmmdMemoryObjectType;
+
+typedef struct {
+  TcmmdMemoryObjectType type;
+  /* the main link or "ifb0"; the tree is on the main link when shaping
+   * egress */
+  const gchar *dev;
+  /* "ingress", "htb", "sfq", "u32" or "flower" */
+  const gchar *kind;
+  guint32 handle;
+  guint32 parent;
+
+  /* htb classes */
+  guint64 rate;
+  guint64 ceil;
+
+  /* stream filters, from the point of view of the remote sender as in
+   * tcmmdrtnl_add_stream(); classid is the target class */
+  int family;
+  guint8 ip_src[16];
+  guint8 ip_dst[16];
+  uint16_t sport;
+  uint16_t dport;
+  guint32 classid;
+} TcmmdMemoryObject;
+
+typedef enum {
+  TCMMD_MEMORY_ADD,
+  TCMMD_MEMORY_CHANGE,
+  TCMMD_MEMORY_DELETE,
+} TcmmdMemoryChangeType;
+
+typedef struct {
+  TcmmdMemoryChangeType change;
+  /* monotonic time in microseconds */
+  gint64 time;
+  TcmmdMemoryObject object;
+} TcmmdMemoryChange;
+
+/* The calls which can be slowed down or failed. A transaction of
+ * tcmmdrtnl_replace_streams() is one TCMMD_MEMORY_CALL_ADD_STREAM call, or
+ * one TCMMD_MEMORY_CALL_DEL_STREAM call when it adds no stream. */
+typedef enum {
+  TCMMD_MEMORY_CALL_ADD_STREAM,
+  TCMMD_MEMORY_CALL_DEL_STREAM,
+  TCMMD_MEMORY_CALL_UPDATE_RATE,
+  TCMMD_MEMORY_CALL_GET_STATS,
+  TCMMD_MEMORY_N_CALLS,
+} TcmmdMemoryCall;
+
+/* Every call blocks for 'latency' microseconds, as a netlink round trip */
+void tcmmd_backend_memory_set_latency (TcmmdMemoryCall call, gulong latency);
+/* Fail 'count' calls after the next 'skip' ones: add_stream and
+ * update_rate fail and leave the tree as it was, del_stream leaves the
+ * rules of the stream installed and get_stats returns zeros. G_MAXUINT
+ * fails forever. */
+void tcmmd_backend_memory_fail (TcmmdMemoryCall call, guint skip, guint count);
+
+/* Byte and drop counters returned by get_stats for the single uplink of
+ * the model, the rates are left as they are */
+void tcmmd_backend_memory_set_stats (const TcmmdStats *stats);
+
+/* Installed objects, in creation order, as TcmmdMemoryObject */
+GArray *tcmmd_backend_memory_get_objects (void);
+const TcmmdMemoryObject *tcmmd_backend_memory_lookup (TcmmdMemoryObjectType type,
+                                                      const gchar *dev,
+                                                      guint32 handle);
+/* Changes since the start or the last clear, as TcmmdMemoryChange */
+GArray *tcmmd_backend_memory_get_log (void);
+void tcmmd_backend_memory_clear_log (void);
+
+/* Number of calls of each kind, failed ones included */
+guint tcmmd_backend_memory_get_calls (TcmmdMemoryCall call);
+
+/* Print the tree, one object per line, like tc show */
+void tcmmd_backend_memory_dump (FILE *file);
+
+#endif
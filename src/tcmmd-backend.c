@@ -0,0 +1,196 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <string.h>
+
+#include "tcmmd-backend.h"
+
+static const TcmmdBackend *backend = &tcmmd_backend_netlink;
+
+static const TcmmdBackend *backends[] = {
+  &tcmmd_backend_netlink,
+  &tcmmd_backend_memory,
+};
+
+const TcmmdBackend *
+tcmmd_backend_lookup (const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (backends); i++)
+    if (g_strcmp0 (backends[i]->name, name) == 0)
+      return backends[i];
+
+  return NULL;
+}
+
+void
+tcmmd_backend_set (const TcmmdBackend *new_backend)
+{
+  backend = new_backend;
+}
+
+const TcmmdBackend *
+tcmmd_backend_get (void)
+{
+  return backend;
+}
+
+void
+tcmmdrtnl_init (const char * const *link_names)
+{
+  backend->init (link_names);
+}
+
+void
+tcmmdrtnl_init_ifb (void)
+{
+  backend->init_ifb ();
+}
+
+gboolean
+tcmmdrtnl_adopt (const TcmmdStreamSpec *streams,
+                 const int *stream_ids,
+                 guint n_streams,
+                 const guint64 *background_rates)
+{
+  return backend->adopt (streams, stream_ids, n_streams, background_rates);
+}
+
+void
+tcmmdrtnl_uninit (void)
+{
+  backend->uninit ();
+}
+
+void
+tcmmdrtnl_del_rules (void)
+{
+  backend->del_rules ();
+}
+
+void
+tcmmdrtnl_set_classifier (TcmmdClassifier classifier)
+{
+  backend->set_classifier (classifier);
+}
+
+void
+tcmmdrtnl_set_direction (TcmmdDirection direction)
+{
+  backend->set_direction (direction);
+}
+
+int
+tcmmdrtnl_add_stream (int family,
+                      const void *ip_src,
+                      const void *ip_dst,
+                      uint16_t tcp_sport,
+                      uint16_t tcp_dport,
+                      guint64 stream_rate,
+                      guint64 background_rate)
+{
+  TcmmdStreamSpec stream = { family, ip_src, ip_dst, tcp_sport, tcp_dport,
+                             stream_rate };
+  guint64 background_rates[TCMMD_MAX_LINKS];
+  int stream_id;
+  int link;
+
+  /* whichever uplink the stream is received on */
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    background_rates[link] = background_rate;
+
+  if (!backend->replace_streams (NULL, 0, &stream, 1, background_rates,
+                                 &stream_id))
+    return -1;
+
+  return stream_id;
+}
+
+gboolean
+tcmmdrtnl_add_streams (const TcmmdStreamSpec *streams,
+                       guint n_streams,
+                       const guint64 *background_rates,
+                       int *stream_ids)
+{
+  return backend->replace_streams (NULL, 0, streams, n_streams,
+                                   background_rates, stream_ids);
+}
+
+gboolean
+tcmmdrtnl_replace_streams (const int *old_ids,
+                           guint n_old,
+                           const TcmmdStreamSpec *streams,
+                           guint n_streams,
+                           const guint64 *background_rates,
+                           int *stream_ids)
+{
+  return backend->replace_streams (old_ids, n_old, streams, n_streams,
+                                   background_rates, stream_ids);
+}
+
+void
+tcmmdrtnl_del_stream (int stream_id)
+{
+  backend->del_stream (stream_id);
+}
+
+gint64
+tcmmdrtnl_update_rate (TcmmdClass class_id,
+                       int stream_id,
+                       guint64 rate,
+                       guint64 ceil)
+{
+  return backend->update_rate (class_id, stream_id, rate, ceil);
+}
+
+void
+tcmmdrtnl_get_stats (TcmmdStats *stats)
+{
+  TcmmdStats link_stats[TCMMD_MAX_LINKS];
+  int i;
+
+  backend->get_stats (link_stats);
+
+  memset (stats, 0, sizeof (TcmmdStats));
+  for (i = 0; i < TCMMD_MAX_LINKS; i++)
+    tcmmdrtnl_stats_add (stats, &link_stats[i]);
+}
+
+void
+tcmmdrtnl_get_link_stats (TcmmdStats *link_stats)
+{
+  backend->get_stats (link_stats);
+}
+
+void
+tcmmdrtnl_stats_add (TcmmdStats *total, const TcmmdStats *stats)
+{
+  total->qdisc_ingress_bytes += stats->qdisc_ingress_bytes;
+  total->qdisc_ingress_rate += stats->qdisc_ingress_rate;
+  total->qdisc_root_bytes += stats->qdisc_root_bytes;
+  total->qdisc_stream_bytes += stats->qdisc_stream_bytes;
+  total->qdisc_background_bytes += stats->qdisc_background_bytes;
+  total->qdisc_root_rate += stats->qdisc_root_rate;
+  total->qdisc_stream_rate += stats->qdisc_stream_rate;
+  total->qdisc_background_rate += stats->qdisc_background_rate;
+  total->qdisc_stream_drops += stats->qdisc_stream_drops;
+  total->qdisc_background_drops += stats->qdisc_background_drops;
+}
@@ -0,0 +1,71 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_BACKEND_H
+#define __TCMMD_BACKEND_H
+
+#include <glib.h>
+
+#include "tcmmd_rtnl.h"
+
+/* A rule engine behind the tcmmdrtnl_* functions of tcmmd_rtnl.h. The
+ * daemon selects one at startup, before tcmmdrtnl_init(); the entries have
+ * the semantics of the tcmmdrtnl_* function of the same name. */
+typedef struct {
+  const gchar *name;
+
+  void (*init) (const char * const *link_names);
+  void (*init_ifb) (void);
+  gboolean (*adopt) (const TcmmdStreamSpec *streams,
+                     const int *stream_ids,
+                     guint n_streams,
+                     const guint64 *background_rates);
+  void (*uninit) (void);
+  void (*del_rules) (void);
+  void (*set_classifier) (TcmmdClassifier classifier);
+  void (*set_direction) (TcmmdDirection direction);
+  /* tcmmdrtnl_add_stream() and tcmmdrtnl_add_streams() are transactions
+   * which do not remove any stream */
+  gboolean (*replace_streams) (const int *old_ids,
+                               guint n_old,
+                               const TcmmdStreamSpec *streams,
+                               guint n_streams,
+                               const guint64 *background_rates,
+                               int *stream_ids);
+  void (*del_stream) (int stream_id);
+  gint64 (*update_rate) (TcmmdClass class_id,
+                         int stream_id,
+                         guint64 rate,
+                         guint64 ceil);
+  /* tcmmdrtnl_get_link_stats(): tcmmdrtnl_get_stats() sums them */
+  void (*get_stats) (TcmmdStats *link_stats);
+} TcmmdBackend;
+
+/* The kernel, through netlink: tcmmd_rtnl.c. The default. */
+extern const TcmmdBackend tcmmd_backend_netlink;
+/* A model of the tree, see tcmmd-backend-memory.h */
+extern const TcmmdBackend tcmmd_backend_memory;
+
+/* "netlink" or "memory". Returns NULL for an unknown name. */
+const TcmmdBackend *tcmmd_backend_lookup (const gchar *name);
+void tcmmd_backend_set (const TcmmdBackend *backend);
+const TcmmdBackend *tcmmd_backend_get (void);
+
+#endif
@@ -0,0 +1,891 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Benchmarks of the rule engine, on the tcmmd tree installed for a number of
+ * streams:
+ *  - classification: send TCP packets of those streams into the interface
+ *    from its veth peer and count how many packets per second make it
+ *    through ifb0. See tests/classifier-bench.sh.
+ *  - stats (--stats=N): time tcmmdrtnl_get_stats() against a refill of a
+ *    cache of all the qdiscs of the system, the way it used to be done.
+ *    See tests/stats-bench.sh.
+ *  - policies (--policies=N): N SetPolicy calls through the policy code and
+ *    the controller, on the memory backend, so without root. --latency adds
+ *    the cost of a netlink round trip to every change of the tree.
+ *  - operations (--operations=N): N runs of each call of the rule engine,
+ *    with their latency percentiles and the system calls they make. See
+ *    tests/rtnl-bench.sh.
+ *  - failures (--failures): not a benchmark but a check of the policy code
+ *    when the calls of the memory backend fail. See
+ *    tests/policy-failures.sh. */
+
+#define _GNU_SOURCE /* sendmmsg */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netpacket/packet.h>
+#include <linux/if_ether.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <netlink/route/qdisc.h>
+
+#include "tcmmd-backend.h"
+#include "tcmmd-backend-memory.h"
+#include "tcmmd-policy.h"
+#include "tcmmd-trace.h"
+
+#define GETTEXT_PACKAGE "tcmmd-bench"
+
+/* Rates high enough that htb never delays a packet */
+#define BENCH_RATE 1000000000ULL
+
+#define BENCH_SPORT 80
+#define BENCH_DPORT_BASE 10000
+#define BENCH_BATCH 64
+
+static gchar *iface_name;
+static gchar *sender_name;
+static gchar *classifier_name;
+static int n_streams = 1;
+static int duration = 5;
+static int stats_samples = 0;
+static int policy_calls = 0;
+static int backend_latency = 0;
+static int operations = 0;
+static gboolean failures = FALSE;
+
+static GOptionEntry option_entries[] =
+{
+  { "interface", 'i', 0, G_OPTION_ARG_STRING, &iface_name, "Shaped network interface", "IFACE" },
+  { "sender", 'S', 0, G_OPTION_ARG_STRING, &sender_name, "Veth peer of IFACE, where the packets are sent", "IFACE" },
+  { "classifier", 'c', 0, G_OPTION_ARG_STRING, &classifier_name, "Classifier matching the streams: u32 (default) or flower", "NAME" },
+  { "streams", 'n', 0, G_OPTION_ARG_INT, &n_streams, "Number of shaped streams", "N" },
+  { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "Duration of the measurement in seconds", "SECONDS" },
+  { "stats", 0, 0, G_OPTION_ARG_INT, &stats_samples, "Benchmark N stats samples instead of the classification", "N" },
+  { "policies", 0, 0, G_OPTION_ARG_INT, &policy_calls, "Benchmark N SetPolicy calls on the memory backend instead", "N" },
+  { "latency", 0, 0, G_OPTION_ARG_INT, &backend_latency, "Latency of every call of the memory backend in microseconds (default: 0)", "US" },
+  { "operations", 0, 0, G_OPTION_ARG_INT, &operations, "Benchmark N runs of each rule engine call instead", "N" },
+  { "failures", 0, 0, G_OPTION_ARG_NONE, &failures, "Check the policy code against failures of the memory backend instead", NULL },
+  { NULL }
+};
+
+/* /proc/net/dev follows the network namespace of the reader, unlike sysfs */
+static guint64
+read_ifb_tx_packets (void)
+{
+  gchar *contents;
+  gchar *line;
+  guint64 packets;
+  int i;
+
+  if (!g_file_get_contents ("/proc/net/dev", &contents, NULL, NULL) ||
+      !(line = strstr (contents, "ifb0:")))
+    {
+      g_printerr ("Error: cannot read ifb0 statistics\n");
+      exit (1);
+    }
+
+  /* rx bytes, packets, errs, drop, fifo, frame, compressed, multicast,
+   * then tx bytes and packets */
+  line += strlen ("ifb0:");
+  for (i = 0; i < 9; i++)
+    g_ascii_strtoull (line, &line, 10);
+  packets = g_ascii_strtoull (line, NULL, 10);
+  g_free (contents);
+
+  return packets;
+}
+
+static guint16
+ip_checksum (const void *data, size_t len)
+{
+  const guint16 *p = data;
+  guint32 sum = 0;
+
+  for (; len > 1; len -= 2)
+    sum += *p++;
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return ~sum;
+}
+
+/* Ethernet + IPv4 + TCP ACK of one stream, as seen on ingress. The MAC
+ * address is not the interface's so the stack drops the packets right after
+ * tc, and only the classification cost is measured. */
+static void
+build_packet (guint8 *buf, size_t len,
+              const struct in_addr *ip_src, const struct in_addr *ip_dst,
+              guint16 sport, guint16 dport)
+{
+  struct ethhdr *eth = (struct ethhdr *) buf;
+  struct iphdr *ip = (struct iphdr *) (eth + 1);
+  struct tcphdr *tcp = (struct tcphdr *) (ip + 1);
+
+  memset (buf, 0, len);
+
+  memset (eth->h_dest, 0, ETH_ALEN);
+  eth->h_dest[0] = 0x02;
+  eth->h_dest[5] = 0x01;
+  memset (eth->h_source, 0, ETH_ALEN);
+  eth->h_source[0] = 0x02;
+  eth->h_source[5] = 0x02;
+  eth->h_proto = htons (ETH_P_IP);
+
+  ip->version = 4;
+  ip->ihl = 5;
+  ip->tot_len = htons (len - sizeof (struct ethhdr));
+  ip->ttl = 64;
+  ip->protocol = IPPROTO_TCP;
+  ip->saddr = ip_src->s_addr;
+  ip->daddr = ip_dst->s_addr;
+  ip->check = ip_checksum (ip, sizeof (struct iphdr));
+
+  tcp->source = htons (sport);
+  tcp->dest = htons (dport);
+  tcp->doff = 5;
+  tcp->ack = 1;
+  tcp->window = htons (65535);
+}
+
+static void
+count_qdisc_cb (struct nl_object *obj, void *arg)
+{
+  int *count = arg;
+
+  (*count)++;
+}
+
+static void
+bench_stats (void)
+{
+  struct nl_sock *dump_sock;
+  struct nl_cache *cache;
+  struct rtnl_qdisc *filter;
+  TcmmdStats stats;
+  gint64 start, full_dump, targeted;
+  int ifb_qdiscs = 0;
+  int err;
+  int i;
+
+  if (!(dump_sock = nl_socket_alloc ()) ||
+      nl_connect (dump_sock, NETLINK_ROUTE) < 0 ||
+      (err = rtnl_qdisc_alloc_cache (dump_sock, &cache)) < 0 ||
+      !(filter = rtnl_qdisc_alloc ()))
+    {
+      g_printerr ("Error: cannot allocate the qdisc cache\n");
+      exit (1);
+    }
+  rtnl_tc_set_ifindex (TC_CAST (filter), if_nametoindex ("ifb0"));
+
+  /* every qdisc of every interface, then filtered for ifb0 */
+  start = g_get_monotonic_time ();
+  for (i = 0; i < stats_samples; i++)
+    {
+      if ((err = nl_cache_refill (dump_sock, cache)) < 0)
+        {
+          g_printerr ("Error: cannot sync cache: %s\n", nl_geterror (err));
+          exit (1);
+        }
+      ifb_qdiscs = 0;
+      nl_cache_foreach_filter (cache, OBJ_CAST (filter), count_qdisc_cb,
+                               &ifb_qdiscs);
+    }
+  full_dump = g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < stats_samples; i++)
+    tcmmdrtnl_get_stats (&stats);
+  targeted = g_get_monotonic_time () - start;
+
+  g_print ("stats streams=%d system_qdiscs=%d ifb_qdiscs=%d "
+           "full_dump_us=%.1f targeted_us=%.1f\n",
+           n_streams, nl_cache_nitems (cache), ifb_qdiscs,
+           full_dump / (double) stats_samples,
+           targeted / (double) stats_samples);
+
+  rtnl_qdisc_put (filter);
+  nl_cache_free (cache);
+  nl_socket_free (dump_sock);
+}
+
+/* Timers of the policy code, run by hand by bench_policies() */
+typedef struct {
+  guint id;
+  GSourceFunc function;
+  gpointer data;
+} BenchTimer;
+
+static GList *bench_timers;
+static guint bench_last_timer;
+
+static guint
+bench_timeout_add (guint interval, GSourceFunc function, gpointer data)
+{
+  BenchTimer *timer = g_new0 (BenchTimer, 1);
+
+  timer->id = ++bench_last_timer;
+  timer->function = function;
+  timer->data = data;
+  bench_timers = g_list_append (bench_timers, timer);
+
+  return timer->id;
+}
+
+static gboolean
+bench_source_remove (guint id)
+{
+  GList *l;
+
+  for (l = bench_timers; l != NULL; l = l->next)
+    if (((BenchTimer *) l->data)->id == id)
+      {
+        g_free (l->data);
+        bench_timers = g_list_delete_link (bench_timers, l);
+        return TRUE;
+      }
+
+  return FALSE;
+}
+
+static const TcmmdPolicyClock bench_clock = {
+  g_get_monotonic_time,
+  bench_timeout_add,
+  bench_source_remove,
+};
+
+static int
+compare_gint64 (gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+bench_policies (void)
+{
+  TcmmdControllerParams params;
+  gint64 *latencies;
+  gint64 start, elapsed;
+  guint steps = 0;
+  int i;
+
+  tcmmd_controller_params_init (&params);
+  tcmmd_policy_init (tcmmd_controller_lookup ("ramp"), &params, &bench_clock);
+
+  latencies = g_new (gint64, policy_calls);
+  start = g_get_monotonic_time ();
+  for (i = 0; i < policy_calls; i++)
+    {
+      int stream = i % n_streams;
+      gchar owner[32];
+      gint64 call_start;
+
+      g_snprintf (owner, sizeof (owner), ":1.%d", stream);
+
+      /* one round in ten, the buffers drop into panic */
+      call_start = g_get_monotonic_time ();
+      tcmmd_policy_set (owner, "198.51.100.1", BENCH_DPORT_BASE + stream,
+                        "192.0.2.1", BENCH_SPORT, 2000000,
+                        (i / n_streams) % 10 == 9 ? 0.5 : 1.0);
+      latencies[i] = g_get_monotonic_time () - call_start;
+
+      /* after each round, one controller step per flow */
+      if (stream == n_streams - 1)
+        {
+          GList *timers = g_list_copy (bench_timers), *l;
+
+          for (l = timers; l != NULL; l = l->next)
+            {
+              BenchTimer *timer = l->data;
+
+              timer->function (timer->data);
+              steps++;
+            }
+          g_list_free (timers);
+        }
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  for (i = 0; i < n_streams; i++)
+    {
+      gchar owner[32];
+
+      g_snprintf (owner, sizeof (owner), ":1.%d", i);
+      tcmmd_policy_unset (owner);
+    }
+
+  qsort (latencies, policy_calls, sizeof (gint64), compare_gint64);
+  g_print ("policies streams=%d calls=%d backend_latency_us=%d "
+           "calls_per_s=%.0f mean_us=%.2f p50_us=%"G_GINT64_FORMAT" p99_us=%"G_GINT64_FORMAT
+           " max_us=%"G_GINT64_FORMAT" steps=%u add_stream=%u update_rate=%u\n",
+           n_streams, policy_calls, backend_latency,
+           policy_calls * (double) G_USEC_PER_SEC / elapsed,
+           elapsed / (double) policy_calls, latencies[policy_calls / 2], latencies[policy_calls * 99 / 100],
+           latencies[policy_calls - 1], steps,
+           tcmmd_backend_memory_get_calls (TCMMD_MEMORY_CALL_ADD_STREAM),
+           tcmmd_backend_memory_get_calls (TCMMD_MEMORY_CALL_UPDATE_RATE));
+
+  g_free (latencies);
+}
+
+static guint check_errors = 0;
+
+#define CHECK(name, condition) \
+  G_STMT_START { \
+    gboolean ok = (condition); \
+    g_print ("%s %s\n", ok ? "ok" : "FAIL", name); \
+    if (!ok) \
+      check_errors++; \
+  } G_STMT_END
+
+/* Stream classes of the memory tree: 1:1 is SSH, 1:3 the background and
+ * the streams start at 1:10 */
+static guint
+count_stream_classes (void)
+{
+  GArray *objects = tcmmd_backend_memory_get_objects ();
+  guint n = 0;
+  guint i;
+
+  for (i = 0; i < objects->len; i++)
+    {
+      const TcmmdMemoryObject *object =
+          &g_array_index (objects, TcmmdMemoryObject, i);
+
+      if (object->type == TCMMD_MEMORY_CLASS && TC_H_MIN (object->handle) >= 0x10)
+        n++;
+    }
+
+  return n;
+}
+
+/* Whether the background rate the policy code believes in is the one of the
+ * tree */
+static gboolean
+background_matches (void)
+{
+  const TcmmdMemoryObject *class;
+
+  class = tcmmd_backend_memory_lookup (TCMMD_MEMORY_CLASS, "ifb0",
+                                       TC_H_MAKE (1 << 16, 3));
+  return class && class->rate == tcmmd_policy_get_background_rate ();
+}
+
+static void
+run_timers (void)
+{
+  GList *timers = g_list_copy (bench_timers), *l;
+
+  for (l = timers; l != NULL; l = l->next)
+    {
+      BenchTimer *timer = l->data;
+
+      timer->function (timer->data);
+    }
+  g_list_free (timers);
+}
+
+/* Fail each call of the memory backend in turn, and check that the flow
+ * table and the result the D-Bus methods reply with match the tree the
+ * backend kept. Returns the number of failed checks. */
+static guint
+check_failures (void)
+{
+  TcmmdControllerParams params;
+  TcmmdPolicyEntry entries[4];
+  TcmmdStats stats = { 0, };
+  guint update_calls;
+  int stream_id;
+  guint i;
+
+  tcmmd_controller_params_init (&params);
+  tcmmd_policy_init (tcmmd_controller_lookup ("ramp"), &params, &bench_clock);
+
+  for (i = 0; i < G_N_ELEMENTS (entries); i++)
+    {
+      tcmmd_flow_key_init (&entries[i].key, "198.51.100.1",
+                           BENCH_DPORT_BASE + i, "192.0.2.1", BENCH_SPORT);
+      entries[i].bitrate = 2000000;
+      entries[i].buffer_fill = 1.0;
+    }
+
+  /* add_streams: SetPolicies fails as a whole */
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_ADD_STREAM, 0, 1);
+  CHECK ("add_fails_reply", !tcmmd_policy_set_many (":1.1", entries, 2, FALSE));
+  CHECK ("add_fails_flows", tcmmd_flow_count () == 0);
+  CHECK ("add_fails_classes", count_stream_classes () == 0);
+
+  CHECK ("add_reply", tcmmd_policy_set_many (":1.1", entries, 2, FALSE));
+  CHECK ("add_flows", tcmmd_flow_count () == 2);
+  CHECK ("add_classes", count_stream_classes () == 2);
+
+  /* replace: entry 2 takes the stream of the flow of entry 0 over */
+  stream_id = tcmmd_flow_lookup (&entries[0].key)->stream_id;
+  CHECK ("replace_reply",
+         tcmmd_policy_set_many (":1.1", &entries[1], 2, TRUE));
+  CHECK ("replace_flows",
+         tcmmd_flow_count () == 2 &&
+         !tcmmd_flow_lookup (&entries[0].key) &&
+         tcmmd_flow_lookup (&entries[2].key) != NULL &&
+         tcmmd_flow_lookup (&entries[2].key)->stream_id == stream_id);
+  CHECK ("replace_classes", count_stream_classes () == 2);
+
+  /* the flows from before a failed batch are still installed */
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_ADD_STREAM, 0, 1);
+  CHECK ("rollback_reply",
+         !tcmmd_policy_set_many (":1.1", &entries[3], 1, TRUE));
+  CHECK ("rollback_flows",
+         tcmmd_flow_count () == 2 &&
+         tcmmd_flow_lookup (&entries[1].key) != NULL &&
+         tcmmd_flow_lookup (&entries[2].key) != NULL &&
+         !tcmmd_flow_lookup (&entries[3].key));
+  CHECK ("rollback_classes", count_stream_classes () == 2);
+
+  /* a batch which only drops flows is one del_stream call */
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_DEL_STREAM, 0, 1);
+  CHECK ("drop_fails_reply",
+         !tcmmd_policy_set_many (":1.1", &entries[1], 1, TRUE));
+  CHECK ("drop_fails_flows",
+         tcmmd_flow_count () == 2 &&
+         tcmmd_flow_lookup (&entries[2].key) != NULL);
+  CHECK ("drop_fails_classes", count_stream_classes () == 2);
+
+  tcmmd_policy_unset (":1.1");
+  CHECK ("unset_owner_flows", tcmmd_flow_count () == 0);
+  CHECK ("unset_owner_classes", count_stream_classes () == 0);
+
+  /* the status of the control socket reply */
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_ADD_STREAM, 0, 1);
+  CHECK ("fixed_fails_reply",
+         !tcmmd_policy_set_fixed (":1.2", "198.51.100.1", BENCH_DPORT_BASE,
+                                  "192.0.2.1", BENCH_SPORT, 3000000, 700000));
+  CHECK ("fixed_fails_flows", tcmmd_flow_count () == 0);
+
+  /* update_rate: the policy code keeps the rate the tree has, and tries
+   * again at the next change */
+  CHECK ("update_setup", tcmmd_policy_set_many (":1.2", entries, 1, FALSE));
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_UPDATE_RATE, 0, G_MAXUINT);
+  update_calls = tcmmd_backend_memory_get_calls (TCMMD_MEMORY_CALL_UPDATE_RATE);
+  tcmmd_policy_set_fixed (":1.2", "198.51.100.1", BENCH_DPORT_BASE,
+                          "192.0.2.1", BENCH_SPORT, 3000000, 700000);
+  CHECK ("update_fails_called",
+         tcmmd_backend_memory_get_calls (TCMMD_MEMORY_CALL_UPDATE_RATE) > update_calls);
+  CHECK ("update_fails_background", background_matches ());
+  CHECK ("update_fails_flows", tcmmd_flow_count () == 1);
+
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_UPDATE_RATE, 0, 0);
+  tcmmd_policy_set_fixed (":1.2", "198.51.100.1", BENCH_DPORT_BASE,
+                          "192.0.2.1", BENCH_SPORT, 3000000, 700000);
+  CHECK ("update_background",
+         background_matches () &&
+         tcmmd_policy_get_background_rate () == 700000);
+  run_timers ();
+
+  /* get_stats: a sample of zeros, the flows are left alone */
+  stats.qdisc_ingress_bytes = 1000;
+  stats.qdisc_background_bytes = 1000;
+  tcmmd_backend_memory_set_stats (&stats);
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_GET_STATS, 0, 1);
+  tcmmd_policy_sample_stats (&stats);
+  CHECK ("stats_fails_sample", stats.qdisc_ingress_bytes == 0);
+  CHECK ("stats_fails_flows", tcmmd_flow_count () == 1);
+  run_timers ();
+  tcmmd_policy_sample_stats (&stats);
+  CHECK ("stats_sample", stats.qdisc_ingress_bytes == 1000);
+
+  /* SetPolicy: a new tuple replaces the flow of the owner, which keeps it
+   * if the new one cannot be installed */
+  tcmmd_backend_memory_fail (TCMMD_MEMORY_CALL_ADD_STREAM, 0, 1);
+  CHECK ("v1_replace_fails_reply",
+         !tcmmd_policy_set (":1.2", "198.51.100.1", BENCH_DPORT_BASE + 1,
+                            "192.0.2.1", BENCH_SPORT, 2000000, 1.0));
+  CHECK ("v1_replace_fails_flows",
+         tcmmd_flow_count () == 1 &&
+         tcmmd_flow_lookup (&entries[0].key) != NULL);
+  CHECK ("v1_replace_reply",
+         tcmmd_policy_set (":1.2", "198.51.100.1", BENCH_DPORT_BASE + 1,
+                           "192.0.2.1", BENCH_SPORT, 2000000, 1.0));
+  CHECK ("v1_replace_flows",
+         tcmmd_flow_count () == 1 &&
+         !tcmmd_flow_lookup (&entries[0].key) &&
+         tcmmd_flow_lookup (&entries[1].key) != NULL);
+  CHECK ("v1_replace_classes", count_stream_classes () == 1);
+
+  tcmmd_policy_unset (":1.1");
+  tcmmd_policy_unset (":1.2");
+  CHECK ("unset_classes", count_stream_classes () == 0);
+
+  return check_errors;
+}
+
+/* Counter of the system calls made by this thread, from the
+ * raw_syscalls:sys_enter tracepoint. Needs tracefs mounted; -1 if it is
+ * not available. */
+static int
+open_syscall_counter (void)
+{
+  static const gchar *id_files[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+  };
+  struct perf_event_attr attr;
+  gchar *contents;
+  guint i;
+  int fd;
+
+  for (i = 0; i < G_N_ELEMENTS (id_files); i++)
+    if (g_file_get_contents (id_files[i], &contents, NULL, NULL))
+      break;
+  if (i == G_N_ELEMENTS (id_files))
+    {
+      g_printerr ("Warning: raw_syscalls tracepoint unavailable, no syscall count\n");
+      return -1;
+    }
+
+  memset (&attr, 0, sizeof (attr));
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof (attr);
+  attr.config = g_ascii_strtoull (contents, NULL, 10);
+  attr.disabled = 1;
+  g_free (contents);
+
+  fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0)
+    g_printerr ("Warning: cannot count syscalls: %s\n", strerror (errno));
+
+  return fd;
+}
+
+static void
+syscall_counter_start (int fd)
+{
+  if (fd < 0)
+    return;
+
+  ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/* the ioctl disabling the counter is not counted */
+static guint64
+syscall_counter_stop (int fd)
+{
+  guint64 count;
+
+  if (fd < 0)
+    return 0;
+
+  ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read (fd, &count, sizeof (count)) != sizeof (count))
+    return 0;
+
+  return count;
+}
+
+static void
+print_operation (const gchar *name, gint64 *latencies, guint64 syscalls,
+                 int counter)
+{
+  gint64 total = 0;
+  gchar syscalls_str[G_ASCII_DTOSTR_BUF_SIZE];
+  int i;
+
+  for (i = 0; i < operations; i++)
+    total += latencies[i];
+  qsort (latencies, operations, sizeof (gint64), compare_gint64);
+
+  if (counter >= 0)
+    g_snprintf (syscalls_str, sizeof (syscalls_str), "%.1f",
+                syscalls / (double) operations);
+  else
+    g_strlcpy (syscalls_str, "n/a", sizeof (syscalls_str));
+
+  g_print ("operation=%s streams=%d runs=%d mean_us=%.1f p50_us=%"G_GINT64_FORMAT
+           " p99_us=%"G_GINT64_FORMAT" max_us=%"G_GINT64_FORMAT" syscalls=%s\n",
+           name, n_streams, operations, total / (double) operations,
+           latencies[operations / 2], latencies[operations * 99 / 100],
+           latencies[operations - 1], syscalls_str);
+}
+
+/* Each operation runs on a tree holding n_streams streams, except cold_add
+ * which rebuilds the tree from scratch, as when the first policy comes in:
+ *   init_ifb      tcmmdrtnl_init_ifb(), the ingress redirection
+ *   cold_add      tcmmdrtnl_del_rules() then the first stream
+ *   warm_add      one more stream on the installed tree
+ *   del_stream    removal of that stream
+ *   update_rate   rate change of a stream class, alternating two rates
+ *   get_stats     one stats sample */
+static void
+bench_operations (const struct in_addr *ip_src, const struct in_addr *ip_dst)
+{
+  enum { INIT_IFB, COLD_ADD, WARM_ADD, DEL_STREAM, UPDATE_RATE, GET_STATS,
+         N_OPERATIONS };
+  static const gchar *names[] = { "init_ifb", "cold_add", "warm_add",
+                                  "del_stream", "update_rate", "get_stats" };
+  gint64 *latencies[N_OPERATIONS];
+  guint64 syscalls[N_OPERATIONS] = { 0, };
+  TcmmdStats stats;
+  int counter;
+  int op;
+  int i;
+
+  counter = open_syscall_counter ();
+  for (op = 0; op < N_OPERATIONS; op++)
+    latencies[op] = g_new (gint64, operations);
+
+#define MEASURE(op, call) \
+  G_STMT_START { \
+    gint64 start = g_get_monotonic_time (); \
+    syscall_counter_start (counter); \
+    call; \
+    syscalls[op] += syscall_counter_stop (counter); \
+    latencies[op][i] = g_get_monotonic_time () - start; \
+  } G_STMT_END
+
+  for (i = 0; i < operations; i++)
+    MEASURE (INIT_IFB, tcmmdrtnl_init_ifb ());
+
+  for (i = 0; i < operations; i++)
+    MEASURE (COLD_ADD,
+             tcmmdrtnl_del_rules ();
+             tcmmdrtnl_add_stream (AF_INET, ip_src, ip_dst, BENCH_SPORT,
+                                   BENCH_DPORT_BASE + i % 1000,
+                                   BENCH_RATE, BENCH_RATE));
+
+  for (i = 1; i < n_streams; i++)
+    tcmmdrtnl_add_stream (AF_INET, ip_src, ip_dst, BENCH_SPORT,
+                          BENCH_DPORT_BASE + i, BENCH_RATE, BENCH_RATE);
+
+  for (i = 0; i < operations; i++)
+    {
+      int id;
+
+      MEASURE (WARM_ADD,
+               id = tcmmdrtnl_add_stream (AF_INET, ip_src, ip_dst, BENCH_SPORT,
+                                          BENCH_DPORT_BASE + n_streams,
+                                          BENCH_RATE, BENCH_RATE));
+      MEASURE (DEL_STREAM, tcmmdrtnl_del_stream (id));
+    }
+
+  for (i = 0; i < operations; i++)
+    MEASURE (UPDATE_RATE,
+             tcmmdrtnl_update_rate (TCMMD_CLASS_STREAM, 0,
+                                    i % 2 ? BENCH_RATE : BENCH_RATE / 2, 0));
+
+  for (i = 0; i < operations; i++)
+    MEASURE (GET_STATS, tcmmdrtnl_get_stats (&stats));
+
+#undef MEASURE
+
+  for (op = 0; op < N_OPERATIONS; op++)
+    {
+      print_operation (names[op], latencies[op], syscalls[op], counter);
+      g_free (latencies[op]);
+    }
+
+  if (counter >= 0)
+    close (counter);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  const char *link_names[2] = { NULL, NULL };
+  struct in_addr ip_src, ip_dst;
+  struct sockaddr_ll addr;
+  guint8 (*packets)[sizeof (struct ethhdr) + sizeof (struct iphdr) + sizeof (struct tcphdr)];
+  struct mmsghdr msgs[BENCH_BATCH];
+  struct iovec iovs[BENCH_BATCH];
+  guint64 sent = 0;
+  guint64 tx_before, tx_after;
+  gint64 start, elapsed;
+  int fd;
+  int i;
+
+  context = g_option_context_new ("- tcmmd classification benchmark");
+  g_option_context_add_main_entries (context, option_entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_print ("option parsing failed: %s\n", error->message);
+      exit (1);
+    }
+
+  if (failures)
+    {
+      guint errors;
+
+      tcmmd_verbosity = TCMMD_LOG_QUIET;
+      tcmmd_backend_set (&tcmmd_backend_memory);
+      link_names[0] = iface_name;
+      tcmmdrtnl_init (link_names);
+      tcmmdrtnl_init_ifb ();
+      errors = check_failures ();
+      tcmmdrtnl_uninit ();
+      g_print ("failures checks=%s\n", errors ? "failed" : "passed");
+      return errors ? 1 : 0;
+    }
+
+  if (policy_calls > 0)
+    {
+      TcmmdMemoryCall call;
+
+      if (n_streams < 1 || n_streams > TCMMD_MAX_STREAMS || backend_latency < 0)
+        {
+          g_print ("1..%d --streams are required\n", TCMMD_MAX_STREAMS);
+          exit (1);
+        }
+
+      tcmmd_verbosity = TCMMD_LOG_QUIET;
+      tcmmd_backend_set (&tcmmd_backend_memory);
+      for (call = 0; call < TCMMD_MEMORY_N_CALLS; call++)
+        tcmmd_backend_memory_set_latency (call, backend_latency);
+      link_names[0] = iface_name;
+      tcmmdrtnl_init (link_names);
+      tcmmdrtnl_init_ifb ();
+      bench_policies ();
+      tcmmdrtnl_uninit ();
+      return 0;
+    }
+
+  if (operations > 0 && (!iface_name || n_streams < 1 ||
+                         n_streams >= TCMMD_MAX_STREAMS))
+    {
+      g_print ("--interface and 1..%d --streams are required\n",
+               TCMMD_MAX_STREAMS - 1);
+      exit (1);
+    }
+
+  if (!iface_name || (!sender_name && stats_samples <= 0 && operations <= 0) ||
+      n_streams < 1 || n_streams > TCMMD_MAX_STREAMS || duration < 1)
+    {
+      g_print ("--interface, --sender or --stats, and 1..%d --streams are required\n",
+               TCMMD_MAX_STREAMS);
+      exit (1);
+    }
+
+  if (classifier_name && g_strcmp0 (classifier_name, "flower") == 0)
+    tcmmdrtnl_set_classifier (TCMMD_CLASSIFIER_FLOWER);
+  else if (classifier_name && g_strcmp0 (classifier_name, "u32") != 0)
+    {
+      g_print ("Unknown classifier '%s'\n", classifier_name);
+      exit (1);
+    }
+
+  /* the streams of a server sending to us, as tcmmd installs them */
+  inet_pton (AF_INET, "192.0.2.1", &ip_src);
+  inet_pton (AF_INET, "198.51.100.1", &ip_dst);
+
+  link_names[0] = iface_name;
+  tcmmdrtnl_init (link_names);
+  if (operations > 0)
+    {
+      tcmmd_verbosity = TCMMD_LOG_QUIET;
+      bench_operations (&ip_src, &ip_dst);
+      tcmmdrtnl_uninit ();
+      return 0;
+    }
+
+  tcmmdrtnl_init_ifb ();
+  for (i = 0; i < n_streams; i++)
+    tcmmdrtnl_add_stream (AF_INET, &ip_src, &ip_dst,
+                          BENCH_SPORT, BENCH_DPORT_BASE + i,
+                          BENCH_RATE, BENCH_RATE);
+
+  if (stats_samples > 0)
+    {
+      bench_stats ();
+      tcmmdrtnl_uninit ();
+      return 0;
+    }
+
+  fd = socket (AF_PACKET, SOCK_RAW, 0);
+  if (fd < 0)
+    {
+      g_printerr ("Error: cannot open packet socket: %s\n", strerror (errno));
+      exit (1);
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_ifindex = if_nametoindex (sender_name);
+  if (addr.sll_ifindex == 0 ||
+      bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      g_printerr ("Error: cannot bind to '%s': %s\n", sender_name,
+                  strerror (errno));
+      exit (1);
+    }
+
+  /* cycle over all the streams, so every filter is hit */
+  packets = g_malloc (BENCH_BATCH * sizeof (*packets));
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < BENCH_BATCH; i++)
+    {
+      build_packet (packets[i], sizeof (*packets), &ip_src, &ip_dst,
+                    BENCH_SPORT, BENCH_DPORT_BASE + i % n_streams);
+      iovs[i].iov_base = packets[i];
+      iovs[i].iov_len = sizeof (*packets);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+  tx_before = read_ifb_tx_packets ();
+  start = g_get_monotonic_time ();
+  do
+    {
+      int n = sendmmsg (fd, msgs, BENCH_BATCH, 0);
+      if (n < 0 && errno != ENOBUFS && errno != EAGAIN)
+        {
+          g_printerr ("Error: cannot send: %s\n", strerror (errno));
+          exit (1);
+        }
+      if (n > 0)
+        sent += n;
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (elapsed < duration * G_USEC_PER_SEC);
+  /* let ifb0 drain its queue */
+  g_usleep (100000);
+  tx_after = read_ifb_tx_packets ();
+
+  g_print ("classifier=%s streams=%d sent_pps=%.0f ifb_pps=%.0f\n",
+           classifier_name ? classifier_name : "u32", n_streams,
+           sent * (double) G_USEC_PER_SEC / elapsed,
+           (tx_after - tx_before) * (double) G_USEC_PER_SEC / elapsed);
+
+  close (fd);
+  g_free (packets);
+  tcmmdrtnl_uninit ();
+
+  return 0;
+}
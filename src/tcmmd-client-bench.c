@@ -0,0 +1,206 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Latency of a buffer fill update from an application to a running tcmmd,
+ * as SetPolicy calls through D-Bus and through the control socket. Both
+ * paths end in the same handlers, so the difference is the transport. See
+ * tests/control-bench.sh. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "tcmmd-client.h"
+#include "tcmmd-generated.h"
+
+#define GETTEXT_PACKAGE "tcmmd-client-bench"
+
+static gchar *control_path;
+static gboolean session_bus;
+static gint calls = 10000;
+
+static GOptionEntry option_entries[] =
+{
+  { "control-socket", 0, 0, G_OPTION_ARG_STRING, &control_path, "Control socket of tcmmd", "PATH" },
+  { "session-bus", 0, 0, G_OPTION_ARG_NONE, &session_bus, "tcmmd is on the session bus", NULL },
+  { "calls", 'n', 0, G_OPTION_ARG_INT, &calls, "Number of SetPolicy calls per transport (default: 10000)", "N" },
+  { NULL }
+};
+
+/* one call in ten, the buffer drops into panic, as in policy-bench.py */
+static gdouble
+call_fill (int i)
+{
+  return i % 10 == 9 ? 0.5 : 1.0;
+}
+
+static int
+compare_gint64 (gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+print_latencies (const gchar *transport, gint64 *latencies)
+{
+  gint64 total = 0;
+  int i;
+
+  for (i = 0; i < calls; i++)
+    total += latencies[i];
+  qsort (latencies, calls, sizeof (gint64), compare_gint64);
+
+  g_print ("transport=%s calls=%d mean_us=%.1f p50_us=%"G_GINT64_FORMAT
+           " p99_us=%"G_GINT64_FORMAT" max_us=%"G_GINT64_FORMAT"\n",
+           transport, calls, total / (double) calls, latencies[calls / 2],
+           latencies[calls * 99 / 100], latencies[calls - 1]);
+}
+
+/* tcmmd may still be acquiring its name */
+static gboolean
+wait_for_name (GDBusProxy *proxy)
+{
+  gchar *owner;
+  int i;
+
+  for (i = 0; i < 50; i++)
+    {
+      owner = g_dbus_proxy_get_name_owner (proxy);
+      if (owner)
+        {
+          g_free (owner);
+          return TRUE;
+        }
+
+      g_usleep (G_USEC_PER_SEC / 10);
+      while (g_main_context_iteration (NULL, FALSE))
+        ;
+    }
+
+  return FALSE;
+}
+
+static void
+bench_dbus (gint64 *latencies)
+{
+  TcmmdManagedConnections *proxy;
+  GError *error = NULL;
+  int i;
+
+  proxy = tcmmd_managed_connections_proxy_new_for_bus_sync (
+      session_bus ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM,
+      G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES, "org.tcmmd",
+      "/org/tcmmd/ManagedConnections", NULL, &error);
+  if (!proxy)
+    {
+      g_printerr ("Cannot reach tcmmd on D-Bus: %s\n", error->message);
+      exit (1);
+    }
+  if (!wait_for_name (G_DBUS_PROXY (proxy)))
+    {
+      g_printerr ("org.tcmmd not found on the bus\n");
+      exit (1);
+    }
+
+  for (i = 0; i < calls; i++)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      if (!tcmmd_managed_connections_call_set_policy_sync (proxy,
+              "198.51.100.1", 10000, "192.0.2.1", 80, 2000000,
+              call_fill (i), NULL, &error))
+        {
+          g_printerr ("SetPolicy failed: %s\n", error->message);
+          exit (1);
+        }
+      latencies[i] = g_get_monotonic_time () - start;
+    }
+
+  tcmmd_managed_connections_call_unset_policy_sync (proxy, NULL, NULL);
+  g_object_unref (proxy);
+}
+
+static void
+bench_control (gint64 *latencies)
+{
+  TcmmdClient *client;
+  int i, ret;
+
+  client = tcmmd_client_new (control_path);
+  if (!client)
+    {
+      g_printerr ("Cannot connect to '%s': %s\n", control_path,
+                  strerror (errno));
+      exit (1);
+    }
+
+  for (i = 0; i < calls; i++)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      ret = tcmmd_client_set_policy (client, "198.51.100.1", 10000,
+                                     "192.0.2.1", 80, 2000000, call_fill (i));
+      if (ret < 0)
+        {
+          g_printerr ("SetPolicy failed: %s\n", strerror (-ret));
+          exit (1);
+        }
+      latencies[i] = g_get_monotonic_time () - start;
+    }
+
+  tcmmd_client_unset_policy (client);
+  tcmmd_client_free (client);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  gint64 *latencies;
+
+  context = g_option_context_new ("- tcmmd SetPolicy latency benchmark");
+  g_option_context_add_main_entries (context, option_entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_print ("option parsing failed: %s\n", error->message);
+      exit (1);
+    }
+
+  if (!control_path || calls < 1)
+    {
+      g_print ("--control-socket and a positive --calls are required\n");
+      exit (1);
+    }
+
+  latencies = g_new (gint64, calls);
+
+  bench_dbus (latencies);
+  print_latencies ("dbus", latencies);
+
+  bench_control (latencies);
+  print_latencies ("control", latencies);
+
+  g_free (latencies);
+
+  return 0;
+}
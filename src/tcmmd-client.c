@@ -0,0 +1,208 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "tcmmd-client.h"
+#include "tcmmd-control-protocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct _TcmmdClient {
+  int fd;
+  uint32_t serial;
+};
+
+TcmmdClient *
+tcmmd_client_new (const char *path)
+{
+  struct sockaddr_un addr = { AF_UNIX, };
+  TcmmdClient *client;
+  int fd;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return NULL;
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      int saved_errno = errno;
+
+      close (fd);
+      errno = saved_errno;
+      return NULL;
+    }
+
+  client = calloc (1, sizeof (TcmmdClient));
+  if (!client)
+    {
+      close (fd);
+      errno = ENOMEM;
+      return NULL;
+    }
+  client->fd = fd;
+
+  return client;
+}
+
+void
+tcmmd_client_free (TcmmdClient *client)
+{
+  close (client->fd);
+  free (client);
+}
+
+static int
+call (TcmmdClient *client,
+      TcmmdControlRequest *request)
+{
+  TcmmdControlReply reply;
+  ssize_t len;
+
+  request->version = TCMMD_CONTROL_VERSION;
+  request->serial = ++client->serial;
+
+  do
+    len = send (client->fd, request, sizeof (*request), MSG_NOSIGNAL);
+  while (len < 0 && errno == EINTR);
+  if (len < 0 && errno == EPIPE)
+    return -ECONNRESET;
+  if (len < 0)
+    return -errno;
+
+  do
+    len = recv (client->fd, &reply, sizeof (reply), 0);
+  while (len < 0 && errno == EINTR);
+  if (len < 0)
+    return -errno;
+  /* tcmmd went away, or refused us */
+  if (len == 0)
+    return -ECONNRESET;
+  if (len != sizeof (reply) || reply.serial != request->serial)
+    return -EPROTO;
+
+  return reply.status;
+}
+
+static int
+parse_addresses (TcmmdControlRequest *request,
+                 const char *src_ip, const char *dst_ip)
+{
+  if (inet_pton (AF_INET, src_ip, request->src_ip) == 1 &&
+      inet_pton (AF_INET, dst_ip, request->dst_ip) == 1)
+    request->family = AF_INET;
+  else if (inet_pton (AF_INET6, src_ip, request->src_ip) == 1 &&
+           inet_pton (AF_INET6, dst_ip, request->dst_ip) == 1)
+    request->family = AF_INET6;
+  else
+    return -EINVAL;
+
+  return 0;
+}
+
+int
+tcmmd_client_set_policy (TcmmdClient *client,
+                         const char *src_ip, uint16_t src_port,
+                         const char *dst_ip, uint16_t dst_port,
+                         uint32_t bitrate,
+                         double buffer_fill)
+{
+  TcmmdControlRequest request = { 0, };
+
+  if (parse_addresses (&request, src_ip, dst_ip) < 0)
+    return -EINVAL;
+
+  request.type = TCMMD_CONTROL_SET_POLICY;
+  request.src_port = src_port;
+  request.dst_port = dst_port;
+  request.rate = bitrate;
+  request.buffer_fill = buffer_fill;
+
+  return call (client, &request);
+}
+
+int
+tcmmd_client_set_fixed_policy (TcmmdClient *client,
+                               const char *src_ip, uint16_t src_port,
+                               const char *dst_ip, uint16_t dst_port,
+                               uint32_t stream_rate,
+                               uint32_t background_rate)
+{
+  TcmmdControlRequest request = { 0, };
+
+  if (parse_addresses (&request, src_ip, dst_ip) < 0)
+    return -EINVAL;
+
+  request.type = TCMMD_CONTROL_SET_FIXED_POLICY;
+  request.src_port = src_port;
+  request.dst_port = dst_port;
+  request.rate = stream_rate;
+  request.background_rate = background_rate;
+
+  return call (client, &request);
+}
+
+int
+tcmmd_client_unset_policy (TcmmdClient *client)
+{
+  TcmmdControlRequest request = { 0, };
+
+  request.type = TCMMD_CONTROL_UNSET_POLICY;
+
+  return call (client, &request);
+}
+
+TcmmdSharedPolicy *
+tcmmd_client_map_shared_policy (int fd)
+{
+  TcmmdSharedPolicy *page;
+
+  page = mmap (NULL, sizeof (TcmmdSharedPolicy), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED)
+    return NULL;
+
+  if (page->magic != TCMMD_SHARED_MAGIC ||
+      page->version != TCMMD_SHARED_VERSION)
+    {
+      munmap (page, sizeof (TcmmdSharedPolicy));
+      errno = EPROTO;
+      return NULL;
+    }
+
+  return page;
+}
+
+void
+tcmmd_client_unmap_shared_policy (TcmmdSharedPolicy *page)
+{
+  munmap (page, sizeof (TcmmdSharedPolicy));
+}
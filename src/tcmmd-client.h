@@ -0,0 +1,65 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_CLIENT_H
+#define __TCMMD_CLIENT_H
+
+#include <stdint.h>
+
+#include "tcmmd-shared-protocol.h"
+
+/* Client of the control socket of tcmmd (see --control-socket), for the
+ * applications that cannot afford a round trip through dbus-daemon for
+ * every buffer fill update. It only depends on the C library.
+ *
+ * The calls are those of org.tcmmd.ManagedConnections and block until tcmmd
+ * replied, which takes a few tens of microseconds. They return 0, or a
+ * negative errno: -EINVAL for invalid arguments, -EPROTO if tcmmd did not
+ * understand the request, -EIO if tcmmd could not install the flow (a rate
+ * it could not apply is not an error), or the error of the socket. Freeing
+ * the client unsets its policy. */
+
+typedef struct _TcmmdClient TcmmdClient;
+
+/* Returns NULL with errno set if tcmmd is not listening at 'path'. If
+ * tcmmd refuses the user, the first call fails with -ECONNRESET. */
+TcmmdClient *tcmmd_client_new (const char *path);
+void tcmmd_client_free (TcmmdClient *client);
+
+/* The addresses are IPv4 or IPv6 strings, of the same family */
+int tcmmd_client_set_policy (TcmmdClient *client,
+                             const char *src_ip, uint16_t src_port,
+                             const char *dst_ip, uint16_t dst_port,
+                             uint32_t bitrate,
+                             double buffer_fill);
+int tcmmd_client_set_fixed_policy (TcmmdClient *client,
+                                   const char *src_ip, uint16_t src_port,
+                                   const char *dst_ip, uint16_t dst_port,
+                                   uint32_t stream_rate,
+                                   uint32_t background_rate);
+int tcmmd_client_unset_policy (TcmmdClient *client);
+
+/* Map the page returned by ManagedConnections2.SetSharedPolicy, then write
+ * to it with tcmmd_shared_policy_write(). The fd can be closed once mapped.
+ * Returns NULL with errno set if it is not a page of this version. */
+TcmmdSharedPolicy *tcmmd_client_map_shared_policy (int fd);
+void tcmmd_client_unmap_shared_policy (TcmmdSharedPolicy *page);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_CONTROL_PROTOCOL_H
+#define __TCMMD_CONTROL_PROTOCOL_H
+
+#include <stdint.h>
+
+/* Wire format of the control socket, see --control-socket.
+ *
+ * The socket is a SOCK_SEQPACKET Unix socket: every message is one
+ * TcmmdControlRequest from the client, answered by one TcmmdControlReply
+ * with the same serial, in order. The methods are those of
+ * org.tcmmd.ManagedConnections, and each connection is one client: closing
+ * it unsets its policy, like leaving the bus.
+ *
+ * Both ends are on the same host, so the fields are in host byte order. */
+
+#define TCMMD_CONTROL_VERSION 1
+
+typedef enum {
+  TCMMD_CONTROL_SET_POLICY = 1,
+  TCMMD_CONTROL_SET_FIXED_POLICY = 2,
+  TCMMD_CONTROL_UNSET_POLICY = 3,
+} TcmmdControlType;
+
+typedef struct {
+  uint16_t version;
+  uint16_t type;
+  uint32_t serial;
+
+  /* AF_INET or AF_INET6, with the addresses in network byte order in the
+   * first 4 or 16 bytes. Ignored by UNSET_POLICY. */
+  uint8_t family;
+  uint8_t padding1;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t padding2;
+  uint8_t src_ip[16];
+  uint8_t dst_ip[16];
+
+  /* SET_POLICY: bitrate and buffer_fill. SET_FIXED_POLICY: stream_rate and
+   * background_rate. */
+  uint32_t rate;
+  uint32_t background_rate;
+  double buffer_fill;
+} TcmmdControlRequest;
+
+typedef struct {
+  uint32_t serial;
+  /* 0, or a negative errno: -EPROTO for a malformed request, -EINVAL for
+   * invalid arguments, -EIO if the flow could not be installed */
+  int32_t status;
+} TcmmdControlReply;
+
+#endif
@@ -0,0 +1,403 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE /* accept4, struct ucred */
+
+#include "tcmmd-control.h"
+#include "tcmmd-control-protocol.h"
+#include "tcmmd-trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+G_DEFINE_TYPE (TcmmdControl, tcmmd_control, G_TYPE_OBJECT)
+
+struct _TcmmdControlPrivate
+{
+  gchar *path;
+  int fd;
+  guint source_id;
+  GArray *allowed_uids;
+  /* of Client */
+  GList *clients;
+  /* makes the owner names unique */
+  guint n_connections;
+};
+
+/* One connection. Its owner name plays the part of the unique bus name of
+ * a D-Bus client. */
+typedef struct {
+  TcmmdControl *control;
+  int fd;
+  guint source_id;
+  gchar *owner;
+  gboolean has_policy;
+} Client;
+
+enum
+{
+  SET_POLICY,
+  SET_FIXED_POLICY,
+  UNSET_POLICY,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
+static void
+client_free (Client *client)
+{
+  g_source_remove (client->source_id);
+  close (client->fd);
+  g_free (client->owner);
+  g_slice_free (Client, client);
+}
+
+static void
+client_close (Client *client)
+{
+  TcmmdControl *self = client->control;
+
+  tcmmd_log (TCMMD_LOG_DEBUG, "Control client %s closed\n", client->owner);
+  self->priv->clients = g_list_remove (self->priv->clients, client);
+
+  if (client->has_policy)
+    g_signal_emit (self, signals[UNSET_POLICY], 0, client->owner);
+
+  client_free (client);
+}
+
+static int
+handle_request (Client *client,
+    const TcmmdControlRequest *request)
+{
+  TcmmdControl *self = client->control;
+  gchar src_ip[INET6_ADDRSTRLEN];
+  gchar dst_ip[INET6_ADDRSTRLEN];
+  gboolean installed = FALSE;
+
+  if (request->version != TCMMD_CONTROL_VERSION)
+    return -EPROTO;
+
+  if (request->type == TCMMD_CONTROL_UNSET_POLICY)
+    {
+      tcmmd_log (TCMMD_LOG_DEBUG, "Control UnsetPolicy\n");
+
+      client->has_policy = FALSE;
+      g_signal_emit (self, signals[UNSET_POLICY], 0, client->owner);
+      return 0;
+    }
+
+  if (request->type != TCMMD_CONTROL_SET_POLICY &&
+      request->type != TCMMD_CONTROL_SET_FIXED_POLICY)
+    return -EPROTO;
+
+  if ((request->family != AF_INET && request->family != AF_INET6) ||
+      !inet_ntop (request->family, request->src_ip, src_ip, sizeof (src_ip)) ||
+      !inet_ntop (request->family, request->dst_ip, dst_ip, sizeof (dst_ip)))
+    return -EINVAL;
+
+  /* also rejects NaN */
+  if (request->type == TCMMD_CONTROL_SET_POLICY &&
+      !(request->buffer_fill >= 0.0 && request->buffer_fill <= 1.0))
+    return -EINVAL;
+
+  client->has_policy = TRUE;
+
+  if (request->type == TCMMD_CONTROL_SET_POLICY)
+    {
+      tcmmd_log (TCMMD_LOG_DEBUG, "Control SetPolicy: src=%s:%d, dest=%s:%d, bitrate=%d, buffer=%d%%\n",
+          src_ip, request->src_port, dst_ip, request->dst_port,
+          request->rate, (gint) (request->buffer_fill * 100.0));
+
+      g_signal_emit (self, signals[SET_POLICY], 0, client->owner,
+          src_ip, (guint) request->src_port, dst_ip, (guint) request->dst_port,
+          (guint) request->rate, request->buffer_fill, &installed);
+    }
+  else
+    {
+      tcmmd_log (TCMMD_LOG_DEBUG, "Control SetFixedPolicy: %s:%d -> %s:%d stream_rate=%d, background_rate=%d\n",
+          src_ip, request->src_port, dst_ip, request->dst_port,
+          request->rate, request->background_rate);
+
+      g_signal_emit (self, signals[SET_FIXED_POLICY], 0, client->owner,
+          src_ip, (guint) request->src_port, dst_ip, (guint) request->dst_port,
+          (guint) request->rate, (guint) request->background_rate,
+          &installed);
+    }
+
+  return installed ? 0 : -EIO;
+}
+
+static gboolean
+client_cb (gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  Client *client = user_data;
+
+  /* all the requests queued since the last wakeup */
+  for (;;)
+    {
+      /* zeroed: the serial of a short message is 0 */
+      TcmmdControlRequest request = { 0, };
+      TcmmdControlReply reply;
+      ssize_t len;
+
+      /* MSG_TRUNC: the real length of longer messages */
+      len = recv (fd, &request, sizeof (request), MSG_DONTWAIT | MSG_TRUNC);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0 && errno == EAGAIN)
+        return G_SOURCE_CONTINUE;
+      if (len <= 0)
+        {
+          client_close (client);
+          return G_SOURCE_REMOVE;
+        }
+
+      reply.serial = request.serial;
+      if (len == sizeof (request))
+        reply.status = handle_request (client, &request);
+      else
+        reply.status = -EPROTO;
+
+      /* a client that does not read its replies is not worth waiting for */
+      if (send (fd, &reply, sizeof (reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        {
+          client_close (client);
+          return G_SOURCE_REMOVE;
+        }
+    }
+}
+
+static gboolean
+is_allowed (TcmmdControl *self,
+    uid_t uid)
+{
+  guint i;
+
+  if (uid == 0 || uid == geteuid ())
+    return TRUE;
+
+  for (i = 0; i < self->priv->allowed_uids->len; i++)
+    if (g_array_index (self->priv->allowed_uids, uid_t, i) == uid)
+      return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+accept_cb (gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  TcmmdControl *self = user_data;
+
+  for (;;)
+    {
+      struct ucred cred;
+      socklen_t cred_len = sizeof (cred);
+      Client *client;
+      int client_fd;
+
+      client_fd = accept4 (fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (client_fd < 0 && errno == EINTR)
+        continue;
+      if (client_fd < 0)
+        {
+          if (errno != EAGAIN)
+            g_printerr ("Cannot accept a control client: %s\n",
+                        strerror (errno));
+          return G_SOURCE_CONTINUE;
+        }
+
+      if (getsockopt (client_fd, SOL_SOCKET, SO_PEERCRED, &cred,
+                      &cred_len) < 0 ||
+          !is_allowed (self, cred.uid))
+        {
+          tcmmd_log (TCMMD_LOG_INFO, "Control client refused\n");
+          close (client_fd);
+          continue;
+        }
+
+      client = g_slice_new0 (Client);
+      client->control = self;
+      client->fd = client_fd;
+      client->owner = g_strdup_printf ("control:%d.%u", (int) cred.pid,
+                                       ++self->priv->n_connections);
+      client->source_id = g_unix_fd_add (client_fd, G_IO_IN | G_IO_HUP |
+                                         G_IO_ERR, client_cb, client);
+      self->priv->clients = g_list_prepend (self->priv->clients, client);
+
+      tcmmd_log (TCMMD_LOG_DEBUG, "Control client %s, uid %d\n",
+                 client->owner, (int) cred.uid);
+    }
+}
+
+static void
+tcmmd_control_init (TcmmdControl *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      TCMMD_TYPE_CONTROL, TcmmdControlPrivate);
+  self->priv->fd = -1;
+  self->priv->allowed_uids = g_array_new (FALSE, FALSE, sizeof (uid_t));
+}
+
+static void
+tcmmd_control_dispose (GObject *object)
+{
+  TcmmdControl *self = (TcmmdControl *) object;
+
+  /* without unsetting the policies: tcmmd is going away */
+  g_list_free_full (self->priv->clients, (GDestroyNotify) client_free);
+  self->priv->clients = NULL;
+
+  if (self->priv->source_id != 0)
+    {
+      g_source_remove (self->priv->source_id);
+      self->priv->source_id = 0;
+    }
+
+  if (self->priv->fd >= 0)
+    {
+      close (self->priv->fd);
+      unlink (self->priv->path);
+      self->priv->fd = -1;
+    }
+
+  G_OBJECT_CLASS (tcmmd_control_parent_class)->dispose (object);
+}
+
+static void
+tcmmd_control_finalize (GObject *object)
+{
+  TcmmdControl *self = (TcmmdControl *) object;
+
+  g_free (self->priv->path);
+  g_array_free (self->priv->allowed_uids, TRUE);
+
+  G_OBJECT_CLASS (tcmmd_control_parent_class)->finalize (object);
+}
+
+static void
+tcmmd_control_class_init (TcmmdControlClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = tcmmd_control_dispose;
+  object_class->finalize = tcmmd_control_finalize;
+
+  g_type_class_add_private (object_class, sizeof (TcmmdControlPrivate));
+
+  /* same as the signals of TcmmdDbus, but set-policy and set-fixed-policy
+   * return whether the flow is installed */
+  signals[SET_POLICY] =
+      g_signal_new ("set-policy",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL, NULL, NULL,
+          G_TYPE_BOOLEAN,
+          7, G_TYPE_STRING,
+          G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
+          G_TYPE_UINT, G_TYPE_DOUBLE);
+
+  signals[SET_FIXED_POLICY] =
+      g_signal_new ("set-fixed-policy",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL, NULL, NULL,
+          G_TYPE_BOOLEAN,
+          7, G_TYPE_STRING,
+          G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
+          G_TYPE_UINT, G_TYPE_UINT);
+
+  signals[UNSET_POLICY] =
+      g_signal_new ("unset-policy",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL, NULL, NULL,
+          G_TYPE_NONE,
+          1, G_TYPE_STRING);
+}
+
+TcmmdControl *
+tcmmd_control_new (const gchar *path,
+    GError **error)
+{
+  TcmmdControl *self;
+  struct sockaddr_un addr = { AF_UNIX, };
+  struct stat st;
+  gboolean bound = FALSE;
+  int fd;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FILENAME_TOO_LONG,
+                   "Control socket path too long: %s", path);
+      return NULL;
+    }
+  strcpy (addr.sun_path, path);
+
+  /* left behind by a tcmmd that did not exit cleanly */
+  if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (path);
+
+  fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0 ||
+      !(bound = bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0) ||
+      /* the peers are checked with SO_PEERCRED instead */
+      chmod (path, 0666) < 0 ||
+      listen (fd, 16) < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Cannot listen on '%s': %s", path, strerror (saved_errno));
+      if (bound)
+        unlink (path);
+      if (fd >= 0)
+        close (fd);
+      return NULL;
+    }
+
+  self = g_object_new (TCMMD_TYPE_CONTROL, NULL);
+  self->priv->path = g_strdup (path);
+  self->priv->fd = fd;
+  self->priv->source_id = g_unix_fd_add (fd, G_IO_IN, accept_cb, self);
+
+  return self;
+}
+
+void
+tcmmd_control_allow_uid (TcmmdControl *self,
+    uid_t uid)
+{
+  g_array_append_val (self->priv->allowed_uids, uid);
+}
@@ -0,0 +1,74 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TCMMD_CONTROL_H__
+#define __TCMMD_CONTROL_H__
+
+#include <sys/types.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define TCMMD_TYPE_CONTROL \
+    (tcmmd_control_get_type ())
+#define TCMMD_CONTROL(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST ((obj), TCMMD_TYPE_CONTROL, \
+        TcmmdControl))
+#define TCMMD_CONTROL_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_CAST ((klass), TCMMD_TYPE_CONTROL, \
+        TcmmdControlClass))
+#define TCMMD_IS_CONTROL(obj) \
+    (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TCMMD_TYPE_CONTROL))
+#define TCMMD_IS_CONTROL_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_TYPE ((klass), TCMMD_TYPE_CONTROL))
+#define TCMMD_CONTROL_GET_CLASS(obj) \
+    (G_TYPE_INSTANCE_GET_CLASS ((obj), TCMMD_TYPE_CONTROL, \
+        TcmmdControlClass))
+
+typedef struct _TcmmdControl TcmmdControl;
+typedef struct _TcmmdControlClass TcmmdControlClass;
+typedef struct _TcmmdControlPrivate TcmmdControlPrivate;
+
+struct _TcmmdControl {
+  GObject parent;
+
+  TcmmdControlPrivate *priv;
+};
+
+struct _TcmmdControlClass {
+  GObjectClass parent_class;
+};
+
+GType tcmmd_control_get_type (void) G_GNUC_CONST;
+
+/* Listen on the control socket at 'path', see tcmmd-control-protocol.h.
+ * The requests are emitted as the "set-policy", "set-fixed-policy" and
+ * "unset-policy" signals of TcmmdDbus, with the same arguments, so the same
+ * handlers serve both. A stale socket at 'path' is replaced. */
+TcmmdControl *tcmmd_control_new (const gchar *path,
+                                 GError **error);
+
+/* The peers are authenticated with SO_PEERCRED: only root, the user of
+ * tcmmd and the users allowed here may connect. */
+void tcmmd_control_allow_uid (TcmmdControl *self,
+                              uid_t uid);
+
+G_END_DECLS
+
+#endif /* __TCMMD_CONTROL_H__ */
@@ -0,0 +1,336 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "tcmmd-controller.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/* bound of the integral term of the pid controller, in percent.second */
+#define PID_INTEGRAL_MAX 200.0
+
+/* shorter intervals between two samples give a noisy rate */
+#define CAPACITY_MIN_INTERVAL (G_USEC_PER_SEC / 2)
+
+void
+tcmmd_controller_params_init (TcmmdControllerParams *params)
+{
+  params->interval = 2000;
+  params->panic_threshold = 70;
+  params->recover_threshold = 100;
+  params->min_rate = 5000; /* keep some bandwidth for SSH :) */
+  params->max_rate = 0xffffffffULL;
+
+  params->ramp_factor = 1.5;
+
+  params->increase = 25000;
+  params->decrease = 0.5;
+  params->drain_slope = 2.0;
+
+  params->target = 90.0;
+  params->kp = 2.0;
+  params->ki = 0.1;
+  params->kd = 8.0;
+
+  params->headroom = 0.2;
+  params->capacity = 0;
+
+  params->tolerance = 0.05;
+  params->stable_steps = 3;
+
+  params->shared_interval = 100;
+
+  params->coalesce_interval = 500;
+  params->panic_hold = 2000;
+}
+
+static guint64
+clamp_rate (const TcmmdControllerParams *params, double rate)
+{
+  if (rate < params->min_rate)
+    return params->min_rate;
+  if (rate > params->max_rate)
+    return params->max_rate;
+  return rate;
+}
+
+/* When cutting the budget, start from what the background really uses: a
+ * budget far above the measured rate is not limiting anything. */
+static guint64
+decrease_base (const TcmmdControllerParams *params,
+               const TcmmdControllerInput *input)
+{
+  return MIN (input->rate, MAX (input->measured_rate, params->min_rate));
+}
+
+/* ramp: the original controller. Back to the minimum on panic, then +50%
+ * at each step. */
+
+static void
+ramp_reset (const TcmmdControllerParams *params,
+            TcmmdControllerState *state)
+{
+}
+
+static guint64
+ramp_panic (const TcmmdControllerParams *params,
+            TcmmdControllerState *state,
+            const TcmmdControllerInput *input)
+{
+  return params->min_rate;
+}
+
+static guint64
+ramp_step (const TcmmdControllerParams *params,
+           TcmmdControllerState *state,
+           const TcmmdControllerInput *input)
+{
+  if (input->in_panic)
+    return params->min_rate;
+
+  return clamp_rate (params, input->rate * params->ramp_factor);
+}
+
+/* aimd: slow start then additive increase, multiplicative decrease from the
+ * measured rate */
+
+static void
+aimd_reset (const TcmmdControllerParams *params,
+            TcmmdControllerState *state)
+{
+  state->ssthresh = params->max_rate;
+}
+
+static guint64
+aimd_panic (const TcmmdControllerParams *params,
+            TcmmdControllerState *state,
+            const TcmmdControllerInput *input)
+{
+  guint64 rate;
+
+  rate = clamp_rate (params, decrease_base (params, input) * params->decrease);
+  state->ssthresh = rate;
+
+  return rate;
+}
+
+static guint64
+aimd_step (const TcmmdControllerParams *params,
+           TcmmdControllerState *state,
+           const TcmmdControllerInput *input)
+{
+  if (input->in_panic)
+    return input->rate;
+
+  if (input->fill_slope < -params->drain_slope)
+    return aimd_panic (params, state, input);
+
+  if (input->rate < state->ssthresh)
+    return clamp_rate (params, MIN (input->rate * 2.0, state->ssthresh));
+
+  return clamp_rate (params, (double) input->rate + params->increase);
+}
+
+/* pid: relative change of the rate from the distance to the target buffer
+ * fill, its integral and the buffer fill slope */
+
+static void
+pid_reset (const TcmmdControllerParams *params,
+           TcmmdControllerState *state)
+{
+  state->integral = 0.0;
+}
+
+static guint64
+pid_panic (const TcmmdControllerParams *params,
+           TcmmdControllerState *state,
+           const TcmmdControllerInput *input)
+{
+  state->integral = 0.0;
+
+  return clamp_rate (params, decrease_base (params, input) * params->decrease);
+}
+
+static guint64
+pid_step (const TcmmdControllerParams *params,
+          TcmmdControllerState *state,
+          const TcmmdControllerInput *input)
+{
+  double error, output;
+
+  if (input->in_panic)
+    return input->rate;
+
+  error = input->percentage - params->target;
+  state->integral += error * params->interval / 1000.0;
+  state->integral = CLAMP (state->integral, -PID_INTEGRAL_MAX, PID_INTEGRAL_MAX);
+
+  output = (params->kp * error + params->ki * state->integral +
+            params->kd * input->fill_slope) / 100.0;
+  output = CLAMP (output, -(1.0 - params->decrease), 1.0);
+
+  if (output < 0)
+    return clamp_rate (params, decrease_base (params, input) * (1.0 + output));
+  return clamp_rate (params, input->rate * (1.0 + output));
+}
+
+void
+tcmmd_capacity_sample (TcmmdCapacity *capacity,
+                       guint64 received_bytes,
+                       gint64 time)
+{
+  gint64 elapsed = time - capacity->previous_time;
+
+  if (capacity->previous_time != 0 && elapsed < CAPACITY_MIN_INTERVAL)
+    return;
+
+  /* the first sample and counter resets only set the reference */
+  if (capacity->previous_time != 0 &&
+      received_bytes >= capacity->previous_bytes)
+    {
+      capacity->rate = (received_bytes - capacity->previous_bytes) *
+                       (double) G_USEC_PER_SEC / elapsed;
+      capacity->capacity = MAX (capacity->capacity, capacity->rate);
+    }
+
+  capacity->previous_bytes = received_bytes;
+  capacity->previous_time = time;
+}
+
+void
+tcmmd_capacity_panic (TcmmdCapacity *capacity)
+{
+  if (capacity->rate > 0)
+    {
+      capacity->capacity = capacity->rate;
+      capacity->saturated = TRUE;
+    }
+}
+
+guint64
+tcmmd_controller_budget (const TcmmdControllerParams *params,
+                         const TcmmdCapacity *capacity,
+                         guint64 stream_rate)
+{
+  guint64 link = params->capacity;
+  double reserved = stream_rate * (1.0 + params->headroom);
+
+  if (link == 0 && capacity->saturated)
+    link = capacity->capacity;
+  if (link == 0)
+    return 0;
+
+  if (reserved >= link)
+    return params->min_rate;
+  return clamp_rate (params, link - reserved);
+}
+
+static const TcmmdController controllers[] = {
+  { "ramp", ramp_reset, ramp_panic, ramp_step },
+  { "aimd", aimd_reset, aimd_panic, aimd_step },
+  { "pid", pid_reset, pid_panic, pid_step },
+};
+
+const TcmmdController *
+tcmmd_controller_lookup (const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (controllers); i++)
+    if (g_strcmp0 (controllers[i].name, name) == 0)
+      return &controllers[i];
+
+  return NULL;
+}
+
+typedef enum {
+  PARAM_UINT,
+  PARAM_INT,
+  PARAM_UINT64,
+  PARAM_DOUBLE,
+} ParamType;
+
+static const struct {
+  const gchar *name;
+  ParamType type;
+  gsize offset;
+} param_specs[] = {
+  { "interval", PARAM_UINT, G_STRUCT_OFFSET (TcmmdControllerParams, interval) },
+  { "panic-threshold", PARAM_INT, G_STRUCT_OFFSET (TcmmdControllerParams, panic_threshold) },
+  { "recover-threshold", PARAM_INT, G_STRUCT_OFFSET (TcmmdControllerParams, recover_threshold) },
+  { "min-rate", PARAM_UINT64, G_STRUCT_OFFSET (TcmmdControllerParams, min_rate) },
+  { "max-rate", PARAM_UINT64, G_STRUCT_OFFSET (TcmmdControllerParams, max_rate) },
+  { "ramp-factor", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, ramp_factor) },
+  { "increase", PARAM_UINT64, G_STRUCT_OFFSET (TcmmdControllerParams, increase) },
+  { "decrease", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, decrease) },
+  { "drain-slope", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, drain_slope) },
+  { "target", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, target) },
+  { "kp", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, kp) },
+  { "ki", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, ki) },
+  { "kd", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, kd) },
+  { "headroom", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, headroom) },
+  { "capacity", PARAM_UINT64, G_STRUCT_OFFSET (TcmmdControllerParams, capacity) },
+  { "tolerance", PARAM_DOUBLE, G_STRUCT_OFFSET (TcmmdControllerParams, tolerance) },
+  { "stable-steps", PARAM_UINT, G_STRUCT_OFFSET (TcmmdControllerParams, stable_steps) },
+  { "shared-interval", PARAM_UINT, G_STRUCT_OFFSET (TcmmdControllerParams, shared_interval) },
+  { "coalesce-interval", PARAM_UINT, G_STRUCT_OFFSET (TcmmdControllerParams, coalesce_interval) },
+  { "panic-hold", PARAM_UINT, G_STRUCT_OFFSET (TcmmdControllerParams, panic_hold) },
+};
+
+gboolean
+tcmmd_controller_params_parse (TcmmdControllerParams *params,
+                               const gchar *assignment)
+{
+  const gchar *value;
+  gchar *end;
+  gpointer field;
+  guint i;
+
+  value = strchr (assignment, '=');
+  if (!value || value[1] == '\0')
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (param_specs); i++)
+    if (strlen (param_specs[i].name) == (gsize) (value - assignment) &&
+        strncmp (param_specs[i].name, assignment, value - assignment) == 0)
+      break;
+  if (i == G_N_ELEMENTS (param_specs))
+    return FALSE;
+
+  value++;
+  field = G_STRUCT_MEMBER_P (params, param_specs[i].offset);
+  switch (param_specs[i].type)
+    {
+      case PARAM_UINT:
+        *(guint *) field = g_ascii_strtoull (value, &end, 10);
+        break;
+      case PARAM_INT:
+        *(int *) field = g_ascii_strtoll (value, &end, 10);
+        break;
+      case PARAM_UINT64:
+        *(guint64 *) field = g_ascii_strtoull (value, &end, 10);
+        break;
+      case PARAM_DOUBLE:
+        *(double *) field = g_ascii_strtod (value, &end);
+        break;
+    }
+
+  return *end == '\0';
+}
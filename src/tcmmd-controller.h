@@ -0,0 +1,155 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_CONTROLLER_H
+#define __TCMMD_CONTROLLER_H
+
+#include <glib.h>
+
+/* Controllers of the background budget of a flow, from the buffer fill
+ * reported by the application and the rate the kernel measured.
+ *
+ * All rates are in bytes per second. */
+
+typedef struct {
+  /* milliseconds between two steps */
+  guint interval;
+  /* enter panic below this buffer fill, leave it at or above the other one,
+   * in percent */
+  int panic_threshold;
+  int recover_threshold;
+  guint64 min_rate;
+  guint64 max_rate;
+
+  /* ramp: multiply by this at each step */
+  double ramp_factor;
+
+  /* aimd: double the rate up to the last decrease, then add 'increase' at
+   * each step. Multiply by 'decrease' on panic or when the buffer drains
+   * faster than 'drain_slope' percent per second. */
+  guint64 increase;
+  double decrease;
+  double drain_slope;
+
+  /* pid: aim for 'target' percent of buffer fill. The output is the
+   * relative change of the rate, in percent: kp per percent of error, ki per
+   * percent.second of accumulated error, kd per percent per second of
+   * buffer fill change. */
+  double target;
+  double kp;
+  double ki;
+  double kd;
+
+  /* capacity-aware budget: leave the declared bitrate of the streams plus
+   * 'headroom' (a fraction of it) and give the rest of the link to the
+   * background. 'capacity' forces the link capacity instead of learning
+   * it, 0 to learn. */
+  double headroom;
+  guint64 capacity;
+
+  /* a session has converged once the rate stayed within 'tolerance' of the
+   * previous one for 'stable_steps' steps in a row */
+  double tolerance;
+  guint stable_steps;
+
+  /* milliseconds between two reads of the shared policy pages, see
+   * tcmmd-shared-protocol.h */
+  guint shared_interval;
+
+  /* input stage: the updates of a flow less than 'coalesce_interval'
+   * milliseconds after the last one applied are held back, and only the
+   * newest is applied at the end of the window. A panic lasts at least
+   * 'panic_hold' milliseconds: a recovery before that is held back too.
+   * Entering a panic is never delayed. 0 disables either. */
+  guint coalesce_interval;
+  guint panic_hold;
+} TcmmdControllerParams;
+
+typedef struct {
+  /* aimd */
+  guint64 ssthresh;
+  /* pid */
+  double integral;
+} TcmmdControllerState;
+
+typedef struct {
+  /* current budget */
+  guint64 rate;
+  /* background throughput measured by the kernel rate estimator */
+  guint64 measured_rate;
+  /* buffer fill in percent, and how fast it changes in percent per second */
+  int percentage;
+  double fill_slope;
+  gboolean in_panic;
+} TcmmdControllerInput;
+
+typedef struct {
+  const gchar *name;
+  void (*reset) (const TcmmdControllerParams *params,
+                 TcmmdControllerState *state);
+  /* the flow just entered panic */
+  guint64 (*panic) (const TcmmdControllerParams *params,
+                    TcmmdControllerState *state,
+                    const TcmmdControllerInput *input);
+  /* periodic step, every params->interval */
+  guint64 (*step) (const TcmmdControllerParams *params,
+                   TcmmdControllerState *state,
+                   const TcmmdControllerInput *input);
+} TcmmdController;
+
+/* Downstream link capacity, learnt from the bytes received on the main
+ * interface: the highest rate seen over at least CAPACITY_MIN_INTERVAL, and
+ * brought down to the current rate when a flow panics, since the link is
+ * then full and the stream still starves.
+ *
+ * Until a panic, the highest rate is only a lower bound: with the
+ * background throttled, the link was never full. */
+typedef struct {
+  guint64 capacity;
+  gboolean saturated;
+  /* last measured rate */
+  guint64 rate;
+  guint64 previous_bytes;
+  gint64 previous_time;
+} TcmmdCapacity;
+
+void tcmmd_capacity_sample (TcmmdCapacity *capacity,
+                            guint64 received_bytes,
+                            gint64 time);
+void tcmmd_capacity_panic (TcmmdCapacity *capacity);
+
+/* Background budget leaving stream_rate plus headroom to the streams, or 0
+ * if the capacity is not known yet: neither forced nor seen saturated. */
+guint64 tcmmd_controller_budget (const TcmmdControllerParams *params,
+                                 const TcmmdCapacity *capacity,
+                                 guint64 stream_rate);
+
+/* "ramp", "aimd" or "pid". Returns NULL for an unknown name. */
+const TcmmdController *tcmmd_controller_lookup (const gchar *name);
+
+void tcmmd_controller_params_init (TcmmdControllerParams *params);
+/* Set one tunable from a "name=value" string, e.g. "kp=4" or
+ * "panic-threshold=60": the names are the fields of TcmmdControllerParams
+ * with '-' instead of '_'. Returns FALSE if the name is unknown or the value
+ * invalid. */
+gboolean tcmmd_controller_params_parse (TcmmdControllerParams *params,
+                                        const gchar *assignment);
+
+#endif
@@ -19,6 +19,14 @@
 
 #include "tcmmd-dbus.h"
 #include "tcmmd-generated.h"
+#include "tcmmd-policy.h"
+#include "tcmmd-shared.h"
+#include "tcmmd-trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gunixfdlist.h>
 
 G_DEFINE_TYPE (TcmmdDbus, tcmmd_dbus, G_TYPE_OBJECT)
 
@@ -26,43 +34,91 @@ struct _TcmmdDbusPrivate
 {
   GDBusConnection *connection;
   TcmmdManagedConnections *iface;
+  TcmmdManagedConnections2 *iface2;
   guint own_name_id;
-  guint watch_id;
+  /* unique name -> Session, one for every client with policies */
+  GHashTable *sessions;
+  /* clients to watch once on the bus, see tcmmd_dbus_watch_client() */
+  GPtrArray *pending_clients;
+  /* StatsUpdated: microseconds between two signals, 0 for none, and the
+   * last one sent */
+  gint64 stats_signal_interval;
+  gint64 stats_signal_time;
+  GVariant *stats_signal_last;
 };
 
+/* The stats are sampled by a main loop timeout, which may fire a bit early
+ * or late: do not wait for one more sample because of that. */
+#define STATS_SIGNAL_SLACK (G_USEC_PER_SEC / 100)
+
+/* A client is watched from its first policy until it vanishes or unsets
+ * its policies. The flows it owns are in the flow table. */
+typedef struct {
+  gchar *name;
+  guint watch_id;
+} Session;
+
 enum
 {
   SET_POLICY,
   SET_FIXED_POLICY,
   UNSET_POLICY,
+  SET_POLICIES,
+  UNSET_POLICIES,
+  SET_SHARED_POLICY,
   LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL];
 
+static void
+session_free (gpointer data)
+{
+  Session *session = data;
+
+  g_bus_unwatch_name (session->watch_id);
+  g_free (session->name);
+  g_slice_free (Session, session);
+}
+
 static void
 name_vanished_cb (GDBusConnection *connection,
     const gchar *name,
     gpointer user_data)
 {
   TcmmdDbus *self = user_data;
+  /* name belongs to the watch, which goes away with the session */
+  gchar *owner = g_strdup (name);
 
-  g_bus_unwatch_name (self->priv->watch_id);
-  self->priv->watch_id = 0;
+  tcmmd_log (TCMMD_LOG_DEBUG, "Client %s vanished\n", owner);
+  g_hash_table_remove (self->priv->sessions, owner);
 
-  g_signal_emit (self, signals[UNSET_POLICY], 0);
+  g_signal_emit (self, signals[UNSET_POLICY], 0, owner);
+  g_free (owner);
 }
 
 static void
-watch_name (TcmmdDbus *self,
+start_session (TcmmdDbus *self,
     const gchar *name)
 {
-  if (self->priv->watch_id != 0)
-    g_bus_unwatch_name (self->priv->watch_id);
+  Session *session;
 
-  self->priv->watch_id = g_bus_watch_name_on_connection (self->priv->connection,
+  if (g_hash_table_lookup (self->priv->sessions, name))
+    return;
+
+  session = g_slice_new0 (Session);
+  session->name = g_strdup (name);
+  session->watch_id = g_bus_watch_name_on_connection (self->priv->connection,
       name, G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
       name_vanished_cb, self, NULL);
+  g_hash_table_insert (self->priv->sessions, session->name, session);
+}
+
+static void
+end_session (TcmmdDbus *self,
+    const gchar *name)
+{
+  g_hash_table_remove (self->priv->sessions, name);
 }
 
 static gboolean
@@ -78,15 +134,16 @@ handle_set_policy_cb (TcmmdManagedConnections *iface,
 {
   TcmmdDbus *self = user_data;
 
-  g_print ("SetPolicy: src=%s:%d, dest=%s:%d, bitrate=%d, buffer=%d%%\n",
+  tcmmd_log (TCMMD_LOG_DEBUG, "SetPolicy: src=%s:%d, dest=%s:%d, bitrate=%d, buffer=%d%%\n",
       src_ip, src_port, dest_ip, dest_port, bitrate, (gint) (buffer_fill * 100.0));
 
-  watch_name (self, g_dbus_method_invocation_get_sender (invocation));
+  start_session (self, g_dbus_method_invocation_get_sender (invocation));
 
   tcmmd_managed_connections_set_bitrate (self->priv->iface, bitrate);
   tcmmd_managed_connections_set_buffer_fill (self->priv->iface, buffer_fill);
 
   g_signal_emit (self, signals[SET_POLICY], 0,
+      g_dbus_method_invocation_get_sender (invocation),
       src_ip, src_port, dest_ip, dest_port, bitrate, buffer_fill);
 
   tcmmd_managed_connections_complete_set_policy (iface, invocation);
@@ -107,12 +164,13 @@ handle_set_fixed_policy_cb (TcmmdManagedConnections *iface,
 {
   TcmmdDbus *self = user_data;
 
-  g_print ("SetFixedPolicy: %s:%d -> %s:%d stream_rate=%d, background_rate=%d\n",
+  tcmmd_log (TCMMD_LOG_DEBUG, "SetFixedPolicy: %s:%d -> %s:%d stream_rate=%d, background_rate=%d\n",
       src_ip, src_port, dest_ip, dest_port, stream_rate, background_rate);
 
-  watch_name (self, g_dbus_method_invocation_get_sender (invocation));
+  start_session (self, g_dbus_method_invocation_get_sender (invocation));
 
   g_signal_emit (self, signals[SET_FIXED_POLICY], 0,
+      g_dbus_method_invocation_get_sender (invocation),
       src_ip, src_port, dest_ip, dest_port, stream_rate, background_rate);
 
   tcmmd_managed_connections_complete_set_fixed_policy (iface, invocation);
@@ -127,17 +185,244 @@ handle_unset_policy_cb (TcmmdManagedConnections *iface,
 {
   TcmmdDbus *self = user_data;
 
-  g_print ("UnsetPolicy\n");
+  tcmmd_log (TCMMD_LOG_DEBUG, "UnsetPolicy\n");
+
+  end_session (self, g_dbus_method_invocation_get_sender (invocation));
+
+  g_signal_emit (self, signals[UNSET_POLICY], 0,
+      g_dbus_method_invocation_get_sender (invocation));
+
+  tcmmd_managed_connections_complete_unset_policy (iface, invocation);
+
+  return TRUE;
+}
+
+/* also rejects NaN */
+static gboolean
+valid_buffer_fill (gdouble buffer_fill)
+{
+  return buffer_fill >= 0.0 && buffer_fill <= 1.0;
+}
 
-  if (self->priv->watch_id != 0)
+/* (ayqayqy) */
+static gboolean
+parse_flow (GVariant *flow,
+    TcmmdFlowKey *key)
+{
+  GVariant *src_ip, *dst_ip;
+  const guint8 *src, *dst;
+  gsize src_len, dst_len;
+  guint16 src_port, dst_port;
+  guint8 protocol;
+  gboolean valid;
+
+  g_variant_get (flow, "(@ayq@ayqy)", &src_ip, &src_port, &dst_ip, &dst_port,
+      &protocol);
+  src = g_variant_get_fixed_array (src_ip, &src_len, sizeof (guint8));
+  dst = g_variant_get_fixed_array (dst_ip, &dst_len, sizeof (guint8));
+
+  valid = tcmmd_flow_key_init_from_bytes (key, src, src_len, src_port,
+      dst, dst_len, dst_port, protocol);
+
+  g_variant_unref (src_ip);
+  g_variant_unref (dst_ip);
+
+  return valid;
+}
+
+static gboolean
+handle_set_policies_cb (TcmmdManagedConnections2 *iface,
+    GDBusMethodInvocation *invocation,
+    GVariant *policies,
+    GVariant *options,
+    gpointer user_data)
+{
+  TcmmdDbus *self = user_data;
+  TcmmdPolicyEntry *entries;
+  GVariantIter iter;
+  GVariant *flow;
+  gboolean replace = FALSE;
+  gboolean applied = FALSE;
+  guint n_entries;
+  guint i = 0;
+
+  g_variant_lookup (options, "replace", "b", &replace);
+
+  n_entries = g_variant_n_children (policies);
+  entries = g_new0 (TcmmdPolicyEntry, n_entries);
+  g_variant_iter_init (&iter, policies);
+  while (g_variant_iter_next (&iter, "(@(ayqayqy)ud)", &flow,
+             &entries[i].bitrate, &entries[i].buffer_fill))
     {
-      g_bus_unwatch_name (self->priv->watch_id);
-      self->priv->watch_id = 0;
+      gboolean valid = parse_flow (flow, &entries[i].key);
+
+      g_variant_unref (flow);
+      if (!valid)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+              G_DBUS_ERROR_INVALID_ARGS, "Invalid flow %u", i);
+          g_free (entries);
+          return TRUE;
+        }
+      if (!valid_buffer_fill (entries[i].buffer_fill))
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+              G_DBUS_ERROR_INVALID_ARGS, "Invalid buffer fill of flow %u", i);
+          g_free (entries);
+          return TRUE;
+        }
+      i++;
     }
 
-  g_signal_emit (self, signals[UNSET_POLICY], 0);
+  tcmmd_log (TCMMD_LOG_DEBUG, "SetPolicies: flows=%u replace=%d\n",
+      n_entries, replace);
 
-  tcmmd_managed_connections_complete_unset_policy (iface, invocation);
+  start_session (self, g_dbus_method_invocation_get_sender (invocation));
+
+  g_signal_emit (self, signals[SET_POLICIES], 0,
+      g_dbus_method_invocation_get_sender (invocation),
+      entries, n_entries, replace, &applied);
+  g_free (entries);
+
+  if (!applied)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+          G_DBUS_ERROR_LIMITS_EXCEEDED, "Cannot install the flows");
+      return TRUE;
+    }
+
+  tcmmd_managed_connections2_complete_set_policies (iface, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_shared_policy_cb (TcmmdManagedConnections2 *iface,
+    GDBusMethodInvocation *invocation,
+    GUnixFDList *fd_list,
+    GVariant *flow,
+    guint bitrate,
+    gdouble buffer_fill,
+    gpointer user_data)
+{
+  TcmmdDbus *self = user_data;
+  TcmmdSharedPolicy *page;
+  TcmmdFlowKey key;
+  GUnixFDList *out_fd_list;
+  GError *error = NULL;
+  gboolean applied = FALSE;
+  gint index;
+  int fd;
+
+  if (!parse_flow (flow, &key))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+          G_DBUS_ERROR_INVALID_ARGS, "Invalid flow");
+      return TRUE;
+    }
+
+  if (!valid_buffer_fill (buffer_fill))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+          G_DBUS_ERROR_INVALID_ARGS, "Invalid buffer fill");
+      return TRUE;
+    }
+
+  tcmmd_log (TCMMD_LOG_DEBUG, "SetSharedPolicy: bitrate=%d, buffer=%d%%\n",
+      bitrate, (gint) (buffer_fill * 100.0));
+
+  page = tcmmd_shared_policy_new (bitrate, buffer_fill, &fd);
+  if (!page)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+          G_DBUS_ERROR_FAILED, "Cannot create the shared page: %s",
+          strerror (errno));
+      return TRUE;
+    }
+
+  start_session (self, g_dbus_method_invocation_get_sender (invocation));
+
+  /* on success, the page belongs to the flow */
+  g_signal_emit (self, signals[SET_SHARED_POLICY], 0,
+      g_dbus_method_invocation_get_sender (invocation),
+      &key, bitrate, buffer_fill, page, &applied);
+  if (!applied)
+    {
+      tcmmd_shared_policy_free (page);
+      close (fd);
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+          G_DBUS_ERROR_LIMITS_EXCEEDED, "Cannot install the flow");
+      return TRUE;
+    }
+
+  out_fd_list = g_unix_fd_list_new ();
+  index = g_unix_fd_list_append (out_fd_list, fd, &error);
+  close (fd);
+  if (index < 0)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      g_clear_error (&error);
+    }
+  else
+    tcmmd_managed_connections2_complete_set_shared_policy (iface, invocation,
+        out_fd_list, g_variant_new_handle (index));
+  g_object_unref (out_fd_list);
+
+  return TRUE;
+}
+
+static gboolean
+handle_unset_policies_cb (TcmmdManagedConnections2 *iface,
+    GDBusMethodInvocation *invocation,
+    GVariant *flows,
+    GVariant *options,
+    gpointer user_data)
+{
+  TcmmdDbus *self = user_data;
+  TcmmdFlowKey *keys;
+  GVariantIter iter;
+  GVariant *flow;
+  guint n_keys;
+  guint i = 0;
+
+  n_keys = g_variant_n_children (flows);
+
+  tcmmd_log (TCMMD_LOG_DEBUG, "UnsetPolicies: flows=%u\n", n_keys);
+
+  if (n_keys == 0)
+    {
+      /* UnsetPolicy */
+      end_session (self, g_dbus_method_invocation_get_sender (invocation));
+
+      g_signal_emit (self, signals[UNSET_POLICY], 0,
+          g_dbus_method_invocation_get_sender (invocation));
+
+      tcmmd_managed_connections2_complete_unset_policies (iface, invocation);
+      return TRUE;
+    }
+
+  keys = g_new0 (TcmmdFlowKey, n_keys);
+  g_variant_iter_init (&iter, flows);
+  while ((flow = g_variant_iter_next_value (&iter)))
+    {
+      gboolean valid = parse_flow (flow, &keys[i]);
+
+      g_variant_unref (flow);
+      if (!valid)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+              G_DBUS_ERROR_INVALID_ARGS, "Invalid flow %u", i);
+          g_free (keys);
+          return TRUE;
+        }
+      i++;
+    }
+
+  g_signal_emit (self, signals[UNSET_POLICIES], 0,
+      g_dbus_method_invocation_get_sender (invocation), keys, n_keys);
+  g_free (keys);
+
+  tcmmd_managed_connections2_complete_unset_policies (iface, invocation);
 
   return TRUE;
 }
@@ -149,9 +434,14 @@ on_bus_acquired (GDBusConnection *connection,
 {
   TcmmdDbus *self = user_data;
   GError *error = NULL;
+  guint i;
 
   self->priv->connection = g_object_ref (connection);
 
+  for (i = 0; i < self->priv->pending_clients->len; i++)
+    start_session (self, g_ptr_array_index (self->priv->pending_clients, i));
+  g_ptr_array_set_size (self->priv->pending_clients, 0);
+
   self->priv->iface = tcmmd_managed_connections_skeleton_new ();
   g_signal_connect (self->priv->iface, "handle-set-policy",
                     G_CALLBACK (handle_set_policy_cb), self);
@@ -168,6 +458,24 @@ on_bus_acquired (GDBusConnection *connection,
       g_critical ("Failed to export iface: %s", error->message);
       g_clear_error (&error);
     }
+
+  /* on the same object */
+  self->priv->iface2 = tcmmd_managed_connections2_skeleton_new ();
+  g_signal_connect (self->priv->iface2, "handle-set-policies",
+                    G_CALLBACK (handle_set_policies_cb), self);
+  g_signal_connect (self->priv->iface2, "handle-unset-policies",
+                    G_CALLBACK (handle_unset_policies_cb), self);
+  g_signal_connect (self->priv->iface2, "handle-set-shared-policy",
+                    G_CALLBACK (handle_set_shared_policy_cb), self);
+
+  if (!g_dbus_interface_skeleton_export (
+          G_DBUS_INTERFACE_SKELETON (self->priv->iface2),
+          self->priv->connection,
+          "/org/tcmmd/ManagedConnections", &error))
+    {
+      g_critical ("Failed to export iface: %s", error->message);
+      g_clear_error (&error);
+    }
 }
 
 static void
@@ -183,10 +491,10 @@ tcmmd_dbus_init (TcmmdDbus *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
       TCMMD_TYPE_DBUS, TcmmdDbusPrivate);
-
-  self->priv->own_name_id = g_bus_own_name (G_BUS_TYPE_SYSTEM, "org.tcmmd",
-      G_BUS_NAME_OWNER_FLAGS_NONE,
-      on_bus_acquired, NULL, on_name_lost, self, NULL);
+  self->priv->sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, session_free);
+  self->priv->pending_clients = g_ptr_array_new_with_free_func (g_free);
+  self->priv->stats_signal_interval = G_USEC_PER_SEC;
 }
 
 static void
@@ -200,14 +508,27 @@ tcmmd_dbus_dispose (GObject *object)
       self->priv->own_name_id = 0;
     }
 
-  if (self->priv->watch_id != 0)
+  if (self->priv->sessions != NULL)
+    {
+      g_hash_table_destroy (self->priv->sessions);
+      self->priv->sessions = NULL;
+    }
+
+  if (self->priv->pending_clients != NULL)
     {
-      g_bus_unwatch_name (self->priv->watch_id);
-      self->priv->watch_id = 0;
+      g_ptr_array_unref (self->priv->pending_clients);
+      self->priv->pending_clients = NULL;
     }
 
   g_clear_object (&self->priv->connection);
   g_clear_object (&self->priv->iface);
+  g_clear_object (&self->priv->iface2);
+
+  if (self->priv->stats_signal_last != NULL)
+    {
+      g_variant_unref (self->priv->stats_signal_last);
+      self->priv->stats_signal_last = NULL;
+    }
 
   G_OBJECT_CLASS (tcmmd_dbus_parent_class)->dispose (object);
 }
@@ -228,7 +549,8 @@ tcmmd_dbus_class_init (TcmmdDbusClass *klass)
           0,
           NULL, NULL, NULL,
           G_TYPE_NONE,
-          6, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
+          7, G_TYPE_STRING,
+          G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
           G_TYPE_UINT, G_TYPE_DOUBLE);
 
   signals[SET_FIXED_POLICY] =
@@ -238,7 +560,8 @@ tcmmd_dbus_class_init (TcmmdDbusClass *klass)
           0,
           NULL, NULL, NULL,
           G_TYPE_NONE,
-          6, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
+          7, G_TYPE_STRING,
+          G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
           G_TYPE_UINT, G_TYPE_UINT);
 
   signals[UNSET_POLICY] =
@@ -248,11 +571,148 @@ tcmmd_dbus_class_init (TcmmdDbusClass *klass)
           0,
           NULL, NULL, NULL,
           G_TYPE_NONE,
-          0);
+          1, G_TYPE_STRING);
+
+  /* owner, const TcmmdPolicyEntry *entries, n_entries, replace. Returns
+   * whether the batch was applied. */
+  signals[SET_POLICIES] =
+      g_signal_new ("set-policies",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL, NULL, NULL,
+          G_TYPE_BOOLEAN,
+          4, G_TYPE_STRING, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_BOOLEAN);
+
+  /* owner, const TcmmdFlowKey *keys, n_keys */
+  signals[UNSET_POLICIES] =
+      g_signal_new ("unset-policies",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL, NULL, NULL,
+          G_TYPE_NONE,
+          3, G_TYPE_STRING, G_TYPE_POINTER, G_TYPE_UINT);
+
+  /* owner, const TcmmdFlowKey *key, bitrate, buffer_fill,
+   * TcmmdSharedPolicy *page. Returns whether the policy was applied, and
+   * then the handler took the page. */
+  signals[SET_SHARED_POLICY] =
+      g_signal_new ("set-shared-policy",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL, NULL, NULL,
+          G_TYPE_BOOLEAN,
+          5, G_TYPE_STRING, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_DOUBLE,
+          G_TYPE_POINTER);
 }
 
 TcmmdDbus *
-tcmmd_dbus_new (void)
+tcmmd_dbus_new (GBusType bus_type)
+{
+  TcmmdDbus *self = g_object_new (TCMMD_TYPE_DBUS, NULL);
+
+  self->priv->own_name_id = g_bus_own_name (bus_type, "org.tcmmd",
+      G_BUS_NAME_OWNER_FLAGS_NONE,
+      on_bus_acquired, NULL, on_name_lost, self, NULL);
+
+  return self;
+}
+
+void
+tcmmd_dbus_watch_client (TcmmdDbus *self,
+                         const gchar *name)
+{
+  if (self->priv->connection)
+    start_session (self, name);
+  else
+    g_ptr_array_add (self->priv->pending_clients, g_strdup (name));
+}
+
+void
+tcmmd_dbus_set_stats_signal_interval (TcmmdDbus *self,
+                                      guint interval)
+{
+  self->priv->stats_signal_interval = (gint64) interval * 1000;
+}
+
+void
+tcmmd_dbus_update_stats (TcmmdDbus *self,
+                         const TcmmdStats *stats,
+                         guint64 background_budget,
+                         guint64 absorbed_updates)
 {
-  return g_object_new (TCMMD_TYPE_DBUS, NULL);
+  TcmmdDbusPrivate *priv = self->priv;
+  GVariantBuilder builder;
+  GVariant *dict;
+  gint64 now;
+
+  /* not on the bus yet */
+  if (priv->iface2 == NULL)
+    return;
+
+  tcmmd_managed_connections2_set_stream_bytes (priv->iface2,
+      stats->qdisc_stream_bytes);
+  tcmmd_managed_connections2_set_background_bytes (priv->iface2,
+      stats->qdisc_background_bytes);
+  tcmmd_managed_connections2_set_stream_drops (priv->iface2,
+      stats->qdisc_stream_drops);
+  tcmmd_managed_connections2_set_background_drops (priv->iface2,
+      stats->qdisc_background_drops);
+  tcmmd_managed_connections2_set_ingress_rate (priv->iface2,
+      stats->qdisc_ingress_rate);
+  tcmmd_managed_connections2_set_stream_rate (priv->iface2,
+      stats->qdisc_stream_rate);
+  tcmmd_managed_connections2_set_background_rate (priv->iface2,
+      stats->qdisc_background_rate);
+  tcmmd_managed_connections2_set_background_budget (priv->iface2,
+      background_budget);
+  tcmmd_managed_connections2_set_absorbed_updates (priv->iface2,
+      absorbed_updates);
+
+  if (priv->stats_signal_interval == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (priv->stats_signal_time != 0 &&
+      now - priv->stats_signal_time + STATS_SIGNAL_SLACK <
+      priv->stats_signal_interval)
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "stream_bytes",
+      g_variant_new_uint64 (stats->qdisc_stream_bytes));
+  g_variant_builder_add (&builder, "{sv}", "background_bytes",
+      g_variant_new_uint64 (stats->qdisc_background_bytes));
+  g_variant_builder_add (&builder, "{sv}", "stream_drops",
+      g_variant_new_uint64 (stats->qdisc_stream_drops));
+  g_variant_builder_add (&builder, "{sv}", "background_drops",
+      g_variant_new_uint64 (stats->qdisc_background_drops));
+  g_variant_builder_add (&builder, "{sv}", "ingress_rate",
+      g_variant_new_uint64 (stats->qdisc_ingress_rate));
+  g_variant_builder_add (&builder, "{sv}", "stream_rate",
+      g_variant_new_uint64 (stats->qdisc_stream_rate));
+  g_variant_builder_add (&builder, "{sv}", "background_rate",
+      g_variant_new_uint64 (stats->qdisc_background_rate));
+  g_variant_builder_add (&builder, "{sv}", "background_budget",
+      g_variant_new_uint64 (background_budget));
+  g_variant_builder_add (&builder, "{sv}", "absorbed_updates",
+      g_variant_new_uint64 (absorbed_updates));
+  dict = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  /* nothing moved, e.g. no traffic at all */
+  if (priv->stats_signal_last != NULL &&
+      g_variant_equal (dict, priv->stats_signal_last))
+    {
+      g_variant_unref (dict);
+      return;
+    }
+
+  tcmmd_managed_connections2_emit_stats_updated (priv->iface2, dict);
+
+  if (priv->stats_signal_last != NULL)
+    g_variant_unref (priv->stats_signal_last);
+  priv->stats_signal_last = dict;
+  priv->stats_signal_time = now;
 }
@@ -21,6 +21,9 @@
 #define __TCMMD_DBUS_H__
 
 #include <glib-object.h>
+#include <gio/gio.h>
+
+#include "tcmmd_rtnl.h"
 
 G_BEGIN_DECLS
 
@@ -55,7 +58,26 @@ struct _TcmmdDbusClass {
 };
 
 GType tcmmd_dbus_get_type (void) G_GNUC_CONST;
-TcmmdDbus *tcmmd_dbus_new (void);
+/* Own org.tcmmd on the system bus, or on the session bus to run without
+ * root with the memory backend */
+TcmmdDbus *tcmmd_dbus_new (GBusType bus_type);
+
+/* Publish a stats sample in the properties of ManagedConnections2, and in
+ * StatsUpdated if the last signal is at least the interval old and the
+ * values changed since then. */
+void tcmmd_dbus_update_stats (TcmmdDbus *self,
+                              const TcmmdStats *stats,
+                              guint64 background_budget,
+                              guint64 absorbed_updates);
+/* Watch a client which already has policies, taken over from a previous
+ * tcmmd: its flows are removed with "unset-policy" when it leaves, or
+ * right away if it is already gone. */
+void tcmmd_dbus_watch_client (TcmmdDbus *self,
+                              const gchar *name);
+/* Milliseconds between two StatsUpdated signals, 0 to never emit it.
+ * Default: 1000. */
+void tcmmd_dbus_set_stats_signal_interval (TcmmdDbus *self,
+                                          guint interval);
 
 G_END_DECLS
 
@@ -0,0 +1,282 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "tcmmd-flow.h"
+
+#include <string.h>
+
+static GHashTable *flows = NULL;
+/* D-Bus unique name -> GList of the TcmmdFlow it owns */
+static GHashTable *owners = NULL;
+
+static guint
+flow_addr_hash (const TcmmdFlowAddr *addr)
+{
+  return addr->in6.s6_addr32[0] ^ addr->in6.s6_addr32[1] ^
+         addr->in6.s6_addr32[2] ^ addr->in6.s6_addr32[3];
+}
+
+static guint
+flow_key_hash (gconstpointer v)
+{
+  const TcmmdFlowKey *key = v;
+
+  return flow_addr_hash (&key->ip_src) ^ (flow_addr_hash (&key->ip_dst) * 31) ^
+         ((key->sport << 16) | key->dport) ^ key->protocol;
+}
+
+static gboolean
+flow_key_equal (gconstpointer v1, gconstpointer v2)
+{
+  const TcmmdFlowKey *a = v1;
+  const TcmmdFlowKey *b = v2;
+
+  return a->family == b->family &&
+         memcmp (&a->ip_src, &b->ip_src, sizeof (TcmmdFlowAddr)) == 0 &&
+         memcmp (&a->ip_dst, &b->ip_dst, sizeof (TcmmdFlowAddr)) == 0 &&
+         a->sport == b->sport &&
+         a->dport == b->dport &&
+         a->protocol == b->protocol;
+}
+
+static void
+flow_free (gpointer data)
+{
+  TcmmdFlow *flow = data;
+
+  g_free (flow->owner);
+  g_slice_free (TcmmdFlow, flow);
+}
+
+void
+tcmmd_flow_table_init (void)
+{
+  flows = g_hash_table_new_full (flow_key_hash, flow_key_equal,
+                                 NULL, flow_free);
+  owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+owner_link (TcmmdFlow *flow)
+{
+  GList *list = g_hash_table_lookup (owners, flow->owner);
+
+  list = g_list_prepend (list, flow);
+  g_hash_table_insert (owners, g_strdup (flow->owner), list);
+}
+
+static void
+owner_unlink (TcmmdFlow *flow)
+{
+  GList *list = g_hash_table_lookup (owners, flow->owner);
+
+  list = g_list_remove (list, flow);
+  if (list)
+    g_hash_table_insert (owners, g_strdup (flow->owner), list);
+  else
+    g_hash_table_remove (owners, flow->owner);
+}
+
+static int
+flow_addr_parse (const gchar *str, TcmmdFlowAddr *addr)
+{
+  if (str[0] == '\0')
+    return AF_UNSPEC;
+  if (inet_pton (AF_INET, str, &addr->in) == 1)
+    return AF_INET;
+  if (inet_pton (AF_INET6, str, &addr->in6) == 1)
+    return AF_INET6;
+  return -1;
+}
+
+static int
+flow_addr_copy (const guint8 *bytes, gsize len, TcmmdFlowAddr *addr)
+{
+  switch (len)
+    {
+      case 0:
+        return AF_UNSPEC;
+      case sizeof (struct in_addr):
+        memcpy (&addr->in, bytes, len);
+        return AF_INET;
+      case sizeof (struct in6_addr):
+        memcpy (&addr->in6, bytes, len);
+        return AF_INET6;
+      default:
+        return -1;
+    }
+}
+
+static gboolean
+flow_key_set_family (TcmmdFlowKey *key, int src_family, int dst_family)
+{
+  if (src_family < 0 || dst_family < 0)
+    return FALSE;
+  if (src_family != AF_UNSPEC && dst_family != AF_UNSPEC &&
+      src_family != dst_family)
+    return FALSE;
+
+  if (src_family != AF_UNSPEC)
+    key->family = src_family;
+  else if (dst_family != AF_UNSPEC)
+    key->family = dst_family;
+  else
+    key->family = AF_INET;
+
+  return TRUE;
+}
+
+gboolean
+tcmmd_flow_key_init (TcmmdFlowKey *key,
+                     const gchar *src_ip_str, guint src_port,
+                     const gchar *dst_ip_str, guint dst_port)
+{
+  int src_family;
+  int dst_family;
+
+  memset (key, 0, sizeof (TcmmdFlowKey));
+
+  src_family = flow_addr_parse (src_ip_str, &key->ip_src);
+  dst_family = flow_addr_parse (dst_ip_str, &key->ip_dst);
+  if (!flow_key_set_family (key, src_family, dst_family))
+    return FALSE;
+
+  key->sport = src_port;
+  key->dport = dst_port;
+  key->protocol = IPPROTO_TCP;
+
+  return TRUE;
+}
+
+gboolean
+tcmmd_flow_key_init_from_bytes (TcmmdFlowKey *key,
+                                const guint8 *src_ip, gsize src_ip_len,
+                                guint16 src_port,
+                                const guint8 *dst_ip, gsize dst_ip_len,
+                                guint16 dst_port,
+                                guint8 protocol)
+{
+  int src_family;
+  int dst_family;
+
+  memset (key, 0, sizeof (TcmmdFlowKey));
+
+  /* the rules only match TCP ports */
+  if (protocol != IPPROTO_TCP)
+    return FALSE;
+
+  src_family = flow_addr_copy (src_ip, src_ip_len, &key->ip_src);
+  dst_family = flow_addr_copy (dst_ip, dst_ip_len, &key->ip_dst);
+  if (!flow_key_set_family (key, src_family, dst_family))
+    return FALSE;
+
+  key->sport = src_port;
+  key->dport = dst_port;
+  key->protocol = protocol;
+
+  return TRUE;
+}
+
+void
+tcmmd_flow_addr_to_string (int family,
+                           const TcmmdFlowAddr *addr,
+                           gchar *str)
+{
+  static const TcmmdFlowAddr any;
+
+  if (memcmp (addr, &any, sizeof (any)) == 0)
+    str[0] = '\0';
+  else
+    inet_ntop (family, addr, str, INET6_ADDRSTRLEN);
+}
+
+gboolean
+tcmmd_flow_key_equal (const TcmmdFlowKey *a, const TcmmdFlowKey *b)
+{
+  return flow_key_equal (a, b);
+}
+
+TcmmdFlow *
+tcmmd_flow_lookup (const TcmmdFlowKey *key)
+{
+  return g_hash_table_lookup (flows, key);
+}
+
+TcmmdFlow *
+tcmmd_flow_add (const TcmmdFlowKey *key,
+                const gchar *owner)
+{
+  TcmmdFlow *flow;
+
+  flow = g_slice_new0 (TcmmdFlow);
+  flow->key = *key;
+  flow->owner = g_strdup (owner);
+  flow->stream_id = -1;
+
+  /* the key is stored in the value */
+  g_hash_table_replace (flows, &flow->key, flow);
+  owner_link (flow);
+
+  return flow;
+}
+
+void
+tcmmd_flow_remove (TcmmdFlow *flow)
+{
+  owner_unlink (flow);
+  g_hash_table_remove (flows, &flow->key);
+}
+
+void
+tcmmd_flow_set_owner (TcmmdFlow *flow,
+                      const gchar *owner)
+{
+  if (g_strcmp0 (flow->owner, owner) == 0)
+    return;
+
+  owner_unlink (flow);
+  g_free (flow->owner);
+  flow->owner = g_strdup (owner);
+  owner_link (flow);
+}
+
+GList *
+tcmmd_flow_get_by_owner (const gchar *owner)
+{
+  return g_list_copy (g_hash_table_lookup (owners, owner));
+}
+
+guint
+tcmmd_flow_count_owners (void)
+{
+  return g_hash_table_size (owners);
+}
+
+guint
+tcmmd_flow_count (void)
+{
+  return g_hash_table_size (flows);
+}
+
+GList *
+tcmmd_flow_get_all (void)
+{
+  return g_hash_table_get_values (flows);
+}
@@ -0,0 +1,135 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_FLOW_H
+#define __TCMMD_FLOW_H
+
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "tcmmd-controller.h"
+#include "tcmmd-shared-protocol.h"
+
+/* An IPv4 or IPv6 address in network byte order, depending on the family
+ * of the flow. The unused bytes are zero. */
+typedef union {
+  struct in_addr in;
+  struct in6_addr in6;
+} TcmmdFlowAddr;
+
+/* A flow is seen from the point of view of the application, like the
+ * arguments of SetPolicy: ip_src/sport is the local end of the connection
+ * and ip_dst/dport the remote server. A zero field is a wildcard. */
+typedef struct {
+  int family;
+  TcmmdFlowAddr ip_src;
+  TcmmdFlowAddr ip_dst;
+  uint16_t sport;
+  uint16_t dport;
+  uint8_t protocol;
+} TcmmdFlowKey;
+
+typedef struct {
+  TcmmdFlowKey key;
+
+  /* D-Bus unique name of the client which set the policy */
+  gchar *owner;
+  /* stream id in the rule engine, see tcmmdrtnl_add_stream() */
+  int stream_id;
+  /* set by SetFixedPolicy: the rates are not controlled */
+  gboolean fixed;
+  guint64 stream_rate;
+
+  /* bitrate declared in SetPolicy, in bytes per second, 0 if unknown */
+  guint64 bitrate;
+
+  /* controller state */
+  guint64 bandwidth;
+  int percentage;
+  gboolean in_panic;
+  gint64 panic_time;
+  guint timeout_id;
+  TcmmdControllerState controller;
+  /* buffer fill slope, in percent per second, between the last two
+   * SetPolicy calls */
+  double fill_slope;
+  gint64 percentage_time;
+
+  /* input stage, see input_policy(): the newest update held back until
+   * input_deadline */
+  gboolean pending;
+  guint pending_bitrate;
+  gdouble pending_fill;
+  guint input_timeout_id;
+  gint64 input_deadline;
+
+  /* set by SetSharedPolicy: the page the client writes to, and the
+   * sequence number of the last values read from it */
+  TcmmdSharedPolicy *shared;
+  guint32 shared_seq;
+
+  /* session report, see report_session() */
+  gint64 session_start;
+  guint panics;
+  guint stable_steps;
+  gint64 converged_time;
+} TcmmdFlow;
+
+void tcmmd_flow_table_init (void);
+
+/* Fill a TCP flow key from the D-Bus arguments. An empty address is a
+ * wildcard; the family is taken from the addresses, IPv4 if both are empty.
+ * Returns FALSE if an address cannot be parsed or the families differ. */
+gboolean tcmmd_flow_key_init (TcmmdFlowKey *key,
+                              const gchar *src_ip_str, guint src_port,
+                              const gchar *dst_ip_str, guint dst_port);
+
+/* The same from the binary fields of the ManagedConnections2 flows: an
+ * address is 0 (wildcard), 4 or 16 bytes long. Only TCP is supported. */
+gboolean tcmmd_flow_key_init_from_bytes (TcmmdFlowKey *key,
+                                         const guint8 *src_ip, gsize src_ip_len,
+                                         guint16 src_port,
+                                         const guint8 *dst_ip, gsize dst_ip_len,
+                                         guint16 dst_port,
+                                         guint8 protocol);
+gboolean tcmmd_flow_key_equal (const TcmmdFlowKey *a, const TcmmdFlowKey *b);
+/* The string tcmmd_flow_key_init() takes: empty for a wildcard. str holds
+ * INET6_ADDRSTRLEN bytes. */
+void tcmmd_flow_addr_to_string (int family,
+                                const TcmmdFlowAddr *addr,
+                                gchar *str);
+
+TcmmdFlow *tcmmd_flow_lookup (const TcmmdFlowKey *key);
+TcmmdFlow *tcmmd_flow_add (const TcmmdFlowKey *key,
+                           const gchar *owner);
+void tcmmd_flow_remove (TcmmdFlow *flow);
+/* A client took over the flow of another one */
+void tcmmd_flow_set_owner (TcmmdFlow *flow,
+                           const gchar *owner);
+
+guint tcmmd_flow_count (void);
+/* Returns a list of TcmmdFlow owned by the table, free with g_list_free() */
+GList *tcmmd_flow_get_all (void);
+/* The same for the flows of one client, without walking the whole table */
+GList *tcmmd_flow_get_by_owner (const gchar *owner);
+/* Number of clients with at least one flow */
+guint tcmmd_flow_count_owners (void);
+
+#endif
@@ -0,0 +1,1296 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <string.h>
+
+#include "tcmmd-policy.h"
+#include "tcmmd-flow.h"
+#include "tcmmd-shared.h"
+#include "tcmmd-trace.h"
+
+#define INFINITE_BANDWIDTH 0xffffffffULL
+
+const TcmmdPolicyClock tcmmd_policy_main_loop_clock = {
+  g_get_monotonic_time,
+  g_timeout_add,
+  g_source_remove,
+};
+
+static const TcmmdController *controller;
+static TcmmdControllerParams controller_params;
+static const TcmmdPolicyClock *policy_clock;
+/* each uplink has its own capacity, and its own stats */
+static TcmmdCapacity link_capacity[TCMMD_MAX_LINKS];
+/* the last sample of tcmmd_policy_sample_stats(), read by the controller */
+static TcmmdStats last_stats[TCMMD_MAX_LINKS];
+/* reads the shared policy pages, while there is any */
+static guint shared_timeout_id = 0;
+/* updates which never reached update_policy(), see input_policy() */
+static guint64 absorbed_updates = 0;
+
+/* The flow table is what the applications told us. So it is from the point
+ * of view of the application: dport is likely to be http=80 and sport is
+ * likely to be a random port.
+ *
+ * When calling tcmmdrtnl_add_streams, we are adding rules for ingress packets,
+ * so it is from the point of view of the remote sender: tcp_sport is likely
+ * to be http=80 and tcp_dport is likely to be a random port.
+ *
+ * Yes, it is confusing.
+ */
+
+/* Background rate currently enforced on each uplink: the lowest budget
+ * among the flows shaped there, 0 without flows */
+static guint64 bandwidth[TCMMD_MAX_LINKS];
+
+int
+tcmmd_policy_get_lowest_percentage (void)
+{
+  GList *flows, *l;
+  int percentage = 0;
+  gboolean found = FALSE;
+
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (flow->fixed)
+        continue;
+      if (!found || flow->percentage < percentage)
+        percentage = flow->percentage;
+      found = TRUE;
+    }
+  g_list_free (flows);
+
+  return percentage;
+}
+
+/* The uplink a flow is received on */
+static int
+flow_link (const TcmmdFlow *flow)
+{
+  return flow->stream_id < 0 ? 0 : TCMMD_STREAM_LINK (flow->stream_id);
+}
+
+/* The lowest budget of the flows installed on an uplink */
+static guint64
+lowest_bandwidth (int link)
+{
+  GList *flows, *l;
+  guint64 rate = INFINITE_BANDWIDTH;
+
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (flow->stream_id >= 0 && flow_link (flow) == link)
+        rate = MIN (rate, flow->bandwidth);
+    }
+  g_list_free (flows);
+
+  return rate;
+}
+
+/* The background rates for tcmmdrtnl_add_streams(): the one of each uplink
+ * as it is, lowered to flow_bandwidth for the new flows */
+static void
+new_background_rates (guint64 flow_bandwidth, guint64 *background_rates)
+{
+  int link;
+
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    background_rates[link] = MIN (lowest_bandwidth (link), flow_bandwidth);
+}
+
+void
+tcmmd_policy_sample_stats (TcmmdStats *stats)
+{
+  gint64 time = policy_clock->get_time ();
+  int link;
+
+  tcmmdrtnl_get_link_stats (last_stats);
+
+  memset (stats, 0, sizeof (TcmmdStats));
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    {
+      tcmmd_capacity_sample (&link_capacity[link],
+                             last_stats[link].qdisc_ingress_bytes, time);
+      tcmmdrtnl_stats_add (stats, &last_stats[link]);
+    }
+}
+
+/* Background budget of an uplink from its capacity and the bitrates declared
+ * by the controlled flows received there, or 0 if one of them did not
+ * declare any or the capacity is not known yet */
+static guint64
+background_budget (int link)
+{
+  GList *flows, *l;
+  guint64 stream_rate = 0;
+  gboolean known = TRUE;
+
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (flow->fixed || flow_link (flow) != link)
+        continue;
+      if (flow->bitrate == 0)
+        known = FALSE;
+      stream_rate += flow->bitrate;
+    }
+  g_list_free (flows);
+
+  if (!known || stream_rate == 0)
+    return 0;
+
+  return tcmmd_controller_budget (&controller_params, &link_capacity[link],
+                                  stream_rate);
+}
+
+void
+tcmmd_policy_count_flows (guint32 *flows, guint32 *flows_in_panic)
+{
+  GList *all, *l;
+
+  *flows = 0;
+  *flows_in_panic = 0;
+
+  all = tcmmd_flow_get_all ();
+  for (l = all; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      (*flows)++;
+      if (flow->in_panic)
+        (*flows_in_panic)++;
+    }
+  g_list_free (all);
+}
+
+/* The lowest background rate of the uplinks with flows, as reported */
+static guint64
+lowest_background (void)
+{
+  guint64 rate = 0;
+  int link;
+
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    if (bandwidth[link] > 0 && (rate == 0 || bandwidth[link] < rate))
+      rate = bandwidth[link];
+
+  return rate;
+}
+
+/* tcmmdrtnl_replace_streams() set the background rate of the uplink of each
+ * new stream */
+static void
+set_installed_background (const int *stream_ids,
+                          guint n_streams,
+                          const guint64 *background_rates)
+{
+  guint i;
+
+  for (i = 0; i < n_streams; i++)
+    {
+      int link = TCMMD_STREAM_LINK (stream_ids[i]);
+
+      bandwidth[link] = background_rates[link];
+    }
+}
+
+/* The background class of an uplink is shared: it gets the lowest budget
+ * requested by the flows received there, so that a stream in panic is
+ * protected from every download on the same uplink. */
+static void
+update_background (void)
+{
+  guint64 new_bandwidth[TCMMD_MAX_LINKS];
+  int stream_ids[TCMMD_MAX_LINKS];
+  GList *flows, *l;
+  int link;
+
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    {
+      new_bandwidth[link] = INFINITE_BANDWIDTH;
+      stream_ids[link] = -1;
+    }
+
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (flow->stream_id < 0)
+        continue;
+      link = TCMMD_STREAM_LINK (flow->stream_id);
+      new_bandwidth[link] = MIN (new_bandwidth[link], flow->bandwidth);
+      stream_ids[link] = flow->stream_id;
+    }
+  g_list_free (flows);
+
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    {
+      if (stream_ids[link] < 0)
+        {
+          bandwidth[link] = 0;
+          continue;
+        }
+      if (new_bandwidth[link] == bandwidth[link])
+        continue;
+
+      /* on failure, the next update tries again */
+      if (tcmmdrtnl_update_rate (TCMMD_CLASS_BACKGROUND, stream_ids[link],
+                                 new_bandwidth[link], new_bandwidth[link]) < 0)
+        {
+          g_printerr ("Cannot change the background rate\n");
+          continue;
+        }
+      TCMMD_TRACE2 (background_changed, bandwidth[link], new_bandwidth[link]);
+      bandwidth[link] = new_bandwidth[link];
+    }
+}
+
+static void
+cancel_timeout (TcmmdFlow *flow)
+{
+  if (flow->timeout_id != 0)
+    {
+      policy_clock->source_remove (flow->timeout_id);
+      flow->timeout_id = 0;
+    }
+}
+
+/* Drop the update held back by the input stage, if any */
+static void
+cancel_input (TcmmdFlow *flow)
+{
+  if (flow->input_timeout_id != 0)
+    {
+      policy_clock->source_remove (flow->input_timeout_id);
+      flow->input_timeout_id = 0;
+    }
+  if (flow->pending)
+    {
+      absorbed_updates++;
+      flow->pending = FALSE;
+    }
+}
+
+/* Log how the controller did for a flow: how long it took to settle and how
+ * many times the buffer went into panic */
+static void
+report_session (TcmmdFlow *flow)
+{
+  gint64 now = policy_clock->get_time ();
+  gint64 duration = now - flow->session_start;
+  gint64 convergence = -1;
+
+  if (flow->fixed)
+    return;
+
+  if (flow->converged_time != 0)
+    convergence = flow->converged_time - flow->session_start;
+
+  TCMMD_TRACE4 (session_end, flow->stream_id, duration / 1000,
+                flow->panics, convergence / 1000);
+
+  if (convergence >= 0)
+    tcmmd_log (TCMMD_LOG_INFO, "Session of stream %d ended: controller=%s "
+               "duration=%.1fs panics=%u convergence=%.1fs\n",
+               flow->stream_id, controller->name,
+               duration / (double) G_USEC_PER_SEC, flow->panics,
+               convergence / (double) G_USEC_PER_SEC);
+  else
+    tcmmd_log (TCMMD_LOG_INFO, "Session of stream %d ended: controller=%s "
+               "duration=%.1fs panics=%u convergence=never\n",
+               flow->stream_id, controller->name,
+               duration / (double) G_USEC_PER_SEC, flow->panics);
+}
+
+static void
+release_shared (TcmmdFlow *flow)
+{
+  if (flow->shared != NULL)
+    {
+      tcmmd_shared_policy_free (flow->shared);
+      flow->shared = NULL;
+    }
+}
+
+static void
+remove_flow (TcmmdFlow *flow)
+{
+  cancel_timeout (flow);
+  cancel_input (flow);
+  release_shared (flow);
+  report_session (flow);
+  if (flow->stream_id >= 0)
+    tcmmdrtnl_del_stream (flow->stream_id);
+  tcmmd_flow_remove (flow);
+}
+
+/* swap source and destination: the rules are for ingress packets */
+static void
+stream_spec_init (TcmmdStreamSpec *stream, const TcmmdFlowKey *key)
+{
+  stream->family = key->family;
+  stream->ip_src = &key->ip_dst;
+  stream->ip_dst = &key->ip_src;
+  stream->tcp_sport = key->dport;
+  stream->tcp_dport = key->sport;
+  stream->stream_rate = INFINITE_BANDWIDTH;
+}
+
+/* The flow of a stream already installed with the given id */
+static TcmmdFlow *
+create_flow (const TcmmdFlowKey *key,
+             const gchar *owner,
+             int stream_id,
+             guint64 stream_rate,
+             guint64 flow_bandwidth)
+{
+  TcmmdFlow *flow;
+
+  flow = tcmmd_flow_add (key, owner);
+  flow->stream_id = stream_id;
+  flow->stream_rate = stream_rate;
+  flow->bandwidth = flow_bandwidth;
+  flow->session_start = policy_clock->get_time ();
+  controller->reset (&controller_params, &flow->controller);
+
+  return flow;
+}
+
+/* A SetPolicy client has a single flow: a new tuple replaces the other
+ * flows of the owner */
+static GList *
+replaced_flows (const gchar *owner, const TcmmdFlowKey *key)
+{
+  GList *flows, *l;
+  GList *replaced = NULL;
+
+  flows = tcmmd_flow_get_by_owner (owner);
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (!tcmmd_flow_key_equal (&flow->key, key))
+        replaced = g_list_prepend (replaced, flow);
+    }
+  g_list_free (flows);
+
+  return replaced;
+}
+
+/* The streams of the replaced flows are removed in the transaction which
+ * adds the new one, so on failure the owner keeps its previous flow */
+static TcmmdFlow *
+add_flow (const TcmmdFlowKey *key,
+          const gchar *owner,
+          guint64 stream_rate,
+          guint64 flow_bandwidth,
+          GList *replaced)
+{
+  TcmmdFlow *flow;
+  TcmmdStreamSpec stream;
+  guint64 background_rates[TCMMD_MAX_LINKS];
+  int *old_ids;
+  guint n_old = 0;
+  int stream_id;
+  GList *l;
+
+  old_ids = g_new (int, g_list_length (replaced));
+  for (l = replaced; l != NULL; l = l->next)
+    {
+      TcmmdFlow *old = l->data;
+
+      if (old->stream_id >= 0)
+        old_ids[n_old++] = old->stream_id;
+    }
+
+  stream_spec_init (&stream, key);
+  stream.stream_rate = stream_rate;
+  new_background_rates (flow_bandwidth, background_rates);
+  if (!tcmmdrtnl_replace_streams (old_ids, n_old, &stream, 1,
+                                  background_rates, &stream_id))
+    {
+      g_free (old_ids);
+      return NULL;
+    }
+  g_free (old_ids);
+
+  for (l = replaced; l != NULL; l = l->next)
+    {
+      TcmmdFlow *old = l->data;
+
+      old->stream_id = -1;
+      remove_flow (old);
+    }
+
+  flow = create_flow (key, owner, stream_id, stream_rate, flow_bandwidth);
+  set_installed_background (&stream_id, 1, background_rates);
+
+  return flow;
+}
+
+/* The measured rate is the one of the uplink of the flow in the last stats
+ * sample: the estimators of the kernel do not move faster than the stats
+ * interval anyway */
+static void
+controller_input (TcmmdFlow *flow, TcmmdControllerInput *input)
+{
+  input->rate = flow->bandwidth;
+  input->measured_rate = last_stats[flow_link (flow)].qdisc_background_rate;
+  input->percentage = flow->percentage;
+  input->fill_slope = flow->fill_slope;
+  input->in_panic = flow->in_panic;
+}
+
+static void
+set_flow_bandwidth (TcmmdFlow *flow, guint64 new_bandwidth)
+{
+  if (new_bandwidth == flow->bandwidth)
+    return;
+
+  TCMMD_TRACE3 (bandwidth_changed, flow->stream_id, flow->bandwidth,
+                new_bandwidth);
+  flow->bandwidth = new_bandwidth;
+  update_background ();
+}
+
+static gboolean
+update_bandwidth_cb (gpointer data)
+{
+  TcmmdFlow *flow = data;
+  TcmmdControllerInput input;
+  guint64 new_bandwidth;
+  guint64 budget;
+
+  tcmmd_log (TCMMD_LOG_DEBUG, "Update callback. Current values: stream=%d "
+             "percentage=%d in_panic=%d sport=%d bandwidth=%"G_GUINT64_FORMAT
+             " capacity=%"G_GUINT64_FORMAT"\n",
+             flow->stream_id, flow->percentage, flow->in_panic,
+             flow->key.sport, flow->bandwidth,
+             link_capacity[flow_link (flow)].capacity);
+
+  controller_input (flow, &input);
+  new_bandwidth = controller->step (&controller_params, &flow->controller,
+                                    &input);
+
+  /* never give the background what the streams said they need */
+  budget = background_budget (flow_link (flow));
+  if (budget != 0)
+    new_bandwidth = MIN (new_bandwidth, budget);
+
+  /* converged: the rate stopped moving, outside of a panic */
+  if (flow->converged_time == 0)
+    {
+      if (!flow->in_panic &&
+          new_bandwidth <= flow->bandwidth * (1.0 + controller_params.tolerance) &&
+          new_bandwidth >= flow->bandwidth * (1.0 - controller_params.tolerance))
+        flow->stable_steps++;
+      else
+        flow->stable_steps = 0;
+
+      if (flow->stable_steps >= controller_params.stable_steps)
+        flow->converged_time = policy_clock->get_time ();
+    }
+
+  set_flow_bandwidth (flow, new_bandwidth);
+
+  return TRUE;
+}
+
+gboolean
+tcmmd_policy_set_fixed (const gchar *owner,
+                        const gchar *src_ip_str, guint src_port,
+                        const gchar *dst_ip_str, guint dst_port,
+                        guint stream_rate,
+                        guint background_rate)
+{
+  TcmmdFlowKey key;
+  TcmmdFlow *flow;
+  GList *replaced;
+
+  TCMMD_TRACE6 (fixed_policy_received, owner, src_ip_str, src_port,
+                dst_ip_str, dst_port, stream_rate);
+
+  if (!tcmmd_flow_key_init (&key, src_ip_str, src_port, dst_ip_str, dst_port))
+    {
+      g_printerr ("Invalid addresses '%s' and '%s', policy ignored\n",
+                  src_ip_str, dst_ip_str);
+      return FALSE;
+    }
+
+  replaced = replaced_flows (owner, &key);
+  flow = tcmmd_flow_lookup (&key);
+  if (!flow)
+    {
+      flow = add_flow (&key, owner, stream_rate, background_rate, replaced);
+      g_list_free (replaced);
+      if (!flow)
+        return FALSE;
+    }
+  else
+    {
+      g_list_free_full (replaced, (GDestroyNotify) remove_flow);
+      tcmmd_flow_set_owner (flow, owner);
+      cancel_timeout (flow);
+      cancel_input (flow);
+      /* the client would take the flow back from the controller */
+      release_shared (flow);
+      flow->bandwidth = background_rate;
+      if (flow->stream_rate != stream_rate &&
+          tcmmdrtnl_update_rate (TCMMD_CLASS_STREAM, flow->stream_id,
+                                 stream_rate, 0) >= 0)
+        flow->stream_rate = stream_rate;
+    }
+
+  flow->fixed = TRUE;
+  update_background ();
+
+  return TRUE;
+}
+
+/* The controller part of SetPolicy, once the flow is installed */
+static void
+update_policy (TcmmdFlow *flow,
+               gboolean new_flow,
+               guint bitrate,
+               gdouble buffer_fill)
+{
+  TcmmdControllerInput input;
+  gboolean new_panic = FALSE;
+  gboolean end_panic = FALSE;
+  guint64 budget;
+  gint64 now;
+  int percentage;
+
+  if (!new_flow && flow->fixed)
+    {
+      flow->fixed = FALSE;
+      controller->reset (&controller_params, &flow->controller);
+    }
+
+  /* back from a fixed policy, or a previous change failed */
+  if (flow->stream_rate != INFINITE_BANDWIDTH &&
+      tcmmdrtnl_update_rate (TCMMD_CLASS_STREAM, flow->stream_id,
+                             INFINITE_BANDWIDTH, 0) >= 0)
+    flow->stream_rate = INFINITE_BANDWIDTH;
+
+  /* GStreamer bitrates are in bits per second */
+  flow->bitrate = bitrate / 8;
+
+  now = policy_clock->get_time ();
+  percentage = buffer_fill * 100.0;
+  if (!new_flow && now > flow->percentage_time)
+    flow->fill_slope = (percentage - flow->percentage) *
+                       (double) G_USEC_PER_SEC / (now - flow->percentage_time);
+  flow->percentage = percentage;
+  flow->percentage_time = now;
+
+  if (!flow->in_panic && flow->percentage < controller_params.panic_threshold)
+    {
+      new_panic = TRUE;
+      flow->in_panic = TRUE;
+      flow->panic_time = now;
+      flow->panics++;
+      flow->stable_steps = 0;
+      TCMMD_TRACE2 (panic_enter, flow->stream_id, flow->percentage);
+    }
+  else if (flow->percentage >= controller_params.recover_threshold)
+    {
+      if (flow->in_panic)
+        {
+          TCMMD_TRACE2 (panic_exit, flow->stream_id, flow->percentage);
+          end_panic = TRUE;
+        }
+      flow->in_panic = FALSE;
+    }
+
+  /* with a known capacity and bitrate, start from the budget rather than
+   * probing up from the minimum */
+  if (new_flow)
+    {
+      budget = background_budget (flow_link (flow));
+      if (budget != 0)
+        flow->bandwidth = budget;
+      update_background ();
+    }
+  else if (new_panic)
+    {
+      cancel_timeout (flow);
+      controller_input (flow, &input);
+      tcmmd_capacity_panic (&link_capacity[flow_link (flow)]);
+      set_flow_bandwidth (flow, controller->panic (&controller_params,
+                                                   &flow->controller,
+                                                   &input));
+    }
+  else
+    {
+      if (end_panic && (budget = background_budget (flow_link (flow))) != 0)
+        set_flow_bandwidth (flow, budget);
+
+      if (flow->timeout_id == 0)
+        {
+          /* schedule change */
+          tcmmd_log (TCMMD_LOG_DEBUG, "Add timeout for stream %d.\n",
+                     flow->stream_id);
+          flow->timeout_id = policy_clock->timeout_add (controller_params.interval,
+                                                       update_bandwidth_cb,
+                                                       flow);
+        }
+    }
+}
+
+static void
+apply_input (TcmmdFlow *flow,
+             guint bitrate,
+             gdouble buffer_fill)
+{
+  /* with the step already scheduled, an unchanged update only brings the
+   * buffer slope to zero and never reaches the rules */
+  if (flow->timeout_id != 0 &&
+      (int) (buffer_fill * 100.0) == flow->percentage &&
+      bitrate / 8 == flow->bitrate)
+    absorbed_updates++;
+
+  update_policy (flow, FALSE, bitrate, buffer_fill);
+}
+
+static gboolean
+input_timeout_cb (gpointer data)
+{
+  TcmmdFlow *flow = data;
+
+  flow->input_timeout_id = 0;
+  flow->pending = FALSE;
+  apply_input (flow, flow->pending_bitrate, flow->pending_fill);
+
+  return FALSE;
+}
+
+/* The input stage in front of update_policy(): a client reporting every
+ * small change of its buffer, or a buffer flapping around the thresholds,
+ * would otherwise re-enter the controller and change the rules several
+ * times a second. See coalesce_interval and panic_hold. */
+static void
+input_policy (TcmmdFlow *flow,
+              guint bitrate,
+              gdouble buffer_fill)
+{
+  int percentage = buffer_fill * 100.0;
+  gint64 now, deadline;
+
+  /* entering a panic cannot wait, nor can a flow leaving a fixed policy */
+  if (flow->fixed ||
+      (!flow->in_panic && percentage < controller_params.panic_threshold))
+    {
+      cancel_input (flow);
+      apply_input (flow, bitrate, buffer_fill);
+      return;
+    }
+
+  now = policy_clock->get_time ();
+  deadline = flow->percentage_time +
+             controller_params.coalesce_interval * (gint64) 1000;
+  if (flow->in_panic && percentage >= controller_params.recover_threshold)
+    deadline = MAX (deadline, flow->panic_time +
+                              controller_params.panic_hold * (gint64) 1000);
+
+  if (deadline <= now)
+    {
+      cancel_input (flow);
+      apply_input (flow, bitrate, buffer_fill);
+      return;
+    }
+
+  /* replaces the update held back so far */
+  if (flow->pending)
+    absorbed_updates++;
+  flow->pending = TRUE;
+  flow->pending_bitrate = bitrate;
+  flow->pending_fill = buffer_fill;
+
+  if (flow->input_timeout_id != 0 && deadline <= flow->input_deadline)
+    return;
+  if (flow->input_timeout_id != 0)
+    policy_clock->source_remove (flow->input_timeout_id);
+  flow->input_deadline = deadline;
+  flow->input_timeout_id = policy_clock->timeout_add ((deadline - now + 999) / 1000,
+                                                      input_timeout_cb,
+                                                      flow);
+}
+
+gboolean
+tcmmd_policy_set (const gchar *owner,
+                  const gchar *src_ip_str, guint src_port,
+                  const gchar *dst_ip_str, guint dst_port,
+                  guint bitrate,
+                  gdouble buffer_fill)
+{
+  TcmmdFlowKey key;
+  TcmmdFlow *flow;
+  GList *replaced;
+
+  TCMMD_TRACE6 (policy_received, owner, src_ip_str, src_port,
+                dst_ip_str, dst_port, (int) (buffer_fill * 100.0));
+
+  if (!tcmmd_flow_key_init (&key, src_ip_str, src_port, dst_ip_str, dst_port))
+    {
+      g_printerr ("Invalid addresses '%s' and '%s', policy ignored\n",
+                  src_ip_str, dst_ip_str);
+      return FALSE;
+    }
+
+  replaced = replaced_flows (owner, &key);
+  flow = tcmmd_flow_lookup (&key);
+  if (!flow)
+    {
+      flow = add_flow (&key, owner, INFINITE_BANDWIDTH,
+                       controller_params.min_rate, replaced);
+      g_list_free (replaced);
+      if (!flow)
+        return FALSE;
+      update_policy (flow, TRUE, bitrate, buffer_fill);
+    }
+  else
+    {
+      if (replaced != NULL)
+        {
+          g_list_free_full (replaced, (GDestroyNotify) remove_flow);
+          update_background ();
+        }
+      tcmmd_flow_set_owner (flow, owner);
+      input_policy (flow, bitrate, buffer_fill);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+policy_in_batch (const TcmmdFlowKey *key,
+                 const TcmmdPolicyEntry *entries,
+                 guint n_entries)
+{
+  guint i;
+
+  for (i = 0; i < n_entries; i++)
+    if (tcmmd_flow_key_equal (key, &entries[i].key))
+      return TRUE;
+
+  return FALSE;
+}
+
+gboolean
+tcmmd_policy_set_many (const gchar *owner,
+                       const TcmmdPolicyEntry *entries,
+                       guint n_entries,
+                       gboolean replace)
+{
+  TcmmdStreamSpec *streams;
+  int *stream_ids;
+  int *old_ids;
+  gboolean *new_flows;
+  GList *dropped = NULL, *l;
+  guint64 background_rates[TCMMD_MAX_LINKS];
+  guint n_streams = 0, n_old = 0;
+  guint i, j;
+
+  TCMMD_TRACE3 (policies_received, owner, n_entries, replace);
+
+  /* the flows the batch drops */
+  if (replace)
+    {
+      GList *flows;
+
+      flows = tcmmd_flow_get_by_owner (owner);
+      for (l = flows; l != NULL; l = l->next)
+        {
+          TcmmdFlow *flow = l->data;
+
+          if (!policy_in_batch (&flow->key, entries, n_entries))
+            dropped = g_list_prepend (dropped, flow);
+        }
+      g_list_free (flows);
+    }
+
+  old_ids = g_new (int, g_list_length (dropped));
+  for (l = dropped; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (flow->stream_id >= 0)
+        old_ids[n_old++] = flow->stream_id;
+    }
+
+  /* a flow listed twice is new only the first time */
+  streams = g_new (TcmmdStreamSpec, n_entries);
+  stream_ids = g_new (int, n_entries);
+  new_flows = g_new0 (gboolean, n_entries);
+  for (i = 0; i < n_entries; i++)
+    {
+      const TcmmdFlowKey *key = &entries[i].key;
+
+      if (tcmmd_flow_lookup (key) || policy_in_batch (key, entries, i))
+        continue;
+      new_flows[i] = TRUE;
+      stream_spec_init (&streams[n_streams++], key);
+    }
+
+  /* the streams of the dropped flows are removed in the same transaction
+   * which installs the new ones, and handed over to them where they arrive
+   * on the same uplink, e.g. a player which reconnected: the class keeps
+   * its queue and only the filter changes. The flows only change once the
+   * rules did. */
+  new_background_rates (controller_params.min_rate, background_rates);
+  if ((n_old > 0 || n_streams > 0) &&
+      !tcmmdrtnl_replace_streams (old_ids, n_old, streams, n_streams,
+                                  background_rates, stream_ids))
+    {
+      g_printerr ("Cannot install %u flows, policies of %s ignored\n",
+                  n_streams, owner);
+      g_list_free (dropped);
+      g_free (old_ids);
+      g_free (streams);
+      g_free (stream_ids);
+      g_free (new_flows);
+      return FALSE;
+    }
+
+  for (l = dropped; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      flow->stream_id = -1;
+      remove_flow (flow);
+    }
+  g_list_free (dropped);
+
+  for (i = 0, j = 0; i < n_entries; i++)
+    if (new_flows[i])
+      create_flow (&entries[i].key, owner, stream_ids[j++],
+                   INFINITE_BANDWIDTH, controller_params.min_rate);
+  set_installed_background (stream_ids, n_streams, background_rates);
+
+  for (i = 0; i < n_entries; i++)
+    {
+      TcmmdFlow *flow = tcmmd_flow_lookup (&entries[i].key);
+
+      tcmmd_flow_set_owner (flow, owner);
+      if (new_flows[i])
+        update_policy (flow, TRUE, entries[i].bitrate,
+                       entries[i].buffer_fill);
+      else
+        input_policy (flow, entries[i].bitrate, entries[i].buffer_fill);
+    }
+
+  /* the background class only changes once for the whole batch */
+  update_background ();
+
+  g_free (old_ids);
+  g_free (streams);
+  g_free (stream_ids);
+  g_free (new_flows);
+
+  return TRUE;
+}
+
+/* New values in a shared page are handled like a SetPolicy call, so a
+ * buffer draining is seen within shared_interval */
+static gboolean
+sample_shared_cb (gpointer data)
+{
+  GList *flows, *l;
+  gboolean found = FALSE;
+
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+      guint32 seq, bitrate;
+      gdouble buffer_fill;
+
+      if (flow->shared == NULL)
+        continue;
+      found = TRUE;
+
+      if (tcmmd_shared_policy_read (flow->shared, &seq, &bitrate,
+                                    &buffer_fill) < 0 ||
+          seq == flow->shared_seq)
+        continue;
+      flow->shared_seq = seq;
+
+      /* the client can write anything there; also rejects NaN */
+      if (!(buffer_fill >= 0.0 && buffer_fill <= 1.0))
+        continue;
+
+      TCMMD_TRACE3 (shared_policy_read, flow->stream_id, bitrate,
+                    (int) (buffer_fill * 100.0));
+      input_policy (flow, bitrate, buffer_fill);
+    }
+  g_list_free (flows);
+
+  if (!found)
+    {
+      shared_timeout_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gboolean
+tcmmd_policy_set_shared (const gchar *owner,
+                         const TcmmdFlowKey *key,
+                         guint bitrate,
+                         gdouble buffer_fill,
+                         TcmmdSharedPolicy *page)
+{
+  TcmmdPolicyEntry entry;
+  TcmmdFlow *flow;
+  guint32 unused_bitrate;
+  gdouble unused_fill;
+
+  entry.key = *key;
+  entry.bitrate = bitrate;
+  entry.buffer_fill = buffer_fill;
+  if (!tcmmd_policy_set_many (owner, &entry, 1, FALSE))
+    return FALSE;
+
+  /* a new page replaces the one the client had for this flow */
+  flow = tcmmd_flow_lookup (key);
+  release_shared (flow);
+  flow->shared = page;
+  /* nobody else has the page yet: the values are the ones just set */
+  tcmmd_shared_policy_read (page, &flow->shared_seq, &unused_bitrate,
+                            &unused_fill);
+
+  if (shared_timeout_id == 0)
+    shared_timeout_id = policy_clock->timeout_add (controller_params.shared_interval,
+                                                   sample_shared_cb, NULL);
+
+  return TRUE;
+}
+
+void
+tcmmd_policy_unset_flows (const gchar *owner,
+                          const TcmmdFlowKey *keys,
+                          guint n_keys)
+{
+  guint i;
+
+  for (i = 0; i < n_keys; i++)
+    {
+      TcmmdFlow *flow = tcmmd_flow_lookup (&keys[i]);
+
+      if (flow && g_strcmp0 (flow->owner, owner) == 0)
+        remove_flow (flow);
+    }
+
+  update_background ();
+}
+
+void
+tcmmd_policy_unset (const gchar *owner)
+{
+  GList *flows, *l;
+
+  flows = tcmmd_flow_get_by_owner (owner);
+  for (l = flows; l != NULL; l = l->next)
+    remove_flow (l->data);
+  g_list_free (flows);
+
+  update_background ();
+}
+
+#define STATE_GROUP "policy"
+#define STATE_FLOW_GROUP "flow "
+#define STATE_LINK_GROUP "uplink "
+
+static void
+save_flow (GKeyFile *state, const gchar *group, const TcmmdFlow *flow)
+{
+  gchar src_ip[INET6_ADDRSTRLEN];
+  gchar dst_ip[INET6_ADDRSTRLEN];
+
+  tcmmd_flow_addr_to_string (flow->key.family, &flow->key.ip_src, src_ip);
+  tcmmd_flow_addr_to_string (flow->key.family, &flow->key.ip_dst, dst_ip);
+
+  g_key_file_set_string (state, group, "owner", flow->owner);
+  g_key_file_set_string (state, group, "src-ip", src_ip);
+  g_key_file_set_integer (state, group, "src-port", flow->key.sport);
+  g_key_file_set_string (state, group, "dst-ip", dst_ip);
+  g_key_file_set_integer (state, group, "dst-port", flow->key.dport);
+  g_key_file_set_integer (state, group, "stream-id", flow->stream_id);
+  g_key_file_set_boolean (state, group, "fixed", flow->fixed);
+  g_key_file_set_boolean (state, group, "shared", flow->shared != NULL);
+  g_key_file_set_uint64 (state, group, "stream-rate", flow->stream_rate);
+  g_key_file_set_uint64 (state, group, "bitrate", flow->bitrate);
+
+  g_key_file_set_uint64 (state, group, "bandwidth", flow->bandwidth);
+  g_key_file_set_integer (state, group, "percentage", flow->percentage);
+  g_key_file_set_boolean (state, group, "in-panic", flow->in_panic);
+  g_key_file_set_int64 (state, group, "panic-time", flow->panic_time);
+  g_key_file_set_boolean (state, group, "stepping", flow->timeout_id != 0);
+  g_key_file_set_uint64 (state, group, "ssthresh", flow->controller.ssthresh);
+  g_key_file_set_double (state, group, "integral", flow->controller.integral);
+  g_key_file_set_double (state, group, "fill-slope", flow->fill_slope);
+  g_key_file_set_int64 (state, group, "percentage-time", flow->percentage_time);
+
+  g_key_file_set_int64 (state, group, "session-start", flow->session_start);
+  g_key_file_set_integer (state, group, "panics", flow->panics);
+  g_key_file_set_integer (state, group, "stable-steps", flow->stable_steps);
+  g_key_file_set_int64 (state, group, "converged-time", flow->converged_time);
+}
+
+void
+tcmmd_policy_save (GKeyFile *state)
+{
+  GList *flows, *l;
+  guint i = 0;
+  int link;
+
+  g_key_file_set_string (state, STATE_GROUP, "controller", controller->name);
+
+  for (link = 0; link < TCMMD_MAX_LINKS; link++)
+    {
+      gchar *group = g_strdup_printf (STATE_LINK_GROUP "%d", link);
+
+      g_key_file_set_uint64 (state, group, "background-rate", bandwidth[link]);
+      g_key_file_set_uint64 (state, group, "capacity",
+                             link_capacity[link].capacity);
+      g_key_file_set_boolean (state, group, "capacity-saturated",
+                              link_capacity[link].saturated);
+      g_free (group);
+    }
+
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      gchar *group = g_strdup_printf (STATE_FLOW_GROUP "%u", i++);
+
+      save_flow (state, group, l->data);
+      g_free (group);
+    }
+  g_list_free (flows);
+}
+
+/* The fields of a saved flow. The times are those of the monotonic clock,
+ * which the previous tcmmd shared with us. */
+static gboolean
+read_flow (GKeyFile *state, const gchar *group, TcmmdFlow *flow,
+           gboolean *shared, gboolean *stepping)
+{
+  gchar *src_ip, *dst_ip;
+  gboolean valid;
+
+  if (!g_key_file_has_key (state, group, "owner", NULL) ||
+      !g_key_file_has_key (state, group, "stream-id", NULL))
+    return FALSE;
+
+  src_ip = g_key_file_get_string (state, group, "src-ip", NULL);
+  dst_ip = g_key_file_get_string (state, group, "dst-ip", NULL);
+  valid = src_ip && dst_ip &&
+          tcmmd_flow_key_init (&flow->key,
+                               src_ip,
+                               g_key_file_get_integer (state, group, "src-port", NULL),
+                               dst_ip,
+                               g_key_file_get_integer (state, group, "dst-port", NULL));
+  g_free (src_ip);
+  g_free (dst_ip);
+  if (!valid)
+    return FALSE;
+
+  flow->owner = g_key_file_get_string (state, group, "owner", NULL);
+  flow->stream_id = g_key_file_get_integer (state, group, "stream-id", NULL);
+  flow->fixed = g_key_file_get_boolean (state, group, "fixed", NULL);
+  *shared = g_key_file_get_boolean (state, group, "shared", NULL);
+  flow->stream_rate = g_key_file_get_uint64 (state, group, "stream-rate", NULL);
+  flow->bitrate = g_key_file_get_uint64 (state, group, "bitrate", NULL);
+
+  flow->bandwidth = g_key_file_get_uint64 (state, group, "bandwidth", NULL);
+  flow->percentage = g_key_file_get_integer (state, group, "percentage", NULL);
+  flow->in_panic = g_key_file_get_boolean (state, group, "in-panic", NULL);
+  flow->panic_time = g_key_file_get_int64 (state, group, "panic-time", NULL);
+  *stepping = g_key_file_get_boolean (state, group, "stepping", NULL);
+  flow->controller.ssthresh = g_key_file_get_uint64 (state, group, "ssthresh", NULL);
+  flow->controller.integral = g_key_file_get_double (state, group, "integral", NULL);
+  flow->fill_slope = g_key_file_get_double (state, group, "fill-slope", NULL);
+  flow->percentage_time = g_key_file_get_int64 (state, group, "percentage-time", NULL);
+
+  flow->session_start = g_key_file_get_int64 (state, group, "session-start", NULL);
+  flow->panics = g_key_file_get_integer (state, group, "panics", NULL);
+  flow->stable_steps = g_key_file_get_integer (state, group, "stable-steps", NULL);
+  flow->converged_time = g_key_file_get_int64 (state, group, "converged-time", NULL);
+
+  return flow->owner != NULL && flow->stream_id >= 0 &&
+         flow->stream_id < TCMMD_MAX_LINKS * TCMMD_MAX_STREAMS;
+}
+
+gboolean
+tcmmd_policy_restore (GKeyFile *state)
+{
+  TcmmdFlow *saved;
+  TcmmdStreamSpec *streams;
+  int *stream_ids;
+  gboolean *shared, *stepping;
+  guint64 background_rates[TCMMD_MAX_LINKS];
+  gboolean same_controller;
+  gboolean adopted = FALSE;
+  gchar **groups, *name;
+  guint n_saved = 0;
+  guint i;
+
+  g_return_val_if_fail (tcmmd_flow_count () == 0, FALSE);
+
+  if (!g_key_file_has_group (state, STATE_GROUP))
+    return FALSE;
+
+  groups = g_key_file_get_groups (state, NULL);
+  saved = g_new0 (TcmmdFlow, g_strv_length (groups));
+  streams = g_new (TcmmdStreamSpec, g_strv_length (groups));
+  stream_ids = g_new (int, g_strv_length (groups));
+  shared = g_new (gboolean, g_strv_length (groups));
+  stepping = g_new (gboolean, g_strv_length (groups));
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      TcmmdFlow *flow = &saved[n_saved];
+
+      if (!g_str_has_prefix (groups[i], STATE_FLOW_GROUP))
+        continue;
+      if (!read_flow (state, groups[i], flow, &shared[n_saved],
+                      &stepping[n_saved]))
+        {
+          g_printerr ("Invalid saved flow '%s'\n", groups[i]);
+          g_free (flow->owner);
+          goto out;
+        }
+
+      stream_spec_init (&streams[n_saved], &flow->key);
+      streams[n_saved].stream_rate = flow->stream_rate;
+      stream_ids[n_saved] = flow->stream_id;
+      n_saved++;
+    }
+
+  for (i = 0; i < TCMMD_MAX_LINKS; i++)
+    {
+      gchar *group = g_strdup_printf (STATE_LINK_GROUP "%u", i);
+
+      /* a tcmmd which only saved one rate for all the uplinks */
+      if (!g_key_file_has_key (state, group, "background-rate", NULL))
+        background_rates[i] = g_key_file_get_uint64 (state, STATE_GROUP,
+                                                     "background-rate", NULL);
+      else
+        background_rates[i] = g_key_file_get_uint64 (state, group,
+                                                     "background-rate", NULL);
+      g_free (group);
+    }
+
+  /* without flows, the rules were removed */
+  if (n_saved == 0 ||
+      !tcmmdrtnl_adopt (streams, stream_ids, n_saved, background_rates))
+    goto out;
+  adopted = TRUE;
+
+  name = g_key_file_get_string (state, STATE_GROUP, "controller", NULL);
+  same_controller = g_strcmp0 (name, controller->name) == 0;
+  g_free (name);
+
+  for (i = 0; i < TCMMD_MAX_LINKS; i++)
+    {
+      gchar *group = g_strdup_printf (STATE_LINK_GROUP "%u", i);
+
+      bandwidth[i] = background_rates[i];
+      link_capacity[i].capacity = g_key_file_get_uint64 (state, group,
+                                                         "capacity", NULL);
+      link_capacity[i].saturated = g_key_file_get_boolean (state, group,
+                                                           "capacity-saturated",
+                                                           NULL);
+      g_free (group);
+    }
+
+  for (i = 0; i < n_saved; i++)
+    {
+      TcmmdFlow *flow = tcmmd_flow_add (&saved[i].key, saved[i].owner);
+      gchar *owner = flow->owner;
+
+      *flow = saved[i];
+      flow->owner = owner;
+      /* the state of another controller means nothing to this one */
+      if (!same_controller)
+        controller->reset (&controller_params, &flow->controller);
+      if (stepping[i] && !flow->fixed)
+        flow->timeout_id = policy_clock->timeout_add (controller_params.interval,
+                                                     update_bandwidth_cb,
+                                                     flow);
+
+      tcmmd_log (TCMMD_LOG_INFO, "Took over stream %d of %s\n",
+                 flow->stream_id, flow->owner);
+
+      /* the page went away with the previous tcmmd, and the client will
+       * not send its updates anywhere else */
+      if (shared[i])
+        remove_flow (flow);
+    }
+
+  update_background ();
+
+out:
+  for (i = 0; i < n_saved; i++)
+    g_free (saved[i].owner);
+  g_free (saved);
+  g_free (streams);
+  g_free (stream_ids);
+  g_free (shared);
+  g_free (stepping);
+  g_strfreev (groups);
+
+  return adopted;
+}
+
+guint64
+tcmmd_policy_get_absorbed_updates (void)
+{
+  return absorbed_updates;
+}
+
+guint64
+tcmmd_policy_get_background_rate (void)
+{
+  return lowest_background ();
+}
+
+void
+tcmmd_policy_init (const TcmmdController *policy_controller,
+                   const TcmmdControllerParams *params,
+                   const TcmmdPolicyClock *clock)
+{
+  controller = policy_controller;
+  controller_params = *params;
+  policy_clock = clock;
+
+  tcmmd_flow_table_init ();
+}
@@ -0,0 +1,122 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_POLICY_H
+#define __TCMMD_POLICY_H
+
+#include <glib.h>
+
+#include "tcmmd_rtnl.h"
+#include "tcmmd-controller.h"
+#include "tcmmd-flow.h"
+#include "tcmmd-shared.h"
+
+/* What tcmmd does with the SetPolicy, SetFixedPolicy and UnsetPolicy calls:
+ * the flow table, the controller steps and the background class. The rules
+ * are changed with tcmmdrtnl_*.
+ *
+ * Time only comes from the clock given to tcmmd_policy_init(), so that
+ * tcmmd-replay can run the same code on a virtual clock. */
+
+typedef struct {
+  /* monotonic time in microseconds */
+  gint64 (*get_time) (void);
+  guint (*timeout_add) (guint interval, GSourceFunc function, gpointer data);
+  gboolean (*source_remove) (guint id);
+} TcmmdPolicyClock;
+
+/* The clock of the GLib main loop */
+extern const TcmmdPolicyClock tcmmd_policy_main_loop_clock;
+
+void tcmmd_policy_init (const TcmmdController *controller,
+                        const TcmmdControllerParams *params,
+                        const TcmmdPolicyClock *clock);
+
+/* Return whether the flow is installed. A rate the tree did not take is
+ * tried again at the next change. The owner has a single flow: a new tuple
+ * replaces its other flows, which stay installed on failure. Several flows
+ * per owner are for tcmmd_policy_set_many(). */
+gboolean tcmmd_policy_set (const gchar *owner,
+                           const gchar *src_ip_str, guint src_port,
+                           const gchar *dst_ip_str, guint dst_port,
+                           guint bitrate,
+                           gdouble buffer_fill);
+gboolean tcmmd_policy_set_fixed (const gchar *owner,
+                                 const gchar *src_ip_str, guint src_port,
+                                 const gchar *dst_ip_str, guint dst_port,
+                                 guint stream_rate,
+                                 guint background_rate);
+void tcmmd_policy_unset (const gchar *owner);
+
+/* One flow of a ManagedConnections2.SetPolicies batch */
+typedef struct {
+  TcmmdFlowKey key;
+  guint bitrate;
+  gdouble buffer_fill;
+} TcmmdPolicyEntry;
+
+/* SetPolicy for several flows at once. With 'replace', the other flows of
+ * the owner are removed. The rules of the whole batch change in one
+ * transaction: if it fails, none of the entries is applied, the flows of
+ * the owner are kept and FALSE is returned. */
+gboolean tcmmd_policy_set_many (const gchar *owner,
+                                const TcmmdPolicyEntry *entries,
+                                guint n_entries,
+                                gboolean replace);
+/* SetPolicy for one flow, whose later updates come from a shared page
+ * instead of calls. On success, the flow owns the page until it is removed
+ * or gets another page; on failure, the caller keeps it. */
+gboolean tcmmd_policy_set_shared (const gchar *owner,
+                                  const TcmmdFlowKey *key,
+                                  guint bitrate,
+                                  gdouble buffer_fill,
+                                  TcmmdSharedPolicy *page);
+/* Remove some of the flows of an owner */
+void tcmmd_policy_unset_flows (const gchar *owner,
+                               const TcmmdFlowKey *keys,
+                               guint n_keys);
+
+/* Save the flows, their controller state and what was learnt of the link
+ * in a key file, for the next tcmmd to take them over with
+ * tcmmd_policy_restore() */
+void tcmmd_policy_save (GKeyFile *state);
+/* Before any policy: recreate the saved flows, with the rules the previous
+ * tcmmd left installed for them (see tcmmdrtnl_adopt()). The flows of a
+ * shared page are removed, the page went away with it. Returns FALSE, and
+ * restores nothing, if there was no flow or the rules are not there. */
+gboolean tcmmd_policy_restore (GKeyFile *state);
+
+/* Read the stats from the kernel. Every sample also feeds the link capacity
+ * estimation, and the controllers work from the last one: call it every
+ * stats interval. */
+void tcmmd_policy_sample_stats (TcmmdStats *stats);
+
+/* Number of policy updates the input stage coalesced or found unchanged,
+ * which never reached the controller nor the rules */
+guint64 tcmmd_policy_get_absorbed_updates (void);
+
+/* Background rate currently enforced, the lowest of the uplinks, 0 without
+ * any flow */
+guint64 tcmmd_policy_get_background_rate (void);
+/* Lowest buffer fill among the controlled flows, in percent */
+int tcmmd_policy_get_lowest_percentage (void);
+void tcmmd_policy_count_flows (guint32 *flows, guint32 *flows_in_panic);
+
+#endif
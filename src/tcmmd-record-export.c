@@ -0,0 +1,123 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Convert a ring file written by tcmmd --record into the text format of
+ * tcmmd --save-stats, which tests/plot-tcmmd-log.sh reads. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+
+#include "tcmmd-record.h"
+
+static gchar *filename_output;
+static gboolean print_info;
+static gboolean print_counters;
+
+static GOptionEntry option_entries[] =
+{
+  { "output", 'o', 0, G_OPTION_ARG_STRING, &filename_output, "Write to FILE instead of stdout", "FILE" },
+  { "info", 0, 0, G_OPTION_ARG_NONE, &print_info, "Print the header of the ring file on stderr", NULL },
+  { "counters", 0, 0, G_OPTION_ARG_NONE, &print_counters, "Append the other counters, the estimator rates and the flows as extra columns", NULL },
+  { NULL }
+};
+
+#define GETTEXT_PACKAGE "tcmmd"
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  TcmmdRecordHeader header;
+  GArray *records;
+  FILE *out = stdout;
+  guint i;
+
+  context = g_option_context_new ("FILE - export a tcmmd stats record");
+  g_option_context_add_main_entries (context, option_entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_print ("option parsing failed: %s\n", error->message);
+      exit (1);
+    }
+
+  if (argc != 2)
+    {
+      g_printerr ("Usage: %s [OPTION...] FILE\n", argv[0]);
+      exit (1);
+    }
+
+  if (!tcmmd_record_read (argv[1], &header, &records))
+    {
+      g_printerr ("Cannot read record '%s': %s\n", argv[1],
+                  errno == EINVAL ? "not a tcmmd record" : strerror (errno));
+      exit (1);
+    }
+
+  if (print_info)
+    g_printerr ("capacity=%u count=%"G_GUINT64_FORMAT" exported=%u\n",
+                header.capacity, header.count, records->len);
+
+  if (filename_output)
+    {
+      out = fopen (filename_output, "w");
+      if (!out)
+        {
+          g_printerr ("Cannot write to '%s': %s\n", filename_output,
+                      strerror (errno));
+          exit (1);
+        }
+    }
+
+  fprintf (out, "time qdisc_root_bytes qdisc_stream_bytes qdisc_background_bytes background_bandwidth_requested gst_buffer_percent%s\n",
+           print_counters ? " qdisc_ingress_bytes qdisc_stream_drops qdisc_background_drops qdisc_ingress_rate qdisc_root_rate qdisc_stream_rate qdisc_background_rate flows flows_in_panic" : "");
+  for (i = 0; i < records->len; i++)
+    {
+      TcmmdRecord *r = &g_array_index (records, TcmmdRecord, i);
+
+      fprintf (out, "%"G_GINT64_FORMAT".%06"G_GINT64_FORMAT" %"G_GUINT64_FORMAT
+               " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+               " %"G_GUINT64_FORMAT" %d",
+               r->time / G_USEC_PER_SEC, r->time % G_USEC_PER_SEC,
+               r->root_bytes, r->stream_bytes, r->background_bytes,
+               r->background_rate, r->buffer_percent);
+      if (print_counters)
+        fprintf (out, " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                 " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                 " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                 " %"G_GUINT64_FORMAT" %u %u",
+                 r->ingress_bytes, r->stream_drops, r->background_drops,
+                 r->ingress_est_rate, r->root_est_rate, r->stream_est_rate,
+                 r->background_est_rate, r->flows, r->flows_in_panic);
+      fputc ('\n', out);
+    }
+
+  g_array_unref (records);
+  if (out != stdout && fclose (out) != 0)
+    {
+      g_printerr ("Cannot write to '%s': %s\n", filename_output,
+                  strerror (errno));
+      exit (1);
+    }
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "tcmmd-record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+G_STATIC_ASSERT (sizeof (TcmmdRecordHeader) == 64);
+G_STATIC_ASSERT (sizeof (TcmmdRecord) == 128);
+
+struct _TcmmdRecorder {
+  int fd;
+  gsize size;
+  TcmmdRecordHeader *header;
+  TcmmdRecord *records;
+};
+
+static gsize
+record_file_size (guint capacity)
+{
+  return sizeof (TcmmdRecordHeader) + (gsize) capacity * sizeof (TcmmdRecord);
+}
+
+/* Returns NULL with errno set on failure */
+TcmmdRecorder *
+tcmmd_record_create (const gchar *filename, guint capacity)
+{
+  TcmmdRecorder *recorder;
+  void *map;
+  int fd;
+  int saved_errno;
+
+  g_return_val_if_fail (capacity > 0, NULL);
+
+  fd = open (filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return NULL;
+
+  /* allocate the blocks now: a full disk must fail here and not with a
+   * SIGBUS in the middle of a capture */
+  errno = posix_fallocate (fd, 0, record_file_size (capacity));
+  if (errno != 0)
+    goto error;
+
+  map = mmap (NULL, record_file_size (capacity), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto error;
+
+  recorder = g_slice_new0 (TcmmdRecorder);
+  recorder->fd = fd;
+  recorder->size = record_file_size (capacity);
+  recorder->header = map;
+  recorder->records = (TcmmdRecord *) (recorder->header + 1);
+
+  memcpy (recorder->header->magic, TCMMD_RECORD_MAGIC, 8);
+  recorder->header->version = TCMMD_RECORD_VERSION;
+  recorder->header->header_size = sizeof (TcmmdRecordHeader);
+  recorder->header->record_size = sizeof (TcmmdRecord);
+  recorder->header->capacity = capacity;
+  recorder->header->count = 0;
+
+  return recorder;
+
+error:
+  saved_errno = errno;
+  close (fd);
+  errno = saved_errno;
+  return NULL;
+}
+
+void
+tcmmd_record_append (TcmmdRecorder *recorder, const TcmmdRecord *record)
+{
+  TcmmdRecordHeader *header = recorder->header;
+  TcmmdRecord *slot;
+  guint64 n = header->count;
+
+  slot = &recorder->records[n % header->capacity];
+
+  __atomic_store_n (&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  memcpy ((guint8 *) slot + sizeof (slot->seq),
+          (const guint8 *) record + sizeof (record->seq),
+          sizeof (TcmmdRecord) - sizeof (record->seq));
+  __atomic_store_n (&slot->seq, n + 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&header->count, n + 1, __ATOMIC_RELEASE);
+}
+
+void
+tcmmd_record_close (TcmmdRecorder *recorder)
+{
+  munmap (recorder->header, recorder->size);
+  close (recorder->fd);
+  g_slice_free (TcmmdRecorder, recorder);
+}
+
+/* Read the records still in the ring, oldest first. The file may be in use
+ * by a running tcmmd. Returns FALSE with errno set on failure. */
+gboolean
+tcmmd_record_read (const gchar *filename,
+                   TcmmdRecordHeader *header,
+                   GArray **records)
+{
+  struct stat st;
+  const TcmmdRecordHeader *map_header;
+  const TcmmdRecord *slots;
+  void *map;
+  guint64 count, n, first;
+  int fd;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  if (st.st_size < sizeof (TcmmdRecordHeader))
+    {
+      close (fd);
+      errno = EINVAL;
+      return FALSE;
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return FALSE;
+
+  map_header = map;
+  if (memcmp (map_header->magic, TCMMD_RECORD_MAGIC, 8) != 0 ||
+      map_header->version != TCMMD_RECORD_VERSION ||
+      map_header->header_size != sizeof (TcmmdRecordHeader) ||
+      map_header->record_size != sizeof (TcmmdRecord) ||
+      map_header->capacity == 0 ||
+      st.st_size < record_file_size (map_header->capacity))
+    {
+      munmap (map, st.st_size);
+      errno = EINVAL;
+      return FALSE;
+    }
+
+  *header = *map_header;
+  slots = (const TcmmdRecord *) (map_header + 1);
+
+  count = __atomic_load_n (&map_header->count, __ATOMIC_ACQUIRE);
+  first = count > header->capacity ? count - header->capacity : 0;
+
+  *records = g_array_sized_new (FALSE, FALSE, sizeof (TcmmdRecord),
+                                count - first);
+  for (n = first; n < count; n++)
+    {
+      const TcmmdRecord *slot = &slots[n % header->capacity];
+      TcmmdRecord copy;
+
+      if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+        continue;
+      memcpy (&copy, slot, sizeof (TcmmdRecord));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != n + 1)
+        continue;
+
+      g_array_append_val (*records, copy);
+    }
+
+  header->count = count;
+  munmap (map, st.st_size);
+
+  return TRUE;
+}
@@ -0,0 +1,90 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_RECORD_H
+#define __TCMMD_RECORD_H
+
+#include <glib.h>
+
+/* Binary stats recording, see --record.
+ *
+ * The file is a fixed-size ring: a header followed by 'capacity' records.
+ * It is mapped in memory, so appending a sample is a few stores and no
+ * syscall; the kernel writes the dirty pages back on its own schedule.
+ * Fields are in host byte order.
+ *
+ * Record n (counting from 0 since the file was created) is in slot
+ * n % capacity and its 'seq' is n + 1. The writer clears 'seq' before
+ * filling a slot and sets it last, so a reader can copy a slot, check 'seq'
+ * again and drop the records overwritten under its feet.
+ */
+
+#define TCMMD_RECORD_MAGIC "TCMMDREC"
+#define TCMMD_RECORD_VERSION 2
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 header_size;
+  guint32 record_size;
+  guint32 capacity;
+  /* number of records appended so far */
+  guint64 count;
+  guint8 reserved[32];
+} TcmmdRecordHeader;
+
+typedef struct {
+  guint64 seq;
+  /* wall clock time in microseconds */
+  gint64 time;
+
+  /* qdisc counters summed over the uplinks, see tcmmdrtnl_get_stats() */
+  guint64 root_bytes;
+  guint64 stream_bytes;
+  guint64 background_bytes;
+  guint64 ingress_bytes;
+  guint64 stream_drops;
+  guint64 background_drops;
+  /* rate estimators, in bytes per second */
+  guint64 ingress_est_rate;
+  guint64 root_est_rate;
+  guint64 stream_est_rate;
+  guint64 background_est_rate;
+
+  /* controller state */
+  guint64 background_rate;
+  guint32 flows;
+  guint32 flows_in_panic;
+  /* lowest buffer fill of the controlled flows, in percent */
+  gint32 buffer_percent;
+  guint32 reserved[3];
+} TcmmdRecord;
+
+typedef struct _TcmmdRecorder TcmmdRecorder;
+
+TcmmdRecorder *tcmmd_record_create (const gchar *filename, guint capacity);
+void tcmmd_record_append (TcmmdRecorder *recorder, const TcmmdRecord *record);
+void tcmmd_record_close (TcmmdRecorder *recorder);
+
+gboolean tcmmd_record_read (const gchar *filename,
+                            TcmmdRecordHeader *header,
+                            GArray **records);
+
+#endif
@@ -0,0 +1,831 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Replay a trace written by tcmmd --trace through the policy code and a
+ * controller, on a virtual clock and a simulated link, and print how the
+ * controller did.
+ *
+ * Nothing is installed in the kernel: the backend below takes the place of
+ * tcmmd_rtnl.c and drives the link model. The link is shared
+ * fairly between the streams and the background downloads, the background
+ * being capped by the rate of its class. Each stream feeds a player buffer
+ * drained at the declared bitrate.
+ *
+ * By default the loop is closed: the time, flow and bitrate of the policy
+ * calls come from the trace but the buffer fill comes from the simulated
+ * player, so that a different controller sees the consequences of its
+ * decisions. --open-loop feeds the recorded buffer fill instead. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+
+#include "tcmmd-backend.h"
+#include "tcmmd-flow.h"
+#include "tcmmd-policy.h"
+#include "tcmmd-trace.h"
+#include "tcmmd-tracelog.h"
+
+static gchar *controller_name;
+static gchar **controller_tunables;
+static gint64 link_rate;
+static gint64 background_demand;
+static gint64 default_bitrate = 125000;
+static gdouble buffer_seconds = 10.0;
+static gint tick = 100;
+static gboolean open_loop;
+
+static GOptionEntry option_entries[] =
+{
+  { "controller", 0, 0, G_OPTION_ARG_STRING, &controller_name, "Background bandwidth controller: ramp (default), aimd or pid", "NAME" },
+  { "tune", 't', 0, G_OPTION_ARG_STRING_ARRAY, &controller_tunables, "Set a controller tunable, see tcmmd-controller.h (repeatable)", "NAME=VALUE" },
+  { "capacity", 'C', 0, G_OPTION_ARG_INT64, &link_rate, "Link capacity in bytes/s (default: the highest received rate in the trace)", "RATE" },
+  { "background", 'b', 0, G_OPTION_ARG_INT64, &background_demand, "Rate the background downloads would use in bytes/s (default: all they get)", "RATE" },
+  { "bitrate", 0, 0, G_OPTION_ARG_INT64, &default_bitrate, "Bitrate of the streams which did not declare any, in bytes/s (default: 125000)", "RATE" },
+  { "buffer", 0, 0, G_OPTION_ARG_DOUBLE, &buffer_seconds, "Seconds of media in a full player buffer (default: 10)", "SECONDS" },
+  { "tick", 0, 0, G_OPTION_ARG_INT, &tick, "Step of the link model in milliseconds (default: 100)", "MS" },
+  { "open-loop", 0, 0, G_OPTION_ARG_NONE, &open_loop, "Use the buffer fill recorded in the trace", NULL },
+  { "verbosity", 'v', 0, G_OPTION_ARG_INT, (gpointer) &tcmmd_verbosity, "Messages of the policy code, as tcmmd --verbosity (default: 0)", "LEVEL" },
+  { NULL }
+};
+
+#define GETTEXT_PACKAGE "tcmmd"
+
+#define INFINITE_RATE 1e12
+
+/* Virtual clock */
+
+typedef struct {
+  guint id;
+  guint interval;
+  gint64 due;
+  GSourceFunc function;
+  gpointer data;
+} Timer;
+
+static gint64 now;
+static GList *timers;
+static guint last_timer_id;
+
+static gint64
+virtual_get_time (void)
+{
+  return now;
+}
+
+static guint
+virtual_timeout_add (guint interval, GSourceFunc function, gpointer data)
+{
+  Timer *timer = g_new0 (Timer, 1);
+
+  timer->id = ++last_timer_id;
+  timer->interval = interval;
+  timer->due = now + (gint64) interval * 1000;
+  timer->function = function;
+  timer->data = data;
+  timers = g_list_prepend (timers, timer);
+
+  return timer->id;
+}
+
+static Timer *
+lookup_timer (guint id)
+{
+  GList *l;
+
+  for (l = timers; l != NULL; l = l->next)
+    if (((Timer *) l->data)->id == id)
+      return l->data;
+
+  return NULL;
+}
+
+static gboolean
+virtual_source_remove (guint id)
+{
+  Timer *timer = lookup_timer (id);
+
+  if (!timer)
+    return FALSE;
+
+  timers = g_list_remove (timers, timer);
+  g_free (timer);
+  return TRUE;
+}
+
+static const TcmmdPolicyClock virtual_clock = {
+  virtual_get_time,
+  virtual_timeout_add,
+  virtual_source_remove,
+};
+
+static Timer *
+next_timer (void)
+{
+  GList *l;
+  Timer *next = NULL;
+
+  for (l = timers; l != NULL; l = l->next)
+    {
+      Timer *timer = l->data;
+
+      if (!next || timer->due < next->due)
+        next = timer;
+    }
+
+  return next;
+}
+
+/* Simulated rule engine, only the classes matter */
+
+static struct {
+  gboolean used;
+  guint64 rate;
+} streams[TCMMD_MAX_STREAMS];
+static guint n_streams;
+static guint64 background_rate;
+/* tc class changes, what a jittery client costs in the kernel */
+static guint rate_changes;
+
+/* byte counters and last rates of the simulated qdiscs */
+static double stream_bytes;
+static double background_bytes;
+static double stream_rate;
+static double current_background_rate;
+
+/* A stream taking over the class of a removed one only changes its rate */
+static gboolean
+replay_replace_streams (const int *old_ids,
+                        guint n_old,
+                        const TcmmdStreamSpec *specs,
+                        guint n_specs,
+                        const guint64 *background_rates,
+                        int *stream_ids)
+{
+  gboolean freed[TCMMD_MAX_STREAMS] = { FALSE, };
+  gboolean used[TCMMD_MAX_STREAMS];
+  int i;
+  guint j;
+
+  for (i = 0; i < TCMMD_MAX_STREAMS; i++)
+    used[i] = streams[i].used;
+  for (j = 0; j < n_old; j++)
+    {
+      freed[old_ids[j]] = TRUE;
+      used[old_ids[j]] = FALSE;
+    }
+
+  for (j = 0; j < n_specs; j++)
+    {
+      for (i = 0; i < TCMMD_MAX_STREAMS; i++)
+        if (freed[i] && !used[i])
+          break;
+      if (i == TCMMD_MAX_STREAMS)
+        for (i = 0; i < TCMMD_MAX_STREAMS; i++)
+          if (!used[i])
+            break;
+      if (i == TCMMD_MAX_STREAMS)
+        return FALSE;
+      used[i] = TRUE;
+      stream_ids[j] = i;
+    }
+
+  n_streams -= n_old;
+  for (j = 0; j < n_old; j++)
+    streams[old_ids[j]].used = FALSE;
+  for (j = 0; j < n_specs; j++)
+    {
+      if (freed[stream_ids[j]])
+        rate_changes++;
+      streams[stream_ids[j]].used = TRUE;
+      streams[stream_ids[j]].rate = specs[j].stream_rate;
+    }
+  if (n_streams == 0 && n_specs > 0)
+    background_rate = background_rates[0];
+  n_streams += n_specs;
+
+  return TRUE;
+}
+
+static void
+replay_del_stream (int stream_id)
+{
+  streams[stream_id].used = FALSE;
+  n_streams--;
+}
+
+static gint64
+replay_update_rate (TcmmdClass class_id,
+                       int stream_id,
+                       guint64 rate,
+                       guint64 ceil)
+{
+  rate_changes++;
+  if (class_id == TCMMD_CLASS_STREAM)
+    streams[stream_id].rate = rate;
+  else
+    background_rate = rate;
+
+  return 0;
+}
+
+/* the simulated link is uplink 0 */
+static void
+replay_get_stats (TcmmdStats *link_stats)
+{
+  TcmmdStats *stats = &link_stats[0];
+
+  memset (link_stats, 0, TCMMD_MAX_LINKS * sizeof (TcmmdStats));
+  stats->qdisc_ingress_bytes = stream_bytes + background_bytes;
+  stats->qdisc_ingress_rate = stream_rate + current_background_rate;
+  stats->qdisc_root_bytes = stats->qdisc_ingress_bytes;
+  stats->qdisc_root_rate = stats->qdisc_ingress_rate;
+  stats->qdisc_stream_bytes = stream_bytes;
+  stats->qdisc_stream_rate = stream_rate;
+  stats->qdisc_background_bytes = background_bytes;
+  stats->qdisc_background_rate = current_background_rate;
+}
+
+static void
+replay_init (const char * const *link_names)
+{
+}
+
+static void
+replay_set_classifier (TcmmdClassifier classifier)
+{
+}
+
+static void
+replay_set_direction (TcmmdDirection direction)
+{
+}
+
+static void
+replay_nop (void)
+{
+}
+
+/* a replay starts without any tree */
+static gboolean
+replay_adopt (const TcmmdStreamSpec *specs,
+              const int *stream_ids,
+              guint n_specs,
+              const guint64 *background_rates)
+{
+  return FALSE;
+}
+
+static const TcmmdBackend replay_backend = {
+  "replay",
+  replay_init,
+  replay_nop,
+  replay_adopt,
+  replay_nop,
+  replay_nop,
+  replay_set_classifier,
+  replay_set_direction,
+  replay_replace_streams,
+  replay_del_stream,
+  replay_update_rate,
+  replay_get_stats,
+};
+
+/* Players */
+
+typedef struct {
+  /* "src sport dst dport" as in the policy calls */
+  gchar *name;
+  gchar owner[256];
+  TcmmdFlowKey key;
+  double bitrate;
+  /* seconds of media in the buffer */
+  double level;
+
+  gboolean in_panic;
+  gint64 panic_start;
+} Player;
+
+static GHashTable *players;
+
+static struct {
+  guint policies;
+  guint panics;
+  guint recovered;
+  gint64 recover_total;
+  gint64 recover_max;
+  double stall;
+} results;
+
+static Player *
+lookup_player (const TcmmdTraceEvent *event, gboolean create)
+{
+  gchar *name;
+  Player *player;
+
+  name = g_strdup_printf ("%s %u %s %u", event->src_ip, event->src_port,
+                          event->dst_ip, event->dst_port);
+  player = g_hash_table_lookup (players, name);
+  if (player || !create)
+    {
+      g_free (name);
+      return player;
+    }
+
+  player = g_new0 (Player, 1);
+  if (!tcmmd_flow_key_init (&player->key, event->src_ip, event->src_port,
+                            event->dst_ip, event->dst_port))
+    {
+      g_free (player);
+      g_free (name);
+      return NULL;
+    }
+  player->name = name;
+  g_strlcpy (player->owner, event->owner, sizeof (player->owner));
+  player->level = event->buffer_fill * buffer_seconds;
+  g_hash_table_insert (players, player->name, player);
+
+  return player;
+}
+
+static void
+free_player (gpointer data)
+{
+  Player *player = data;
+
+  g_free (player->name);
+  g_free (player);
+}
+
+static TcmmdFlow *
+player_flow (Player *player)
+{
+  return tcmmd_flow_lookup (&player->key);
+}
+
+/* Count the panics from the state of the flow after each policy call */
+static void
+check_panic (Player *player)
+{
+  TcmmdFlow *flow = player_flow (player);
+  gboolean in_panic = flow && flow->in_panic;
+  gint64 duration;
+
+  if (in_panic && !player->in_panic)
+    {
+      results.panics++;
+      player->panic_start = now;
+    }
+  else if (!in_panic && player->in_panic && flow)
+    {
+      duration = now - player->panic_start;
+      results.recovered++;
+      results.recover_total += duration;
+      results.recover_max = MAX (results.recover_max, duration);
+    }
+
+  player->in_panic = in_panic;
+}
+
+/* Share 'capacity' fairly between flows wanting at most demand[i], the
+ * unused share of a flow going to the others. */
+static void
+share_link (double capacity, const double *demand, double *got, guint n)
+{
+  gboolean *done = g_new0 (gboolean, n);
+  guint left = n;
+  guint i;
+
+  while (left > 0 && capacity > 0)
+    {
+      double share = capacity / left;
+      gboolean capped = FALSE;
+
+      for (i = 0; i < n; i++)
+        if (!done[i] && demand[i] <= share)
+          {
+            got[i] = demand[i];
+            capacity -= demand[i];
+            done[i] = TRUE;
+            left--;
+            capped = TRUE;
+          }
+
+      if (!capped)
+        {
+          for (i = 0; i < n; i++)
+            if (!done[i])
+              got[i] = share;
+          break;
+        }
+    }
+
+  g_free (done);
+}
+
+/* Move the link and the players forward by dt seconds */
+static void
+simulate_link (double dt)
+{
+  GHashTableIter iter;
+  gpointer value;
+  Player **list;
+  double *demand, *got;
+  guint n, i;
+
+  if (dt <= 0)
+    return;
+
+  /* the background is the last flow */
+  n = g_hash_table_size (players);
+  list = g_new0 (Player *, n);
+  demand = g_new0 (double, n + 1);
+  got = g_new0 (double, n + 1);
+
+  i = 0;
+  g_hash_table_iter_init (&iter, players);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Player *player = value;
+      TcmmdFlow *flow = player_flow (player);
+
+      list[i] = player;
+      /* a full player only downloads what it plays */
+      demand[i] = player->level < buffer_seconds ? INFINITE_RATE
+                                                 : player->bitrate;
+      if (flow && flow->stream_id >= 0)
+        demand[i] = MIN (demand[i], streams[flow->stream_id].rate);
+      i++;
+    }
+
+  demand[n] = background_demand > 0 ? background_demand : INFINITE_RATE;
+  if (n_streams > 0)
+    demand[n] = MIN (demand[n], background_rate);
+
+  share_link (link_rate, demand, got, n + 1);
+
+  stream_rate = 0;
+  for (i = 0; i < n; i++)
+    {
+      Player *player = list[i];
+
+      stream_rate += got[i];
+      player->level += (got[i] / player->bitrate - 1.0) * dt;
+      if (player->level < 0)
+        {
+          results.stall += -player->level;
+          player->level = 0;
+        }
+      player->level = MIN (player->level, buffer_seconds);
+    }
+  current_background_rate = got[n];
+  stream_bytes += stream_rate * dt;
+  background_bytes += current_background_rate * dt;
+
+  g_free (list);
+  g_free (demand);
+  g_free (got);
+}
+
+/* Run the link and the controller timers up to 'time' */
+static void
+advance (gint64 time)
+{
+  while (now < time)
+    {
+      gint64 next = MIN (time, now + (gint64) tick * 1000);
+      Timer *timer = next_timer ();
+
+      if (timer && timer->due < next)
+        next = MAX (timer->due, now);
+
+      simulate_link ((next - now) / (double) G_USEC_PER_SEC);
+      now = next;
+
+      while ((timer = next_timer ()) != NULL && timer->due <= now)
+        {
+          guint id = timer->id;
+
+          if (timer->function (timer->data))
+            {
+              /* the callback may have removed its own timer */
+              if ((timer = lookup_timer (id)) != NULL)
+                timer->due += (gint64) timer->interval * 1000;
+            }
+          else
+            virtual_source_remove (id);
+        }
+    }
+}
+
+static void
+replay_policy (const TcmmdTraceEvent *event)
+{
+  Player *player;
+  TcmmdPolicyEntry entry;
+
+  results.policies++;
+
+  player = lookup_player (event, TRUE);
+  if (!player)
+    {
+      g_printerr ("Invalid addresses '%s' and '%s', policy ignored\n",
+                  event->src_ip, event->dst_ip);
+      return;
+    }
+
+  player->bitrate = event->bitrate ? event->bitrate / 8.0 : default_bitrate;
+
+  if (event->type == TCMMD_TRACE_FIXED_POLICY)
+    {
+      tcmmd_policy_set_fixed (event->owner,
+                              event->src_ip, event->src_port,
+                              event->dst_ip, event->dst_port,
+                              event->stream_rate, event->background_rate);
+      check_panic (player);
+      return;
+    }
+
+  /* a policy event is a SetPolicy call, or one entry of a SetPolicies
+   * batch: the flows a call replaced were traced as removed before it, so
+   * the owner keeps its other flows here */
+  entry.key = player->key;
+  entry.bitrate = event->bitrate;
+  entry.buffer_fill = open_loop ? event->buffer_fill
+                                : player->level / buffer_seconds;
+  tcmmd_policy_set_many (event->owner, &entry, 1, FALSE);
+  check_panic (player);
+}
+
+static gboolean
+is_owned_by (gpointer key, gpointer value, gpointer owner)
+{
+  return g_strcmp0 (((Player *) value)->owner, owner) == 0;
+}
+
+static void
+replay_unset (const TcmmdTraceEvent *event)
+{
+  tcmmd_policy_unset (event->owner);
+  g_hash_table_foreach_remove (players, is_owned_by, (gpointer) event->owner);
+}
+
+static void
+replay_unset_flow (const TcmmdTraceEvent *event)
+{
+  Player *player = lookup_player (event, FALSE);
+
+  if (!player)
+    return;
+
+  tcmmd_policy_unset_flows (event->owner, &player->key, 1);
+  g_hash_table_remove (players, player->name);
+}
+
+/* Highest received rate between two stats samples at least half a second
+ * apart, as tcmmd would learn it */
+static guint64
+trace_capacity (GArray *events)
+{
+  const TcmmdTraceEvent *previous = NULL;
+  guint64 capacity = 0;
+  guint i;
+
+  for (i = 0; i < events->len; i++)
+    {
+      const TcmmdTraceEvent *event = &g_array_index (events, TcmmdTraceEvent, i);
+
+      if (event->type != TCMMD_TRACE_STATS)
+        continue;
+
+      if (previous && event->time - previous->time >= G_USEC_PER_SEC / 2 &&
+          event->stats.qdisc_ingress_bytes >= previous->stats.qdisc_ingress_bytes)
+        capacity = MAX (capacity, (event->stats.qdisc_ingress_bytes -
+                                   previous->stats.qdisc_ingress_bytes) *
+                                  (double) G_USEC_PER_SEC /
+                                  (event->time - previous->time));
+      if (!previous || event->time - previous->time >= G_USEC_PER_SEC / 2)
+        previous = event;
+    }
+
+  return capacity;
+}
+
+/* Background rate recorded in the trace, to compare with the simulated one,
+ * or -1 without stats */
+static double
+trace_background_rate (GArray *events)
+{
+  const TcmmdTraceEvent *first = NULL, *last = NULL;
+  guint i;
+
+  for (i = 0; i < events->len; i++)
+    {
+      const TcmmdTraceEvent *event = &g_array_index (events, TcmmdTraceEvent, i);
+
+      if (event->type != TCMMD_TRACE_STATS)
+        continue;
+      if (!first)
+        first = event;
+      last = event;
+    }
+
+  if (!first || last->time <= first->time)
+    return -1;
+
+  return (last->stats.qdisc_background_bytes -
+          first->stats.qdisc_background_bytes) *
+         (double) G_USEC_PER_SEC / (last->time - first->time);
+}
+
+static GArray *
+read_trace (const gchar *filename)
+{
+  TcmmdTraceEvent event;
+  GArray *events;
+  FILE *file;
+  guint line = 0;
+  int ret;
+
+  file = fopen (filename, "r");
+  if (!file)
+    {
+      g_printerr ("Cannot read '%s': %s\n", filename, strerror (errno));
+      exit (1);
+    }
+
+  events = g_array_new (FALSE, FALSE, sizeof (TcmmdTraceEvent));
+  while ((ret = tcmmd_tracelog_read (file, &event, &line)) != 0)
+    {
+      if (ret < 0)
+        {
+          g_printerr ("%s:%u: malformed event\n", filename, line);
+          exit (1);
+        }
+      if (events->len > 0 &&
+          event.time < g_array_index (events, TcmmdTraceEvent,
+                                      events->len - 1).time)
+        {
+          g_printerr ("%s:%u: event out of order\n", filename, line);
+          exit (1);
+        }
+      g_array_append_val (events, event);
+    }
+  fclose (file);
+
+  if (events->len == 0)
+    {
+      g_printerr ("%s: empty trace\n", filename);
+      exit (1);
+    }
+
+  return events;
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  const TcmmdController *controller;
+  TcmmdControllerParams params;
+  GArray *events;
+  TcmmdStats stats;
+  gint64 start, duration;
+  double recorded_rate;
+  GList *l;
+  guint i;
+
+  tcmmd_verbosity = TCMMD_LOG_QUIET;
+
+  context = g_option_context_new ("TRACE - replay a tcmmd trace on a simulated link");
+  g_option_context_add_main_entries (context, option_entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_print ("option parsing failed: %s\n", error->message);
+      exit (1);
+    }
+
+  if (argc != 2)
+    {
+      g_printerr ("Usage: %s [OPTION...] TRACE\n", argv[0]);
+      exit (1);
+    }
+
+  tcmmd_controller_params_init (&params);
+  if (controller_tunables)
+    {
+      gchar **tunable;
+
+      for (tunable = controller_tunables; *tunable; tunable++)
+        if (!tcmmd_controller_params_parse (&params, *tunable))
+          {
+            g_printerr ("Invalid controller tunable '%s'\n", *tunable);
+            exit (1);
+          }
+    }
+
+  controller = tcmmd_controller_lookup (controller_name ? controller_name : "ramp");
+  if (!controller)
+    {
+      g_printerr ("Unknown controller '%s'\n", controller_name);
+      exit (1);
+    }
+
+  if (params.interval == 0 || params.min_rate > params.max_rate ||
+      tick <= 0 || buffer_seconds <= 0 || default_bitrate <= 0)
+    {
+      g_printerr ("Invalid parameters\n");
+      exit (1);
+    }
+
+  events = read_trace (argv[1]);
+
+  if (link_rate <= 0)
+    link_rate = trace_capacity (events);
+  if (link_rate <= 0)
+    {
+      g_printerr ("No stats in the trace to learn the link capacity from, "
+                  "use --capacity\n");
+      exit (1);
+    }
+
+  players = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free_player);
+  start = now = g_array_index (events, TcmmdTraceEvent, 0).time;
+  tcmmd_backend_set (&replay_backend);
+  tcmmd_policy_init (controller, &params, &virtual_clock);
+
+  for (i = 0; i < events->len; i++)
+    {
+      const TcmmdTraceEvent *event = &g_array_index (events, TcmmdTraceEvent, i);
+
+      advance (event->time);
+
+      switch (event->type)
+        {
+          case TCMMD_TRACE_POLICY:
+          case TCMMD_TRACE_FIXED_POLICY:
+            replay_policy (event);
+            break;
+          case TCMMD_TRACE_UNSET_POLICY:
+            replay_unset (event);
+            break;
+          case TCMMD_TRACE_UNSET_FLOW:
+            replay_unset_flow (event);
+            break;
+          case TCMMD_TRACE_STATS:
+            /* sampled when tcmmd did, but from the simulated link */
+            tcmmd_policy_sample_stats (&stats);
+            break;
+        }
+    }
+
+  duration = now - start;
+  recorded_rate = trace_background_rate (events);
+
+  g_print ("controller=%s loop=%s duration=%.1fs policies=%u absorbed=%"
+           G_GUINT64_FORMAT" rate_changes=%u capacity=%"G_GINT64_FORMAT"\n",
+           controller->name, open_loop ? "open" : "closed",
+           duration / (double) G_USEC_PER_SEC, results.policies,
+           tcmmd_policy_get_absorbed_updates (), rate_changes, link_rate);
+  g_print ("panics=%u recovered=%u recover_mean=%.1fs recover_max=%.1fs "
+           "stall=%.1fs\n",
+           results.panics, results.recovered,
+           results.recovered ? results.recover_total / (double) results.recovered /
+                               G_USEC_PER_SEC : 0.0,
+           results.recover_max / (double) G_USEC_PER_SEC, results.stall);
+  g_print ("background_rate=%.0f stream_rate=%.0f utilisation=%.2f",
+           duration ? background_bytes * G_USEC_PER_SEC / duration : 0.0,
+           duration ? stream_bytes * G_USEC_PER_SEC / duration : 0.0,
+           duration ? (background_bytes + stream_bytes) * G_USEC_PER_SEC /
+                      duration / link_rate : 0.0);
+  if (recorded_rate >= 0)
+    g_print (" recorded_background_rate=%.0f", recorded_rate);
+  g_print ("\n");
+
+  for (l = timers; l != NULL; l = l->next)
+    g_free (l->data);
+  g_list_free (timers);
+  g_hash_table_unref (players);
+  g_array_unref (events);
+
+  return 0;
+}
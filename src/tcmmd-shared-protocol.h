@@ -0,0 +1,97 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_SHARED_PROTOCOL_H
+#define __TCMMD_SHARED_PROTOCOL_H
+
+#include <errno.h>
+#include <stdint.h>
+
+/* Layout of the shared policy page returned by
+ * ManagedConnections2.SetSharedPolicy: a memfd which the client maps
+ * read-write and where it writes the bitrate and buffer fill of its flow,
+ * as often as it likes and without any message. tcmmd reads it every
+ * shared-interval milliseconds (see tcmmd-controller.h) and handles a new
+ * value like a SetPolicy call.
+ *
+ * The fields are protected by a seqlock: the client, the only writer, makes
+ * 'seq' odd while it changes them. Use the functions below on both sides. */
+
+#define TCMMD_SHARED_MAGIC 0x74636d6d /* "tcmm" */
+#define TCMMD_SHARED_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  /* as in SetPolicy: bits per second and 0.0 to 1.0 */
+  uint32_t bitrate;
+  double buffer_fill;
+} TcmmdSharedPolicy;
+
+/* a reader gives up after this many torn reads */
+#define TCMMD_SHARED_READ_TRIES 16
+
+static inline void
+tcmmd_shared_policy_write (TcmmdSharedPolicy *page,
+                           uint32_t bitrate,
+                           double buffer_fill)
+{
+  uint32_t seq = __atomic_load_n (&page->seq, __ATOMIC_RELAXED);
+
+  __atomic_store_n (&page->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  __atomic_store_n (&page->bitrate, bitrate, __ATOMIC_RELAXED);
+  __atomic_store (&page->buffer_fill, &buffer_fill, __ATOMIC_RELAXED);
+  __atomic_store_n (&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Returns 0 and the sequence number of the values read, which changes at
+ * every write, or -EAGAIN if the writer kept changing them. */
+static inline int
+tcmmd_shared_policy_read (const TcmmdSharedPolicy *page,
+                          uint32_t *seq,
+                          uint32_t *bitrate,
+                          double *buffer_fill)
+{
+  int i;
+
+  for (i = 0; i < TCMMD_SHARED_READ_TRIES; i++)
+    {
+      uint32_t begin = __atomic_load_n (&page->seq, __ATOMIC_ACQUIRE);
+
+      if (begin & 1)
+        continue;
+
+      *bitrate = __atomic_load_n (&page->bitrate, __ATOMIC_RELAXED);
+      __atomic_load (&page->buffer_fill, buffer_fill, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+      if (__atomic_load_n (&page->seq, __ATOMIC_RELAXED) == begin)
+        {
+          *seq = begin;
+          return 0;
+        }
+    }
+
+  return -EAGAIN;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE /* memfd_create */
+
+#include "tcmmd-shared.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+TcmmdSharedPolicy *
+tcmmd_shared_policy_new (guint bitrate,
+                         gdouble buffer_fill,
+                         int *fd)
+{
+  TcmmdSharedPolicy *page;
+  int saved_errno;
+
+  *fd = memfd_create ("tcmmd-policy", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (*fd < 0)
+    return NULL;
+
+  if (ftruncate (*fd, sizeof (TcmmdSharedPolicy)) < 0 ||
+      fcntl (*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    goto error;
+
+  page = mmap (NULL, sizeof (TcmmdSharedPolicy), PROT_READ | PROT_WRITE,
+               MAP_SHARED, *fd, 0);
+  if (page == MAP_FAILED)
+    goto error;
+
+  page->magic = TCMMD_SHARED_MAGIC;
+  page->version = TCMMD_SHARED_VERSION;
+  tcmmd_shared_policy_write (page, bitrate, buffer_fill);
+
+  return page;
+
+error:
+  saved_errno = errno;
+  close (*fd);
+  errno = saved_errno;
+  return NULL;
+}
+
+void
+tcmmd_shared_policy_free (TcmmdSharedPolicy *page)
+{
+  munmap (page, sizeof (TcmmdSharedPolicy));
+}
@@ -0,0 +1,37 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_SHARED_H
+#define __TCMMD_SHARED_H
+
+#include <glib.h>
+
+#include "tcmmd-shared-protocol.h"
+
+/* Create a shared policy page holding the given values, see
+ * tcmmd-shared-protocol.h. The memfd is sealed against resizing, so that the
+ * client cannot make tcmmd fault by truncating it. Returns NULL with errno
+ * set on failure; otherwise the caller owns the mapping and *fd. */
+TcmmdSharedPolicy *tcmmd_shared_policy_new (guint bitrate,
+                                            gdouble buffer_fill,
+                                            int *fd);
+void tcmmd_shared_policy_free (TcmmdSharedPolicy *page);
+
+#endif
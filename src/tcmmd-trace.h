@@ -0,0 +1,96 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_TRACE_H
+#define __TCMMD_TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+/* Static tracepoints (USDT) in the provider "tcmmd". When systemtap's
+ * sys/sdt.h is available, each probe is a single nop until a tracer
+ * attaches, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/tcmmd:tcmmd:panic_enter { printf("%d\n", arg0); }'
+ *   perf probe -x /usr/bin/tcmmd sdt_tcmmd:bandwidth_changed
+ *
+ * Without it, the probes compile to nothing.
+ *
+ * Probes and arguments:
+ *   policy_received       owner, src, sport, dst, dport, buffer percent
+ *   fixed_policy_received owner, src, sport, dst, dport, stream rate
+ *   policies_received     owner, number of flows, replace
+ *   shared_policy_read    stream id, bitrate, buffer percent
+ *   panic_enter           stream id, buffer percent
+ *   panic_exit            stream id, buffer percent
+ *   bandwidth_changed     stream id, old rate, new rate
+ *   background_changed    old rate, new rate
+ *   rules_install_start   stream id, family
+ *   rules_install_end     stream id
+ *   rules_remove_start    stream id
+ *   rules_remove_end      stream id
+ *   qdisc_stats           handle, packets, bytes, drops, overlimits, backlog
+ *   stats_sampled         root bytes, stream bytes, background bytes
+ *   session_end           stream id, duration ms, panics, convergence ms
+ *                         (-1 if the rate never settled)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TCMMD_TRACE(name) DTRACE_PROBE (tcmmd, name)
+#define TCMMD_TRACE1(name, a) DTRACE_PROBE1 (tcmmd, name, a)
+#define TCMMD_TRACE2(name, a, b) DTRACE_PROBE2 (tcmmd, name, a, b)
+#define TCMMD_TRACE3(name, a, b, c) DTRACE_PROBE3 (tcmmd, name, a, b, c)
+#define TCMMD_TRACE4(name, a, b, c, d) DTRACE_PROBE4 (tcmmd, name, a, b, c, d)
+#define TCMMD_TRACE6(name, a, b, c, d, e, f) \
+  DTRACE_PROBE6 (tcmmd, name, a, b, c, d, e, f)
+#else
+#define TCMMD_TRACE(name) G_STMT_START { } G_STMT_END
+#define TCMMD_TRACE1(name, a) G_STMT_START { } G_STMT_END
+#define TCMMD_TRACE2(name, a, b) G_STMT_START { } G_STMT_END
+#define TCMMD_TRACE3(name, a, b, c) G_STMT_START { } G_STMT_END
+#define TCMMD_TRACE4(name, a, b, c, d) G_STMT_START { } G_STMT_END
+#define TCMMD_TRACE6(name, a, b, c, d, e, f) G_STMT_START { } G_STMT_END
+#endif
+
+/* Verbosity of the messages on stdout, see --verbosity. Errors always go
+ * to stderr. */
+typedef enum {
+  TCMMD_LOG_QUIET = 0,
+  /* setup, teardown, streams added and removed */
+  TCMMD_LOG_INFO = 1,
+  /* every D-Bus call and controller step */
+  TCMMD_LOG_DEBUG = 2,
+  /* every qdisc of every stats sample */
+  TCMMD_LOG_STATS = 3,
+} TcmmdLogLevel;
+
+extern volatile int tcmmd_verbosity;
+
+#define tcmmd_log(level, ...) \
+  G_STMT_START { \
+    if (G_UNLIKELY (tcmmd_verbosity >= (level))) \
+      g_print (__VA_ARGS__); \
+  } G_STMT_END
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "tcmmd-tracelog.h"
+
+#include <string.h>
+
+#define TRACELOG_LINE_MAX 1024
+
+FILE *
+tcmmd_tracelog_create (const gchar *filename)
+{
+  FILE *file;
+
+  file = fopen (filename, "w");
+  if (!file)
+    return NULL;
+
+  fprintf (file, "# tcmmd trace, see tcmmd-tracelog.h\n");
+  fflush (file);
+
+  return file;
+}
+
+/* Write one field, keeping the line parsable whatever the client sent */
+static void
+write_token (FILE *file, const gchar *token)
+{
+  const gchar *c;
+
+  fputc (' ', file);
+  if (token[0] == '\0')
+    {
+      fputc ('-', file);
+      return;
+    }
+
+  for (c = token; *c; c++)
+    fputc (g_ascii_isspace (*c) || *c == '#' ? '_' : *c, file);
+}
+
+static void
+write_flow (FILE *file, const TcmmdTraceEvent *event)
+{
+  write_token (file, event->owner);
+  write_token (file, event->src_ip);
+  fprintf (file, " %u", event->src_port);
+  write_token (file, event->dst_ip);
+  fprintf (file, " %u", event->dst_port);
+}
+
+void
+tcmmd_tracelog_write (FILE *file, const TcmmdTraceEvent *event)
+{
+  gchar fill[G_ASCII_DTOSTR_BUF_SIZE];
+
+  fprintf (file, "%"G_GINT64_FORMAT, event->time);
+
+  switch (event->type)
+    {
+      case TCMMD_TRACE_POLICY:
+        fprintf (file, " policy");
+        write_flow (file, event);
+        fprintf (file, " %u %s\n", event->bitrate,
+                 g_ascii_dtostr (fill, sizeof (fill), event->buffer_fill));
+        break;
+      case TCMMD_TRACE_FIXED_POLICY:
+        fprintf (file, " fixed");
+        write_flow (file, event);
+        fprintf (file, " %u %u\n", event->stream_rate, event->background_rate);
+        break;
+      case TCMMD_TRACE_UNSET_POLICY:
+        fprintf (file, " unset");
+        write_token (file, event->owner);
+        fputc ('\n', file);
+        break;
+      case TCMMD_TRACE_UNSET_FLOW:
+        fprintf (file, " unset-flow");
+        write_flow (file, event);
+        fputc ('\n', file);
+        break;
+      case TCMMD_TRACE_STATS:
+        fprintf (file, " stats %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                 " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+                 " %"G_GUINT64_FORMAT"\n",
+                 event->stats.qdisc_ingress_bytes,
+                 event->stats.qdisc_root_bytes,
+                 event->stats.qdisc_stream_bytes,
+                 event->stats.qdisc_background_bytes,
+                 event->enforced_rate);
+        break;
+    }
+
+  /* the daemon may be killed at any time: keep every event */
+  fflush (file);
+}
+
+static gboolean
+parse_uint64 (const gchar *str, guint64 *value)
+{
+  gchar *end;
+
+  *value = g_ascii_strtoull (str, &end, 10);
+  return end != str && *end == '\0';
+}
+
+static gboolean
+parse_uint (const gchar *str, guint *value)
+{
+  guint64 v;
+
+  if (!parse_uint64 (str, &v) || v > G_MAXUINT)
+    return FALSE;
+  *value = v;
+  return TRUE;
+}
+
+static gboolean
+parse_string (const gchar *str, gchar *value, gsize size)
+{
+  if (strcmp (str, "-") == 0)
+    str = "";
+  return g_strlcpy (value, str, size) < size;
+}
+
+static gboolean
+parse_flow (gchar **fields, TcmmdTraceEvent *event)
+{
+  return parse_string (fields[2], event->owner, sizeof (event->owner)) &&
+         parse_string (fields[3], event->src_ip, sizeof (event->src_ip)) &&
+         parse_uint (fields[4], &event->src_port) &&
+         parse_string (fields[5], event->dst_ip, sizeof (event->dst_ip)) &&
+         parse_uint (fields[6], &event->dst_port);
+}
+
+static gboolean
+parse_event (gchar **fields, TcmmdTraceEvent *event)
+{
+  guint n = g_strv_length (fields);
+  guint64 time;
+  gchar *end;
+
+  memset (event, 0, sizeof (*event));
+
+  if (n < 2 || !parse_uint64 (fields[0], &time))
+    return FALSE;
+  event->time = time;
+
+  if (strcmp (fields[1], "policy") == 0 && n == 9)
+    {
+      event->type = TCMMD_TRACE_POLICY;
+      event->buffer_fill = g_ascii_strtod (fields[8], &end);
+      return parse_flow (fields, event) &&
+             parse_uint (fields[7], &event->bitrate) &&
+             end != fields[8] && *end == '\0';
+    }
+  else if (strcmp (fields[1], "fixed") == 0 && n == 9)
+    {
+      event->type = TCMMD_TRACE_FIXED_POLICY;
+      return parse_flow (fields, event) &&
+             parse_uint (fields[7], &event->stream_rate) &&
+             parse_uint (fields[8], &event->background_rate);
+    }
+  else if (strcmp (fields[1], "unset") == 0 && n == 3)
+    {
+      event->type = TCMMD_TRACE_UNSET_POLICY;
+      return parse_string (fields[2], event->owner, sizeof (event->owner));
+    }
+  else if (strcmp (fields[1], "unset-flow") == 0 && n == 7)
+    {
+      event->type = TCMMD_TRACE_UNSET_FLOW;
+      return parse_flow (fields, event);
+    }
+  else if (strcmp (fields[1], "stats") == 0 && n == 7)
+    {
+      event->type = TCMMD_TRACE_STATS;
+      return parse_uint64 (fields[2], &event->stats.qdisc_ingress_bytes) &&
+             parse_uint64 (fields[3], &event->stats.qdisc_root_bytes) &&
+             parse_uint64 (fields[4], &event->stats.qdisc_stream_bytes) &&
+             parse_uint64 (fields[5], &event->stats.qdisc_background_bytes) &&
+             parse_uint64 (fields[6], &event->enforced_rate);
+    }
+
+  return FALSE;
+}
+
+int
+tcmmd_tracelog_read (FILE *file, TcmmdTraceEvent *event, guint *line)
+{
+  gchar buffer[TRACELOG_LINE_MAX];
+  gchar **fields;
+  gboolean valid;
+
+  do
+    {
+      if (!fgets (buffer, sizeof (buffer), file))
+        return 0;
+      (*line)++;
+      g_strstrip (buffer);
+    }
+  while (buffer[0] == '\0' || buffer[0] == '#');
+
+  fields = g_strsplit (buffer, " ", 0);
+  valid = parse_event (fields, event);
+  g_strfreev (fields);
+
+  return valid ? 1 : -1;
+}
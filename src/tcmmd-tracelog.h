@@ -0,0 +1,83 @@
+/*
+ * tcmmd - traffic control multimedia daemon
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __TCMMD_TRACELOG_H
+#define __TCMMD_TRACELOG_H
+
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "tcmmd_rtnl.h"
+
+/* Trace of the policy calls and stats samples of a session, written by
+ * tcmmd --trace and read by tcmmd-replay. A text file, one event per line:
+ *
+ *   TIME policy OWNER SRC SPORT DST DPORT BITRATE BUFFER_FILL
+ *   TIME fixed OWNER SRC SPORT DST DPORT STREAM_RATE BACKGROUND_RATE
+ *   TIME unset OWNER
+ *   TIME unset-flow OWNER SRC SPORT DST DPORT
+ *   TIME stats INGRESS_BYTES ROOT_BYTES STREAM_BYTES BACKGROUND_BYTES RATE
+ *
+ * TIME is the monotonic time in microseconds and an empty address is '-'.
+ * The arguments are the ones of the D-Bus calls; RATE is the background
+ * rate enforced when the stats were sampled. The ManagedConnections2 calls
+ * are traced as one policy line per flow, and unset-flow lines for the flows
+ * they remove. Lines starting with '#' are comments. */
+
+typedef enum {
+  TCMMD_TRACE_POLICY,
+  TCMMD_TRACE_FIXED_POLICY,
+  TCMMD_TRACE_UNSET_POLICY,
+  TCMMD_TRACE_UNSET_FLOW,
+  TCMMD_TRACE_STATS,
+} TcmmdTraceEventType;
+
+typedef struct {
+  TcmmdTraceEventType type;
+  gint64 time;
+
+  /* policy calls. D-Bus names are at most 255 bytes. */
+  gchar owner[256];
+  gchar src_ip[INET6_ADDRSTRLEN];
+  gchar dst_ip[INET6_ADDRSTRLEN];
+  guint src_port;
+  guint dst_port;
+  /* SetPolicy */
+  guint bitrate;
+  gdouble buffer_fill;
+  /* SetFixedPolicy */
+  guint stream_rate;
+  guint background_rate;
+
+  /* stats samples, only the byte counters are traced */
+  TcmmdStats stats;
+  guint64 enforced_rate;
+} TcmmdTraceEvent;
+
+/* Returns NULL and sets errno on failure */
+FILE *tcmmd_tracelog_create (const gchar *filename);
+void tcmmd_tracelog_write (FILE *file, const TcmmdTraceEvent *event);
+
+/* Read the next event. Returns 1, 0 at the end of the file, or -1 if the
+ * line is malformed; *line is incremented for every line read. */
+int tcmmd_tracelog_read (FILE *file, TcmmdTraceEvent *event, guint *line);
+
+#endif
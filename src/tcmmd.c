@@ -19,24 +19,68 @@
 
 #include <stdlib.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sysexits.h>
 
-#include "tcmmd_rtnl.h"
+#include "tcmmd-backend.h"
+#include "tcmmd-control.h"
 #include "tcmmd-dbus.h"
+#include "tcmmd-policy.h"
+#include "tcmmd-record.h"
+#include "tcmmd-tracelog.h"
+#include "tcmmd-trace.h"
 
-static gchar *iface_name;
+static gchar **iface_names;
 static gchar *filename_stats;
+static gchar *filename_record;
+static gchar *filename_trace;
+static gint record_size = 86400;
+static gint stats_interval = 1000;
+static gint stats_signal_interval = 1000;
+static gchar *classifier_name;
+static gboolean egress;
+static gchar *backend_name;
+static gboolean session_bus;
+static gchar *controller_name;
+static gchar **controller_tunables;
+static gchar *control_path;
+static gchar **control_users;
+static gchar *filename_state;
+static gboolean keep_rules;
+/* SIGHUP: exit with EX_TEMPFAIL, keeping the rules for the next tcmmd */
+static gboolean handover;
 static FILE *file_stats = NULL;
+static TcmmdRecorder *recorder = NULL;
+static FILE *file_trace = NULL;
 
 static GOptionEntry option_entries[] =
 {
-  { "interface", 'i', 0, G_OPTION_ARG_STRING, &iface_name, "Network interface (usually eth0)", "IFACE" },
+  { "interface", 'i', 0, G_OPTION_ARG_STRING_ARRAY, &iface_names, "Network interface (usually eth0), once per shaped uplink (default: all the ethernet ones)", "IFACE" },
   { "save-stats", 's', 0, G_OPTION_ARG_STRING, &filename_stats, "Save traffic control stats in a file", "FILE" },
+  { "record", 'r', 0, G_OPTION_ARG_STRING, &filename_record, "Record traffic control stats in a binary ring file, see tcmmd-record-export", "FILE" },
+  { "record-size", 0, 0, G_OPTION_ARG_INT, &record_size, "Number of samples kept in the ring file (default: 86400)", "N" },
+  { "trace", 0, 0, G_OPTION_ARG_STRING, &filename_trace, "Record the policy calls and stats samples in a text file, see tcmmd-replay", "FILE" },
+  { "stats-interval", 0, 0, G_OPTION_ARG_INT, &stats_interval, "Interval between two stats samples in milliseconds (default: 1000)", "MS" },
+  { "stats-signal-interval", 0, 0, G_OPTION_ARG_INT, &stats_signal_interval, "Minimum interval between two StatsUpdated D-Bus signals in milliseconds, 0 to disable them (default: 1000)", "MS" },
+  { "verbosity", 'v', 0, G_OPTION_ARG_INT, (gpointer) &tcmmd_verbosity, "0: errors only, 1: setup and streams (default), 2: policies and controller, 3: qdisc stats. SIGUSR1 and SIGUSR2 raise and lower it", "LEVEL" },
+  { "classifier", 'c', 0, G_OPTION_ARG_STRING, &classifier_name, "Classifier matching the streams: u32 (default) or flower", "NAME" },
+  { "egress", 0, 0, G_OPTION_ARG_NONE, &egress, "Shape the traffic sent on the interfaces instead of the received one. Their root qdisc is replaced, and restored on exit", NULL },
+  { "backend", 0, 0, G_OPTION_ARG_STRING, &backend_name, "Rule engine: netlink (default) or memory, which installs nothing", "NAME" },
+  { "session-bus", 0, 0, G_OPTION_ARG_NONE, &session_bus, "Own org.tcmmd on the session bus instead of the system bus", NULL },
+  { "controller", 0, 0, G_OPTION_ARG_STRING, &controller_name, "Background bandwidth controller: ramp (default), aimd or pid", "NAME" },
+  { "tune", 't', 0, G_OPTION_ARG_STRING_ARRAY, &controller_tunables, "Set a controller tunable, see tcmmd-controller.h (repeatable)", "NAME=VALUE" },
+  { "control-socket", 0, 0, G_OPTION_ARG_STRING, &control_path, "Also accept the policies on a Unix socket, see tcmmd-client.h", "PATH" },
+  { "control-user", 0, 0, G_OPTION_ARG_STRING_ARRAY, &control_users, "Allow this user on the control socket besides root (repeatable)", "NAME" },
+  { "state-file", 0, 0, G_OPTION_ARG_STRING, &filename_state, "Save the flows in a file, and take them over with their rules at startup (e.g. /run/tcmmd/state)", "FILE" },
+  { "keep-rules", 0, 0, G_OPTION_ARG_NONE, &keep_rules, "Leave the rules installed on exit, for the next tcmmd to take them over. SIGHUP does it for one exit", NULL },
   { NULL }
 };
 
@@ -44,204 +88,483 @@ static GOptionEntry option_entries[] =
 
 #define DEFAULT_IFACE "eth0"
 
-/* Keep some bandwidth for SSH :) */
-#define MINIMUM_BANDWIDTH 5000 /* 5 kB/s */
+static const TcmmdController *controller;
+static TcmmdControllerParams controller_params;
 
-#define INFINITE_BANDWIDTH 0xffffffffULL
+/* the last state written to filename_state. Until the rules are ours,
+ * the file is still the one of the previous tcmmd. */
+static gchar *saved_state = NULL;
+static gboolean state_ready = FALSE;
 
-/* This cache is what the application told us. So it is from the point of view
- * of the application: tcp_dport_cache is likely to be http=80 and
- * tcp_sport_cache is likely to be a random port.
- *
- * When calling tcmmdrtnl_add_rules, we are adding rules for ingress packets,
- * so it is from the point of view of the remote sender: tcp_sport_cache is
- * likely to be http=80 and tcp_dport_cache is likely to be a random port.
- *
- * Yes, it is confusing.
- */
-static in_addr_t ip_src_cache = 0;
-static in_addr_t ip_dst_cache = 0;
-static uint16_t tcp_sport_cache = 0;
-static uint16_t tcp_dport_cache = 0;
+static void
+save_state (void)
+{
+  GKeyFile *state;
+  GError *error = NULL;
+  gchar *data;
+  gsize length;
+
+  state = g_key_file_new ();
+  g_key_file_set_string (state, "tcmmd", "classifier",
+                         classifier_name ? classifier_name : "u32");
+  g_key_file_set_boolean (state, "tcmmd", "egress", egress);
+  tcmmd_policy_save (state);
+  data = g_key_file_to_data (state, &length, NULL);
+  g_key_file_free (state);
+
+  /* saved at every stats sample: only write what changed */
+  if (g_strcmp0 (data, saved_state) == 0)
+    {
+      g_free (data);
+      return;
+    }
+
+  if (!g_file_set_contents (filename_state, data, length, &error))
+    {
+      /* once, not at every sample */
+      if (saved_state == NULL || saved_state[0] != '\0')
+        g_printerr ("Cannot save the state in '%s': %s\n", filename_state,
+                    error->message);
+      g_clear_error (&error);
+      g_free (saved_state);
+      saved_state = g_strdup ("");
+      g_free (data);
+      return;
+    }
 
-static guint64 bandwidth = 0;
-static int percentage = 0;
-static gboolean in_panic = FALSE;
-static guint timeout_id = 0;
+  g_free (saved_state);
+  saved_state = data;
+}
 
+/* Take over the flows of the previous tcmmd, and the rules it left */
 static gboolean
-stats_cb (gpointer data)
+restore_state (void)
 {
-  struct timeval tv = {0,};
-  guint64 qdisc_root_bytes = 0;
-  guint64 qdisc_stream_bytes = 0;
-  guint64 qdisc_background_bytes = 0;
+  GKeyFile *state;
+  GError *error = NULL;
+  gchar *saved_classifier;
+  gboolean restored = FALSE;
 
-  if (!file_stats)
-    return FALSE;
+  state = g_key_file_new ();
+  if (!g_key_file_load_from_file (state, filename_state, G_KEY_FILE_NONE,
+                                  &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_printerr ("Cannot read the state in '%s': %s\n", filename_state,
+                    error->message);
+      g_clear_error (&error);
+      g_key_file_free (state);
+      return FALSE;
+    }
 
-  gettimeofday (&tv, NULL);
+  /* the filters of another classifier would have to be replaced anyway, and
+   * the rules of the other direction are somewhere else */
+  saved_classifier = g_key_file_get_string (state, "tcmmd", "classifier",
+                                            NULL);
+  if (g_strcmp0 (saved_classifier,
+                 classifier_name ? classifier_name : "u32") == 0 &&
+      g_key_file_get_boolean (state, "tcmmd", "egress", NULL) == egress)
+    restored = tcmmd_policy_restore (state);
+  g_free (saved_classifier);
+  g_key_file_free (state);
+
+  if (!restored)
+    tcmmd_log (TCMMD_LOG_INFO, "Nothing to take over from '%s'\n",
+               filename_state);
+
+  return restored;
+}
 
-  tcmmdrtnl_get_stats (&qdisc_root_bytes, &qdisc_stream_bytes,
-                       &qdisc_background_bytes);
+/* The clients of the flows taken over are still on the bus, if they did not
+ * leave in between. The connections to the control socket were closed. */
+static void
+watch_restored_clients (TcmmdDbus *dbus)
+{
+  GList *flows, *l;
+  GPtrArray *gone = g_ptr_array_new_with_free_func (g_free);
+  guint i;
 
-  fprintf (file_stats, "%ld.%06ld %"G_GUINT64_FORMAT
-           " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
-           " %"G_GUINT64_FORMAT" %d\n",
-           tv.tv_sec, tv.tv_usec,
-           qdisc_root_bytes, qdisc_stream_bytes, qdisc_background_bytes,
-           bandwidth, percentage);
-  fflush (file_stats);
+  flows = tcmmd_flow_get_all ();
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
 
-  return TRUE;
+      if (g_dbus_is_unique_name (flow->owner))
+        tcmmd_dbus_watch_client (dbus, flow->owner);
+      else
+        g_ptr_array_add (gone, g_strdup (flow->owner));
+    }
+  g_list_free (flows);
+
+  for (i = 0; i < gone->len; i++)
+    tcmmd_policy_unset (g_ptr_array_index (gone, i));
+  g_ptr_array_unref (gone);
+}
+
+static void
+cleanup (void)
+{
+  if (keep_rules)
+    {
+      if (filename_state && state_ready)
+        save_state ();
+      return;
+    }
+
+  tcmmdrtnl_uninit ();
+  /* nothing left to take over */
+  if (filename_state && state_ready)
+    unlink (filename_state);
+}
+
+/* Common fields of a traced policy call. src_ip_str and dst_ip_str are NULL
+ * for UnsetPolicy. */
+static void
+trace_event_init (TcmmdTraceEvent *event,
+                  TcmmdTraceEventType type,
+                  const gchar *owner,
+                  const gchar *src_ip_str, guint src_port,
+                  const gchar *dst_ip_str, guint dst_port)
+{
+  memset (event, 0, sizeof (*event));
+  event->type = type;
+  event->time = g_get_monotonic_time ();
+  g_strlcpy (event->owner, owner, sizeof (event->owner));
+  if (src_ip_str)
+    g_strlcpy (event->src_ip, src_ip_str, sizeof (event->src_ip));
+  if (dst_ip_str)
+    g_strlcpy (event->dst_ip, dst_ip_str, sizeof (event->dst_ip));
+  event->src_port = src_port;
+  event->dst_port = dst_port;
 }
 
 static gboolean
-update_bandwidth_cb (gpointer data)
+stats_cb (gpointer data)
 {
-  guint64 new_bandwidth = 0;
+  TcmmdDbus *dbus = data;
+  struct timeval tv = {0,};
+  TcmmdStats stats;
+  guint64 bandwidth;
 
-  g_print ("Update callback. Current values: "
-           "percentage=%d in_panic=%d tcp_sport_cache=%d bandwidth=%"G_GUINT64_FORMAT"\n",
-           percentage, in_panic, tcp_sport_cache, bandwidth);
+  gettimeofday (&tv, NULL);
+
+  tcmmd_policy_sample_stats (&stats);
+  bandwidth = tcmmd_policy_get_background_rate ();
 
-  if (in_panic)
+  if (recorder)
     {
-      new_bandwidth = MINIMUM_BANDWIDTH;
+      TcmmdRecord record = {0,};
+
+      record.time = (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+      record.root_bytes = stats.qdisc_root_bytes;
+      record.stream_bytes = stats.qdisc_stream_bytes;
+      record.background_bytes = stats.qdisc_background_bytes;
+      record.ingress_bytes = stats.qdisc_ingress_bytes;
+      record.stream_drops = stats.qdisc_stream_drops;
+      record.background_drops = stats.qdisc_background_drops;
+      record.ingress_est_rate = stats.qdisc_ingress_rate;
+      record.root_est_rate = stats.qdisc_root_rate;
+      record.stream_est_rate = stats.qdisc_stream_rate;
+      record.background_est_rate = stats.qdisc_background_rate;
+      record.background_rate = bandwidth;
+      record.buffer_percent = tcmmd_policy_get_lowest_percentage ();
+      tcmmd_policy_count_flows (&record.flows, &record.flows_in_panic);
+
+      tcmmd_record_append (recorder, &record);
     }
-  else
+
+  if (file_stats)
     {
-      new_bandwidth = bandwidth * 1.5;
-      if (new_bandwidth > INFINITE_BANDWIDTH)
-        new_bandwidth = bandwidth;
+      fprintf (file_stats, "%ld.%06ld %"G_GUINT64_FORMAT
+               " %"G_GUINT64_FORMAT" %"G_GUINT64_FORMAT
+               " %"G_GUINT64_FORMAT" %d\n",
+               tv.tv_sec, tv.tv_usec,
+               stats.qdisc_root_bytes, stats.qdisc_stream_bytes,
+               stats.qdisc_background_bytes, bandwidth,
+               tcmmd_policy_get_lowest_percentage ());
+      fflush (file_stats);
     }
 
-  if (new_bandwidth != bandwidth)
+  if (file_trace)
     {
-      bandwidth = new_bandwidth;
-      tcmmdrtnl_add_rules (&ip_dst_cache, &ip_src_cache,
-                           tcp_dport_cache, tcp_sport_cache,
-                           INFINITE_BANDWIDTH, bandwidth);
+      TcmmdTraceEvent event = {0,};
+
+      event.type = TCMMD_TRACE_STATS;
+      event.time = g_get_monotonic_time ();
+      event.stats = stats;
+      event.enforced_rate = bandwidth;
+      tcmmd_tracelog_write (file_trace, &event);
     }
 
+  tcmmd_dbus_update_stats (dbus, &stats, bandwidth,
+                           tcmmd_policy_get_absorbed_updates ());
+
+  if (filename_state)
+    save_state ();
+
   return TRUE;
 }
 
+/* Trace one flow of the flow table */
+static void
+trace_flow_event (TcmmdTraceEvent *event,
+                  TcmmdTraceEventType type,
+                  const gchar *owner,
+                  const TcmmdFlowKey *key)
+{
+  gchar src_ip[INET6_ADDRSTRLEN];
+  gchar dst_ip[INET6_ADDRSTRLEN];
+
+  tcmmd_flow_addr_to_string (key->family, &key->ip_src, src_ip);
+  tcmmd_flow_addr_to_string (key->family, &key->ip_dst, dst_ip);
+  trace_event_init (event, type, owner, src_ip, key->sport, dst_ip, key->dport);
+}
+
+/* The flows a SetPolicy call is about to replace, so that a replay, which
+ * keeps every flow of an owner, removes them too */
 static void
-on_set_fixed_policy (TcmmdDbus *dbus,
+trace_replaced_flows (const gchar *owner,
+                      const gchar *src_ip_str, guint src_port,
+                      const gchar *dst_ip_str, guint dst_port)
+{
+  TcmmdTraceEvent event;
+  TcmmdFlowKey key;
+  GList *flows, *l;
+
+  if (!tcmmd_flow_key_init (&key, src_ip_str, src_port, dst_ip_str, dst_port))
+    return;
+
+  flows = tcmmd_flow_get_by_owner (owner);
+  for (l = flows; l != NULL; l = l->next)
+    {
+      TcmmdFlow *flow = l->data;
+
+      if (tcmmd_flow_key_equal (&flow->key, &key))
+        continue;
+
+      trace_flow_event (&event, TCMMD_TRACE_UNSET_FLOW, owner, &flow->key);
+      tcmmd_tracelog_write (file_trace, &event);
+    }
+  g_list_free (flows);
+}
+
+/* The result of these handlers, whether the flow is installed, is the
+ * status of the control socket reply; the signals of TcmmdDbus ignore it */
+static gboolean
+on_set_fixed_policy (GObject *source,
+                     const gchar *owner,
                      const gchar *src_ip_str, guint src_port,
                      const gchar *dst_ip_str, guint dst_port,
                      guint stream_rate,
                      guint background_rate,
                      gpointer user_data)
 {
-  in_addr_t ip_src_b = 0;
-  in_addr_t ip_dst_b = 0;
-
-  if (src_ip_str[0] != '\0')
-    ip_src_b = inet_network (src_ip_str);
-  if (dst_ip_str[0] != '\0')
-    ip_dst_b = inet_network (dst_ip_str);
-
-  if (timeout_id != 0)
+  if (file_trace)
     {
-      g_source_remove (timeout_id);
-      timeout_id = 0;
+      TcmmdTraceEvent event;
+
+      trace_replaced_flows (owner, src_ip_str, src_port, dst_ip_str, dst_port);
+      trace_event_init (&event, TCMMD_TRACE_FIXED_POLICY, owner,
+                        src_ip_str, src_port, dst_ip_str, dst_port);
+      event.stream_rate = stream_rate;
+      event.background_rate = background_rate;
+      tcmmd_tracelog_write (file_trace, &event);
     }
 
-  tcmmdrtnl_add_rules (&ip_dst_b, &ip_src_b, dst_port, src_port, stream_rate, background_rate);
+  return tcmmd_policy_set_fixed (owner, src_ip_str, src_port,
+                                 dst_ip_str, dst_port,
+                                 stream_rate, background_rate);
 }
 
-static void
-on_set_policy (TcmmdDbus *dbus,
+static gboolean
+on_set_policy (GObject *source,
+    const gchar *owner,
     const gchar *src_ip_str, guint src_port,
     const gchar *dst_ip_str, guint dst_port,
     guint bitrate,
     gdouble buffer_fill,
     gpointer user_data)
 {
-  gboolean new_panic = FALSE;
-
-  in_addr_t ip_src_b = inet_network (src_ip_str);
-  in_addr_t ip_dst_b = inet_network (dst_ip_str);
-
-  percentage = buffer_fill * 100.0;
-  if (!in_panic && percentage < 70)
+  if (file_trace)
     {
-      new_panic = TRUE;
-      in_panic = TRUE;
+      TcmmdTraceEvent event;
+
+      trace_replaced_flows (owner, src_ip_str, src_port, dst_ip_str, dst_port);
+      trace_event_init (&event, TCMMD_TRACE_POLICY, owner,
+                        src_ip_str, src_port, dst_ip_str, dst_port);
+      event.bitrate = bitrate;
+      event.buffer_fill = buffer_fill;
+      tcmmd_tracelog_write (file_trace, &event);
     }
-  else if (percentage == 100)
+
+  return tcmmd_policy_set (owner, src_ip_str, src_port, dst_ip_str, dst_port,
+                           bitrate, buffer_fill);
+}
+
+static void
+on_unset_policy (GObject *source,
+    const gchar *owner,
+    gpointer user_data)
+{
+  if (file_trace)
     {
-      in_panic = FALSE;
+      TcmmdTraceEvent event;
+
+      trace_event_init (&event, TCMMD_TRACE_UNSET_POLICY, owner,
+                        NULL, 0, NULL, 0);
+      tcmmd_tracelog_write (file_trace, &event);
     }
 
-  if (new_panic || src_port != tcp_sport_cache)
+  tcmmd_policy_unset (owner);
+}
+
+static void
+trace_set_policies (const gchar *owner,
+                    const TcmmdPolicyEntry *entries,
+                    guint n_entries,
+                    gboolean replace)
+{
+  TcmmdTraceEvent event;
+  guint i;
+
+  /* the flows 'replace' is about to remove */
+  if (replace)
     {
-      if (timeout_id != 0)
+      GList *flows, *l;
+
+      flows = tcmmd_flow_get_by_owner (owner);
+      for (l = flows; l != NULL; l = l->next)
         {
-          g_source_remove (timeout_id);
-          timeout_id = 0;
-        }
+          TcmmdFlow *flow = l->data;
 
-      bandwidth = MINIMUM_BANDWIDTH;
-      tcp_sport_cache = src_port;
-      tcp_dport_cache = dst_port;
-      ip_src_cache = ip_src_b;
-      ip_dst_cache = ip_dst_b;
-      tcmmdrtnl_add_rules (&ip_dst_cache, &ip_src_cache,
-                           tcp_dport_cache, tcp_sport_cache,
-                           INFINITE_BANDWIDTH, bandwidth);
+          for (i = 0; i < n_entries; i++)
+            if (tcmmd_flow_key_equal (&flow->key, &entries[i].key))
+              break;
+          if (i < n_entries)
+            continue;
+
+          trace_flow_event (&event, TCMMD_TRACE_UNSET_FLOW, owner, &flow->key);
+          tcmmd_tracelog_write (file_trace, &event);
+        }
+      g_list_free (flows);
     }
-  else
+
+  for (i = 0; i < n_entries; i++)
     {
-      if (timeout_id == 0)
-        {
-          /* schedule change */
-          g_print ("Add timeout.\n");
-          timeout_id = g_timeout_add (2000, update_bandwidth_cb, NULL);
-        }
+      trace_flow_event (&event, TCMMD_TRACE_POLICY, owner, &entries[i].key);
+      event.bitrate = entries[i].bitrate;
+      event.buffer_fill = entries[i].buffer_fill;
+      tcmmd_tracelog_write (file_trace, &event);
     }
 }
 
-static void
-on_unset_policy (TcmmdDbus *dbus,
-    gpointer user_data)
+static gboolean
+on_set_policies (TcmmdDbus *dbus,
+                 const gchar *owner,
+                 const TcmmdPolicyEntry *entries,
+                 guint n_entries,
+                 gboolean replace,
+                 gpointer user_data)
+{
+  if (file_trace)
+    trace_set_policies (owner, entries, n_entries, replace);
+
+  return tcmmd_policy_set_many (owner, entries, n_entries, replace);
+}
+
+static gboolean
+on_set_shared_policy (TcmmdDbus *dbus,
+                      const gchar *owner,
+                      const TcmmdFlowKey *key,
+                      guint bitrate,
+                      gdouble buffer_fill,
+                      TcmmdSharedPolicy *page,
+                      gpointer user_data)
 {
-  if (timeout_id != 0)
+  /* the values read from the page later are not traced */
+  if (file_trace)
     {
-      g_source_remove (timeout_id);
-      timeout_id = 0;
+      TcmmdTraceEvent event;
+
+      trace_flow_event (&event, TCMMD_TRACE_POLICY, owner, key);
+      event.bitrate = bitrate;
+      event.buffer_fill = buffer_fill;
+      tcmmd_tracelog_write (file_trace, &event);
     }
 
-  tcp_sport_cache = 0;
+  return tcmmd_policy_set_shared (owner, key, bitrate, buffer_fill, page);
+}
+
+static void
+on_unset_policies (TcmmdDbus *dbus,
+                   const gchar *owner,
+                   const TcmmdFlowKey *keys,
+                   guint n_keys,
+                   gpointer user_data)
+{
+  guint i;
+
+  if (file_trace)
+    for (i = 0; i < n_keys; i++)
+      {
+        TcmmdTraceEvent event;
+
+        trace_flow_event (&event, TCMMD_TRACE_UNSET_FLOW, owner, &keys[i]);
+        tcmmd_tracelog_write (file_trace, &event);
+      }
 
-  tcmmdrtnl_del_rules ();
+  tcmmd_policy_unset_flows (owner, keys, n_keys);
 }
 
 static void signal_handler (int sig)
 {
-  if (sig == SIGINT || sig == SIGTERM)
-    {
-      /* By exiting properly instead of being terminated by the signal,
-       * atexit will run _uninit to remove the TC rules.
-       */
-      exit (0);
-    }
+  if (sig == SIGUSR1 && tcmmd_verbosity < TCMMD_LOG_STATS)
+    tcmmd_verbosity++;
+  else if (sig == SIGUSR2 && tcmmd_verbosity > TCMMD_LOG_QUIET)
+    tcmmd_verbosity--;
+}
+
+static gboolean
+quit_cb (gpointer data)
+{
+  GMainLoop *loop = data;
+
+  /* By returning from main() instead of being terminated by the signal,
+   * atexit will run cleanup to remove the TC rules, from the main loop
+   * rather than from a signal handler.
+   */
+  g_main_loop_quit (loop);
+
+  return TRUE;
+}
+
+/* A restart rather than a stop: the service manager starts tcmmd again on
+ * EX_TEMPFAIL, and the new one takes the rules and the state over */
+static gboolean
+handover_cb (gpointer data)
+{
+  keep_rules = TRUE;
+  handover = TRUE;
+
+  return quit_cb (data);
 }
 
 static void
-init_signals (void)
+init_signals (GMainLoop *loop)
 {
   struct sigaction sigact;
 
+  g_unix_signal_add (SIGINT, quit_cb, loop);
+  g_unix_signal_add (SIGTERM, quit_cb, loop);
+  g_unix_signal_add (SIGHUP, handover_cb, loop);
+
   sigact.sa_handler = signal_handler;
   sigemptyset(&sigact.sa_mask);
   sigact.sa_flags = 0;
-  sigaction (SIGINT, &sigact, (struct sigaction *)NULL);
-  sigaction (SIGTERM, &sigact, (struct sigaction *)NULL);
+  sigaction (SIGUSR1, &sigact, (struct sigaction *)NULL);
+  sigaction (SIGUSR2, &sigact, (struct sigaction *)NULL);
 
-  atexit (tcmmdrtnl_uninit);
+  atexit (cleanup);
 }
 
 int
@@ -250,6 +573,7 @@ main (int argc, char **argv)
   GError *error = NULL;
   GOptionContext *context;
   TcmmdDbus *dbus;
+  TcmmdControl *control = NULL;
   GMainLoop *loop;
 
   context = g_option_context_new ("- traffic control multimedia daemon");
@@ -260,19 +584,129 @@ main (int argc, char **argv)
       exit (1);
     }
 
-  init_signals ();
-  tcmmdrtnl_init (iface_name);
-  tcmmdrtnl_init_ifb ();
+  if (backend_name)
+    {
+      const TcmmdBackend *backend = tcmmd_backend_lookup (backend_name);
+
+      if (!backend)
+        {
+          g_print ("Unknown backend '%s'\n", backend_name);
+          exit (1);
+        }
+      tcmmd_backend_set (backend);
+    }
+
+  if (classifier_name)
+    {
+      if (g_strcmp0 (classifier_name, "flower") == 0)
+        tcmmdrtnl_set_classifier (TCMMD_CLASSIFIER_FLOWER);
+      else if (g_strcmp0 (classifier_name, "u32") != 0)
+        {
+          g_print ("Unknown classifier '%s'\n", classifier_name);
+          exit (1);
+        }
+    }
+
+  if (egress)
+    tcmmdrtnl_set_direction (TCMMD_DIRECTION_EGRESS);
+
+  tcmmd_controller_params_init (&controller_params);
+  if (controller_tunables)
+    {
+      gchar **tunable;
+
+      for (tunable = controller_tunables; *tunable; tunable++)
+        if (!tcmmd_controller_params_parse (&controller_params, *tunable))
+          {
+            g_print ("Invalid controller tunable '%s'\n", *tunable);
+            exit (1);
+          }
+    }
+
+  controller = tcmmd_controller_lookup (controller_name ? controller_name : "ramp");
+  if (!controller)
+    {
+      g_print ("Unknown controller '%s'\n", controller_name);
+      exit (1);
+    }
+
+  if (controller_params.interval == 0 || controller_params.shared_interval == 0 ||
+      controller_params.min_rate > controller_params.max_rate)
+    {
+      g_print ("Invalid controller tunables\n");
+      exit (1);
+    }
+
+  if (record_size <= 0 || stats_interval <= 0)
+    {
+      g_print ("--record-size and --stats-interval must be positive\n");
+      exit (1);
+    }
 
-  g_print ("Init done.\n");
+  if (stats_signal_interval < 0)
+    {
+      g_print ("--stats-signal-interval must not be negative\n");
+      exit (1);
+    }
 
-  dbus = tcmmd_dbus_new ();
+  loop = g_main_loop_new (NULL, FALSE);
+  init_signals (loop);
+  tcmmd_policy_init (controller, &controller_params,
+                     &tcmmd_policy_main_loop_clock);
+  tcmmdrtnl_init ((const char * const *) iface_names);
+  if (!filename_state || !restore_state ())
+    tcmmdrtnl_init_ifb ();
+  state_ready = TRUE;
+
+  tcmmd_log (TCMMD_LOG_INFO, "Init done.\n");
+
+  dbus = tcmmd_dbus_new (session_bus ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM);
+  tcmmd_dbus_set_stats_signal_interval (dbus, stats_signal_interval);
   g_signal_connect (dbus, "set-policy",
       G_CALLBACK (on_set_policy), NULL);
   g_signal_connect (dbus, "set-fixed-policy",
       G_CALLBACK (on_set_fixed_policy), NULL);
   g_signal_connect (dbus, "unset-policy",
       G_CALLBACK (on_unset_policy), NULL);
+  g_signal_connect (dbus, "set-policies",
+      G_CALLBACK (on_set_policies), NULL);
+  g_signal_connect (dbus, "unset-policies",
+      G_CALLBACK (on_unset_policies), NULL);
+  g_signal_connect (dbus, "set-shared-policy",
+      G_CALLBACK (on_set_shared_policy), NULL);
+  watch_restored_clients (dbus);
+
+  if (control_path)
+    {
+      gchar **user;
+
+      control = tcmmd_control_new (control_path, &error);
+      if (!control)
+        {
+          g_print ("%s\n", error->message);
+          exit (1);
+        }
+
+      for (user = control_users; user && *user; user++)
+        {
+          struct passwd *pw = getpwnam (*user);
+
+          if (!pw)
+            {
+              g_print ("Unknown user '%s'\n", *user);
+              exit (1);
+            }
+          tcmmd_control_allow_uid (control, pw->pw_uid);
+        }
+
+      /* the same handlers as D-Bus */
+      g_signal_connect (control, "set-policy",
+          G_CALLBACK (on_set_policy), NULL);
+      g_signal_connect (control, "set-fixed-policy",
+          G_CALLBACK (on_set_fixed_policy), NULL);
+      g_signal_connect (control, "unset-policy",
+          G_CALLBACK (on_unset_policy), NULL);
+    }
 
   if (filename_stats)
     {
@@ -284,14 +718,39 @@ main (int argc, char **argv)
           exit (1);
         }
       fprintf (file_stats, "time qdisc_root_bytes qdisc_stream_bytes qdisc_background_bytes background_bandwidth_requested gst_buffer_percent\n");
-      g_timeout_add (1000, stats_cb, NULL);
     }
 
-  loop = g_main_loop_new (NULL, FALSE);
+  if (filename_record)
+    {
+      recorder = tcmmd_record_create (filename_record, record_size);
+      if (!recorder)
+        {
+          g_print ("Cannot write to '%s': %s\n",  filename_record,
+                   strerror (errno));
+          exit (1);
+        }
+    }
+
+  if (filename_trace)
+    {
+      file_trace = tcmmd_tracelog_create (filename_trace);
+      if (!file_trace)
+        {
+          g_print ("Cannot write to '%s': %s\n",  filename_trace,
+                   strerror (errno));
+          exit (1);
+        }
+    }
+
+  /* also feeds the D-Bus properties, so always sample */
+  g_timeout_add (stats_interval, stats_cb, dbus);
+
   g_main_loop_run (loop);
 
+  g_clear_object (&control);
   g_object_unref (dbus);
+  g_main_loop_unref (loop);
 
-  return 0;
+  return handover ? EX_TEMPFAIL : 0;
 }
 
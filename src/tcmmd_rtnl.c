@@ -17,7 +17,8 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#include "tcmmd_rtnl.h"
+#include "tcmmd-backend.h"
+#include "tcmmd-trace.h"
 
 #include <glib.h>
 
@@ -29,34 +30,85 @@
 #include <netlink/route/cls/u32.h>
 #include <netlink/route/cls/basic.h>
 #include <netlink/route/cls/ematch.h>
-#include <netlink/route/qdisc/dsmark.h>
 #include <netlink/route/qdisc/htb.h>
 #include <netlink/route/qdisc/sfq.h>
 
 #include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
 #include <linux/tc_act/tc_mirred.h>
+#include <netinet/in.h>
 
 #define Q_ESTIMATOR "estimator 250ms 500ms"
 
+/* u32 hash table handle, as in "tc filter ... handle <htid>:0:0" */
+#define U32_HT(htid) ((uint32_t) (htid) << 20)
+
 static struct nl_sock *sock;
 
 static struct nl_cache *link_cache;
 static struct nl_cache *qdisc_cache;
-static struct nl_cache *class_cache;
-
-/* filter/classifier cache attached to qdisc 1:0 */
-static struct nl_cache *cls1_cache = NULL;
-/* filter/classifier cache attached to qdisc 2:0 */
-static struct nl_cache *cls2_cache = NULL;
 
-static struct rtnl_link *main_link = NULL;
-static struct rtnl_link *ifb_link = NULL;
+/* A stream of the tree, from the point of view of the remote sender as in
+ * tcmmdrtnl_add_stream(). Unused address bytes are zero. */
+typedef struct {
+  gboolean used;
+  int family;
+  guint8 ip_src[16];
+  guint8 ip_dst[16];
+  uint16_t tcp_sport;
+  uint16_t tcp_dport;
+  guint64 rate;
+} StreamState;
+
+/* The tree of an uplink. The backend calls describe the tree they want
+ * in a copy of the installed one, and _reconcile() sends the kernel the
+ * difference. */
+typedef struct {
+  gboolean installed;
+  guint64 background_rate;
+  StreamState streams[TCMMD_MAX_STREAMS];
+} TreeState;
+
+/* A shaped uplink: the packets received on its main link (e.g. eth0) are
+ * redirected to its own ifb device, where its tree lives. Uplink n uses
+ * ifb<n> and the stream ids of TCMMD_STREAM_LINK() n. When shaping egress,
+ * the tree is on the root of the main link and there is no ifb device. */
+typedef struct {
+  struct rtnl_link *main;
+  struct rtnl_link *ifb;
+  /* where the tree is: ifb, or main when shaping egress */
+  struct rtnl_link *dev;
+  struct nl_cache *class_cache;
+  /* filter/classifier cache attached to qdisc 1:0 */
+  struct nl_cache *cls1_cache;
+
+  TreeState installed;
+  /* the kernel may not match installed: a batch failed half way, or the
+   * tree was removed. It is built again at the next change */
+  gboolean stale;
+  /* the ingress qdisc of the main link, and the redirection to ifb with
+   * it, were removed. They are added again at the next change */
+  gboolean redirect_missing;
+  /* when shaping egress, the root qdisc of the main link the tree replaced,
+   * as the request adding it back on uninit */
+  struct nl_msg *saved_root;
+  /* u32 hash tables are kept when a stream goes away and reused */
+  gboolean stream_ht_created[TCMMD_MAX_STREAMS];
+} Uplink;
+
+static Uplink uplinks[TCMMD_MAX_LINKS];
+static int n_uplinks = 0;
+
+static TcmmdDirection direction = TCMMD_DIRECTION_INGRESS;
 
 static void
 link_cb (struct nl_object *obj, void *data)
 {
   struct rtnl_link *link = nl_object_priv (obj);
   const char *link_name = (const char *) data;
+  int i;
 
   /* Ignore loopback and other non-ethernet interfaces
    * unless explicitely requested.
@@ -72,16 +124,20 @@ link_cb (struct nl_object *obj, void *data)
   if (rtnl_link_is_bridge(link))
     return;
 
-  if (main_link)
+  /* an interface given twice */
+  for (i = 0; i < n_uplinks; i++)
+    if (uplinks[i].main == link)
+      return;
+
+  if (n_uplinks == TCMMD_MAX_LINKS)
     {
-      g_printerr ("Error: several network interfaces. "
-                  "Hint: use options such as -i %s or -i %s\n",
-                  rtnl_link_get_name (main_link),
-                  rtnl_link_get_name (link));
+      g_printerr ("Error: more than %d network interfaces. "
+                  "Hint: select them with options such as -i %s\n",
+                  TCMMD_MAX_LINKS, rtnl_link_get_name (uplinks[0].main));
       exit (1);
     }
   nl_object_get (OBJ_CAST (link));
-  main_link = link;
+  uplinks[n_uplinks++].main = link;
 }
 
 static void
@@ -98,10 +154,10 @@ qdisc_delete_cb (struct nl_object *obj, void *arg)
     return;
 
   link = rtnl_link_get (link_cache, rtnl_tc_get_ifindex (tc));
-  g_print ("delete qdisc dev %s handle %s %s\n",
-           rtnl_link_get_name (link),
-           rtnl_tc_handle2str (rtnl_tc_get_handle (tc), buf, sizeof(buf)),
-           rtnl_tc_get_kind (tc));
+  tcmmd_log (TCMMD_LOG_INFO, "delete qdisc dev %s handle %s %s\n",
+             rtnl_link_get_name (link),
+             rtnl_tc_handle2str (rtnl_tc_get_handle (tc), buf, sizeof(buf)),
+             rtnl_tc_get_kind (tc));
   rtnl_link_put (link);
 
   if ((err = rtnl_qdisc_delete (sock, qdisc)) < 0)
@@ -112,28 +168,161 @@ qdisc_delete_cb (struct nl_object *obj, void *arg)
 }
 
 
-void
-tcmmdrtnl_init (const char *link_name)
+/* Batch of netlink requests, sent to the kernel in a single sendmsg() */
+static GByteArray *batch = NULL;
+static int batch_count = 0;
+
+struct batch_acks {
+  int count;
+  int err;
+};
+
+static void
+_batch_queue (struct nl_msg *msg)
 {
-  struct rtnl_link *link_filter;
+  struct nlmsghdr *hdr;
+  static const guint8 padding[NLMSG_ALIGNTO] = {0,};
+
+  if (!batch)
+    batch = g_byte_array_new ();
+
+  /* assign sequence number and request an ACK for each message */
+  nl_complete_msg (sock, msg);
+  hdr = nlmsg_hdr (msg);
+
+  g_byte_array_append (batch, (guint8 *) hdr, hdr->nlmsg_len);
+  g_byte_array_append (batch, padding,
+                       NLMSG_ALIGN (hdr->nlmsg_len) - hdr->nlmsg_len);
+  batch_count++;
+
+  nlmsg_free (msg);
+}
+
+static int
+batch_seq_cb (struct nl_msg *msg, void *arg)
+{
+  /* each message of the batch has its own sequence number */
+  return NL_OK;
+}
+
+static int
+batch_ack_cb (struct nl_msg *msg, void *arg)
+{
+  struct batch_acks *acks = arg;
+
+  acks->count++;
+  return NL_OK;
+}
+
+static int
+batch_err_cb (struct sockaddr_nl *nla, struct nlmsgerr *nlerr, void *arg)
+{
+  struct batch_acks *acks = arg;
+
+  acks->count++;
+  /* keep the first error: the following ones are usually consequences */
+  if (acks->err == 0)
+    acks->err = -nl_syserr2nlerr (nlerr->error);
+
+  return NL_SKIP;
+}
+
+/* Send all queued requests at once and wait for the kernel to acknowledge
+ * every one of them. Replies other than acknowledgements, e.g. to get
+ * requests, are given to valid_cb. Returns 0 or the first libnl error. */
+static int
+_batch_commit_full (nl_recvmsg_msg_cb_t valid_cb, void *arg)
+{
+  struct batch_acks acks = {0,};
+  struct nl_cb *cb;
+  int expected;
   int err;
 
-  if (!(sock = nl_socket_alloc()))
-    exit (1);
+  if (batch_count == 0)
+    return 0;
+
+  expected = batch_count;
+  err = nl_sendto (sock, batch->data, batch->len);
+  g_byte_array_set_size (batch, 0);
+  batch_count = 0;
+  if (err < 0)
+    return err;
+
+  cb = nl_cb_clone (nl_socket_get_cb (sock));
+  if (!cb)
+    return -NLE_NOMEM;
+  nl_cb_set (cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, batch_seq_cb, NULL);
+  nl_cb_set (cb, NL_CB_ACK, NL_CB_CUSTOM, batch_ack_cb, &acks);
+  nl_cb_err (cb, NL_CB_CUSTOM, batch_err_cb, &acks);
+  if (valid_cb)
+    nl_cb_set (cb, NL_CB_VALID, NL_CB_CUSTOM, valid_cb, arg);
+
+  while (acks.count < expected)
+    {
+      if ((err = nl_recvmsgs (sock, cb)) < 0)
+        break;
+    }
+  nl_cb_put (cb);
 
-  if ((err = nl_connect(sock, NETLINK_ROUTE)) < 0)
-    exit (1);
+  if (err < 0)
+    return err;
+  return acks.err;
+}
 
-  /* init link cache */
+static int
+_batch_commit (void)
+{
+  return _batch_commit_full (NULL, NULL);
+}
 
-  if ((err = rtnl_link_alloc_cache(sock, AF_UNSPEC, &link_cache)) < 0)
+static void
+_put_estimator (struct nl_msg *msg)
+{
+  /* Q_ESTIMATOR: "estimator 250ms 500ms", as computed by tc */
+  struct tc_estimator est = { .interval = -2, .ewma_log = 1 };
+
+  if (nla_put (msg, TCA_RATE, sizeof (est), &est) < 0)
     {
-      g_printerr ("Error: unable to allocate link cache: %s\n", nl_geterror(err));
+      g_printerr ("Error: unable to add estimator\n");
       exit (1);
     }
-  nl_cache_mngt_provide (link_cache);
+}
+
+static void
+_queue_qdisc (struct rtnl_qdisc *qdisc)
+{
+  struct nl_msg *msg;
+  int err;
+
+  if ((err = rtnl_qdisc_build_add_request (qdisc, NLM_F_CREATE, &msg)) < 0)
+    {
+      g_printerr ("Error: cannot build qdisc request: %s\n", nl_geterror(err));
+      exit (1);
+    }
+  _put_estimator (msg);
+  _batch_queue (msg);
+}
+
+static void
+_queue_class (struct rtnl_class *class)
+{
+  struct nl_msg *msg;
+  int err;
+
+  if ((err = rtnl_class_build_add_request (class, NLM_F_CREATE, &msg)) < 0)
+    {
+      g_printerr ("Error: cannot build class request: %s\n", nl_geterror(err));
+      exit (1);
+    }
+  _put_estimator (msg);
+  _batch_queue (msg);
+}
 
-  /* look for the main network interface (e.g. eth0) */
+
+static void
+_find_links (const char *link_name)
+{
+  struct rtnl_link *link_filter;
 
   link_filter = rtnl_link_alloc();
   if (!link_filter)
@@ -152,95 +341,104 @@ tcmmdrtnl_init (const char *link_name)
 
   nl_cache_foreach_filter (link_cache, OBJ_CAST (link_filter),
                            link_cb, (void *) link_name);
+  rtnl_link_put (link_filter);
+}
 
-  if (main_link == NULL)
-    {
-      g_printerr ("Error: network interface not found\n");
-      exit (1);
-    }
+static void
+netlink_init (const char * const *link_names)
+{
+  int err;
+  int i;
 
-  g_print ("Using iface %s\n", rtnl_link_get_name (main_link));
+  if (!(sock = nl_socket_alloc()))
+    exit (1);
 
-  /* init qdisc cache */
+  if ((err = nl_connect(sock, NETLINK_ROUTE)) < 0)
+    exit (1);
 
-  if ((err = rtnl_qdisc_alloc_cache(sock, &qdisc_cache)) < 0)
+  /* dumps of the qdiscs of all interfaces can be large on routers with many
+   * interfaces: avoid overruns and receive them with few recvmsg() calls */
+  if ((err = nl_socket_set_buffer_size (sock, 1024 * 1024, 0)) < 0)
+    g_printerr ("Warning: cannot set the netlink buffer size: %s\n",
+                nl_geterror(err));
+  nl_socket_set_msg_buf_size (sock, 64 * 1024);
+
+  /* init link cache */
+
+  if ((err = rtnl_link_alloc_cache(sock, AF_UNSPEC, &link_cache)) < 0)
     {
-      g_printerr ("Error: unable to allocate qdisc cache: %s\n", nl_geterror(err));
+      g_printerr ("Error: unable to allocate link cache: %s\n", nl_geterror(err));
       exit (1);
     }
-  nl_cache_mngt_provide (qdisc_cache);
-}
-
-static void
-tcmmrtnl_setup_ifb_redirection (void)
-{
-#if 1
-  gchar *cmd;
-  int err;
+  nl_cache_mngt_provide (link_cache);
 
-  tcmmdrtnl_del_rules ();
+  /* look for the main network interfaces (e.g. eth0): the requested ones,
+   * or all the ethernet ones */
 
-  cmd = g_strdup_printf ("tc qdisc del dev %s ingress > /dev/null 2>&1 || true",
-                         rtnl_link_get_name (main_link));
-  if ((err = system (cmd)))
+  if (!link_names || !link_names[0])
+    _find_links (NULL);
+  for (i = 0; link_names && link_names[i]; i++)
     {
-      g_printerr ("Error: command failed: '%s' (%d)\n", cmd, err);
-      exit (1);
+      int found = n_uplinks;
+
+      _find_links (link_names[i]);
+      if (n_uplinks == found)
+        {
+          g_printerr ("Error: network interface %s not found\n", link_names[i]);
+          exit (1);
+        }
     }
-  g_free (cmd);
 
-  cmd = g_strdup_printf ("tc qdisc add dev %s "Q_ESTIMATOR" handle ffff: ingress",
-                         rtnl_link_get_name (main_link));
-  if ((err = system (cmd)))
+  if (n_uplinks == 0)
     {
-      g_printerr ("Error: command failed: '%s' (%d)\n", cmd, err);
+      g_printerr ("Error: network interface not found\n");
       exit (1);
     }
-  g_free (cmd);
 
-  cmd = g_strdup_printf ("tc filter add dev %s parent ffff: protocol ip u32 match u32 0 0 action mirred egress redirect dev ifb0",
-                         rtnl_link_get_name (main_link));
-  if ((err = system (cmd)))
+  for (i = 0; i < n_uplinks; i++)
+    tcmmd_log (TCMMD_LOG_INFO, "Using iface %s\n",
+               rtnl_link_get_name (uplinks[i].main));
+
+  /* init qdisc cache */
+
+  if ((err = rtnl_qdisc_alloc_cache(sock, &qdisc_cache)) < 0)
     {
-      g_printerr ("Error: command failed: '%s' (%d)\n", cmd, err);
+      g_printerr ("Error: unable to allocate qdisc cache: %s\n", nl_geterror(err));
       exit (1);
     }
-  g_free (cmd);
-#else
+  nl_cache_mngt_provide (qdisc_cache);
+}
+
+static void
+_del_qdiscs (struct rtnl_link *link, uint32_t parent)
+{
   struct rtnl_qdisc *qdisc;
-  struct rtnl_cls *cls;
   struct rtnl_tc *tc;
-  struct rtnl_act *act;
-  int err;
 
-  qdisc = rtnl_qdisc_alloc ();
-  if (!qdisc)
+  if (!(qdisc = rtnl_qdisc_alloc ()))
     {
-      g_printerr ("Error: unable to allocate qdisc object\n");
+      g_printerr ("Error: unable to allocate qdisc\n");
       exit (1);
     }
   tc = (struct rtnl_tc *) qdisc;
 
-  /* delete previous ingress qdisc on eth0, if any */
-  rtnl_tc_set_link (tc, main_link);
-  rtnl_tc_set_parent (tc, TC_H_INGRESS);
+  rtnl_tc_set_link (tc, link);
+  rtnl_tc_set_parent (tc, parent);
   nl_cache_foreach_filter (qdisc_cache, OBJ_CAST(qdisc), qdisc_delete_cb, NULL);
 
-  /* tc qdisc add dev eth0 handle ffff: ingress */
-  rtnl_tc_set_link (tc, main_link);
-  rtnl_tc_set_handle (tc, TC_HANDLE (0xffff, 0));
-  rtnl_tc_set_parent (tc, TC_H_INGRESS);
-  /* "ingress" is both the parent and the name of the qdisq */
-  rtnl_tc_set_kind (tc, "ingress");
-
-  if ((err = rtnl_qdisc_add (sock, qdisc, NLM_F_CREATE)))
-    {
-      g_printerr ("Error: cannot add ingress qdisc: %s\n", nl_geterror(err));
-      exit (1);
-    }
   rtnl_qdisc_put (qdisc);
+}
+
+/* tc filter add dev eth0 parent ffff: protocol ip prio 1 u32 match u32 0 0 action mirred egress redirect dev ifb0 */
+static void
+_add_ingress_redirect (Uplink *uplink, uint32_t prio, uint16_t protocol)
+{
+  struct rtnl_cls *cls;
+  struct rtnl_tc *tc;
+  struct rtnl_act *act;
+  struct nl_msg *msg;
+  int err;
 
-  /* tc filter add dev eth0 parent ffff: protocol ip u32 match u32 0 0 action mirred egress redirect dev ifb0 */
   cls = rtnl_cls_alloc ();
   if (!cls)
     {
@@ -249,9 +447,10 @@ tcmmrtnl_setup_ifb_redirection (void)
     }
   tc = (struct rtnl_tc *) cls;
 
-  rtnl_tc_set_link (tc, main_link);
+  rtnl_tc_set_link (tc, uplink->main);
   rtnl_tc_set_parent (tc, TC_HANDLE (0xffff, 0));
-  rtnl_cls_set_protocol (cls, ETH_P_IP);
+  rtnl_cls_set_prio (cls, prio);
+  rtnl_cls_set_protocol (cls, protocol);
   rtnl_tc_set_kind (tc, "u32");
 
   rtnl_u32_add_key_uint32 (cls, 0, 0, 0, 0);
@@ -271,33 +470,96 @@ tcmmrtnl_setup_ifb_redirection (void)
       exit (1);
     }
 
-  rtnl_mirred_set_ifindex (act, rtnl_link_get_ifindex (ifb_link));
+  rtnl_mirred_set_ifindex (act, rtnl_link_get_ifindex (uplink->ifb));
 
   rtnl_u32_add_action (cls, act);
+  rtnl_act_put (act);
+  /* the actions of a u32 node only run on terminal nodes */
+  rtnl_u32_set_cls_terminal (cls);
 
-  if ((err = rtnl_cls_add (sock, cls, NLM_F_CREATE)))
+  if ((err = rtnl_cls_build_add_request (cls, NLM_F_CREATE, &msg)) < 0)
     {
-      g_printerr ("Error: cannot add ingress redirection: %s\n", nl_geterror(err));
+      g_printerr ("Error: cannot build filter request: %s\n", nl_geterror(err));
       exit (1);
     }
+  _batch_queue (msg);
   rtnl_cls_put (cls);
-#endif
 }
 
-void
-tcmmdrtnl_init_ifb (void)
+static void
+_queue_ingress_redirection (Uplink *uplink)
+{
+  struct rtnl_qdisc *qdisc;
+  struct rtnl_tc *tc;
+
+  qdisc = rtnl_qdisc_alloc ();
+  if (!qdisc)
+    {
+      g_printerr ("Error: unable to allocate qdisc object\n");
+      exit (1);
+    }
+  tc = (struct rtnl_tc *) qdisc;
+
+  /* tc qdisc add dev eth0 handle ffff: ingress */
+  rtnl_tc_set_link (tc, uplink->main);
+  rtnl_tc_set_handle (tc, TC_HANDLE (0xffff, 0));
+  rtnl_tc_set_parent (tc, TC_H_INGRESS);
+  /* "ingress" is both the parent and the name of the qdisq */
+  rtnl_tc_set_kind (tc, "ingress");
+
+  _queue_qdisc (qdisc);
+  rtnl_qdisc_put (qdisc);
+
+  /* one filter per protocol, each in its own priority */
+  _add_ingress_redirect (uplink, 1, ETH_P_IP);
+  _add_ingress_redirect (uplink, 2, ETH_P_IPV6);
+}
+
+static void _del_tree (Uplink *uplink);
+
+static void
+tcmmrtnl_setup_ifb_redirection (Uplink *uplink)
 {
-  struct rtnl_link *change;
   int err;
 
-  ifb_link = rtnl_link_get_by_name (link_cache, "ifb0");
-  if (ifb_link == NULL)
+  _del_tree (uplink);
+
+  /* delete previous ingress qdisc on eth0, if any */
+  _del_qdiscs (uplink->main, TC_H_INGRESS);
+
+  _queue_ingress_redirection (uplink);
+  if ((err = _batch_commit ()) < 0)
     {
-      g_printerr ("Error: network interface ifb0 unavailable. Hint: sudo modprobe ifb numifbs=1\n");
+      g_printerr ("Error: cannot add ingress redirection: %s\n", nl_geterror(err));
       exit (1);
     }
+  uplink->redirect_missing = FALSE;
+}
+
+/* ip link set dev ifb<n> up, and the caches of the classes of the tree */
+static void
+_init_ifb_link (Uplink *uplink)
+{
+  struct rtnl_link *change;
+  gchar *name;
+  int err;
+
+  if (direction == TCMMD_DIRECTION_EGRESS)
+    uplink->dev = uplink->main;
+  else if (!uplink->ifb)
+    {
+      name = g_strdup_printf ("ifb%d", (int) (uplink - uplinks));
+      uplink->ifb = rtnl_link_get_by_name (link_cache, name);
+      if (uplink->ifb == NULL)
+        {
+          g_printerr ("Error: network interface %s unavailable. Hint: sudo modprobe ifb numifbs=%d\n",
+                      name, n_uplinks);
+          exit (1);
+        }
+      g_free (name);
+    }
 
-  if (!(rtnl_link_get_flags (ifb_link) & IFF_UP))
+  if (uplink->ifb && !(rtnl_link_get_flags (uplink->ifb) & IFF_UP))
     {
       change = rtnl_link_alloc ();
       if (change == NULL)
@@ -308,186 +570,255 @@ tcmmdrtnl_init_ifb (void)
 
       /* "ip link set dev ifb0 up" */
       rtnl_link_set_flags (change, IFF_UP);
-      if ((err = rtnl_link_change (sock, ifb_link, change, 0)))
+      if ((err = rtnl_link_change (sock, uplink->ifb, change, 0)))
         {
-          g_printerr ("Error: cannot set ifb0 up: %s\n", nl_geterror(err));
+          g_printerr ("Error: cannot set %s up: %s\n",
+                      rtnl_link_get_name (uplink->ifb), nl_geterror(err));
           exit (1);
         }
       rtnl_link_put (change);
   }
+  if (uplink->ifb)
+    uplink->dev = uplink->ifb;
 
-  tcmmrtnl_setup_ifb_redirection ();
+  /* init class cache, once: it is only read when adopting a tree, which
+   * refills it first */
 
-  /* init class cache */
+  if (uplink->class_cache)
+    return;
 
   if ((err = rtnl_class_alloc_cache (sock,
-                                     rtnl_link_get_ifindex (ifb_link),
-                                     &class_cache)) < 0)
+                                     rtnl_link_get_ifindex (uplink->dev),
+                                     &uplink->class_cache)) < 0)
     {
       g_printerr ("Error: unable to allocate class cache: %s\n", nl_geterror(err));
       exit (1);
     }
-  nl_cache_mngt_provide (class_cache);
+  nl_cache_mngt_provide (uplink->class_cache);
 }
 
-/* Last configured values */
-static int previous_port = -1;
-static guint64 previous_stream_rate = 0;
-static guint64 previous_background_rate = 0;
+static void _queue_get_qdisc (struct rtnl_link *link, uint32_t handle);
 
-static void
-_del_rules (void)
+/* When shaping egress, the tree replaces the root qdisc of the main link.
+ * The default one (pfifo_fast, mq...) has no handle and comes back when the
+ * tree is removed; one an administrator set up, e.g. fq_codel or cake, is
+ * kept with its kind and options as the kernel reported them, which it
+ * takes back as they are, whether libnl knows the kind or not. */
+static int
+save_root_cb (struct nl_msg *msg, void *arg)
 {
-  int err;
-
-#if 1
-  gchar *cmd;
-
-  cmd = g_strdup_printf ("tc qdisc del dev %s root > /dev/null 2>&1 || true",
-                         rtnl_link_get_name (ifb_link));
-  if ((err = system (cmd)))
+  Uplink *uplink = arg;
+  struct nlmsghdr *hdr = nlmsg_hdr (msg);
+  struct tcmsg *tcm = nlmsg_data (hdr);
+  struct nlattr *tb[TCA_MAX + 1];
+  struct tcmsg add = {
+    .tcm_family = AF_UNSPEC,
+    .tcm_ifindex = tcm->tcm_ifindex,
+    .tcm_handle = tcm->tcm_handle,
+    .tcm_parent = TC_H_ROOT,
+  };
+  struct nl_msg *request;
+
+  if (hdr->nlmsg_type != RTM_NEWQDISC ||
+      nlmsg_parse (hdr, sizeof (*tcm), tb, TCA_MAX, NULL) < 0 ||
+      !tb[TCA_KIND])
+    return NL_OK;
+
+  /* or the tree of a previous tcmmd */
+  if (tcm->tcm_handle == 0 ||
+      (tcm->tcm_handle == TC_HANDLE (1, 0) &&
+       g_strcmp0 (nla_get_string (tb[TCA_KIND]), "htb") == 0))
+    return NL_OK;
+
+  if (!(request = nlmsg_alloc_simple (RTM_NEWQDISC, NLM_F_CREATE)) ||
+      nlmsg_append (request, &add, sizeof (add), NLMSG_ALIGNTO) < 0 ||
+      nla_put (request, TCA_KIND, nla_len (tb[TCA_KIND]),
+               nla_data (tb[TCA_KIND])) < 0 ||
+      (tb[TCA_OPTIONS] &&
+       nla_put (request, TCA_OPTIONS, nla_len (tb[TCA_OPTIONS]),
+                nla_data (tb[TCA_OPTIONS])) < 0))
     {
-      g_printerr ("Error: command failed: '%s' (%d)\n", cmd, err);
+      g_printerr ("Error: unable to build qdisc request\n");
       exit (1);
     }
-  g_free (cmd);
 
-  cmd = g_strdup_printf ("tc qdisc del dev %s ingress > /dev/null 2>&1 || true",
-                         rtnl_link_get_name (ifb_link));
-  if ((err = system (cmd)))
-    {
-      g_printerr ("Error: command failed: '%s' (%d)\n", cmd, err);
-      exit (1);
-    }
-  g_free (cmd);
+  tcmmd_log (TCMMD_LOG_INFO, "The %s root qdisc of %s is replaced, and "
+             "restored on exit\n", nla_get_string (tb[TCA_KIND]),
+             rtnl_link_get_name (uplink->main));
+  if (uplink->saved_root)
+    nlmsg_free (uplink->saved_root);
+  uplink->saved_root = request;
 
-#else
-  struct rtnl_qdisc *qdisc;
-  struct rtnl_tc *tc;
+  return NL_OK;
+}
 
-  if (!(qdisc = rtnl_qdisc_alloc ()))
+static void
+_save_root_qdisc (Uplink *uplink)
+{
+  int err;
+
+  _queue_get_qdisc (uplink->main, 0);
+  if ((err = _batch_commit_full (save_root_cb, uplink)) < 0)
     {
-      g_printerr ("Error: unable to allocate qdisc\n");
+      g_printerr ("Error: cannot get qdisc: %s\n", nl_geterror(err));
       exit (1);
     }
-  tc = (struct rtnl_tc *) qdisc;
-
-  /* tc qdisc del dev ifb0 root */
-  rtnl_tc_set_link (tc, ifb_link);
-  rtnl_tc_set_parent (tc, TC_H_ROOT);
-  nl_cache_foreach_filter (qdisc_cache, OBJ_CAST(qdisc), qdisc_delete_cb, NULL);
-
-  /* tc qdisc del dev ifb0 ingress */
-  rtnl_tc_set_link (tc, ifb_link);
-  rtnl_tc_set_parent (tc, TC_H_INGRESS);
-  nl_cache_foreach_filter (qdisc_cache, OBJ_CAST(qdisc), qdisc_delete_cb, NULL);
-
-  rtnl_qdisc_put (qdisc);
-#endif
-
 }
 
-void
-tcmmdrtnl_del_rules (void)
+/* The root qdisc comes back once the tree is removed: the kernel only
+ * grafts a new one over the default qdisc */
+static void
+_restore_root_qdisc (Uplink *uplink)
 {
   int err;
 
-  _del_rules ();
+  if (!uplink->saved_root)
+    return;
 
-  if (qdisc_cache)
-    {
-      if ((err = nl_cache_refill(sock, qdisc_cache)))
-        {
-          g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
-          exit (1);
-        }
-    }
+  _batch_queue (uplink->saved_root);
+  uplink->saved_root = NULL;
+  if ((err = _batch_commit ()) < 0)
+    g_printerr ("Warning: cannot restore the root qdisc of %s: %s\n",
+                rtnl_link_get_name (uplink->main), nl_geterror(err));
+}
+
+static void
+netlink_init_ifb (void)
+{
+  int i;
 
-  if (class_cache)
+  for (i = 0; i < n_uplinks; i++)
     {
-      if ((err = nl_cache_refill(sock, class_cache)))
+      _init_ifb_link (&uplinks[i]);
+      if (direction == TCMMD_DIRECTION_EGRESS)
         {
-          g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
-          exit (1);
+          _save_root_qdisc (&uplinks[i]);
+          _del_tree (&uplinks[i]);
         }
+      else
+        tcmmrtnl_setup_ifb_redirection (&uplinks[i]);
     }
-
-  nl_cache_free (cls1_cache);
-  cls1_cache = NULL;
-  nl_cache_free (cls2_cache);
-  cls2_cache = NULL;
-
-  previous_port = -1;
-  previous_stream_rate = 0;
-  previous_background_rate = 0;
 }
 
-void
-tcmmdrtnl_uninit (void)
-{
-  int err;
-  gchar *cmd;
+/* Handle layout on each ifb device, or main link when shaping egress:
+ *   1:0 htb root, classifying straight to its leaf classes
+ *   1:1 SSH class with sfq 3:0
+ *   1:3 background class with sfq 5:0, the htb default class
+ *   stream n: class 1:(0x10+n) with sfq (0x10+n):0
+ *
+ * u32 filters on 1:0, one priority per protocol:
+ *   prio 1, ip: SSH and IPv4 streams. Node 800::(0x10+n) matches the
+ *     addresses and links to hash table (0x10+n): for the ports
+ *   prio 2, ipv6: IPv6 streams. The root node links to hash table 2:, where
+ *     node 2::(0x10+n) matches the whole header of stream n
+ * Everything else is not matched and goes to the default class.
+ * With the flower classifier, prio 1 and 2 hold instead one flower filter
+ * per stream with handle (0x10+n), and one for SSH with handle 1.
+ * The kernel numbers the root hash tables of the priorities from 800: up, in
+ * creation order, so ours stay below that.
+ */
+#define STREAM_MINOR(id) (0x10 + (id))
+/* slot of a stream id in the tree of its uplink */
+#define STREAM_SLOT(stream_id) ((stream_id) % TCMMD_MAX_STREAMS)
+#define BACKGROUND_MINOR 3
 
-  if (!ifb_link || !main_link)
-    return;
+#define U32_PRIO_IP 1
+#define U32_PRIO_IPV6 2
 
-  g_print ("uninit\n");
+/* nodes in a hash table are ordered by node id */
+#define U32_ROOT_HTID 0x800
+#define U32_IPV6_HTID 2
+#define U32_NODE_SSH 1
 
-  _del_rules ();
+#define FLOWER_HANDLE_SSH 1
 
-  cmd = g_strdup_printf ("tc qdisc del dev %s ingress > /dev/null 2>&1 || true",
-                         rtnl_link_get_name (main_link));
-  if ((err = system (cmd)))
-    g_printerr ("Error: command failed: '%s' (%d)\n", cmd, err);
-  g_free (cmd);
-}
+static TcmmdClassifier classifier = TCMMD_CLASSIFIER_U32;
 
 static void
-_add_qdisc_dsmark_root (void)
+_del_rules (Uplink *uplink)
 {
-  struct rtnl_qdisc *qdisc;
-  struct rtnl_tc *tc;
   int err;
 
-  qdisc = rtnl_qdisc_alloc ();
-  if (!qdisc)
+  if ((err = nl_cache_refill(sock, qdisc_cache)))
     {
-      g_printerr ("Error: unable to allocate qdisc object\n");
+      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
       exit (1);
     }
-  tc = (struct rtnl_tc *) qdisc;
 
-  /* tc qdisc add dev ifb0 handle 1:0 root dsmark indices 4 default_index 0 */
-
-  rtnl_tc_set_link (tc, ifb_link);
-  rtnl_tc_set_handle (tc, TC_HANDLE (1, 0));
-  rtnl_tc_set_parent (tc, TC_H_ROOT);
-  rtnl_tc_set_kind (tc, "dsmark");
+  /* tc qdisc del dev ifb0 root */
+  _del_qdiscs (uplink->dev, TC_H_ROOT);
 
-  rtnl_qdisc_dsmark_set_indices (qdisc, 4);
-  rtnl_qdisc_dsmark_set_default_index (qdisc, 0);
+  /* tc qdisc del dev ifb0 ingress, but not the one of the main link which
+   * is not ours when shaping egress */
+  if (uplink->ifb)
+    _del_qdiscs (uplink->ifb, TC_H_INGRESS);
+}
 
-  if ((err = rtnl_qdisc_add (sock, qdisc, NLM_F_CREATE)))
-    {
-      g_printerr ("Error: cannot add dsmark qdisc: %s\n", nl_geterror(err));
-      exit (1);
-    }
+/* Remove the tree of one uplink and forget it, leaving the others alone */
+static void
+_del_tree (Uplink *uplink)
+{
+  _del_rules (uplink);
 
-  rtnl_qdisc_put (qdisc);
+  nl_cache_free (uplink->cls1_cache);
+  uplink->cls1_cache = NULL;
 
-  if ((err = nl_cache_refill(sock, qdisc_cache)))
-    {
-      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
-      exit (1);
-    }
+  memset (&uplink->installed, 0, sizeof (uplink->installed));
+  memset (uplink->stream_ht_created, 0, sizeof (uplink->stream_ht_created));
+  uplink->stale = FALSE;
 }
 
 static void
-_add_qdisc_htb_root (void)
+netlink_del_rules (void)
+{
+  int i;
+
+  for (i = 0; i < n_uplinks; i++)
+    if (uplinks[i].dev)
+      _del_tree (&uplinks[i]);
+}
+
+static void
+netlink_uninit (void)
+{
+  int i;
+
+  for (i = 0; i < n_uplinks; i++)
+    {
+      if (!uplinks[i].dev)
+        continue;
+
+      tcmmd_log (TCMMD_LOG_INFO, "uninit %s\n",
+                 rtnl_link_get_name (uplinks[i].main));
+
+      _del_rules (&uplinks[i]);
+      _restore_root_qdisc (&uplinks[i]);
+
+      /* tc qdisc del dev eth0 ingress */
+      if (uplinks[i].ifb)
+        _del_qdiscs (uplinks[i].main, TC_H_INGRESS);
+    }
+}
+
+static struct nl_msg *
+_build_filter (struct rtnl_cls *filter, int flags)
+{
+  struct nl_msg *msg;
+  int err;
+
+  if ((err = rtnl_cls_build_add_request (filter, flags, &msg)) < 0)
+    {
+      g_printerr ("Error: cannot build filter request: %s\n", nl_geterror(err));
+      exit (1);
+    }
+  return msg;
+}
+
+static void
+_add_qdisc_htb_root (struct rtnl_link *dev)
 {
   struct rtnl_qdisc *qdisc;
   struct rtnl_tc *tc;
-  int err;
 
   qdisc = rtnl_qdisc_alloc ();
   if (!qdisc)
@@ -497,36 +828,25 @@ _add_qdisc_htb_root (void)
     }
   tc = (struct rtnl_tc *) qdisc;
 
-  /* tc qdisc add dev ifb0 handle 2:0 parent 1:0 htb r2q 2 */
+  /* tc qdisc add dev ifb0 handle 1:0 root htb r2q 2 default 3 */
 
-  rtnl_tc_set_link (tc, ifb_link);
-  rtnl_tc_set_handle (tc, TC_HANDLE (2, 0));
-  rtnl_tc_set_parent (tc, TC_HANDLE (1, 0));
+  rtnl_tc_set_link (tc, dev);
+  rtnl_tc_set_handle (tc, TC_HANDLE (1, 0));
+  rtnl_tc_set_parent (tc, TC_H_ROOT);
   rtnl_tc_set_kind (tc, "htb");
 
   rtnl_htb_set_rate2quantum (qdisc, 2);
+  rtnl_htb_set_defcls (qdisc, BACKGROUND_MINOR);
 
-  if ((err = rtnl_qdisc_add (sock, qdisc, NLM_F_CREATE)))
-    {
-      g_printerr ("Error: cannot add htb qdisc: %s\n", nl_geterror(err));
-      exit (1);
-    }
-
+  _queue_qdisc (qdisc);
   rtnl_qdisc_put (qdisc);
-
-  if ((err = nl_cache_refill(sock, qdisc_cache)))
-    {
-      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
-      exit (1);
-    }
 }
 
 static void
-_add_class_htb (uint32_t parent, uint32_t classid, uint64_t rate, uint64_t ceil)
+_add_class_htb (struct rtnl_link *dev, uint32_t parent, uint32_t classid, uint64_t rate, uint64_t ceil)
 {
   struct rtnl_class *class;
   struct rtnl_tc *tc;
-  int err;
 
   class = rtnl_class_alloc ();
   if (!class)
@@ -536,9 +856,9 @@ _add_class_htb (uint32_t parent, uint32_t classid, uint64_t rate, uint64_t ceil)
     }
   tc = (struct rtnl_tc *) class;
 
-  /* tc class add dev ifb0 parent 2:0 classid 2:1 htb rate 50000bps ceil 50000bps */
+  /* tc class add dev ifb0 parent 1:0 classid 1:1 htb rate 50000bps ceil 50000bps */
 
-  rtnl_tc_set_link (tc, ifb_link);
+  rtnl_tc_set_link (tc, dev);
   rtnl_tc_set_handle (tc, classid);
   rtnl_tc_set_parent (tc, parent);
   rtnl_tc_set_kind (tc, "htb");
@@ -547,27 +867,15 @@ _add_class_htb (uint32_t parent, uint32_t classid, uint64_t rate, uint64_t ceil)
   if (ceil > 0)
     rtnl_htb_set_ceil (class, ceil);
 
-  if ((err = rtnl_class_add (sock, class, NLM_F_CREATE)))
-    {
-      g_printerr ("Error: cannot add htb class: %s\n", nl_geterror(err));
-      exit (1);
-    }
-
+  _queue_class (class);
   rtnl_class_put (class);
-
-  if ((err = nl_cache_refill(sock, class_cache)))
-    {
-      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
-      exit (1);
-    }
 }
 
 static void
-_add_qdisc_sfq (uint32_t handle, uint32_t parent)
+_add_qdisc_sfq (struct rtnl_link *dev, uint32_t handle, uint32_t parent)
 {
   struct rtnl_qdisc *qdisc;
   struct rtnl_tc *tc;
-  int err;
 
   qdisc = rtnl_qdisc_alloc ();
   if (!qdisc)
@@ -577,34 +885,195 @@ _add_qdisc_sfq (uint32_t handle, uint32_t parent)
     }
   tc = (struct rtnl_tc *) qdisc;
 
-  /* tc qdisc add dev ifb0 handle 3:0 parent 2:1 sfq */
+  /* tc qdisc add dev ifb0 handle 3:0 parent 1:1 sfq */
 
-  rtnl_tc_set_link (tc, ifb_link);
+  rtnl_tc_set_link (tc, dev);
   rtnl_tc_set_handle (tc, handle);
   rtnl_tc_set_parent (tc, parent);
   rtnl_tc_set_kind (tc, "sfq");
 
-  if ((err = rtnl_qdisc_add (sock, qdisc, NLM_F_CREATE)))
-    {
-      g_printerr ("Error: cannot add sfq qdisc: %s\n", nl_geterror(err));
-      exit (1);
-    }
-
+  _queue_qdisc (qdisc);
   rtnl_qdisc_put (qdisc);
+}
 
-  if ((err = nl_cache_refill(sock, qdisc_cache)))
+static struct rtnl_cls *
+_alloc_filter_u32 (struct rtnl_link *dev, uint32_t parent, uint32_t prio, uint16_t protocol)
+{
+  struct rtnl_cls *filter;
+  struct rtnl_tc *tc;
+
+  filter = rtnl_cls_alloc ();
+  if (!filter)
     {
-      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
+      g_printerr ("Error: unable to allocate filter object\n");
       exit (1);
     }
+  tc = (struct rtnl_tc *) filter;
+
+  rtnl_tc_set_link (tc, dev);
+  rtnl_tc_set_parent (tc, parent);
+  rtnl_tc_set_kind (tc, "u32");
+
+  rtnl_cls_set_prio (filter, prio);
+  rtnl_cls_set_protocol (filter, protocol);
+
+  return filter;
+}
+
+static void
+_queue_filter_u32 (struct rtnl_cls *filter)
+{
+  _batch_queue (_build_filter (filter, NLM_F_CREATE | NLM_F_EXCL));
+  rtnl_cls_put (filter);
+}
+
+/* tc filter add dev ifb0 parent 1:0 protocol ip prio 1 handle 1:0:0 u32 divisor 1 */
+static void
+_add_filter_u32_hashtable (struct rtnl_link *dev, uint32_t parent, uint32_t prio, uint16_t protocol,
+                           int htid)
+{
+  struct rtnl_cls *filter;
+
+  filter = _alloc_filter_u32 (dev, parent, prio, protocol);
+  rtnl_u32_set_handle (filter, htid, 0, 0);
+  rtnl_u32_set_divisor (filter, 1);
+
+  _queue_filter_u32 (filter);
+}
+
+/* Match TCP packets and skip the IP header before jumping to the hash table:
+ * tc filter add dev ifb0 parent 1:0 protocol ip prio 1 handle 800::<node> u32 \
+ *   match u8 0x6 0xff at 9 \
+ *   match ip src <src>/32 match ip dst <dst>/32 \
+ *   offset at 0 mask 0f00 shift 6 eat link 1:0:0
+ */
+static void
+_add_filter_u32_tcp_link (struct rtnl_link *dev, uint32_t parent, int node,
+                          const struct in_addr *ip_src,
+                          const struct in_addr *ip_dst,
+                          int htid)
+{
+  struct rtnl_cls *filter;
+
+  filter = _alloc_filter_u32 (dev, parent, U32_PRIO_IP, ETH_P_IP);
+  rtnl_u32_set_handle (filter, U32_ROOT_HTID, 0, node);
+  rtnl_u32_add_key_uint8 (filter, IPPROTO_TCP, 0xff, 9, 0);
+  if (ip_src && ip_src->s_addr != INADDR_ANY)
+    rtnl_u32_add_key_in_addr (filter, ip_src, 32, 12, 0);
+  if (ip_dst && ip_dst->s_addr != INADDR_ANY)
+    rtnl_u32_add_key_in_addr (filter, ip_dst, 32, 16, 0);
+  rtnl_u32_set_selector (filter, 0, 0x0f00, 6, 0,
+                         TC_U32_VAROFFSET | TC_U32_EAT);
+  rtnl_u32_set_link (filter, U32_HT (htid));
+
+  _queue_filter_u32 (filter);
+}
+
+/* Match the TCP ports, relative to the IP payload:
+ * tc filter add dev ifb0 parent 1:0 protocol ip prio 1 handle 1:0:1 u32 ht 1:0:0 \
+ *   match u16 <sport> <mask> at 0 match u16 <dport> <mask> at 2 classid 1:1
+ */
+static void
+_add_filter_u32_tcp_ports (struct rtnl_link *dev, uint32_t parent, int htid,
+                           uint16_t sport, uint16_t sport_mask,
+                           uint16_t dport, uint16_t dport_mask,
+                           uint32_t classid)
+{
+  struct rtnl_cls *filter;
+
+  filter = _alloc_filter_u32 (dev, parent, U32_PRIO_IP, ETH_P_IP);
+  rtnl_u32_set_handle (filter, htid, 0, 1);
+  rtnl_u32_set_hashtable (filter, U32_HT (htid));
+  if (dport_mask)
+    rtnl_u32_add_key_uint16 (filter, dport, dport_mask, 2, 0);
+  if (sport_mask)
+    rtnl_u32_add_key_uint16 (filter, sport, sport_mask, 0, 0);
+  rtnl_u32_set_classid (filter, classid);
+  rtnl_u32_set_cls_terminal (filter);
+
+  _queue_filter_u32 (filter);
+}
+
+/* The IPv6 streams are in their own hash table, whose handle is known:
+ * tc filter add dev ifb0 parent 1:0 protocol ipv6 prio 2 handle 2:0:0 u32 divisor 1
+ * tc filter add dev ifb0 parent 1:0 protocol ipv6 prio 2 handle ::1 u32 match u32 0 0 at 0 link 2:0:0
+ */
+static void
+_add_filter_u32_ipv6_hashtable (struct rtnl_link *dev, uint32_t parent)
+{
+  struct rtnl_cls *filter;
+
+  _add_filter_u32_hashtable (dev, parent, U32_PRIO_IPV6, ETH_P_IPV6, U32_IPV6_HTID);
+
+  filter = _alloc_filter_u32 (dev, parent, U32_PRIO_IPV6, ETH_P_IPV6);
+  rtnl_u32_set_handle (filter, 0, 0, 1);
+  rtnl_u32_add_key_uint32 (filter, 0, 0, 0, 0);
+  rtnl_u32_set_link (filter, U32_HT (U32_IPV6_HTID));
+
+  _queue_filter_u32 (filter);
+}
+
+/* IPv6 has a fixed header length, so a single node matches it all:
+ * tc filter add dev ifb0 parent 1:0 protocol ipv6 prio 2 handle 2::<node> u32 ht 2: \
+ *   match u8 0x6 0xff at 6 \
+ *   match ip6 src <src>/128 match ip6 dst <dst>/128 \
+ *   match u16 <sport> 0xffff at 40 match u16 <dport> 0xffff at 42 classid <classid>
+ * Packets with extension headers before TCP are not matched.
+ */
+static void
+_add_filter_u32_tcp6 (struct rtnl_link *dev, uint32_t parent, int node,
+                      const struct in6_addr *ip_src,
+                      const struct in6_addr *ip_dst,
+                      uint16_t sport, uint16_t dport,
+                      uint32_t classid)
+{
+  struct rtnl_cls *filter;
+
+  filter = _alloc_filter_u32 (dev, parent, U32_PRIO_IPV6, ETH_P_IPV6);
+  rtnl_u32_set_handle (filter, U32_IPV6_HTID, 0, node);
+  rtnl_u32_set_hashtable (filter, U32_HT (U32_IPV6_HTID));
+  rtnl_u32_add_key_uint8 (filter, IPPROTO_TCP, 0xff, 6, 0);
+  if (ip_src && !IN6_IS_ADDR_UNSPECIFIED (ip_src))
+    rtnl_u32_add_key_in6_addr (filter, ip_src, 128, 8, 0);
+  if (ip_dst && !IN6_IS_ADDR_UNSPECIFIED (ip_dst))
+    rtnl_u32_add_key_in6_addr (filter, ip_dst, 128, 24, 0);
+  if (sport)
+    rtnl_u32_add_key_uint16 (filter, sport, 0xffff, 40, 0);
+  if (dport)
+    rtnl_u32_add_key_uint16 (filter, dport, 0xffff, 42, 0);
+  rtnl_u32_set_classid (filter, classid);
+  rtnl_u32_set_cls_terminal (filter);
+
+  _queue_filter_u32 (filter);
 }
 
+/* libnl's flower support has no TCP ports, IPv6 or classid: the options are
+ * added by hand, with nla_nest_start() after the generic request. Zero fields are not matched.
+ * tc filter add dev ifb0 parent 1:0 protocol ip prio 1 handle <handle> flower skip_hw \
+ *   ip_proto tcp src_ip <src> dst_ip <dst> src_port <sport> dst_port <dport> classid <classid>
+ * With 'replace', an existing filter of the same handle and family is
+ * changed in place, as tc filter replace.
+ */
 static void
-_add_filter_tcindex (uint32_t parent)
+_add_filter_flower (struct rtnl_link *dev, uint32_t parent, uint32_t handle,
+                    int family,
+                    const void *ip_src,
+                    const void *ip_dst,
+                    uint16_t sport, uint16_t dport,
+                    uint32_t classid,
+                    gboolean replace)
 {
+  static const struct in6_addr in6_mask = {{{ 0xff, 0xff, 0xff, 0xff,
+                                              0xff, 0xff, 0xff, 0xff,
+                                              0xff, 0xff, 0xff, 0xff,
+                                              0xff, 0xff, 0xff, 0xff }}};
   struct rtnl_cls *filter;
   struct rtnl_tc *tc;
-  int err;
+  struct nl_msg *msg;
+  struct nlattr *opts;
+  uint16_t protocol;
+
+  protocol = family == AF_INET6 ? ETH_P_IPV6 : ETH_P_IP;
 
   filter = rtnl_cls_alloc ();
   if (!filter)
@@ -614,250 +1083,1291 @@ _add_filter_tcindex (uint32_t parent)
     }
   tc = (struct rtnl_tc *) filter;
 
-  /* tc filter add dev ifb0 parent 2:0 protocol all prio 1 tcindex mask 0x3 shift 0 */
-
-  rtnl_tc_set_link (tc, ifb_link);
+  rtnl_tc_set_link (tc, dev);
   rtnl_tc_set_parent (tc, parent);
-  rtnl_tc_set_kind (tc, "tcindex");
+  rtnl_tc_set_kind (tc, "flower");
+  rtnl_tc_set_handle (tc, handle);
+
+  rtnl_cls_set_prio (filter,
+                     family == AF_INET6 ? U32_PRIO_IPV6 : U32_PRIO_IP);
+  rtnl_cls_set_protocol (filter, protocol);
 
-  rtnl_cls_set_prio (filter, 1);
+  msg = _build_filter (filter, replace ? NLM_F_CREATE | NLM_F_REPLACE
+                                      : NLM_F_CREATE | NLM_F_EXCL);
 
-  if ((err = rtnl_cls_add (sock, filter, NLM_F_CREATE | NLM_F_EXCL)))
+  if (!(opts = nla_nest_start (msg, TCA_OPTIONS)))
+    goto nla_put_failure;
+  NLA_PUT_U32 (msg, TCA_FLOWER_CLASSID, classid);
+  NLA_PUT_U32 (msg, TCA_FLOWER_FLAGS, TCA_CLS_FLAGS_SKIP_HW);
+  NLA_PUT_U16 (msg, TCA_FLOWER_KEY_ETH_TYPE, htons (protocol));
+  NLA_PUT_U8 (msg, TCA_FLOWER_KEY_IP_PROTO, IPPROTO_TCP);
+  if (family == AF_INET6)
     {
-      g_printerr ("Error: cannot add filter: %s\n", nl_geterror(err));
-      exit (1);
+      if (ip_src && !IN6_IS_ADDR_UNSPECIFIED ((const struct in6_addr *) ip_src))
+        {
+          NLA_PUT (msg, TCA_FLOWER_KEY_IPV6_SRC, sizeof (struct in6_addr), ip_src);
+          NLA_PUT (msg, TCA_FLOWER_KEY_IPV6_SRC_MASK, sizeof (struct in6_addr), &in6_mask);
+        }
+      if (ip_dst && !IN6_IS_ADDR_UNSPECIFIED ((const struct in6_addr *) ip_dst))
+        {
+          NLA_PUT (msg, TCA_FLOWER_KEY_IPV6_DST, sizeof (struct in6_addr), ip_dst);
+          NLA_PUT (msg, TCA_FLOWER_KEY_IPV6_DST_MASK, sizeof (struct in6_addr), &in6_mask);
+        }
+    }
+  else
+    {
+      if (ip_src && ((const struct in_addr *) ip_src)->s_addr != INADDR_ANY)
+        {
+          NLA_PUT (msg, TCA_FLOWER_KEY_IPV4_SRC, sizeof (struct in_addr), ip_src);
+          NLA_PUT_U32 (msg, TCA_FLOWER_KEY_IPV4_SRC_MASK, 0xffffffff);
+        }
+      if (ip_dst && ((const struct in_addr *) ip_dst)->s_addr != INADDR_ANY)
+        {
+          NLA_PUT (msg, TCA_FLOWER_KEY_IPV4_DST, sizeof (struct in_addr), ip_dst);
+          NLA_PUT_U32 (msg, TCA_FLOWER_KEY_IPV4_DST_MASK, 0xffffffff);
+        }
+    }
+  if (sport)
+    {
+      NLA_PUT_U16 (msg, TCA_FLOWER_KEY_TCP_SRC, htons (sport));
+      NLA_PUT_U16 (msg, TCA_FLOWER_KEY_TCP_SRC_MASK, 0xffff);
+    }
+  if (dport)
+    {
+      NLA_PUT_U16 (msg, TCA_FLOWER_KEY_TCP_DST, htons (dport));
+      NLA_PUT_U16 (msg, TCA_FLOWER_KEY_TCP_DST_MASK, 0xffff);
     }
+  nla_nest_end (msg, opts);
 
+  _batch_queue (msg);
   rtnl_cls_put (filter);
+  return;
+
+nla_put_failure:
+  g_printerr ("Error: unable to build flower filter\n");
+  exit (1);
+}
+
+static void
+_sync_caches (Uplink *uplink)
+{
+  int err;
+
+  if ((err = nl_cache_refill(sock, qdisc_cache)))
+    {
+      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
+      exit (1);
+    }
 
-  if ((err = nl_cache_refill(sock, cls2_cache)))
+  if ((err = nl_cache_refill(sock, uplink->class_cache)))
     {
       g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
       exit (1);
     }
 }
 
-void
-tcmmdrtnl_add_rules (in_addr_t *ip_src,
-                     in_addr_t *ip_dst,
-                     uint16_t tcp_sport,
-                     uint16_t tcp_dport,
-                     guint64 stream_rate,
-                     guint64 background_rate)
+/* tc filter del dev ifb0 parent <parent> protocol <protocol> prio <prio> handle <handle> <kind> */
+static void
+_del_filter (struct rtnl_link *dev, uint32_t parent, const char *kind,
+             uint32_t prio, uint16_t protocol, uint32_t handle)
 {
-  char *cmd;
+  struct rtnl_cls *filter;
+  struct rtnl_tc *tc;
+  struct nl_msg *msg;
   int err;
-  uint32_t ip_src_mask = 0xffffffff;
-  uint32_t ip_dst_mask = 0xffffffff;
-  uint16_t tcp_sport_mask = 0xffff;
-  uint16_t tcp_dport_mask = 0xffff;
-
-  /* zero means we don't filter on that */
-  if (*ip_src == 0)
-    ip_src_mask = 0;
-  if (*ip_dst == 0)
-    ip_dst_mask = 0;
-  if (tcp_sport == 0)
-    tcp_sport_mask = 0;
-  if (tcp_dport == 0)
-    tcp_dport_mask = 0;
 
-  /* if the tuple didn't change, don't reinstall the rules, just modify them */
-  if (previous_port == tcp_dport)
+  filter = rtnl_cls_alloc ();
+  if (!filter)
     {
-      g_print ("Updating traffic control: tcp_dport=%d stream_rate=%"G_GUINT64_FORMAT" background_rate=%"G_GUINT64_FORMAT" ...\n", tcp_dport, stream_rate, background_rate);
-
-      if (previous_stream_rate != stream_rate)
-        {
-          cmd = g_strdup_printf (
-            "tc class change dev ifb0 parent 2:0 classid 2:2 htb rate %"G_GUINT64_FORMAT"bps",
-            stream_rate);
-          g_print ("%s\n", cmd);
-          err = system (cmd);
-          g_print ("cmd returned %d\n", err);
-          g_free (cmd);
-        }
+      g_printerr ("Error: unable to allocate filter object\n");
+      exit (1);
+    }
+  tc = (struct rtnl_tc *) filter;
 
-      if (previous_background_rate != background_rate)
-        {
-          cmd = g_strdup_printf (
-            "tc class change dev ifb0 parent 2:0 classid 2:3 htb rate %"G_GUINT64_FORMAT"bps ceil %"G_GUINT64_FORMAT"bps",
-            background_rate, background_rate);
-          g_print ("%s\n", cmd);
-          err = system (cmd);
-          g_print ("cmd returned %d\n", err);
-          g_free (cmd);
-        }
+  rtnl_tc_set_link (tc, dev);
+  rtnl_tc_set_parent (tc, parent);
+  rtnl_tc_set_handle (tc, handle);
+  rtnl_tc_set_kind (tc, kind);
 
-      previous_stream_rate = stream_rate;
-      previous_background_rate = background_rate;
+  rtnl_cls_set_prio (filter, prio);
+  rtnl_cls_set_protocol (filter, protocol);
 
-      g_print ("Updating traffic control: tcp_dport=%d stream_rate=%"G_GUINT64_FORMAT" background_rate=%"G_GUINT64_FORMAT" : done.\n", tcp_dport, stream_rate, background_rate);
-      return;
+  if ((err = rtnl_cls_build_delete_request (filter, 0, &msg)) < 0)
+    {
+      g_printerr ("Error: cannot build filter request: %s\n", nl_geterror(err));
+      exit (1);
     }
+  _batch_queue (msg);
+  rtnl_cls_put (filter);
+}
 
-  tcmmdrtnl_del_rules ();
-
-  g_print ("Adding traffic control: tcp_dport=%d stream_rate=%"G_GUINT64_FORMAT" background_rate=%"G_GUINT64_FORMAT" ...\n", tcp_dport, stream_rate, background_rate);
+/* tc class del dev ifb0 parent 1:0 classid <classid>, removing its leaf qdisc */
+static void
+_del_class (struct rtnl_link *dev, uint32_t parent, uint32_t classid)
+{
+  struct rtnl_class *class;
+  struct rtnl_tc *tc;
+  struct nl_msg *msg;
+  int err;
 
-#if 0
-  /* add qdisc and classes */
-  _add_qdisc_dsmark_root ();
-  _add_qdisc_htb_root ();
-  _add_class_htb (TC_HANDLE (2, 0), TC_HANDLE (2, 1), 50000, 50000);
-  _add_qdisc_sfq (TC_HANDLE (3, 0), TC_HANDLE (2, 1));
-  _add_class_htb (TC_HANDLE (2, 0), TC_HANDLE (2, 2), stream_rate, 0);
-  _add_qdisc_sfq (TC_HANDLE (4, 0), TC_HANDLE (2, 2));
-  _add_class_htb (TC_HANDLE (2, 0), TC_HANDLE (2, 3), background_rate, background_rate);
-  _add_qdisc_sfq (TC_HANDLE (5, 0), TC_HANDLE (2, 3));
-#endif
-
-  /* classifier caches are specific to the qdisc they are attached to */
-  if ((err = rtnl_cls_alloc_cache (sock,
-                                   rtnl_link_get_ifindex (ifb_link),
-                                   TC_HANDLE (1,0),
-                                   &cls1_cache)) < 0)
+  class = rtnl_class_alloc ();
+  if (!class)
     {
-      g_printerr ("Error: unable to allocate filter cache: %s\n", nl_geterror(err));
+      g_printerr ("Error: unable to allocate class object\n");
       exit (1);
     }
-  nl_cache_mngt_provide (cls1_cache);
+  tc = (struct rtnl_tc *) class;
 
-  if ((err = rtnl_cls_alloc_cache (sock,
-                                   rtnl_link_get_ifindex (ifb_link),
-                                   TC_HANDLE (1,0),
-                                   &cls2_cache)) < 0)
+  rtnl_tc_set_link (tc, dev);
+  rtnl_tc_set_parent (tc, parent);
+  rtnl_tc_set_handle (tc, classid);
+
+  if ((err = rtnl_class_build_delete_request (class, &msg)) < 0)
     {
-      g_printerr ("Error: unable to allocate filter cache: %s\n", nl_geterror(err));
+      g_printerr ("Error: cannot build class request: %s\n", nl_geterror(err));
       exit (1);
     }
-  nl_cache_mngt_provide (cls2_cache);
+  _batch_queue (msg);
+  rtnl_class_put (class);
+}
+
+/* Shared part of the tree: SSH, background and the default filter */
+static void
+_add_base_rules (Uplink *uplink, guint64 background_rate)
+{
+  /* SSH to this host, or from it when shaping egress */
+  uint16_t ssh_sport = direction == TCMMD_DIRECTION_EGRESS ? 22 : 0;
+  uint16_t ssh_dport = direction == TCMMD_DIRECTION_EGRESS ? 0 : 22;
+
+  /* add qdisc and classes */
+  _add_qdisc_htb_root (uplink->dev);
+  _add_class_htb (uplink->dev, TC_HANDLE (1, 0), TC_HANDLE (1, 1), 50000, 50000); /* SSH */
+  _add_qdisc_sfq (uplink->dev, TC_HANDLE (3, 0), TC_HANDLE (1, 1));
+  _add_class_htb (uplink->dev, TC_HANDLE (1, 0), TC_HANDLE (1, BACKGROUND_MINOR),
+                  background_rate, background_rate);
+  _add_qdisc_sfq (uplink->dev, TC_HANDLE (5, 0), TC_HANDLE (1, BACKGROUND_MINOR));
+
+  /* classifiers on 1:0: SSH and the IPv6 hash table, the rest goes to the
+   * default class */
+  if (classifier == TCMMD_CLASSIFIER_FLOWER)
+    {
+      _add_filter_flower (uplink->dev, TC_HANDLE (1, 0), FLOWER_HANDLE_SSH, AF_INET,
+                          NULL, NULL, ssh_sport, ssh_dport, TC_HANDLE (1, 1),
+                          FALSE);
+    }
+  else
+    {
+      _add_filter_u32_hashtable (uplink->dev, TC_HANDLE (1, 0), U32_PRIO_IP, ETH_P_IP, 1);
+      _add_filter_u32_tcp_ports (uplink->dev, TC_HANDLE (1, 0), 1,
+                                 ssh_sport, ssh_sport ? 0xffff : 0,
+                                 ssh_dport, ssh_dport ? 0xffff : 0,
+                                 TC_HANDLE (1, 1));
+      _add_filter_u32_tcp_link (uplink->dev, TC_HANDLE (1, 0), U32_NODE_SSH, NULL, NULL, 1);
+      _add_filter_u32_ipv6_hashtable (uplink->dev, TC_HANDLE (1, 0));
+    }
+}
 
-  /* add classifiers */
-  /* TODO: tcindex classifiers not supported by libnl?
-   * This patch could help:
-   * http://marc.info/?l=linux-netdev&m=120888202117595&w=2
-   */
-  /* _add_filter_tcindex (TC_HANDLE (2, 0)); */
-
-  cmd = g_strdup_printf (
-    "tc qdisc add dev ifb0 "Q_ESTIMATOR" handle 1:0 root dsmark indices 4 default_index 0 && "
-    "tc qdisc add dev ifb0 "Q_ESTIMATOR" handle 2:0 parent 1:0 htb r2q 2 && "
-    "tc class add dev ifb0 "Q_ESTIMATOR" parent 2:0 classid 2:1 htb rate 50000bps ceil 50000bps && " /* SSH */
-    "tc qdisc add dev ifb0 "Q_ESTIMATOR" handle 3:0 parent 2:1 sfq && "
-    "tc class add dev ifb0 "Q_ESTIMATOR" parent 2:0 classid 2:2 htb rate %"G_GUINT64_FORMAT"bps && "
-    "tc qdisc add dev ifb0 "Q_ESTIMATOR" handle 4:0 parent 2:2 sfq && "
-    "tc class add dev ifb0 "Q_ESTIMATOR" parent 2:0 classid 2:3 htb rate %"G_GUINT64_FORMAT"bps ceil %"G_GUINT64_FORMAT"bps && "
-    "tc qdisc add dev ifb0 "Q_ESTIMATOR" handle 5:0 parent 2:3 sfq && "
-    //
-    "tc filter add dev ifb0 parent 2:0 protocol all prio 1 tcindex mask 0x3 shift 0 && "
-    "tc filter add dev ifb0 parent 2:0 protocol all prio 1 handle 3 tcindex classid 2:3 && "
-    "tc filter add dev ifb0 parent 2:0 protocol all prio 1 handle 2 tcindex classid 2:2 && "
-    "tc filter add dev ifb0 parent 2:0 protocol all prio 1 handle 1 tcindex classid 2:1 && "
-
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 handle 1:0:0 u32 divisor 1 && "
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 u32 match u8 0x6 0xff at 9 offset at 0 mask 0f00 shift 6 eat link 1:0:0 && "
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 handle 1:0:1 u32 ht 1:0:0 match u16 0x16 0xffff at 2 classid 1:1 && "
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 handle 2:0:0 u32 divisor 1 && "
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 u32 match u8 0x6 0xff at 9 match u32 0x%x 0x%x at 12 match u32 0x%x 0x%x at 16 offset at 0 mask 0f00 shift 6 eat link 2:0:0 && "
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 handle 2:0:1 u32 ht 2:0:0 match u16 0x%x 0x%x at 2 match u16 0x%x 0x%x at 0 classid 1:2 && "
-    "tc filter add dev ifb0 parent 1:0 protocol all prio 1 u32 match u32 0x0 0x0 at 0 classid 1:3",
-    stream_rate, background_rate, background_rate,
-    *ip_src, ip_src_mask,
-    *ip_dst, ip_dst_mask,
-    tcp_dport, tcp_dport_mask,
-    tcp_sport, tcp_sport_mask
-  );
-
-  g_print ("%s\n", cmd);
-  err = system (cmd);
-  g_print ("cmd returned %d\n", err);
-  g_free (cmd);
-
-  previous_port = tcp_dport;
-
-  g_print ("Adding traffic control: tcp_dport=%d stream_rate=%"G_GUINT64_FORMAT" background_rate=%"G_GUINT64_FORMAT" : done.\n", tcp_dport, stream_rate, background_rate);
-
-}
-
-struct tcmmd_stats {
-  guint64 qdisc_root_bytes;
-  guint64 qdisc_stream_bytes;
-  guint64 qdisc_background_bytes;
-};
+static void
+_stream_state_set (StreamState *state, const TcmmdStreamSpec *stream)
+{
+  gsize len = stream->family == AF_INET6 ? 16 : 4;
+
+  memset (state, 0, sizeof (StreamState));
+  state->used = TRUE;
+  state->family = stream->family;
+  if (stream->ip_src)
+    memcpy (state->ip_src, stream->ip_src, len);
+  if (stream->ip_dst)
+    memcpy (state->ip_dst, stream->ip_dst, len);
+  state->tcp_sport = stream->tcp_sport;
+  state->tcp_dport = stream->tcp_dport;
+  state->rate = stream->stream_rate;
+}
 
+/* The packets of a stream as they are sent: the other way round */
 static void
-qdisc_stats_cb (struct nl_object *obj, void *arg)
+_stream_state_reverse (StreamState *reversed, const StreamState *stream)
 {
-  struct rtnl_qdisc *qdisc = nl_object_priv(obj);
-  struct rtnl_tc *tc = (struct rtnl_tc *) qdisc;
-  struct tcmmd_stats *stats = arg;
-  char buf[32];
+  *reversed = *stream;
+  memcpy (reversed->ip_src, stream->ip_dst, sizeof (reversed->ip_src));
+  memcpy (reversed->ip_dst, stream->ip_src, sizeof (reversed->ip_dst));
+  reversed->tcp_sport = stream->tcp_dport;
+  reversed->tcp_dport = stream->tcp_sport;
+}
 
-  g_print ("stats of qdisc handle %s %s: RTNL_TC_PACKETS=%"G_GUINT64_FORMAT" RTNL_TC_BYTES=%"G_GUINT64_FORMAT"\n",
-           rtnl_tc_handle2str (rtnl_tc_get_handle (tc), buf, sizeof(buf)),
-           rtnl_tc_get_kind (tc),
-           rtnl_tc_get_stat (tc, RTNL_TC_PACKETS),
-           rtnl_tc_get_stat (tc, RTNL_TC_BYTES));
-
-  g_print ("  - RTNL_TC_PACKETS:    %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_PACKETS));
-  g_print ("  - RTNL_TC_BYTES:      %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_BYTES));
-  g_print ("  - RTNL_TC_RATE_BPS:   %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_RATE_BPS));
-  g_print ("  - RTNL_TC_RATE_PPS:   %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_RATE_PPS));
-  g_print ("  - RTNL_TC_QLEN:       %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_QLEN));
-  g_print ("  - RTNL_TC_BACKLOG:    %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_BACKLOG));
-  g_print ("  - RTNL_TC_DROPS:      %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_DROPS));
-  g_print ("  - RTNL_TC_REQUEUES:   %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_REQUEUES));
-  g_print ("  - RTNL_TC_OVERLIMITS: %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_OVERLIMITS));
-
-  /* if tcmmd didn't install any rules, the default pfifo_fast is on 0:0 */
-  if (rtnl_tc_get_handle (tc) == TC_HANDLE (0, 0) ||
-      rtnl_tc_get_handle (tc) == TC_HANDLE (1, 0))
-    stats->qdisc_root_bytes = rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+static gboolean
+_stream_match_equal (const StreamState *a, const StreamState *b)
+{
+  return a->family == b->family &&
+         memcmp (a->ip_src, b->ip_src, sizeof (a->ip_src)) == 0 &&
+         memcmp (a->ip_dst, b->ip_dst, sizeof (a->ip_dst)) == 0 &&
+         a->tcp_sport == b->tcp_sport &&
+         a->tcp_dport == b->tcp_dport;
+}
 
-  if (rtnl_tc_get_handle (tc) == TC_HANDLE (4, 0) &&
-      g_strcmp0 (rtnl_tc_get_kind (tc), "sfq") == 0)
-    stats->qdisc_stream_bytes = rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+/* flower replaces the keys of a filter in place; u32 keeps the old keys on
+ * a change, and the priority of a filter depends on the family */
+static gboolean
+_stream_filter_replaceable (const StreamState *old, const StreamState *new)
+{
+  return classifier == TCMMD_CLASSIFIER_FLOWER && old->family == new->family;
+}
 
-  if (rtnl_tc_get_handle (tc) == TC_HANDLE (5, 0) &&
-      g_strcmp0 (rtnl_tc_get_kind (tc), "sfq") == 0)
-    stats->qdisc_background_bytes = rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+static void
+_add_stream_class (Uplink *uplink, int id, guint64 stream_rate)
+{
+  int minor = STREAM_MINOR (id);
+
+  _add_class_htb (uplink->dev, TC_HANDLE (1, 0), TC_HANDLE (1, minor), stream_rate, 0);
+  _add_qdisc_sfq (uplink->dev, TC_HANDLE (minor, 0), TC_HANDLE (1, minor));
 }
 
-void
-tcmmdrtnl_get_stats (guint64 *qdisc_root_bytes,
-                     guint64 *qdisc_stream_bytes,
-                     guint64 *qdisc_background_bytes)
+static void
+_add_stream_filters (Uplink *uplink, int id, const StreamState *stream, gboolean replace)
 {
-  struct rtnl_qdisc *qdisc;
-  struct rtnl_tc *tc;
-  int err;
-  struct tcmmd_stats stats = {0,};
+  StreamState sent;
+  int minor = STREAM_MINOR (id);
+  uint16_t tcp_sport_mask = 0xffff;
+  uint16_t tcp_dport_mask = 0xffff;
 
-  if ((err = nl_cache_refill(sock, qdisc_cache)))
+  if (direction == TCMMD_DIRECTION_EGRESS)
     {
-      g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
-      exit (1);
+      _stream_state_reverse (&sent, stream);
+      stream = &sent;
     }
 
-  if (!(qdisc = rtnl_qdisc_alloc ()))
+  /* zero means we don't filter on that */
+  if (stream->tcp_sport == 0)
+    tcp_sport_mask = 0;
+  if (stream->tcp_dport == 0)
+    tcp_dport_mask = 0;
+
+  if (classifier == TCMMD_CLASSIFIER_FLOWER)
     {
-      g_printerr ("Error: unable to allocate qdisc\n");
-      exit (1);
+      _add_filter_flower (uplink->dev, TC_HANDLE (1, 0), minor, stream->family,
+                          stream->ip_src, stream->ip_dst,
+                          stream->tcp_sport, stream->tcp_dport,
+                          TC_HANDLE (1, minor), replace);
+    }
+  else if (stream->family == AF_INET6)
+    {
+      _add_filter_u32_tcp6 (uplink->dev, TC_HANDLE (1, 0), minor,
+                            (const struct in6_addr *) stream->ip_src,
+                            (const struct in6_addr *) stream->ip_dst,
+                            stream->tcp_sport, stream->tcp_dport,
+                            TC_HANDLE (1, minor));
+    }
+  else
+    {
+      /* the hash table is filled before being linked from the root one */
+      if (!uplink->stream_ht_created[id])
+        {
+          _add_filter_u32_hashtable (uplink->dev, TC_HANDLE (1, 0), U32_PRIO_IP,
+                                     ETH_P_IP, minor);
+          uplink->stream_ht_created[id] = TRUE;
+        }
+      _add_filter_u32_tcp_ports (uplink->dev, TC_HANDLE (1, 0), minor,
+                                 stream->tcp_sport, tcp_sport_mask,
+                                 stream->tcp_dport, tcp_dport_mask,
+                                 TC_HANDLE (1, minor));
+      _add_filter_u32_tcp_link (uplink->dev, TC_HANDLE (1, 0), minor,
+                                (const struct in_addr *) stream->ip_src,
+                                (const struct in_addr *) stream->ip_dst,
+                                minor);
     }
-  tc = (struct rtnl_tc *) qdisc;
-
-  /* dev ifb0 root */
-  rtnl_tc_set_link (tc, ifb_link);
-  //rtnl_tc_set_kind (tc, "sfq");
-
-  nl_cache_foreach_filter (qdisc_cache, OBJ_CAST(qdisc), qdisc_stats_cb, &stats);
-
-  if (qdisc_root_bytes)
-    *qdisc_root_bytes = stats.qdisc_root_bytes;
-  if (qdisc_stream_bytes)
-    *qdisc_stream_bytes = stats.qdisc_stream_bytes;
-  if (qdisc_background_bytes)
-    *qdisc_background_bytes = stats.qdisc_background_bytes;
 }
 
+static void
+_del_stream_filters (Uplink *uplink, int id, const StreamState *stream)
+{
+  int minor = STREAM_MINOR (id);
+
+  if (classifier == TCMMD_CLASSIFIER_FLOWER)
+    {
+      if (stream->family == AF_INET6)
+        _del_filter (uplink->dev, TC_HANDLE (1, 0), "flower", U32_PRIO_IPV6, ETH_P_IPV6, minor);
+      else
+        _del_filter (uplink->dev, TC_HANDLE (1, 0), "flower", U32_PRIO_IP, ETH_P_IP, minor);
+    }
+  else if (stream->family == AF_INET6)
+    {
+      _del_filter (uplink->dev, TC_HANDLE (1, 0), "u32", U32_PRIO_IPV6, ETH_P_IPV6,
+                   U32_HT (U32_IPV6_HTID) | minor);
+    }
+  else
+    {
+      _del_filter (uplink->dev, TC_HANDLE (1, 0), "u32", U32_PRIO_IP, ETH_P_IP,
+                   U32_HT (U32_ROOT_HTID) | minor);
+      _del_filter (uplink->dev, TC_HANDLE (1, 0), "u32", U32_PRIO_IP, ETH_P_IP,
+                   U32_HT (minor) | 1);
+    }
+}
+
+/* tc class change dev ifb0 parent 1:0 classid 1:3 htb rate 5000bps ceil 5000bps */
+static struct nl_msg *
+_build_class_change (struct rtnl_link *dev, uint32_t classid, guint64 rate, guint64 ceil)
+{
+  struct rtnl_class *class;
+  struct rtnl_tc *tc;
+  struct nl_msg *msg;
+  int err;
+
+  class = rtnl_class_alloc ();
+  if (!class)
+    {
+      g_printerr ("Error: unable to allocate class object\n");
+      exit (1);
+    }
+  tc = (struct rtnl_tc *) class;
+
+  rtnl_tc_set_link (tc, dev);
+  rtnl_tc_set_parent (tc, TC_HANDLE (1, 0));
+  rtnl_tc_set_kind (tc, "htb");
+  rtnl_tc_set_handle (tc, classid);
+
+  rtnl_htb_set_rate (class, rate);
+  if (ceil > 0)
+    rtnl_htb_set_ceil (class, ceil);
+
+  if ((err = rtnl_class_build_add_request (class, NLM_F_REPLACE, &msg)) < 0)
+    {
+      g_printerr ("Error: cannot build class request: %s\n", nl_geterror(err));
+      exit (1);
+    }
+  rtnl_class_put (class);
+
+  return msg;
+}
+
+static gboolean
+_commit_rules (Uplink *uplink)
+{
+  int err;
+
+  if ((err = _batch_commit ()) < 0)
+    {
+      g_printerr ("Error: cannot change traffic control rules on %s: %s\n",
+                  rtnl_link_get_name (uplink->dev), nl_geterror(err));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* tc -s qdisc show dev <link> handle <handle>, without dumping the qdiscs
+ * of every interface. A zero handle means the root qdisc, whatever it is.
+ * The kernel only sends the answer back to us with NLM_F_ECHO; otherwise it
+ * goes to the multicast group alone. */
+static void
+_queue_get_qdisc (struct rtnl_link *link, uint32_t handle)
+{
+  struct nl_msg *msg;
+  struct tcmsg tchdr = {
+    .tcm_family = AF_UNSPEC,
+    .tcm_ifindex = rtnl_link_get_ifindex (link),
+    .tcm_handle = handle,
+    .tcm_parent = handle ? 0 : TC_H_ROOT,
+  };
+
+  if (!(msg = nlmsg_alloc_simple (RTM_GETQDISC, NLM_F_ECHO)) ||
+      nlmsg_append (msg, &tchdr, sizeof (tchdr), NLMSG_ALIGNTO) < 0)
+    {
+      g_printerr ("Error: unable to build qdisc request\n");
+      exit (1);
+    }
+  _batch_queue (msg);
+}
+
+static gboolean
+_qdisc_in_kernel (struct rtnl_link *link, uint32_t handle)
+{
+  int err;
+
+  _queue_get_qdisc (link, handle);
+  err = _batch_commit ();
+  if (err == -NLE_OBJ_NOTFOUND)
+    return FALSE;
+  if (err < 0)
+    {
+      g_printerr ("Error: cannot get qdisc: %s\n", nl_geterror(err));
+      exit (1);
+    }
+
+  return TRUE;
+}
+
+/* Whether the root qdisc tcmmd installed is still there: another program,
+ * or an administrator with tc, may have removed the tree */
+static gboolean
+_tree_in_kernel (Uplink *uplink)
+{
+  return _qdisc_in_kernel (uplink->dev, TC_HANDLE (1, 0));
+}
+
+/* classifier caches are specific to the qdisc they are attached to */
+static void
+_alloc_cls1_cache (Uplink *uplink)
+{
+  int err;
+
+  nl_cache_free (uplink->cls1_cache);
+  if ((err = rtnl_cls_alloc_cache (sock,
+                                   rtnl_link_get_ifindex (uplink->dev),
+                                   TC_HANDLE (1,0),
+                                   &uplink->cls1_cache)) < 0)
+    {
+      g_printerr ("Error: unable to allocate filter cache: %s\n", nl_geterror(err));
+      exit (1);
+    }
+  nl_cache_mngt_provide (uplink->cls1_cache);
+}
+
+/* Bring the kernel from the installed tree to the desired one in one batch
+ * of the fewest requests. The classes and filters of the streams which do
+ * not change are not touched, so their queues keep their packets; a stream
+ * matching another flow keeps its class and only has its filter changed.
+ * Returns FALSE if the kernel refused part of the batch: installed is left
+ * as it was and the uplink is marked stale. */
+static gboolean
+_reconcile (Uplink *uplink, const TreeState *desired)
+{
+  TreeState *installed = &uplink->installed;
+  TreeState previous = *installed;
+  gboolean new_tree;
+  int id;
+
+  if (!desired->installed)
+    {
+      _del_tree (uplink);
+      return TRUE;
+    }
+
+  if (installed->installed && uplink->stale)
+    installed->installed = FALSE;
+  else if (installed->installed && !_tree_in_kernel (uplink))
+    {
+      g_printerr ("Warning: the rules on %s were removed, installing them "
+                  "again\n", rtnl_link_get_name (uplink->dev));
+      installed->installed = FALSE;
+    }
+
+  new_tree = !installed->installed;
+  if (new_tree)
+    {
+      /* also forgets the installed streams */
+      _del_tree (uplink);
+      _add_base_rules (uplink, desired->background_rate);
+    }
+  else if (desired->background_rate != installed->background_rate)
+    {
+      _batch_queue (_build_class_change (uplink->dev, TC_HANDLE (1, BACKGROUND_MINOR),
+                                         desired->background_rate,
+                                         desired->background_rate));
+    }
+
+  /* without the redirection, the tree does not see the traffic: what is
+   * left of it goes, and it is added again in the same batch */
+  if (uplink->redirect_missing)
+    {
+      int err;
+
+      if ((err = nl_cache_refill (sock, qdisc_cache)))
+        {
+          g_printerr ("Error: cannot sync cache: %s\n", nl_geterror(err));
+          exit (1);
+        }
+      _del_qdiscs (uplink->main, TC_H_INGRESS);
+      _queue_ingress_redirection (uplink);
+    }
+
+  /* unlink first, so no packet reaches a class being removed */
+  for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+    {
+      const StreamState *old = &installed->streams[id];
+      const StreamState *new = &desired->streams[id];
+
+      if (old->used &&
+          (!new->used ||
+           (!_stream_match_equal (old, new) &&
+            !_stream_filter_replaceable (old, new))))
+        _del_stream_filters (uplink, id, old);
+    }
+
+  for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+    {
+      const StreamState *old = &installed->streams[id];
+      const StreamState *new = &desired->streams[id];
+
+      if (old->used && !new->used)
+        {
+          /* removes its sfq too */
+          _del_class (uplink->dev, TC_HANDLE (1, 0), TC_HANDLE (1, STREAM_MINOR (id)));
+        }
+      else if (!old->used && new->used)
+        {
+          _add_stream_class (uplink, id, new->rate);
+          _add_stream_filters (uplink, id, new, FALSE);
+        }
+      else if (old->used && new->used)
+        {
+          if (!_stream_match_equal (old, new))
+            _add_stream_filters (uplink, id, new,
+                                 _stream_filter_replaceable (old, new));
+          if (old->rate != new->rate)
+            _batch_queue (_build_class_change (uplink->dev, TC_HANDLE (1, STREAM_MINOR (id)),
+                                               new->rate, 0));
+        }
+    }
+
+  if (!_commit_rules (uplink))
+    {
+      *installed = previous;
+      uplink->stale = TRUE;
+      return FALSE;
+    }
+  *installed = *desired;
+  uplink->stale = FALSE;
+  uplink->redirect_missing = FALSE;
+
+  if (new_tree)
+    _alloc_cls1_cache (uplink);
+
+  return TRUE;
+}
+
+/* After a failed batch, build the tree of a stale uplink again from
+ * scratch; if this fails too, the next change will try once more */
+static void
+_restore_tree (Uplink *uplink, const TreeState *tree)
+{
+  /* tree may be uplink->installed, which _reconcile() changes */
+  TreeState copy = *tree;
+
+  if (!_reconcile (uplink, &copy))
+    g_printerr ("Warning: the rules on %s do not match the managed flows\n",
+                rtnl_link_get_name (uplink->dev));
+}
+
+static void
+netlink_set_classifier (TcmmdClassifier new_classifier)
+{
+  int i;
+
+  for (i = 0; i < n_uplinks; i++)
+    g_return_if_fail (!uplinks[i].installed.installed);
+
+  classifier = new_classifier;
+}
+
+/* The trees are installed on the devices _init_ifb_link() found for this
+ * direction */
+static void
+netlink_set_direction (TcmmdDirection new_direction)
+{
+  int i;
+
+  for (i = 0; i < n_uplinks; i++)
+    g_return_if_fail (!uplinks[i].dev);
+
+  direction = new_direction;
+}
+
+/* The uplink of a stream id, or NULL if it is not one of ours */
+static Uplink *
+_stream_uplink (int stream_id)
+{
+  if (stream_id < 0 || TCMMD_STREAM_LINK (stream_id) >= n_uplinks)
+    return NULL;
+
+  return &uplinks[TCMMD_STREAM_LINK (stream_id)];
+}
+
+static int
+route_valid_cb (struct nl_msg *msg, void *arg)
+{
+  struct nlattr *tb[RTA_MAX + 1];
+  int *oif = arg;
+
+  if (nlmsg_parse (nlmsg_hdr (msg), sizeof (struct rtmsg), tb, RTA_MAX,
+                   NULL) < 0)
+    return NL_OK;
+
+  if (tb[RTA_OIF])
+    *oif = nla_get_u32 (tb[RTA_OIF]);
+
+  return NL_OK;
+}
+
+/* The uplink a stream arrives on, or leaves from when shaping egress: the
+ * one of the route to the remote end, as "ip route get <ip_src>". A stream
+ * from any address, or from a sender not routed through one of our uplinks,
+ * goes to the first one. */
+static Uplink *
+_uplink_for_stream (const TcmmdStreamSpec *stream)
+{
+  static const guint8 any[16] = {0,};
+  struct rtmsg rtm = { .rtm_family = stream->family };
+  gsize len = stream->family == AF_INET6 ? 16 : 4;
+  struct nl_msg *msg;
+  int oif = 0;
+  int err;
+  int i;
+
+  if (n_uplinks == 1)
+    return &uplinks[0];
+
+  if (!stream->ip_src || memcmp (stream->ip_src, any, len) == 0)
+    {
+      tcmmd_log (TCMMD_LOG_INFO, "Stream tcp_dport=%d from any address, "
+                 "shaped on %s\n", stream->tcp_dport,
+                 rtnl_link_get_name (uplinks[0].main));
+      return &uplinks[0];
+    }
+
+  rtm.rtm_dst_len = len * 8;
+  if (!(msg = nlmsg_alloc_simple (RTM_GETROUTE, 0)) ||
+      nlmsg_append (msg, &rtm, sizeof (rtm), NLMSG_ALIGNTO) < 0 ||
+      nla_put (msg, RTA_DST, len, stream->ip_src) < 0)
+    {
+      g_printerr ("Error: unable to build route request\n");
+      exit (1);
+    }
+  _batch_queue (msg);
+
+  if ((err = _batch_commit_full (route_valid_cb, &oif)) < 0)
+    tcmmd_log (TCMMD_LOG_INFO, "No route to the sender of tcp_dport=%d: %s\n",
+               stream->tcp_dport, nl_geterror(err));
+
+  for (i = 0; i < n_uplinks; i++)
+    if (rtnl_link_get_ifindex (uplinks[i].main) == oif)
+      return &uplinks[i];
+
+  tcmmd_log (TCMMD_LOG_INFO, "Stream tcp_dport=%d not received on a shaped "
+             "interface, shaped on %s\n", stream->tcp_dport,
+             rtnl_link_get_name (uplinks[0].main));
+  return &uplinks[0];
+}
+
+static gint64
+netlink_update_rate (TcmmdClass class_id,
+                       int stream_id,
+                       guint64 rate,
+                       guint64 ceil)
+{
+  Uplink *uplink;
+  struct nl_msg *msg;
+  uint32_t classid;
+  gint64 start;
+  int err;
+
+  start = g_get_monotonic_time ();
+
+  if (class_id == TCMMD_CLASS_STREAM)
+    {
+      uplink = _stream_uplink (stream_id);
+      g_return_val_if_fail (uplink != NULL, -1);
+      classid = TC_HANDLE (1, STREAM_MINOR (STREAM_SLOT (stream_id)));
+    }
+  else
+    {
+      uplink = _stream_uplink (stream_id);
+      g_return_val_if_fail (uplink != NULL, -1);
+      classid = TC_HANDLE (1, BACKGROUND_MINOR);
+    }
+
+  msg = _build_class_change (uplink->dev, classid, rate, ceil);
+  if ((err = nl_send_sync (sock, msg)) < 0)
+    {
+      g_printerr ("Error: cannot change htb class: %s\n", nl_geterror(err));
+      return -1;
+    }
+
+  /* only what the kernel acknowledged */
+  if (class_id == TCMMD_CLASS_STREAM)
+    uplink->installed.streams[STREAM_SLOT (stream_id)].rate = rate;
+  else
+    uplink->installed.background_rate = rate;
+
+  return g_get_monotonic_time () - start;
+}
+
+/* All the changes of an uplink go in the same batch, with the shared part
+ * of its tree if it is not installed yet. */
+static gboolean
+netlink_replace_streams (const int *old_ids,
+                         guint n_old,
+                         const TcmmdStreamSpec *streams,
+                         guint n_streams,
+                         const guint64 *background_rates,
+                         int *stream_ids)
+{
+  TreeState previous[TCMMD_MAX_LINKS];
+  TreeState desired[TCMMD_MAX_LINKS];
+  gboolean changed[TCMMD_MAX_LINKS] = { FALSE, };
+  gboolean added[TCMMD_MAX_LINKS] = { FALSE, };
+  /* slots of the removed streams, which the new ones take over first */
+  gboolean freed[TCMMD_MAX_LINKS][TCMMD_MAX_STREAMS];
+  int link;
+  guint i;
+
+  memset (freed, 0, sizeof (freed));
+  for (link = 0; link < n_uplinks; link++)
+    previous[link] = desired[link] = uplinks[link].installed;
+
+  for (i = 0; i < n_old; i++)
+    {
+      int slot = STREAM_SLOT (old_ids[i]);
+
+      g_return_val_if_fail (_stream_uplink (old_ids[i]) != NULL, FALSE);
+      link = TCMMD_STREAM_LINK (old_ids[i]);
+      if (!desired[link].streams[slot].used)
+        continue;
+      desired[link].streams[slot].used = FALSE;
+      freed[link][slot] = TRUE;
+      changed[link] = TRUE;
+    }
+
+  /* allocate all the ids first: a batch is applied entirely or not at all */
+  for (i = 0; i < n_streams; i++)
+    {
+      TreeState *tree;
+      int id = 0;
+
+      link = _uplink_for_stream (&streams[i]) - uplinks;
+      tree = &desired[link];
+      while (id < TCMMD_MAX_STREAMS && !freed[link][id])
+        id++;
+      if (id == TCMMD_MAX_STREAMS)
+        {
+          id = 0;
+          while (id < TCMMD_MAX_STREAMS && tree->streams[id].used)
+            id++;
+        }
+      if (id == TCMMD_MAX_STREAMS)
+        {
+          g_printerr ("Error: too many streams on %s, tcp_dport=%d not managed\n",
+                      rtnl_link_get_name (uplinks[link].main),
+                      streams[i].tcp_dport);
+          return FALSE;
+        }
+      /* a class of a removed stream keeps its queue, only the filter and
+       * the rate change */
+      freed[link][id] = FALSE;
+      _stream_state_set (&tree->streams[id], &streams[i]);
+      tree->installed = TRUE;
+      tree->background_rate = background_rates[link];
+      changed[link] = TRUE;
+      added[link] = TRUE;
+      stream_ids[i] = link * TCMMD_MAX_STREAMS + id;
+    }
+
+  /* an uplink left without streams goes back to unshaped */
+  for (link = 0; link < n_uplinks; link++)
+    {
+      int id;
+
+      if (!changed[link] || added[link])
+        continue;
+      for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+        if (desired[link].streams[id].used)
+          break;
+      if (id == TCMMD_MAX_STREAMS)
+        desired[link].installed = FALSE;
+    }
+
+  for (i = 0; i < n_old; i++)
+    {
+      tcmmd_log (TCMMD_LOG_INFO, "Removing traffic control: stream=%d\n", old_ids[i]);
+      TCMMD_TRACE1 (rules_remove_start, old_ids[i]);
+    }
+  for (i = 0; i < n_streams; i++)
+    {
+      tcmmd_log (TCMMD_LOG_INFO, "Adding traffic control: stream=%d tcp_dport=%d stream_rate=%"G_GUINT64_FORMAT" background_rate=%"G_GUINT64_FORMAT" ...\n", stream_ids[i], streams[i].tcp_dport, streams[i].stream_rate, background_rates[TCMMD_STREAM_LINK (stream_ids[i])]);
+      TCMMD_TRACE2 (rules_install_start, stream_ids[i], streams[i].family);
+    }
+
+  for (link = 0; link < n_uplinks; link++)
+    if (changed[link] && !_reconcile (&uplinks[link], &desired[link]))
+      break;
+
+  if (link < n_uplinks)
+    {
+      int failed = link;
+
+      /* put back the uplinks already changed, and the one the kernel
+       * refused */
+      for (link = 0; link <= failed; link++)
+        if (changed[link])
+          _restore_tree (&uplinks[link], &previous[link]);
+
+      for (i = 0; i < n_old; i++)
+        TCMMD_TRACE1 (rules_remove_end, old_ids[i]);
+      for (i = 0; i < n_streams; i++)
+        TCMMD_TRACE1 (rules_install_end, stream_ids[i]);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_old; i++)
+    TCMMD_TRACE1 (rules_remove_end, old_ids[i]);
+  for (i = 0; i < n_streams; i++)
+    {
+      TCMMD_TRACE1 (rules_install_end, stream_ids[i]);
+      tcmmd_log (TCMMD_LOG_INFO, "Adding traffic control: stream=%d tcp_dport=%d : done.\n", stream_ids[i], streams[i].tcp_dport);
+    }
+
+  return TRUE;
+}
+
+static void
+netlink_del_stream (int stream_id)
+{
+  Uplink *uplink = _stream_uplink (stream_id);
+  TreeState desired;
+  int id;
+
+  g_return_if_fail (uplink != NULL);
+
+  if (!uplink->installed.streams[STREAM_SLOT (stream_id)].used)
+    return;
+
+  desired = uplink->installed;
+  desired.streams[STREAM_SLOT (stream_id)].used = FALSE;
+
+  for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+    if (desired.streams[id].used)
+      break;
+
+  /* last stream: go back to an unshaped link */
+  if (id == TCMMD_MAX_STREAMS)
+    {
+      tcmmd_log (TCMMD_LOG_INFO, "Removing traffic control: stream=%d, last one on %s\n",
+                 stream_id, rtnl_link_get_name (uplink->main));
+      desired.installed = FALSE;
+    }
+  else
+    tcmmd_log (TCMMD_LOG_INFO, "Removing traffic control: stream=%d\n", stream_id);
+
+  TCMMD_TRACE1 (rules_remove_start, stream_id);
+  /* the stream is gone for the caller either way: rebuild without it */
+  if (!_reconcile (uplink, &desired))
+    {
+      uplink->installed = desired;
+      _restore_tree (uplink, &desired);
+    }
+  TCMMD_TRACE1 (rules_remove_end, stream_id);
+}
+
+/* What the filters on 1:0 tell of a tree left by another tcmmd */
+struct adopt_filters {
+  Uplink *uplink;
+  const char *kind;
+  gboolean other_kind;
+};
+
+static void
+adopt_filter_cb (struct nl_object *obj, void *arg)
+{
+  struct rtnl_tc *tc = (struct rtnl_tc *) nl_object_priv (obj);
+  struct adopt_filters *filters = arg;
+  uint32_t handle = rtnl_tc_get_handle (tc);
+  int htid;
+
+  if (g_strcmp0 (rtnl_tc_get_kind (tc), filters->kind) != 0)
+    {
+      filters->other_kind = TRUE;
+      return;
+    }
+
+  /* the hash tables of the u32 streams outlive their streams */
+  htid = TC_U32_USERHTID (handle);
+  if (classifier == TCMMD_CLASSIFIER_U32 && TC_U32_NODE (handle) == 0 &&
+      htid >= STREAM_MINOR (0) && htid < STREAM_MINOR (TCMMD_MAX_STREAMS))
+    filters->uplink->stream_ht_created[htid - STREAM_MINOR (0)] = TRUE;
+}
+
+/* What the filters on the ingress qdisc of the main link tell: the u32
+ * ones tcmmrtnl_setup_ifb_redirection() adds, one per protocol */
+struct adopt_redirect {
+  gboolean ip;
+  gboolean ipv6;
+  gboolean other;
+};
+
+static void
+adopt_redirect_cb (struct nl_object *obj, void *arg)
+{
+  struct rtnl_cls *cls = (struct rtnl_cls *) obj;
+  struct adopt_redirect *redirect = arg;
+
+  if (g_strcmp0 (rtnl_tc_get_kind (TC_CAST (cls)), "u32") != 0)
+    redirect->other = TRUE;
+  else if (rtnl_cls_get_prio (cls) == 1 &&
+           rtnl_cls_get_protocol (cls) == ETH_P_IP)
+    redirect->ip = TRUE;
+  else if (rtnl_cls_get_prio (cls) == 2 &&
+           rtnl_cls_get_protocol (cls) == ETH_P_IPV6)
+    redirect->ipv6 = TRUE;
+  else
+    redirect->other = TRUE;
+}
+
+static gboolean
+_adopt_redirect (Uplink *uplink)
+{
+  struct adopt_redirect redirect = { FALSE, FALSE, FALSE };
+  struct nl_cache *cache;
+  int err;
+
+  if (!_qdisc_in_kernel (uplink->main, TC_HANDLE (0xffff, 0)))
+    return FALSE;
+
+  if ((err = rtnl_cls_alloc_cache (sock,
+                                   rtnl_link_get_ifindex (uplink->main),
+                                   TC_HANDLE (0xffff, 0), &cache)) < 0)
+    {
+      g_printerr ("Error: unable to allocate filter cache: %s\n", nl_geterror(err));
+      exit (1);
+    }
+  nl_cache_foreach (cache, adopt_redirect_cb, &redirect);
+  nl_cache_free (cache);
+
+  if (!redirect.ip || !redirect.ipv6 || redirect.other)
+    {
+      tcmmd_log (TCMMD_LOG_INFO, "The filters on the ingress of %s are not "
+                 "the redirection to %s\n", rtnl_link_get_name (uplink->main),
+                 rtnl_link_get_name (uplink->ifb));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Whether the kernel has the tree described on this uplink: the ingress
+ * redirection on the main link unless shaping egress, the root qdisc of the
+ * tree if it has streams with the SSH and background classes, filters of the
+ * selected classifier and a class for every stream and no other. Their
+ * filters are trusted. */
+static gboolean
+_adopt_tree (Uplink *uplink, const TreeState *adopted)
+{
+  struct adopt_filters filters = { uplink, NULL, FALSE };
+  /* SSH and background */
+  static const int base_minors[] = { 1, BACKGROUND_MINOR };
+  struct rtnl_class *class;
+  guint i;
+  int id;
+
+  _init_ifb_link (uplink);
+
+  /* the tree went away with the last stream of the uplink */
+  if (_tree_in_kernel (uplink) != adopted->installed)
+    return FALSE;
+
+  if (uplink->ifb && !_adopt_redirect (uplink))
+    return FALSE;
+
+  if (!adopted->installed)
+    return TRUE;
+
+  _sync_caches (uplink);
+  for (i = 0; i < G_N_ELEMENTS (base_minors); i++)
+    {
+      class = rtnl_class_get (uplink->class_cache,
+                              rtnl_link_get_ifindex (uplink->dev),
+                              TC_HANDLE (1, base_minors[i]));
+      if (!class)
+        {
+          tcmmd_log (TCMMD_LOG_INFO, "Class 1:%x is missing on %s\n",
+                     base_minors[i], rtnl_link_get_name (uplink->dev));
+          return FALSE;
+        }
+      rtnl_class_put (class);
+    }
+
+  for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+    {
+      class = rtnl_class_get (uplink->class_cache,
+                              rtnl_link_get_ifindex (uplink->dev),
+                              TC_HANDLE (1, STREAM_MINOR (id)));
+      if (class)
+        rtnl_class_put (class);
+      if ((class != NULL) != adopted->streams[id].used)
+        {
+          tcmmd_log (TCMMD_LOG_INFO, "The class of stream %d does not match "
+                     "the saved state\n",
+                     (int) (uplink - uplinks) * TCMMD_MAX_STREAMS + id);
+          return FALSE;
+        }
+    }
+
+  _alloc_cls1_cache (uplink);
+  memset (uplink->stream_ht_created, 0, sizeof (uplink->stream_ht_created));
+  filters.kind = classifier == TCMMD_CLASSIFIER_FLOWER ? "flower" : "u32";
+  nl_cache_foreach (uplink->cls1_cache, adopt_filter_cb, &filters);
+  if (filters.other_kind)
+    {
+      tcmmd_log (TCMMD_LOG_INFO, "The filters on %s are not %s ones\n",
+                 rtnl_link_get_name (uplink->dev), filters.kind);
+      nl_cache_free (uplink->cls1_cache);
+      uplink->cls1_cache = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Take the trees over only if every uplink has the one described */
+static gboolean
+netlink_adopt (const TcmmdStreamSpec *streams,
+               const int *stream_ids,
+               guint n_streams,
+               const guint64 *background_rates)
+{
+  TreeState adopted[TCMMD_MAX_LINKS];
+  int link;
+  guint i;
+
+  for (link = 0; link < n_uplinks; link++)
+    {
+      g_return_val_if_fail (!uplinks[link].installed.installed, FALSE);
+      memset (&adopted[link], 0, sizeof (TreeState));
+    }
+
+  for (i = 0; i < n_streams; i++)
+    {
+      TreeState *tree;
+      int id = stream_ids[i];
+
+      if (!_stream_uplink (id))
+        return FALSE;
+      tree = &adopted[TCMMD_STREAM_LINK (id)];
+      if (tree->streams[STREAM_SLOT (id)].used)
+        return FALSE;
+      _stream_state_set (&tree->streams[STREAM_SLOT (id)], &streams[i]);
+      tree->installed = TRUE;
+      tree->background_rate = background_rates[TCMMD_STREAM_LINK (id)];
+    }
+
+  for (link = 0; link < n_uplinks; link++)
+    if (!_adopt_tree (&uplinks[link], &adopted[link]))
+      return FALSE;
+
+  for (link = 0; link < n_uplinks; link++)
+    uplinks[link].installed = adopted[link];
+  tcmmd_log (TCMMD_LOG_INFO, "Adopted the rules on %d interfaces: %u streams\n",
+             n_uplinks, n_streams);
+
+  return TRUE;
+}
+
+static void
+qdisc_stats_cb (struct nl_object *obj, void *arg)
+{
+  struct rtnl_qdisc *qdisc = nl_object_priv(obj);
+  struct rtnl_tc *tc = (struct rtnl_tc *) qdisc;
+  TcmmdStats *stats = arg;
+  char buf[32];
+  int i;
+
+  TCMMD_TRACE6 (qdisc_stats, rtnl_tc_get_handle (tc),
+                rtnl_tc_get_stat (tc, RTNL_TC_PACKETS),
+                rtnl_tc_get_stat (tc, RTNL_TC_BYTES),
+                rtnl_tc_get_stat (tc, RTNL_TC_DROPS),
+                rtnl_tc_get_stat (tc, RTNL_TC_OVERLIMITS),
+                rtnl_tc_get_stat (tc, RTNL_TC_BACKLOG));
+
+  if (tcmmd_verbosity >= TCMMD_LOG_STATS)
+    {
+      g_print ("stats of qdisc handle %s %s: RTNL_TC_PACKETS=%"G_GUINT64_FORMAT" RTNL_TC_BYTES=%"G_GUINT64_FORMAT"\n",
+             rtnl_tc_handle2str (rtnl_tc_get_handle (tc), buf, sizeof(buf)),
+             rtnl_tc_get_kind (tc),
+             rtnl_tc_get_stat (tc, RTNL_TC_PACKETS),
+             rtnl_tc_get_stat (tc, RTNL_TC_BYTES));
+
+      g_print ("  - RTNL_TC_PACKETS:    %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_PACKETS));
+      g_print ("  - RTNL_TC_BYTES:      %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_BYTES));
+      g_print ("  - RTNL_TC_RATE_BPS:   %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_RATE_BPS));
+      g_print ("  - RTNL_TC_RATE_PPS:   %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_RATE_PPS));
+      g_print ("  - RTNL_TC_QLEN:       %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_QLEN));
+      g_print ("  - RTNL_TC_BACKLOG:    %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_BACKLOG));
+      g_print ("  - RTNL_TC_DROPS:      %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_DROPS));
+      g_print ("  - RTNL_TC_REQUEUES:   %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_REQUEUES));
+      g_print ("  - RTNL_TC_OVERLIMITS: %"G_GUINT64_FORMAT"\n", rtnl_tc_get_stat (tc, RTNL_TC_OVERLIMITS));
+    }
+
+  /* everything received on the main interfaces, before shaping */
+  for (i = 0; i < n_uplinks && direction == TCMMD_DIRECTION_INGRESS; i++)
+    {
+      if (rtnl_tc_get_ifindex (tc) != rtnl_link_get_ifindex (uplinks[i].main))
+        continue;
+      if (rtnl_tc_get_handle (tc) == TC_HANDLE (0xffff, 0))
+        {
+          stats->qdisc_ingress_bytes += rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+          stats->qdisc_ingress_rate += rtnl_tc_get_stat (tc, RTNL_TC_RATE_BPS);
+        }
+      return;
+    }
+
+  /* the htb root is on 1:0. If tcmmd didn't install any rules, the default
+   * pfifo_fast is on 0:0 */
+  if (rtnl_tc_get_handle (tc) == TC_HANDLE (0, 0) ||
+      rtnl_tc_get_handle (tc) == TC_HANDLE (1, 0))
+    {
+      stats->qdisc_root_bytes += rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+      stats->qdisc_root_rate += rtnl_tc_get_stat (tc, RTNL_TC_RATE_BPS);
+    }
+
+  if (TC_H_MAJ (rtnl_tc_get_handle (tc)) >= TC_HANDLE (STREAM_MINOR (0), 0) &&
+      TC_H_MAJ (rtnl_tc_get_handle (tc)) < TC_HANDLE (STREAM_MINOR (TCMMD_MAX_STREAMS), 0) &&
+      g_strcmp0 (rtnl_tc_get_kind (tc), "sfq") == 0)
+    {
+      stats->qdisc_stream_bytes += rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+      stats->qdisc_stream_rate += rtnl_tc_get_stat (tc, RTNL_TC_RATE_BPS);
+      stats->qdisc_stream_drops += rtnl_tc_get_stat (tc, RTNL_TC_DROPS);
+    }
+
+  if (rtnl_tc_get_handle (tc) == TC_HANDLE (5, 0) &&
+      g_strcmp0 (rtnl_tc_get_kind (tc), "sfq") == 0)
+    {
+      stats->qdisc_background_bytes += rtnl_tc_get_stat (tc, RTNL_TC_BYTES);
+      stats->qdisc_background_rate += rtnl_tc_get_stat (tc, RTNL_TC_RATE_BPS);
+      stats->qdisc_background_drops += rtnl_tc_get_stat (tc, RTNL_TC_DROPS);
+    }
+}
+
+/* everything sent on a main interface when shaping egress, counted by the
+ * link rather than by the tree shaping it */
+static void
+link_stats_cb (struct nl_object *obj, void *arg)
+{
+  struct rtnl_link *link = (struct rtnl_link *) obj;
+  TcmmdStats *stats = arg;
+
+  stats->qdisc_ingress_bytes += rtnl_link_get_stat (link, RTNL_LINK_TX_BYTES);
+}
+
+static int
+stats_valid_cb (struct nl_msg *msg, void *arg)
+{
+  int err;
+
+  if (nlmsg_hdr (msg)->nlmsg_type == RTM_NEWLINK)
+    {
+      if ((err = nl_msg_parse (msg, link_stats_cb, arg)) < 0)
+        g_printerr ("Error: cannot parse link: %s\n", nl_geterror(err));
+      return NL_OK;
+    }
+
+  if ((err = nl_msg_parse (msg, qdisc_stats_cb, arg)) < 0)
+    g_printerr ("Error: cannot parse qdisc: %s\n", nl_geterror(err));
+
+  return NL_OK;
+}
+
+/* ip -s link show dev <link>, in a batch */
+static void
+_queue_get_link (struct rtnl_link *link)
+{
+  struct nl_msg *msg;
+  struct ifinfomsg ifi = {
+    .ifi_family = AF_UNSPEC,
+    .ifi_index = rtnl_link_get_ifindex (link),
+  };
+
+  if (!(msg = nlmsg_alloc_simple (RTM_GETLINK, 0)) ||
+      nlmsg_append (msg, &ifi, sizeof (ifi), NLMSG_ALIGNTO) < 0)
+    {
+      g_printerr ("Error: unable to build link request\n");
+      exit (1);
+    }
+  _batch_queue (msg);
+}
+
+static void
+netlink_get_stats (TcmmdStats *link_stats)
+{
+  guint64 root_bytes = 0, stream_bytes = 0, background_bytes = 0;
+  int err;
+  int id;
+  int i;
+
+  /* only the qdiscs tcmmd owns, in one round trip per uplink */
+  memset (link_stats, 0, TCMMD_MAX_LINKS * sizeof (TcmmdStats));
+  for (i = 0; i < n_uplinks; i++)
+    {
+      Uplink *uplink = &uplinks[i];
+      TcmmdStats *stats = &link_stats[i];
+
+      /* on its own, so that a missing ingress qdisc is not taken for a
+       * missing tree */
+      if (uplink->ifb)
+        {
+          _queue_get_qdisc (uplink->main, TC_HANDLE (0xffff, 0));
+          err = _batch_commit_full (stats_valid_cb, stats);
+          if (err == -NLE_OBJ_NOTFOUND)
+            {
+              if (!uplink->redirect_missing)
+                g_printerr ("Warning: the redirection of %s to %s was "
+                            "removed\n", rtnl_link_get_name (uplink->main),
+                            rtnl_link_get_name (uplink->ifb));
+              uplink->redirect_missing = TRUE;
+            }
+          else if (err < 0)
+            {
+              g_printerr ("Error: cannot get qdisc stats: %s\n", nl_geterror(err));
+              exit (1);
+            }
+        }
+      else
+        _queue_get_link (uplink->main);
+      _queue_get_qdisc (uplink->dev, 0);
+      if (uplink->installed.installed && !uplink->stale)
+        {
+          _queue_get_qdisc (uplink->dev, TC_HANDLE (5, 0));
+          for (id = 0; id < TCMMD_MAX_STREAMS; id++)
+            if (uplink->installed.streams[id].used)
+              _queue_get_qdisc (uplink->dev, TC_HANDLE (STREAM_MINOR (id), 0));
+        }
+
+      err = _batch_commit_full (stats_valid_cb, stats);
+      if (err == -NLE_OBJ_NOTFOUND)
+        {
+          /* removed behind our back, e.g. with tc: the streams are kept, so
+           * the next change builds the same tree again */
+          g_printerr ("Warning: the rules on %s were removed\n",
+                      rtnl_link_get_name (uplink->dev));
+          uplink->stale = TRUE;
+        }
+      else if (err < 0)
+        {
+          g_printerr ("Error: cannot get qdisc stats: %s\n", nl_geterror(err));
+          exit (1);
+        }
+
+      /* the link has no rate estimator: the one of the root qdisc sees the
+       * same traffic */
+      if (direction == TCMMD_DIRECTION_EGRESS)
+        stats->qdisc_ingress_rate = stats->qdisc_root_rate;
+
+      root_bytes += stats->qdisc_root_bytes;
+      stream_bytes += stats->qdisc_stream_bytes;
+      background_bytes += stats->qdisc_background_bytes;
+    }
+
+  TCMMD_TRACE3 (stats_sampled, root_bytes, stream_bytes, background_bytes);
+}
+
+const TcmmdBackend tcmmd_backend_netlink = {
+  "netlink",
+  netlink_init,
+  netlink_init_ifb,
+  netlink_adopt,
+  netlink_uninit,
+  netlink_del_rules,
+  netlink_set_classifier,
+  netlink_set_direction,
+  netlink_replace_streams,
+  netlink_del_stream,
+  netlink_update_rate,
+  netlink_get_stats,
+};
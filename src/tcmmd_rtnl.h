@@ -23,20 +23,153 @@
 #include <arpa/inet.h>
 #include <glib.h>
 
-void tcmmdrtnl_init (const char *link_name);
+/* The rule engine. The calls go to the backend selected at startup, the
+ * kernel by default, see tcmmd-backend.h. */
+
+/* Number of uplinks shaped at the same time */
+#define TCMMD_MAX_LINKS 4
+
+/* Shape the received traffic of the interfaces in the NULL-terminated
+ * link_names, each through its own ifb device, or of every ethernet
+ * interface if link_names is NULL or empty. */
+void tcmmdrtnl_init (const char * const *link_names);
 void tcmmdrtnl_init_ifb (void);
 void tcmmdrtnl_uninit (void);
 
 void tcmmdrtnl_del_rules (void);
 
-void tcmmdrtnl_add_rules (in_addr_t *ip_src,
-                          in_addr_t *ip_dst,
+typedef enum {
+  TCMMD_CLASSIFIER_U32,
+  TCMMD_CLASSIFIER_FLOWER,
+} TcmmdClassifier;
+
+/* Select the classifier matching the streams in the tree of every uplink,
+ * on its ifb device or, when shaping egress, on its main link. u32 walks its
+ * nodes in order; flower looks up exact keys in hash tables, one per mask,
+ * so its cost does not grow with the number of streams. Only allowed while
+ * no stream is installed. */
+void tcmmdrtnl_set_classifier (TcmmdClassifier classifier);
+
+typedef enum {
+  TCMMD_DIRECTION_INGRESS,
+  TCMMD_DIRECTION_EGRESS,
+} TcmmdDirection;
+
+/* Select the traffic shaped: the one received on the uplinks, redirected to
+ * their ifb devices (the default), or the one they send, with the tree on
+ * the root qdisc of the main links instead. That tree replaces the root
+ * qdisc an administrator may have set up, e.g. fq_codel or cake, which
+ * tcmmdrtnl_uninit() adds back with its options; in between, removing the
+ * tree brings the default one back. The streams are described the same way
+ * in both directions, as received packets, and matched the other way round
+ * on egress. Only allowed before tcmmdrtnl_init_ifb() or
+ * tcmmdrtnl_adopt(). */
+void tcmmdrtnl_set_direction (TcmmdDirection direction);
+
+/* Number of streams that can be shaped at the same time on each uplink */
+#define TCMMD_MAX_STREAMS 32
+
+/* Index of the uplink of a stream id: the ids of uplink n start at
+ * n * TCMMD_MAX_STREAMS */
+#define TCMMD_STREAM_LINK(stream_id) ((stream_id) / TCMMD_MAX_STREAMS)
+
+/* Add a class, leaf qdisc and filters for one stream on the uplink it is
+ * received on, the one routing back to ip_src, installing the shared part
+ * of the tree first if needed. ip_src and ip_dst point to a struct
+ * in_addr or struct in6_addr depending on family, all zeros for any address.
+ * Returns the stream id, or -1 if all the stream classes are in use or the
+ * backend failed. */
+int tcmmdrtnl_add_stream (int family,
+                          const void *ip_src,
+                          const void *ip_dst,
                           uint16_t tcp_sport,
                           uint16_t tcp_dport,
                           guint64 stream_rate,
                           guint64 background_rate);
 
-void tcmmdrtnl_get_stats (guint64 *qdisc_root_bytes,
-                          guint64 *qdisc_stream_bytes,
-                          guint64 *qdisc_background_bytes);
+typedef struct {
+  int family;
+  const void *ip_src;
+  const void *ip_dst;
+  uint16_t tcp_sport;
+  uint16_t tcp_dport;
+  guint64 stream_rate;
+} TcmmdStreamSpec;
+
+/* Add several streams in one transaction, as tcmmdrtnl_add_stream() does
+ * for one: either all of them are installed and their ids stored in
+ * stream_ids, or none is and FALSE is returned. background_rates has
+ * TCMMD_MAX_LINKS entries, the rate of each uplink which gets a stream. */
+gboolean tcmmdrtnl_add_streams (const TcmmdStreamSpec *streams,
+                                guint n_streams,
+                                const guint64 *background_rates,
+                                int *stream_ids);
+
+/* The same, removing the installed streams old_ids in the same
+ * transaction. A new stream received on the uplink of a removed one takes
+ * its class over, so the queue is kept and only the filter and the rate
+ * change; an uplink left without streams goes back to unshaped. On
+ * failure, the old streams stay installed. */
+gboolean tcmmdrtnl_replace_streams (const int *old_ids,
+                                    guint n_old,
+                                    const TcmmdStreamSpec *streams,
+                                    guint n_streams,
+                                    const guint64 *background_rates,
+                                    int *stream_ids);
+
+/* Remove the rules of one stream without disturbing the others. */
+void tcmmdrtnl_del_stream (int stream_id);
+
+/* Instead of tcmmdrtnl_init_ifb(), take over the rules a previous tcmmd
+ * left installed with these streams, the stream_ids it gave them and
+ * background_rates, one per uplink as in tcmmdrtnl_add_streams(). Nothing
+ * is changed in the kernel, so the streams stay shaped across a restart.
+ * Returns FALSE if the rules are not there as described:
+ * tcmmdrtnl_init_ifb() then starts afresh. */
+gboolean tcmmdrtnl_adopt (const TcmmdStreamSpec *streams,
+                          const int *stream_ids,
+                          guint n_streams,
+                          const guint64 *background_rates);
+
+typedef enum {
+  TCMMD_CLASS_STREAM,
+  TCMMD_CLASS_BACKGROUND,
+} TcmmdClass;
+
+/* Change the rate of an installed htb class in place, without touching the
+ * rest of the tree. For the background class, stream_id is any stream of
+ * the uplink to change: each uplink has its own background class.
+ * Returns how long the kernel took, in microseconds, or -1 if the backend
+ * failed. */
+gint64 tcmmdrtnl_update_rate (TcmmdClass class_id,
+                              int stream_id,
+                              guint64 rate,
+                              guint64 ceil);
+
+/* Of one uplink, or summed over the uplinks */
+typedef struct {
+  /* ingress qdisc of the main interface: all the received traffic. When
+   * shaping egress, the bytes the main interface sent, as counted by the
+   * link rather than by the tree, and the rate of its root qdisc */
+  guint64 qdisc_ingress_bytes;
+  guint64 qdisc_ingress_rate;
+  /* qdiscs of the trees, after shaping */
+  guint64 qdisc_root_bytes;
+  guint64 qdisc_stream_bytes;
+  guint64 qdisc_background_bytes;
+  /* from the rate estimators, in bytes per second */
+  guint64 qdisc_root_rate;
+  guint64 qdisc_stream_rate;
+  guint64 qdisc_background_rate;
+  /* packets dropped by the leaf qdiscs */
+  guint64 qdisc_stream_drops;
+  guint64 qdisc_background_drops;
+} TcmmdStats;
+
+void tcmmdrtnl_get_stats (TcmmdStats *stats);
+/* Add the counters and rates of stats to total */
+void tcmmdrtnl_stats_add (TcmmdStats *total, const TcmmdStats *stats);
+/* The same for each uplink, in the order of their stream ids: link_stats
+ * has TCMMD_MAX_LINKS entries, zeros past the last uplink */
+void tcmmdrtnl_get_link_stats (TcmmdStats *link_stats);
 #endif
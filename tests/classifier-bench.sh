@@ -0,0 +1,39 @@
+#!/bin/sh
+
+# Compare the packets per second going through ifb0 with the u32 and flower
+# classifiers, for a growing number of streams. Everything runs in a
+# throw-away network namespace with a veth pair, so it is safe to run on a
+# machine where tcmmd is in use.
+
+if [ `id -u` != 0 ] ; then
+  echo "Not root"
+  exit 1
+fi
+
+if [ -z "$TCMMD_BENCH" ] ; then
+  TCMMD_BENCH=`dirname $0`/../src/tcmmd-bench
+fi
+if [ -z "$CLASSIFIERS" ] ; then
+  CLASSIFIERS="u32 flower"
+fi
+if [ -z "$STREAMS" ] ; then
+  STREAMS="1 8 32"
+fi
+if [ -z "$DURATION" ] ; then
+  DURATION=5
+fi
+
+modprobe ifb numifbs=0 > /dev/null 2>&1
+
+for classifier in $CLASSIFIERS ; do
+  for streams in $STREAMS ; do
+    unshare -n sh -c "
+      ip link add ifb0 type ifb
+      ip link add bench0 type veth peer name bench1
+      ip link set bench0 up
+      ip link set bench1 up
+      $TCMMD_BENCH --interface=bench0 --sender=bench1 \
+        --classifier=$classifier --streams=$streams --duration=$DURATION" |
+      grep '^classifier='
+  done
+done
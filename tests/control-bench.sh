@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# Latency of SetPolicy from a client to tcmmd and back, through D-Bus and
+# through the control socket (tcmmd --control-socket). tcmmd runs with the
+# memory backend on a private session bus, so without root, and the same
+# handlers serve both transports. See tcmmd-client-bench.c.
+
+if [ -z "$TCMMD" ] ; then
+  TCMMD=`dirname $0`/../src/tcmmd
+fi
+if [ -z "$TCMMD_CLIENT_BENCH" ] ; then
+  TCMMD_CLIENT_BENCH=`dirname $0`/../src/tcmmd-client-bench
+fi
+if [ -z "$CALLS" ] ; then
+  CALLS=10000
+fi
+
+SOCKET=`mktemp -u /tmp/tcmmd-control.XXXXXX`
+
+dbus-run-session -- sh -c "
+  $TCMMD --backend=memory --session-bus --verbosity=0 --control-socket=$SOCKET &
+  # tcmmd may still be starting
+  for i in \`seq 50\` ; do
+    [ -S $SOCKET ] && break
+    sleep 0.1
+  done
+  $TCMMD_CLIENT_BENCH --session-bus --control-socket=$SOCKET --calls=$CALLS
+  kill \$!"
@@ -0,0 +1,26 @@
+#!/bin/sh
+
+# Replay traces recorded with tcmmd --trace with every controller, on the
+# simulated link of tcmmd-replay, and print one line of results per run.
+# Extra arguments of tcmmd-replay (e.g. --tune, --capacity, --open-loop) can
+# be given in REPLAY_ARGS.
+#
+# Usage: controller-replay.sh [TRACE...]
+
+if [ -z "$TCMMD_REPLAY" ] ; then
+  TCMMD_REPLAY=`dirname $0`/../src/tcmmd-replay
+fi
+if [ -z "$CONTROLLERS" ] ; then
+  CONTROLLERS="ramp aimd pid"
+fi
+if [ $# = 0 ] ; then
+  set -- `dirname $0`/replay-sample.trace
+fi
+
+for trace in "$@" ; do
+  for controller in $CONTROLLERS ; do
+    result=`$TCMMD_REPLAY --controller=$controller $REPLAY_ARGS "$trace"` ||
+      exit 1
+    echo "trace=`basename $trace`" $result
+  done
+done
@@ -1,6 +1,18 @@
 #!/bin/sh
 
-./tcmmd-log-parsing.py -i ${1} -o /tmp/tmp.$$
+# ${1} is a file written by tcmmd --save-stats or tcmmd --record
+
+if [ -z "$TCMMD_RECORD_EXPORT" ] ; then
+  TCMMD_RECORD_EXPORT=tcmmd-record-export
+fi
+
+if [ "`head -c 8 ${1}`" = "TCMMDREC" ] ; then
+  $TCMMD_RECORD_EXPORT -o /tmp/tmp.$$.log ${1} || exit 1
+  ./tcmmd-log-parsing.py -i /tmp/tmp.$$.log -o /tmp/tmp.$$
+  rm -f /tmp/tmp.$$.log
+else
+  ./tcmmd-log-parsing.py -i ${1} -o /tmp/tmp.$$
+fi
 echo "set terminal png size 2048,768
 set output '${1}.png'
 set yrange [0:500000]
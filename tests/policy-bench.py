@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+
+# Time SetPolicy calls from a client to tcmmd and back, through D-Bus, the
+# policy code and the rule backend. With --batch, each round over the
+# streams is a single ManagedConnections2.SetPolicies call instead. See
+# policy-bench.sh.
+
+import sys
+import time
+import socket
+import argparse
+import dbus
+
+parser = argparse.ArgumentParser(description='Benchmark tcmmd SetPolicy')
+parser.add_argument('--session', action='store_true',
+                    help='tcmmd is on the session bus (tcmmd --session-bus)')
+parser.add_argument('-n', '--calls', type=int, default=10000,
+                    help='Number of SetPolicy calls')
+parser.add_argument('-s', '--streams', type=int, default=1,
+                    help='Number of streams the calls are spread over')
+parser.add_argument('--batch', action='store_true',
+                    help='One SetPolicies call per round over the streams')
+args = parser.parse_args()
+
+if args.session:
+    bus = dbus.SessionBus()
+else:
+    bus = dbus.SystemBus()
+
+# tcmmd may still be starting
+for attempt in range(50):
+    if bus.name_has_owner("org.tcmmd"):
+        break
+    time.sleep(0.1)
+else:
+    sys.exit("org.tcmmd not found on the bus")
+
+remote_object = bus.get_object("org.tcmmd",
+                               "/org/tcmmd/ManagedConnections")
+iface = dbus.Interface(remote_object, "org.tcmmd.ManagedConnections")
+iface2 = dbus.Interface(remote_object, "org.tcmmd.ManagedConnections2")
+
+def flow(stream):
+    local = socket.inet_pton(socket.AF_INET, "198.51.100.1")
+    remote = socket.inet_pton(socket.AF_INET, "192.0.2.1")
+    return dbus.Struct((dbus.ByteArray(local), dbus.UInt16(10000 + stream),
+                        dbus.ByteArray(remote), dbus.UInt16(80),
+                        dbus.Byte(socket.IPPROTO_TCP)),
+                       signature='ayqayqy')
+
+latencies = []
+start = time.time()
+for i in range(0, args.calls, args.streams if args.batch else 1):
+    if args.batch:
+        fill = 0.5 if (i // args.streams) % 10 == 9 else 1.0
+        policies = [(flow(stream), dbus.UInt32(2000000), fill)
+                    for stream in range(args.streams)]
+        call_start = time.time()
+        iface2.SetPolicies(dbus.Array(policies, signature='((ayqayqy)ud)'),
+                           dbus.Dictionary({}, signature='sv'))
+        latencies.append(time.time() - call_start)
+        continue
+
+    stream = i % args.streams
+    # one round in ten, the buffers drop into panic
+    if (i // args.streams) % 10 == 9:
+        fill = 0.5
+    else:
+        fill = 1.0
+    call_start = time.time()
+    iface.SetPolicy("198.51.100.1", 10000 + stream, "192.0.2.1", 80,
+                    dbus.UInt32(2000000), fill)
+    latencies.append(time.time() - call_start)
+elapsed = time.time() - start
+
+iface.UnsetPolicy()
+
+latencies.sort()
+# with --batch, the rate is still in policies per second
+print("dbus streams={0} calls={1} batch={6} calls_per_s={2:.0f} p50_us={3:.0f} "
+      "p99_us={4:.0f} max_us={5:.0f}".format(
+          args.streams, len(latencies), args.calls / elapsed,
+          latencies[len(latencies) // 2] * 1e6,
+          latencies[len(latencies) * 99 // 100] * 1e6,
+          latencies[-1] * 1e6, int(args.batch)))
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+# Throughput of the SetPolicy path without root: D-Bus, the policy code and
+# the controller, down to the rule backend. tcmmd runs with the memory
+# backend on a private session bus; BACKEND=netlink (as root, with ifb0)
+# measures the kernel too. BATCH=1 sends each round over the streams as a
+# single ManagedConnections2.SetPolicies call. The same path without D-Bus is
+# measured by tcmmd-bench --policies.
+
+if [ -z "$TCMMD" ] ; then
+  TCMMD=`dirname $0`/../src/tcmmd
+fi
+if [ -z "$BACKEND" ] ; then
+  BACKEND=memory
+fi
+if [ -z "$CALLS" ] ; then
+  CALLS=10000
+fi
+if [ -z "$STREAMS" ] ; then
+  STREAMS="1 8 32"
+fi
+if [ -n "$BATCH" ] ; then
+  BATCH_ARG=--batch
+fi
+
+for streams in $STREAMS ; do
+  dbus-run-session -- sh -c "
+    $TCMMD --backend=$BACKEND --session-bus --verbosity=0 &
+    python `dirname $0`/policy-bench.py --session --calls=$CALLS --streams=$streams $BATCH_ARG
+    kill \$!"
+done
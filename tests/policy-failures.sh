@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# Fail each call of the rule engine in turn (stream added, moved, rate
+# change, stats sample) on the in-memory backend of tcmmd-bench, and check
+# that the flow table and the replies of the policy calls match the tree
+# that is left. Needs neither root nor a network interface. Exits with 1
+# if a check failed; the failed checks are the lines starting with FAIL.
+#
+# Usage: policy-failures.sh
+
+if [ -z "$TCMMD_BENCH" ] ; then
+  TCMMD_BENCH=`dirname $0`/../src/tcmmd-bench
+fi
+
+$TCMMD_BENCH --failures
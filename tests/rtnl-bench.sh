@@ -0,0 +1,40 @@
+#!/bin/sh
+
+# Latency of each call of the rule engine (ifb setup, tree rebuild, stream
+# added and removed, rate change, stats sample) and the system calls it
+# makes, for a growing number of streams. Everything runs in a throw-away
+# network namespace with a veth pair and ifb0. Keep the output of a run as
+# the baseline to compare a change of tcmmd_rtnl.c against.
+#
+# The system calls are counted with the raw_syscalls tracepoint: tracefs is
+# mounted in a private mount namespace if needed.
+
+if [ `id -u` != 0 ] ; then
+  echo "Not root"
+  exit 1
+fi
+
+if [ -z "$TCMMD_BENCH" ] ; then
+  TCMMD_BENCH=`dirname $0`/../src/tcmmd-bench
+fi
+if [ -z "$STREAMS" ] ; then
+  STREAMS="1 8 31"
+fi
+if [ -z "$RUNS" ] ; then
+  RUNS=5000
+fi
+
+modprobe ifb numifbs=0 > /dev/null 2>&1
+
+for streams in $STREAMS ; do
+  unshare -m -n sh -c "
+    if [ ! -e /sys/kernel/tracing/events ] ; then
+      mount -t tracefs nodev /sys/kernel/tracing 2> /dev/null
+    fi
+    ip link add ifb0 type ifb
+    ip link add bench0 type veth peer name bench1
+    ip link set bench0 up
+    ip link set bench1 up
+    $TCMMD_BENCH --interface=bench0 --streams=$streams --operations=$RUNS" |
+    grep '^operation='
+done
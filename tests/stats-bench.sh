@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# Compare the cost of one stats sample of tcmmd (the qdiscs it owns on ifb0)
+# with a dump of the qdiscs of every interface, on a system with a growing
+# number of interfaces (veth pairs, each with its own root qdisc). Everything
+# runs in a throw-away network namespace.
+
+if [ `id -u` != 0 ] ; then
+  echo "Not root"
+  exit 1
+fi
+
+if [ -z "$TCMMD_BENCH" ] ; then
+  TCMMD_BENCH=`dirname $0`/../src/tcmmd-bench
+fi
+if [ -z "$INTERFACES" ] ; then
+  INTERFACES="0 50 200"
+fi
+if [ -z "$STREAMS" ] ; then
+  STREAMS=4
+fi
+if [ -z "$SAMPLES" ] ; then
+  SAMPLES=1000
+fi
+
+modprobe ifb numifbs=0 > /dev/null 2>&1
+
+for interfaces in $INTERFACES ; do
+  unshare -n sh -c "
+    ip link add ifb0 type ifb
+    ip link add bench0 type veth peer name bench1
+    ip link set bench0 up
+    i=0
+    while [ \$i -lt $interfaces ] ; do
+      ip link add other\$i type veth peer name otherp\$i
+      tc qdisc add dev other\$i root pfifo limit 10
+      i=\$((i + 1))
+    done
+    $TCMMD_BENCH --interface=bench0 --streams=$STREAMS --stats=$SAMPLES" |
+    grep '^stats ' | sed "s/^stats /interfaces=$interfaces /"
+done